@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_bench_util.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+
+gint64 d_bench_read_rss(gint pid)
+{
+    g_autofree gchar* path = g_strdup_printf("/proc/%d/status",pid);
+    g_autofree gchar* contents{nullptr};
+    GError *error{NULL};
+    if(!g_file_get_contents(path,&contents,NULL,&error)) {
+        g_warning("read process status failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return -1;
+    }
+    auto line = g_strstr_len(contents,-1,"VmRSS:");
+    if(!line) {
+        return -1;
+    }
+    return g_ascii_strtoll(line + strlen("VmRSS:"),NULL,10);
+}
+
+gint64 d_bench_read_cpu_time(gint pid)
+{
+    g_autofree gchar* path = g_strdup_printf("/proc/%d/stat",pid);
+    g_autofree gchar* contents{nullptr};
+    GError *error{NULL};
+    if(!g_file_get_contents(path,&contents,NULL,&error)) {
+        g_warning("read process stat failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return -1;
+    }
+    // The process name may contain spaces, fields are counted after it.
+    auto p = strrchr(contents,')');
+    if(!p) {
+        return -1;
+    }
+    g_auto(GStrv) fields = g_strsplit(p + 2," ",0);
+    // utime and stime are 14th and 15th fields, the state is the 3rd one.
+    if(g_strv_length(fields) < 13) {
+        return -1;
+    }
+    gint64 ticks = g_ascii_strtoll(fields[11],NULL,10) + g_ascii_strtoll(fields[12],NULL,10);
+    return ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK);
+}
+
+gboolean d_bench_read_response(
+    GSocket* socket,
+    guint expected_code)
+{
+    gchar buffer[512];
+    GError *error{NULL};
+    gssize count = g_socket_receive(socket,buffer,sizeof(buffer) - 1,NULL,&error);
+    if(count <= 0) {
+        if(error) {
+            g_warning("receive failed: %d %s",error->code,error->message);
+            g_error_free(error);
+        }
+        return FALSE;
+    }
+    buffer[count] = 0;
+    return g_ascii_strtoull(buffer,NULL,10) == expected_code;
+}
+
+gboolean d_bench_send_text(
+    GSocket* socket,
+    const gchar* text)
+{
+    gsize count = strlen(text);
+    while(count) {
+        GError *error{NULL};
+        gssize sent = g_socket_send(socket,text,count,NULL,&error);
+        if(sent < 0) {
+            g_warning("send failed: %d %s",error->code,error->message);
+            g_error_free(error);
+            return FALSE;
+        }
+        text += sent;
+        count -= sent;
+    }
+    return TRUE;
+}
+
+GSocketConnection* d_bench_open_idle_connection(
+    GSocketClient* client,
+    const gchar* host,
+    guint port)
+{
+    GError *error{NULL};
+    auto connection = g_socket_client_connect_to_host(client,host,port,NULL,&error);
+    if(!connection) {
+        g_warning("connect failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    auto socket = g_socket_connection_get_socket(connection);
+    if(!d_bench_read_response(socket,220) ||
+       !d_bench_send_text(socket,"HELO bench.localdomain\r\n") ||
+       !d_bench_read_response(socket,250)) {
+        g_warning("SMTP handshake failed");
+        g_object_unref(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+static gint d_bench_compare_samples(gconstpointer a, gconstpointer b)
+{
+    gint64 left = *static_cast<const gint64*>(a);
+    gint64 right = *static_cast<const gint64*>(b);
+    return left < right ? -1 : left > right;
+}
+
+void d_bench_sort_samples(
+    GArray* samples)
+{
+    g_array_sort(samples,d_bench_compare_samples);
+}
+
+gint64 d_bench_percentile(
+    GArray* samples,
+    gdouble percentile)
+{
+    if(!samples->len) {
+        return 0;
+    }
+    guint index = guint(percentile / 100.0 * (samples->len - 1) + 0.5);
+    return g_array_index(samples,gint64,MIN(index,samples->len - 1));
+}
+
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__BENCH_UTIL__HPP__
+#define __D__NEW__BENCH_UTIL__HPP__
+/**
+ * @brief Helpers shared by the SMTP server benchmarks.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+
+/**
+ * @brief Read the resident set size of the process in kilobytes.
+ * @return Return -1 in case of failure.
+ */
+gint64 d_bench_read_rss(gint pid);
+
+/**
+ * @brief Read the user plus system CPU time of the process in microseconds.
+ * @return Return -1 in case of failure.
+ */
+gint64 d_bench_read_cpu_time(gint pid);
+
+/**
+ * @brief Read the one response line and check the response code.
+ */
+gboolean d_bench_read_response(
+    GSocket* socket,
+    guint expected_code);
+
+/**
+ * @brief Send the whole text by the blocking socket.
+ */
+gboolean d_bench_send_text(
+    GSocket* socket,
+    const gchar* text);
+
+/**
+ * @brief Open the connection and bring it to the idle command phase.
+ * @return The connection or NULL in case of failure.
+ */
+GSocketConnection* d_bench_open_idle_connection(
+    GSocketClient* client,
+    const gchar* host,
+    guint port);
+
+/**
+ * @brief Sort the array of gint64 samples in ascending order.
+ */
+void d_bench_sort_samples(
+    GArray* samples);
+
+/**
+ * @brief Get the value of sorted samples at the percentile.
+ * @param [in] samples The sorted array of gint64 samples.
+ * @param [in] percentile The percentile in range 0..100.
+ */
+gint64 d_bench_percentile(
+    GArray* samples,
+    gdouble percentile);
+
+}
+
+#endif //#ifndef __D__NEW__BENCH_UTIL__HPP__
@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Spool body compression benchmark.
+ * @details The message bodies are compressed in the receive blocks the
+ * same way as the transaction does it and decompressed back by the spool
+ * converter. The run reports the disk bytes saved and the CPU time per
+ * megabyte for no dictionary, the built-in one, the dictionary trained on
+ * the other half of the messages and the dictionary file if given. The
+ * messages are read from the directory, one file per message, or made up
+ * like the newsletter traffic.
+ */
+#include "d_bench_util.hpp"
+#include "d_smtp_compress.hpp"
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static gchar* opt_samples{nullptr};
+static gint opt_messages{2000};
+static gint opt_level{6};
+static gint opt_block_size{2048};
+static gchar* opt_dictionary{nullptr};
+static gchar* opt_train{nullptr};
+static gint opt_dictionary_size{SMTP_COMPRESS_MAX_DICTIONARY};
+
+static GOptionEntry bench_entries[] =
+{
+    {"samples",'d',0,G_OPTION_ARG_FILENAME,&opt_samples,"Directory of the message files, made up messages if not set","DIRECTORY"},
+    {"messages",'n',0,G_OPTION_ARG_INT,&opt_messages,"Number of made up messages","COUNT"},
+    {"level",'l',0,G_OPTION_ARG_INT,&opt_level,"Compression level 1..9","LEVEL"},
+    {"block-size",'b',0,G_OPTION_ARG_INT,&opt_block_size,"Receive block size","BYTES"},
+    {"dictionary",'f',0,G_OPTION_ARG_FILENAME,&opt_dictionary,"Dictionary file to compare","FILE"},
+    {"train",'t',0,G_OPTION_ARG_FILENAME,&opt_train,"Write the dictionary trained on all messages","FILE"},
+    {"dictionary-size",'s',0,G_OPTION_ARG_INT,&opt_dictionary_size,"Trained dictionary size","BYTES"},
+    {NULL}
+};
+
+static const gchar* compress_bench_words[] = {
+    "the","offer","your","account","order","delivery","please","update","free","new",
+    "today","click","here","view","online","unsubscribe","newsletter","price","discount","week",
+    "customer","service","team","support","information","details","thank","you","for","shopping",
+};
+
+/**
+ * @brief Make up the newsletter like message with the MIME parts.
+ */
+static GBytes* compress_bench_message(
+    GRand* rand,
+    guint index)
+{
+    GString* text = g_string_new(NULL);
+    guint32 boundary = g_rand_int(rand);
+    g_string_append_printf(text,
+        "From: News <news@shop%u.example>\r\n"
+        "To: customer%u@example.com\r\n"
+        "Subject: Weekly offers %u\r\n"
+        "Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+        "Message-ID: <%u.%u@shop%u.example>\r\n"
+        "MIME-Version: 1.0\r\n"
+        "Content-Type: multipart/alternative; boundary=\"b%08x\"\r\n"
+        "\r\n"
+        "This is a multi-part message in MIME format.\r\n"
+        "--b%08x\r\n"
+        "Content-Type: text/plain; charset=\"utf-8\"\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n",index % 20,index,index,index,boundary,index % 20,boundary,boundary);
+    guint paragraphs = g_rand_int_range(rand,3,12);
+    GString* plain = g_string_new(NULL);
+    for(guint paragraph = 0; paragraph < paragraphs; paragraph++) {
+        guint words = g_rand_int_range(rand,20,80);
+        for(guint word = 0; word < words; word++) {
+            g_string_append_printf(plain,"%s%s",word ? " " : "",
+                compress_bench_words[g_rand_int_range(rand,0,G_N_ELEMENTS(compress_bench_words))]);
+            if(word % 12 == 11) {
+                g_string_append(plain,"\r\n");
+            }
+        }
+        g_string_append(plain,"\r\n\r\n");
+    }
+    g_string_append_len(text,plain->str,plain->len);
+    g_string_append_printf(text,
+        "--b%08x\r\n"
+        "Content-Type: text/html; charset=\"utf-8\"\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n"
+        "<html><head><meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\"></head><body>\r\n"
+        "<table width=\"100%%\" cellpadding=\"0\" cellspacing=\"0\" border=\"0\"><tr><td>\r\n",boundary);
+    for(gchar* line = strtok(plain->str,"\r\n"); line; line = strtok(NULL,"\r\n")) {
+        g_string_append_printf(text,"<p style=\"font-family: Arial, Helvetica, sans-serif; font-size: 14px;\">%s</p>\r\n",line);
+    }
+    g_string_append_printf(text,
+        "<a href=\"https://shop%u.example/unsubscribe?id=%u\">Unsubscribe</a>\r\n"
+        "</td></tr></table></body></html>\r\n"
+        "--b%08x--\r\n",index % 20,g_rand_int(rand),boundary);
+    g_string_free(plain,TRUE);
+    gsize size = text->len;
+    return g_bytes_new_take(g_string_free(text,FALSE),size);
+}
+
+/**
+ * @brief Read the messages of the samples directory.
+ */
+static GPtrArray* compress_bench_load_samples(
+    const gchar* directory,
+    GError** error)
+{
+    g_autoptr(GDir) dir = g_dir_open(directory,0,error);
+    if(!dir) {
+        return NULL;
+    }
+    GPtrArray* messages = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    for(const gchar* name = g_dir_read_name(dir); name; name = g_dir_read_name(dir)) {
+        g_autofree gchar* path = g_build_filename(directory,name,NULL);
+        gchar* data{nullptr};
+        gsize size{0};
+        if(g_file_test(path,G_FILE_TEST_IS_REGULAR) && g_file_get_contents(path,&data,&size,NULL)) {
+            g_ptr_array_add(messages,g_bytes_new_take(data,size));
+        }
+    }
+    return messages;
+}
+
+/**
+ * @brief Get the body part of the message, the spool compresses only it.
+ */
+static GBytes* compress_bench_body(
+    GBytes* message)
+{
+    gsize size{0};
+    auto data = static_cast<const gchar*>(g_bytes_get_data(message,&size));
+    const gchar* end = g_strstr_len(data,size,"\r\n\r\n");
+    gsize offset = end ? end - data + 4 : size;
+    if(!end && (end = g_strstr_len(data,size,"\n\n"))) {
+        offset = end - data + 2;
+    }
+    return g_bytes_new_from_bytes(message,offset,size - offset);
+}
+
+struct DCompressBenchResult
+{
+    guint64 raw_bytes;
+    guint64 stored_bytes;
+    guint compressed;
+    gint64 deflate_time;
+    gint64 inflate_time;
+    gboolean failed;
+};
+
+/**
+ * @brief Decompress the body by the spool converter and check it.
+ */
+static gboolean compress_bench_inflate(
+    GPtrArray* blocks,
+    GBytes* body,
+    const gchar* dictionaries)
+{
+    g_autoptr(GByteArray) stored = g_byte_array_new();
+    for(guint index = 0; index < blocks->len; index++) {
+        gsize size{0};
+        auto data = static_cast<const guint8*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(blocks,index)),&size));
+        g_byte_array_append(stored,data,size);
+    }
+    g_autoptr(GBytes) stored_bytes = g_byte_array_free_to_bytes(static_cast<GByteArray*>(g_steal_pointer(&stored)));
+    g_autoptr(GInputStream) memory = g_memory_input_stream_new_from_bytes(stored_bytes);
+    g_autoptr(DSmtpInflater) inflater = d_smtp_inflater_new(dictionaries);
+    g_autoptr(GInputStream) stream = g_converter_input_stream_new(memory,G_CONVERTER(inflater));
+    gsize body_size = g_bytes_get_size(body);
+    g_autofree gchar* buffer = static_cast<gchar*>(g_malloc(body_size + 1));
+    gsize read{0};
+    GError* error{NULL};
+    if(!g_input_stream_read_all(stream,buffer,body_size + 1,&read,NULL,&error)) {
+        g_printerr("inflate failed: %s\n",error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    return read == body_size && memcmp(buffer,g_bytes_get_data(body,NULL),body_size) == 0;
+}
+
+/**
+ * @brief Compress every body in the receive blocks and decompress it back.
+ */
+static DCompressBenchResult compress_bench_run(
+    GPtrArray* bodies,
+    GBytes* dictionary,
+    const gchar* dictionaries)
+{
+    DCompressBenchResult result{};
+    g_autoptr(DSmtpCompressor) compressor = d_smtp_compressor_new(opt_level,dictionary);
+    guint32 id{0};
+    GBytes* compressor_dictionary = d_smtp_compressor_get_dictionary(compressor,&id);
+    if(compressor_dictionary) {
+        // The inflater finds the dictionary by the id, as in the spool.
+        g_autofree gchar* name = g_strdup_printf("%08x",id);
+        g_autofree gchar* path = g_build_filename(dictionaries,name,NULL);
+        gsize size{0};
+        auto data = static_cast<const gchar*>(g_bytes_get_data(compressor_dictionary,&size));
+        g_file_set_contents(path,data,size,NULL);
+    }
+    g_autoptr(GPtrArray) stored = g_ptr_array_new_full(bodies->len,
+        reinterpret_cast<GDestroyNotify>(g_ptr_array_unref));
+    gint64 start = d_bench_read_cpu_time(getpid());
+    for(guint index = 0; index < bodies->len; index++) {
+        gsize size{0};
+        auto data = static_cast<const gchar*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(bodies,index)),&size));
+        DSmtpDeflate* deflate = d_smtp_deflate_new(compressor);
+        for(gsize offset = 0; offset < size; offset += opt_block_size) {
+            d_smtp_deflate_update(deflate,data + offset,MIN(gsize(opt_block_size),size - offset));
+        }
+        GPtrArray* blocks = d_smtp_deflate_finish(deflate);
+        d_smtp_deflate_free(deflate);
+        result.raw_bytes += size;
+        if(blocks) {
+            for(guint block = 0; block < blocks->len; block++) {
+                result.stored_bytes += g_bytes_get_size(static_cast<GBytes*>(g_ptr_array_index(blocks,block)));
+            }
+            result.compressed++;
+            g_ptr_array_add(stored,blocks);
+        } else {
+            result.stored_bytes += size;
+            g_ptr_array_add(stored,g_ptr_array_new());
+        }
+    }
+    result.deflate_time = d_bench_read_cpu_time(getpid()) - start;
+
+    start = d_bench_read_cpu_time(getpid());
+    for(guint index = 0; index < bodies->len; index++) {
+        auto blocks = static_cast<GPtrArray*>(g_ptr_array_index(stored,index));
+        if(blocks->len && !compress_bench_inflate(blocks,static_cast<GBytes*>(g_ptr_array_index(bodies,index)),dictionaries)) {
+            result.failed = TRUE;
+        }
+    }
+    result.inflate_time = d_bench_read_cpu_time(getpid()) - start;
+    d_smtp_compressor_log_metrics(compressor);
+    return result;
+}
+
+static void compress_bench_print(
+    const gchar* title,
+    GBytes* dictionary,
+    const DCompressBenchResult& result)
+{
+    gdouble megabytes = MAX(result.raw_bytes,1) / 1048576.0;
+    g_print("%-10s %6" G_GSIZE_FORMAT " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %6.1f%% %6u"
+        " %8.1f %8.1f%s\n",title,dictionary ? g_bytes_get_size(dictionary) : 0,
+        result.raw_bytes,result.stored_bytes,
+        100.0 - 100.0 * result.stored_bytes / MAX(result.raw_bytes,1),result.compressed,
+        result.deflate_time / 1000.0 / megabytes,result.inflate_time / 1000.0 / megabytes,
+        result.failed ? " MISMATCH" : "");
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- spool body compression benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(opt_messages < 2 || opt_level < 1 || opt_level > 9 || opt_block_size <= 0 || opt_dictionary_size <= 0) {
+        g_printerr("At least 2 messages, the level 1..9 and the positive sizes are required\n");
+        return EXIT_FAILURE;
+    }
+    g_autoptr(GPtrArray) messages = NULL;
+    if(opt_samples) {
+        messages = compress_bench_load_samples(opt_samples,&error);
+        if(!messages) {
+            g_printerr("samples read failed: %s\n",error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+    } else {
+        g_autoptr(GRand) rand = g_rand_new_with_seed(1);
+        messages = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+        for(gint index = 0; index < opt_messages; index++) {
+            g_ptr_array_add(messages,compress_bench_message(rand,index));
+        }
+    }
+    if(messages->len < 2) {
+        g_printerr("At least 2 messages are required\n");
+        return EXIT_FAILURE;
+    }
+    // The dictionary is trained on the even messages and measured on the odd ones.
+    g_autoptr(GPtrArray) training = g_ptr_array_new();
+    g_autoptr(GPtrArray) bodies = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    for(guint index = 0; index < messages->len; index++) {
+        if(index % 2 == 0) {
+            g_ptr_array_add(training,g_ptr_array_index(messages,index));
+        } else {
+            g_ptr_array_add(bodies,compress_bench_body(static_cast<GBytes*>(g_ptr_array_index(messages,index))));
+        }
+    }
+    gint64 start = g_get_monotonic_time();
+    g_autoptr(GBytes) trained = d_smtp_compress_train_dictionary(training,opt_dictionary_size);
+    g_print("%u messages, level %d, dictionary trained on %u messages in %" G_GINT64_FORMAT " ms\n",
+        messages->len,opt_level,training->len,(g_get_monotonic_time() - start) / 1000);
+    if(opt_train) {
+        g_autoptr(GBytes) dictionary = d_smtp_compress_train_dictionary(messages,opt_dictionary_size);
+        gsize size{0};
+        auto data = static_cast<const gchar*>(g_bytes_get_data(dictionary,&size));
+        if(!g_file_set_contents(opt_train,data,size,&error)) {
+            g_printerr("dictionary write failed: %s\n",error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+        g_print("dictionary of %" G_GSIZE_FORMAT " bytes written to %s\n",size,opt_train);
+    }
+    g_autoptr(GBytes) loaded = NULL;
+    if(opt_dictionary) {
+        g_autoptr(GFile) file = g_file_new_for_path(opt_dictionary);
+        loaded = g_file_load_bytes(file,NULL,NULL,&error);
+        if(!loaded) {
+            g_printerr("dictionary read failed: %s\n",error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+    }
+    g_autofree gchar* dictionaries = g_dir_make_tmp("compress-bench-XXXXXX",&error);
+    if(!dictionaries) {
+        g_printerr("temporary directory create failed: %s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+
+    // The deflate and inflate columns are the CPU milliseconds per body megabyte.
+    g_print("%-10s %6s %10s %10s %7s %6s %8s %8s\n",
+        "dictionary","bytes","raw","stored","saved","packed","deflate","inflate");
+    g_autoptr(GBytes) none = g_bytes_new(NULL,0);
+    compress_bench_print("none",none,compress_bench_run(bodies,none,dictionaries));
+    g_autoptr(DSmtpCompressor) builtin = d_smtp_compressor_new(opt_level,NULL);
+    guint32 id{0};
+    compress_bench_print("built-in",d_smtp_compressor_get_dictionary(builtin,&id),
+        compress_bench_run(bodies,NULL,dictionaries));
+    compress_bench_print("trained",trained,compress_bench_run(bodies,trained,dictionaries));
+    if(loaded) {
+        compress_bench_print("file",loaded,compress_bench_run(bodies,loaded,dictionaries));
+    }
+
+    g_autoptr(GDir) dir = g_dir_open(dictionaries,0,NULL);
+    for(const gchar* name = dir ? g_dir_read_name(dir) : NULL; name; name = g_dir_read_name(dir)) {
+        g_autofree gchar* path = g_build_filename(dictionaries,name,NULL);
+        g_unlink(path);
+    }
+    g_rmdir(dictionaries);
+    return EXIT_SUCCESS;
+}
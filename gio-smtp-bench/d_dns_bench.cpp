@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief DNS cache benchmark.
+ * @details The cache queries the stub DNS server run in the benchmark
+ * thread, the server answers every name after the delay. The runs measure
+ * the lookup latency of the cache misses and hits and count the queries
+ * the server has got for the concurrent lookups of one name, the negative
+ * answers and the hot name used through its TTL. The forward confirmed
+ * host name of 127.0.0.1 is looked up at last.
+ */
+#include "d_bench_util.hpp"
+#include "d_dns_cache.hpp"
+#include <arpa/nameser.h>
+#include <stdlib.h>
+#include <string.h>
+
+static gchar* opt_server{nullptr};
+static gint opt_names{1000};
+static gint opt_concurrent{100};
+static gint opt_ttl{10};
+static gint opt_delay{2};
+static gint opt_threads{4};
+
+static GOptionEntry bench_entries[] =
+{
+    {"server",'s',0,G_OPTION_ARG_STRING,&opt_server,"DNS server, the stub server if not set","ADDRESS[:PORT]"},
+    {"names",'n',0,G_OPTION_ARG_INT,&opt_names,"Number of names looked up by the miss and hit runs","COUNT"},
+    {"concurrent",'c',0,G_OPTION_ARG_INT,&opt_concurrent,"Number of concurrent lookups of one name","COUNT"},
+    {"ttl",'T',0,G_OPTION_ARG_INT,&opt_ttl,"TTL of the stub server answers","SECONDS"},
+    {"delay",'d',0,G_OPTION_ARG_INT,&opt_delay,"Stub server answer delay","MILLISECONDS"},
+    {"threads",'t',0,G_OPTION_ARG_INT,&opt_threads,"Number of the cache query threads","COUNT"},
+    {NULL}
+};
+
+/**
+ * @brief The stub DNS server.
+ * @details Names starting with "nx" don't exist, other names have one
+ * record of every type: 127.0.0.1, ::1, stub.example, 10 mx.example and
+ * "v=spf1 -all".
+ */
+struct DDnsStub
+{
+    GSocket* socket;
+    GThread* thread;
+    gint running;
+    gint queries;
+};
+
+static void dns_stub_append_name(
+    GByteArray* packet,
+    const gchar* name)
+{
+    g_auto(GStrv) labels = g_strsplit(name,".",-1);
+    for(gchar** label = labels; *label; label++) {
+        guint8 length = strlen(*label);
+        if(length == 0) continue;
+        g_byte_array_append(packet,&length,1);
+        g_byte_array_append(packet,reinterpret_cast<const guint8*>(*label),length);
+    }
+    guint8 root = 0;
+    g_byte_array_append(packet,&root,1);
+}
+
+static void dns_stub_append_16(
+    GByteArray* packet,
+    guint value)
+{
+    guint8 bytes[2] = {guint8(value >> 8),guint8(value)};
+    g_byte_array_append(packet,bytes,sizeof(bytes));
+}
+
+/**
+ * @brief Build the answer to the query.
+ * @return The answer or NULL if the query is malformed.
+ */
+static GByteArray* dns_stub_answer(
+    const guint8* query,
+    gsize size)
+{
+    if(size < NS_HFIXEDSZ) {
+        return NULL;
+    }
+    // Take the question name and the type.
+    GString* name = g_string_new(NULL);
+    gsize offset = NS_HFIXEDSZ;
+    while(offset < size && query[offset] != 0) {
+        guint length = query[offset];
+        if(offset + 1 + length > size) {
+            g_string_free(name,TRUE);
+            return NULL;
+        }
+        g_string_append_len(name,reinterpret_cast<const gchar*>(query) + offset + 1,length);
+        g_string_append_c(name,'.');
+        offset += 1 + length;
+    }
+    gsize question_end = offset + 1 + NS_QFIXEDSZ;
+    if(question_end > size) {
+        g_string_free(name,TRUE);
+        return NULL;
+    }
+    guint type = (query[offset + 1] << 8) | query[offset + 2];
+    gboolean nxdomain = g_str_has_prefix(name->str,"nx");
+    g_string_free(name,TRUE);
+
+    GByteArray* packet = g_byte_array_sized_new(512);
+    g_byte_array_append(packet,query,2);
+    // QR, AA, RD and RA flags, NXDOMAIN or no error.
+    guint8 flags[2] = {0x85,guint8(0x80 | (nxdomain ? ns_r_nxdomain : ns_r_noerror))};
+    g_byte_array_append(packet,flags,sizeof(flags));
+    dns_stub_append_16(packet,1);
+    GByteArray* rdata = g_byte_array_new();
+    if(!nxdomain) {
+        if(type == ns_t_a) {
+            guint8 address[4] = {127,0,0,1};
+            g_byte_array_append(rdata,address,sizeof(address));
+        } else if(type == ns_t_aaaa) {
+            guint8 address[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1};
+            g_byte_array_append(rdata,address,sizeof(address));
+        } else if(type == ns_t_ptr) {
+            dns_stub_append_name(rdata,"stub.example");
+        } else if(type == ns_t_mx) {
+            dns_stub_append_16(rdata,10);
+            dns_stub_append_name(rdata,"mx.example");
+        } else if(type == ns_t_txt) {
+            static const gchar txt[] = "v=spf1 -all";
+            guint8 length = sizeof(txt) - 1;
+            g_byte_array_append(rdata,&length,1);
+            g_byte_array_append(rdata,reinterpret_cast<const guint8*>(txt),length);
+        }
+    }
+    dns_stub_append_16(packet,rdata->len > 0 ? 1 : 0);
+    dns_stub_append_16(packet,0);
+    dns_stub_append_16(packet,0);
+    g_byte_array_append(packet,query + NS_HFIXEDSZ,question_end - NS_HFIXEDSZ);
+    if(rdata->len > 0) {
+        // The owner name is the pointer to the question name.
+        dns_stub_append_16(packet,0xc000 | NS_HFIXEDSZ);
+        dns_stub_append_16(packet,type);
+        dns_stub_append_16(packet,ns_c_in);
+        dns_stub_append_16(packet,guint(opt_ttl) >> 16);
+        dns_stub_append_16(packet,guint(opt_ttl) & 0xffff);
+        dns_stub_append_16(packet,rdata->len);
+        g_byte_array_append(packet,rdata->data,rdata->len);
+    }
+    g_byte_array_unref(rdata);
+    return packet;
+}
+
+static gpointer dns_stub_thread(gpointer user_data)
+{
+    auto stub = static_cast<DDnsStub*>(user_data);
+    guint8 query[NS_PACKETSZ * 8];
+    while(g_atomic_int_get(&stub->running)) {
+        GSocketAddress* client{NULL};
+        // The socket timeout lets the thread see the stop.
+        gssize size = g_socket_receive_from(stub->socket,&client,
+            reinterpret_cast<gchar*>(query),sizeof(query),NULL,NULL);
+        if(size <= 0) {
+            g_clear_object(&client);
+            continue;
+        }
+        g_atomic_int_inc(&stub->queries);
+        GByteArray* answer = dns_stub_answer(query,size);
+        if(answer) {
+            if(opt_delay > 0) {
+                g_usleep(opt_delay * 1000);
+            }
+            g_socket_send_to(stub->socket,client,reinterpret_cast<const gchar*>(answer->data),
+                answer->len,NULL,NULL);
+            g_byte_array_unref(answer);
+        }
+        g_object_unref(client);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the stub server on the loopback address.
+ * @return The server address[:port] text.
+ */
+static gchar* dns_stub_start(
+    DDnsStub* stub,
+    GError** error)
+{
+    stub->socket = g_socket_new(G_SOCKET_FAMILY_IPV4,G_SOCKET_TYPE_DATAGRAM,G_SOCKET_PROTOCOL_UDP,error);
+    if(!stub->socket) {
+        return NULL;
+    }
+    g_autoptr(GInetAddress) loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    g_autoptr(GSocketAddress) address = g_inet_socket_address_new(loopback,0);
+    if(!g_socket_bind(stub->socket,address,FALSE,error)) {
+        return NULL;
+    }
+    g_autoptr(GSocketAddress) local = g_socket_get_local_address(stub->socket,error);
+    if(!local) {
+        return NULL;
+    }
+    g_socket_set_timeout(stub->socket,1);
+    stub->running = TRUE;
+    stub->thread = g_thread_new("dns-stub",dns_stub_thread,stub);
+    return g_strdup_printf("127.0.0.1:%u",g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(local)));
+}
+
+static void dns_stub_stop(
+    DDnsStub* stub)
+{
+    if(stub->thread) {
+        g_atomic_int_set(&stub->running,FALSE);
+        g_thread_join(stub->thread);
+    }
+    g_clear_object(&stub->socket);
+}
+
+/**
+ * @brief The lookups of the run.
+ */
+struct DDnsBenchRun
+{
+    guint pending;
+    guint failed;
+    GArray* latencies;
+};
+
+struct DDnsBenchLookup
+{
+    DDnsBenchRun* run;
+    gint64 start;
+};
+
+static void dns_bench_lookup_handle(
+    GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    auto lookup = static_cast<DDnsBenchLookup*>(user_data);
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source),result,&error);
+    gint64 latency = g_get_monotonic_time() - lookup->start;
+    if(!answer) {
+        g_printerr("lookup failed: %s\n",error->message);
+        g_error_free(error);
+        lookup->run->failed++;
+    }
+    g_array_append_val(lookup->run->latencies,latency);
+    lookup->run->pending--;
+    g_free(lookup);
+}
+
+static void dns_bench_lookup(
+    DDnsCache* cache,
+    DDnsBenchRun* run,
+    DNS_RECORD_TYPE type,
+    const gchar* name)
+{
+    auto lookup = g_new0(DDnsBenchLookup,1);
+    lookup->run = run;
+    lookup->start = g_get_monotonic_time();
+    run->pending++;
+    d_dns_cache_lookup_async(cache,type,name,NULL,dns_bench_lookup_handle,lookup);
+}
+
+static void dns_bench_wait(
+    DDnsBenchRun* run)
+{
+    while(run->pending > 0) {
+        g_main_context_iteration(NULL,TRUE);
+    }
+}
+
+/**
+ * @brief Print the latency of the run lookups and the stub server queries.
+ */
+static void dns_bench_report(
+    const gchar* title,
+    DDnsBenchRun* run,
+    DDnsStub* stub,
+    gint queries_before)
+{
+    d_bench_sort_samples(run->latencies);
+    g_print("%-14s %6u lookups, latency p50 %6" G_GINT64_FORMAT " us p99 %6" G_GINT64_FORMAT " us, failed %u",
+        title,run->latencies->len,d_bench_percentile(run->latencies,50),
+        d_bench_percentile(run->latencies,99),run->failed);
+    if(stub->thread) {
+        g_print(", server queries %d",g_atomic_int_get(&stub->queries) - queries_before);
+    }
+    g_print("\n");
+    g_array_set_size(run->latencies,0);
+    run->failed = 0;
+}
+
+static void dns_bench_verify_handle(
+    GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    auto run = static_cast<DDnsBenchRun*>(user_data);
+    GError* error{NULL};
+    g_autofree gchar* host = d_dns_cache_verify_address_finish(D_DNS_CACHE(source),result,&error);
+    if(error) {
+        g_printerr("verify failed: %s\n",error->message);
+        g_error_free(error);
+        run->failed++;
+    }
+    g_print("127.0.0.1 host name: %s\n",host ? host : "not confirmed");
+    run->pending--;
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- DNS cache benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(opt_names <= 0 || opt_concurrent <= 0 || opt_ttl < 0 || opt_delay < 0 || opt_threads <= 0) {
+        g_printerr("The positive names, concurrent lookups and threads are required\n");
+        return EXIT_FAILURE;
+    }
+    DDnsStub stub{};
+    g_autofree gchar* server = opt_server ? g_strdup(opt_server) : dns_stub_start(&stub,&error);
+    if(!server) {
+        g_printerr("stub server start failed: %s\n",error->message);
+        g_error_free(error);
+        dns_stub_stop(&stub);
+        return EXIT_FAILURE;
+    }
+    g_autoptr(DDnsCache) cache = d_dns_cache_new(server,opt_names * 2 + 1024,60,86400,opt_threads,&error);
+    if(!cache) {
+        g_printerr("cache create failed: %s\n",error->message);
+        g_error_free(error);
+        dns_stub_stop(&stub);
+        return EXIT_FAILURE;
+    }
+    g_print("server %s, %d query threads\n",server,opt_threads);
+
+    DDnsBenchRun run{0,0,g_array_new(FALSE,FALSE,sizeof(gint64))};
+    gint queries = g_atomic_int_get(&stub.queries);
+    for(gint index = 0; index < opt_names; index++) {
+        g_autofree gchar* name = g_strdup_printf("host%d.example",index);
+        dns_bench_lookup(cache,&run,DNS_RECORD_A,name);
+        dns_bench_wait(&run);
+    }
+    dns_bench_report("miss",&run,&stub,queries);
+
+    queries = g_atomic_int_get(&stub.queries);
+    for(gint index = 0; index < opt_names; index++) {
+        g_autofree gchar* name = g_strdup_printf("host%d.example",index);
+        dns_bench_lookup(cache,&run,DNS_RECORD_A,name);
+        dns_bench_wait(&run);
+    }
+    dns_bench_report("hit",&run,&stub,queries);
+
+    // All lookups wait for the one query.
+    queries = g_atomic_int_get(&stub.queries);
+    for(gint index = 0; index < opt_concurrent; index++) {
+        dns_bench_lookup(cache,&run,DNS_RECORD_MX,"burst.example");
+    }
+    dns_bench_wait(&run);
+    dns_bench_report("coalesced",&run,&stub,queries);
+
+    queries = g_atomic_int_get(&stub.queries);
+    for(gint index = 0; index < opt_names; index++) {
+        dns_bench_lookup(cache,&run,DNS_RECORD_TXT,"nx.example");
+        dns_bench_wait(&run);
+    }
+    dns_bench_report("negative",&run,&stub,queries);
+
+    // The hot name is used every 100 ms through two TTLs, the refresh
+    // ahead keeps the lookups from missing.
+    if(opt_ttl >= 10 && opt_ttl <= 30) {
+        queries = g_atomic_int_get(&stub.queries);
+        gint64 deadline = g_get_monotonic_time() + 2 * opt_ttl * G_USEC_PER_SEC;
+        while(g_get_monotonic_time() < deadline) {
+            dns_bench_lookup(cache,&run,DNS_RECORD_A,"hot.example");
+            dns_bench_wait(&run);
+            g_usleep(100000);
+        }
+        dns_bench_report("refresh-ahead",&run,&stub,queries);
+    }
+
+    run.pending++;
+    g_autoptr(GInetAddress) loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    d_dns_cache_verify_address_async(cache,loopback,NULL,dns_bench_verify_handle,&run);
+    dns_bench_wait(&run);
+
+    d_dns_cache_log_metrics(cache);
+    g_array_unref(run.latencies);
+    g_clear_object(&cache);
+    dns_stub_stop(&stub);
+    return run.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief I/O engine benchmark.
+ * @details Runs the sequential SMTP transactions against the running
+ * server and reports the latency of every command and the server CPU
+ * time spent per transaction. Run the benchmark once against the server
+ * started with every --io-engine value (gio, socket, uring) to compare
+ * the engines. The --sessions option keeps the number of idle sessions
+ * open during the measurement, e.g. 10000 to compare the engines at
+ * 10k concurrent sessions.
+ */
+#include "d_bench_util.hpp"
+#include <stdlib.h>
+
+static gchar* opt_host{nullptr};
+static gint opt_port{8425};
+static gint opt_transactions{10000};
+static gint opt_pid{0};
+static gint opt_sessions{0};
+
+static GOptionEntry bench_entries[] =
+{
+    {"host",'H',0,G_OPTION_ARG_STRING,&opt_host,"SMTP server address","ADDRESS"},
+    {"port",'p',0,G_OPTION_ARG_INT,&opt_port,"SMTP server port","PORT"},
+    {"transactions",'n',0,G_OPTION_ARG_INT,&opt_transactions,"Number of transactions","COUNT"},
+    {"pid",'P',0,G_OPTION_ARG_INT,&opt_pid,"SMTP server process id, used for CPU time","PID"},
+    {"sessions",'s',0,G_OPTION_ARG_INT,&opt_sessions,"Number of idle sessions kept open","COUNT"},
+    {NULL}
+};
+
+/**
+ * @brief The one step of SMTP transaction.
+ */
+struct DBenchStep
+{
+    const gchar* name;
+    /// @brief Text sent to the server, NULL for the greeting.
+    const gchar* request;
+    guint response_code;
+};
+
+static const DBenchStep bench_steps[] =
+{
+    {"connect", NULL, 220},
+    {"HELO", "HELO bench.localdomain\r\n", 250},
+    {"MAIL", "MAIL FROM:<sender@bench.localdomain>\r\n", 250},
+    {"RCPT", "RCPT TO:<recipient@localhost>\r\n", 250},
+    {"DATA", "DATA\r\n", 354},
+    {"message", "Subject: bench\r\n\r\nI/O engine benchmark message.\r\n.\r\n", 250},
+    {"QUIT", "QUIT\r\n", 221},
+};
+#define NR_BENCH_STEPS G_N_ELEMENTS(bench_steps)
+
+/**
+ * @brief Run the one transaction and append the latency of every step.
+ */
+static gboolean bench_transaction(
+    GSocketClient* client,
+    GArray** latencies)
+{
+    GError *error{NULL};
+    gint64 start = g_get_monotonic_time();
+    g_autoptr(GSocketConnection) connection =
+        g_socket_client_connect_to_host(client,opt_host,opt_port,NULL,&error);
+    if(!connection) {
+        g_warning("connect failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    auto socket = g_socket_connection_get_socket(connection);
+    for(guint step = 0; step < NR_BENCH_STEPS; step++) {
+        if(step) {
+            start = g_get_monotonic_time();
+            if(!d_bench_send_text(socket,bench_steps[step].request)) {
+                return FALSE;
+            }
+        }
+        if(!d_bench_read_response(socket,bench_steps[step].response_code)) {
+            g_warning("unexpected response to %s",bench_steps[step].name);
+            return FALSE;
+        }
+        gint64 latency = g_get_monotonic_time() - start;
+        g_array_append_val(latencies[step],latency);
+    }
+    return TRUE;
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- SMTP server I/O engine benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(!opt_host) {
+        opt_host = g_strdup("127.0.0.1");
+    }
+    if(opt_transactions <= 0) {
+        g_printerr("The positive --transactions is required\n");
+        return EXIT_FAILURE;
+    }
+
+    GArray* latencies[NR_BENCH_STEPS];
+    for(guint step = 0; step < NR_BENCH_STEPS; step++) {
+        latencies[step] = g_array_sized_new(FALSE,FALSE,sizeof(gint64),opt_transactions);
+    }
+    g_autoptr(GSocketClient) client = g_socket_client_new();
+    g_autoptr(GPtrArray) sessions = g_ptr_array_new_with_free_func(g_object_unref);
+    for(gint i = 0; i < opt_sessions; i++) {
+        auto connection = d_bench_open_idle_connection(client,opt_host,opt_port);
+        if(!connection) {
+            g_printerr("Only %d idle sessions are opened\n",i);
+            return EXIT_FAILURE;
+        }
+        g_ptr_array_add(sessions,connection);
+    }
+    gint64 cpu_before = opt_pid > 0 ? d_bench_read_cpu_time(opt_pid) : -1;
+    gint64 start = g_get_monotonic_time();
+    gint completed{0};
+    for(; completed < opt_transactions; completed++) {
+        if(!bench_transaction(client,latencies)) {
+            break;
+        }
+    }
+    gint64 elapsed = g_get_monotonic_time() - start;
+    gint64 cpu_after = opt_pid > 0 ? d_bench_read_cpu_time(opt_pid) : -1;
+
+    g_print("idle sessions: %u\n",sessions->len);
+    g_print("transactions: %d in %.3f s, %.1f per second\n",completed,
+        elapsed / 1e6, completed ? completed * 1e6 / elapsed : 0.0);
+    g_print("%-10s %10s %10s %10s %10s (microseconds)\n","command","mean","p50","p99","max");
+    for(guint step = 0; step < NR_BENCH_STEPS; step++) {
+        GArray* samples = latencies[step];
+        if(!samples->len) {
+            continue;
+        }
+        gint64 sum{0};
+        for(guint i = 0; i < samples->len; i++) {
+            sum += g_array_index(samples,gint64,i);
+        }
+        d_bench_sort_samples(samples);
+        g_print("%-10s %10.1f %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+            bench_steps[step].name,double(sum) / samples->len,
+            d_bench_percentile(samples,50),d_bench_percentile(samples,99),
+            g_array_index(samples,gint64,samples->len - 1));
+        g_array_unref(samples);
+    }
+    if(cpu_before >= 0 && cpu_after >= 0 && completed) {
+        g_print("server CPU per transaction: %.1f us\n",double(cpu_after - cpu_before) / completed);
+    }
+    if(opt_pid > 0) {
+        g_print("server RSS: %" G_GINT64_FORMAT " kB\n",d_bench_read_rss(opt_pid));
+    }
+    g_free(opt_host);
+    return completed == opt_transactions ? EXIT_SUCCESS : EXIT_FAILURE;
+}
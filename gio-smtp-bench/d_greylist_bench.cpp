@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Greylist benchmark.
+ * @details The threads check the random triplets of the working set, the
+ * run reports the checks per second of all threads and the share of the
+ * deferred ones. The snapshot of the filled table is written and loaded
+ * at last.
+ */
+#include "d_bench_util.hpp"
+#include "d_greylist.hpp"
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static gint opt_size{1048576};
+static gint opt_triplets{500000};
+static gint opt_checks{1000000};
+static gint opt_threads{4};
+static gchar* opt_snapshot{nullptr};
+
+static GOptionEntry bench_entries[] =
+{
+    {"size",'s',0,G_OPTION_ARG_INT,&opt_size,"Number of triplets kept by the greylist","COUNT"},
+    {"triplets",'n',0,G_OPTION_ARG_INT,&opt_triplets,"Number of distinct triplets checked","COUNT"},
+    {"checks",'c',0,G_OPTION_ARG_INT,&opt_checks,"Number of checks made by every thread","COUNT"},
+    {"threads",'t',0,G_OPTION_ARG_INT,&opt_threads,"Number of checking threads","COUNT"},
+    {"snapshot",'f',0,G_OPTION_ARG_FILENAME,&opt_snapshot,"Snapshot file, the temporary file if not set","FILE"},
+    {NULL}
+};
+
+struct DGreylistBenchThread
+{
+    DGreylist* greylist;
+    GInetAddress* addresses[256];
+    guint32 seed;
+    guint deferred;
+};
+
+/**
+ * @brief Make the checks of the triplets picked by the thread random.
+ */
+static gpointer greylist_bench_thread(gpointer user_data)
+{
+    auto thread = static_cast<DGreylistBenchThread*>(user_data);
+    GRand* rand = g_rand_new_with_seed(thread->seed);
+    gchar sender[64];
+    gchar recipient[64];
+    for(gint index = 0; index < opt_checks; index++) {
+        guint32 triplet = g_rand_int_range(rand,0,opt_triplets);
+        g_snprintf(sender,sizeof(sender),"sender%u@example.org",triplet / 16);
+        g_snprintf(recipient,sizeof(recipient),"user%u@example.com",triplet % 16);
+        if(!d_greylist_check(thread->greylist,thread->addresses[triplet & 0xff],sender,recipient)) {
+            thread->deferred++;
+        }
+    }
+    g_rand_free(rand);
+    return NULL;
+}
+
+static void greylist_bench_run(
+    const gchar* title,
+    DGreylist* greylist,
+    GInetAddress** addresses)
+{
+    g_autofree DGreylistBenchThread* threads = g_new0(DGreylistBenchThread,opt_threads);
+    g_autofree GThread** handles = g_new0(GThread*,opt_threads);
+    gint64 start = g_get_monotonic_time();
+    for(gint index = 0; index < opt_threads; index++) {
+        threads[index].greylist = greylist;
+        memcpy(threads[index].addresses,addresses,sizeof(threads[index].addresses));
+        threads[index].seed = index + 1;
+        handles[index] = g_thread_new("greylist-bench",greylist_bench_thread,&threads[index]);
+    }
+    guint deferred{0};
+    for(gint index = 0; index < opt_threads; index++) {
+        g_thread_join(handles[index]);
+        deferred += threads[index].deferred;
+    }
+    gint64 elapsed = MAX(g_get_monotonic_time() - start,1);
+    gint64 checks = gint64(opt_checks) * opt_threads;
+    g_print("%-8s %10" G_GINT64_FORMAT " checks, %10.0f checks/s, deferred %.1f%%\n",
+        title,checks,checks * double(G_USEC_PER_SEC) / elapsed,100.0 * deferred / checks);
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- greylist benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(opt_size <= 0 || opt_triplets <= 0 || opt_checks <= 0 || opt_threads <= 0) {
+        g_printerr("The positive size, triplets, checks and threads are required\n");
+        return EXIT_FAILURE;
+    }
+    g_autofree gchar* snapshot = NULL;
+    if(opt_snapshot) {
+        snapshot = g_strdup(opt_snapshot);
+    } else {
+        gint fd = g_file_open_tmp("greylist-bench-XXXXXX",&snapshot,&error);
+        if(fd < 0) {
+            g_printerr("temporary file create failed: %s\n",error->message);
+            g_error_free(error);
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        g_unlink(snapshot);
+    }
+    GInetAddress* addresses[256];
+    for(guint index = 0; index < G_N_ELEMENTS(addresses); index++) {
+        g_autofree gchar* text = g_strdup_printf("10.%u.%u.1",index / 16,index % 16);
+        addresses[index] = g_inet_address_new_from_string(text);
+    }
+    g_print("%d slots, %d triplets, %d threads\n",opt_size,opt_triplets,opt_threads);
+
+    // No delay, the second attempt of the triplet passes it.
+    DGreylist* greylist = d_greylist_new(opt_size,0,3600,86400,snapshot,86400,&error);
+    if(!greylist) {
+        g_printerr("greylist create failed: %s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    greylist_bench_run("fill",greylist,addresses);
+    greylist_bench_run("steady",greylist,addresses);
+
+    gint64 start = g_get_monotonic_time();
+    if(!d_greylist_save(greylist,&error)) {
+        g_printerr("snapshot failed: %s\n",error->message);
+        g_error_free(error);
+        g_object_unref(greylist);
+        return EXIT_FAILURE;
+    }
+    g_print("snapshot %" G_GINT64_FORMAT " us\n",g_get_monotonic_time() - start);
+    g_object_unref(greylist);
+
+    start = g_get_monotonic_time();
+    greylist = d_greylist_new(opt_size,0,3600,86400,snapshot,86400,&error);
+    if(!greylist) {
+        g_printerr("snapshot load failed: %s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    g_print("load     %" G_GINT64_FORMAT " us\n",g_get_monotonic_time() - start);
+    greylist_bench_run("restart",greylist,addresses);
+    d_greylist_log_metrics(greylist);
+    g_object_unref(greylist);
+
+    if(!opt_snapshot) {
+        g_unlink(snapshot);
+    }
+    for(GInetAddress* address : addresses) {
+        g_object_unref(address);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Idle connections memory benchmark.
+ * @details Opens the number of connections to the SMTP server, brings
+ * every connection to the command phase and keeps it idle. The server
+ * resident memory is measured before and after and reported per
+ * 10000 idle connections.
+ * Raise the open files limit (ulimit -n) of both processes before run.
+ */
+#include "d_bench_util.hpp"
+#include <stdlib.h>
+
+static gchar* opt_host{nullptr};
+static gint opt_port{8425};
+static gint opt_count{10000};
+static gint opt_pid{0};
+
+static GOptionEntry bench_entries[] =
+{
+    {"host",'H',0,G_OPTION_ARG_STRING,&opt_host,"SMTP server address","ADDRESS"},
+    {"port",'p',0,G_OPTION_ARG_INT,&opt_port,"SMTP server port","PORT"},
+    {"count",'n',0,G_OPTION_ARG_INT,&opt_count,"Number of idle connections","COUNT"},
+    {"pid",'P',0,G_OPTION_ARG_INT,&opt_pid,"SMTP server process id","PID"},
+    {NULL}
+};
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- idle SMTP connections memory benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(!opt_host) {
+        opt_host = g_strdup("127.0.0.1");
+    }
+    if(opt_pid <= 0 || opt_count <= 0) {
+        g_printerr("The server --pid and positive --count are required\n");
+        return EXIT_FAILURE;
+    }
+
+    gint64 rss_before = d_bench_read_rss(opt_pid);
+    g_autoptr(GSocketClient) client = g_socket_client_new();
+    g_autoptr(GPtrArray) connections = g_ptr_array_new_with_free_func(g_object_unref);
+    for(gint i = 0; i < opt_count; i++) {
+        auto connection = d_bench_open_idle_connection(client,opt_host,opt_port);
+        if(!connection) {
+            break;
+        }
+        g_ptr_array_add(connections,connection);
+    }
+    // Let the server settle down after the last command.
+    g_usleep(G_USEC_PER_SEC);
+    gint64 rss_after = d_bench_read_rss(opt_pid);
+    if(rss_before < 0 || rss_after < 0) {
+        g_printerr("Can't read the server resident memory\n");
+        return EXIT_FAILURE;
+    }
+    guint opened = connections->len;
+    g_print("idle connections: %u\n",opened);
+    g_print("server RSS before: %" G_GINT64_FORMAT " kB\n",rss_before);
+    g_print("server RSS after:  %" G_GINT64_FORMAT " kB\n",rss_after);
+    if(opened) {
+        g_print("server RSS per 10k idle connections: %.1f kB\n",
+            double(rss_after - rss_before) * 10000.0 / opened);
+    }
+    g_free(opt_host);
+    return opened == guint(opt_count) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
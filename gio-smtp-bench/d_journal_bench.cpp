@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Journal group commit benchmark.
+ * @details Every thread is the session which appends the record and waits
+ * until it is durable before the next one, like the client waits for the
+ * response to the end of data. The run with the one record per commit is
+ * the fsync per message baseline, the next runs use the group commit with
+ * the given commit windows.
+ */
+#include "d_bench_util.hpp"
+#include "d_smtp_journal.hpp"
+#include <glib/gstdio.h>
+#include <stdlib.h>
+
+static gchar* opt_directory{nullptr};
+static gint opt_threads{32};
+static gint opt_record_size{4096};
+static gint opt_duration{5};
+static gchar* opt_windows{nullptr};
+
+static GOptionEntry bench_entries[] =
+{
+    {"directory",'D',0,G_OPTION_ARG_FILENAME,&opt_directory,"Journal directory, temporary if not set","DIRECTORY"},
+    {"threads",'t',0,G_OPTION_ARG_INT,&opt_threads,"Number of appending threads","COUNT"},
+    {"record-size",'s',0,G_OPTION_ARG_INT,&opt_record_size,"Record size","BYTES"},
+    {"duration",'d',0,G_OPTION_ARG_INT,&opt_duration,"Duration of the one run","SECONDS"},
+    {"windows",'w',0,G_OPTION_ARG_STRING,&opt_windows,"Commit windows, default 0,200,1000,5000","MICROSECONDS,..."},
+    {NULL}
+};
+
+/**
+ * @brief The state of the one appending thread.
+ */
+struct DJournalBenchThread
+{
+    DSmtpJournal* journal;
+    GBytes* record;
+    gint64 deadline;
+    /// @brief The append to durable time of every record.
+    GArray* latencies;
+    gboolean done;
+    gboolean failed;
+};
+
+static void journal_bench_append_handle(
+    GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    auto thread = static_cast<DJournalBenchThread*>(user_data);
+    GError* error{NULL};
+    if(!g_task_propagate_boolean(G_TASK(result),&error)) {
+        g_printerr("append failed: %s\n",error->message);
+        g_error_free(error);
+        thread->failed = TRUE;
+    }
+    thread->done = TRUE;
+}
+
+static gpointer journal_bench_thread(gpointer user_data)
+{
+    auto thread = static_cast<DJournalBenchThread*>(user_data);
+    g_autoptr(GMainContext) context = g_main_context_new();
+    // The task callback is invoked in this thread.
+    g_main_context_push_thread_default(context);
+    while(!thread->failed && g_get_monotonic_time() < thread->deadline) {
+        thread->done = FALSE;
+        gint64 start = g_get_monotonic_time();
+        g_autoptr(GTask) task = g_task_new(NULL,NULL,journal_bench_append_handle,thread);
+        d_smtp_journal_append(thread->journal,thread->record,task);
+        g_clear_object(&task);
+        while(!thread->done) {
+            g_main_context_iteration(context,TRUE);
+        }
+        gint64 latency = g_get_monotonic_time() - start;
+        g_array_append_val(thread->latencies,latency);
+    }
+    g_main_context_pop_thread_default(context);
+    return NULL;
+}
+
+/**
+ * @brief Append the records from all threads for the run duration.
+ */
+static void journal_bench_run(
+    const gchar* path,
+    guint commit_window,
+    guint max_batch)
+{
+    GError* error{NULL};
+    g_autoptr(DSmtpJournal) journal = d_smtp_journal_new(path,0,commit_window,max_batch,G_MAXSIZE,&error);
+    if(!journal) {
+        g_printerr("journal open failed: %s\n",error->message);
+        g_error_free(error);
+        exit(EXIT_FAILURE);
+    }
+    g_autoptr(GBytes) record = g_bytes_new_take(g_malloc0(opt_record_size),opt_record_size);
+    gint64 deadline = g_get_monotonic_time() + opt_duration * G_USEC_PER_SEC;
+    auto threads = g_new0(DJournalBenchThread,opt_threads);
+    g_autoptr(GPtrArray) handles = g_ptr_array_new();
+    for(gint index = 0; index < opt_threads; index++) {
+        threads[index].journal = journal;
+        threads[index].record = record;
+        threads[index].deadline = deadline;
+        threads[index].latencies = g_array_new(FALSE,FALSE,sizeof(gint64));
+        g_ptr_array_add(handles,g_thread_new("journal-bench",journal_bench_thread,&threads[index]));
+    }
+    g_autoptr(GArray) latencies = g_array_new(FALSE,FALSE,sizeof(gint64));
+    for(gint index = 0; index < opt_threads; index++) {
+        g_thread_join(static_cast<GThread*>(g_ptr_array_index(handles,index)));
+        g_array_append_vals(latencies,threads[index].latencies->data,threads[index].latencies->len);
+        g_array_unref(threads[index].latencies);
+    }
+    g_free(threads);
+    d_bench_sort_samples(latencies);
+    if(max_batch == 1) {
+        g_print("fsync per record:");
+    } else {
+        g_print("window %5u us:",commit_window);
+    }
+    g_print(" %8.0f records/s, latency p50 %" G_GINT64_FORMAT " us p99 %" G_GINT64_FORMAT " us\n",
+        latencies->len / double(opt_duration),
+        d_bench_percentile(latencies,50),d_bench_percentile(latencies,99));
+    // The mean batch size is in the metrics.
+    d_smtp_journal_log_metrics(journal);
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- SMTP journal group commit benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(opt_threads <= 0 || opt_record_size <= 0 || opt_duration <= 0) {
+        g_printerr("The positive threads, record size and duration are required\n");
+        return EXIT_FAILURE;
+    }
+    g_autofree gchar* directory = opt_directory ? g_strdup(opt_directory) : g_dir_make_tmp("journal-bench-XXXXXX",&error);
+    if(!directory) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    g_autofree gchar* path = g_build_filename(directory,"journal",NULL);
+    g_print("journal %s, %d threads, record %d bytes\n",path,opt_threads,opt_record_size);
+    journal_bench_run(path,0,1);
+    g_auto(GStrv) windows = g_strsplit(opt_windows ? opt_windows : "0,200,1000,5000",",",-1);
+    for(gchar** window = windows; *window; window++) {
+        journal_bench_run(path,guint(g_ascii_strtoull(*window,NULL,10)),G_MAXUINT);
+    }
+    g_unlink(path);
+    if(!opt_directory) {
+        g_rmdir(directory);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Microbenchmarks of the command parser, message scanner, FSM and
+ * timeout object.
+ * @details Built with Google Benchmark when it is installed. The results
+ * are written in JSON by the microbench-json target, or run directly:
+ * gio-smtp-microbench --benchmark_format=json --benchmark_out=FILE
+ * The log output is discarded, but the messages are still formatted
+ * like in the server with the message level filtered out.
+ */
+#include "d_smtp_command.hpp"
+#include "d_smtp_message.hpp"
+#include "d_smtp_state.hpp"
+#include "d_timeout.hpp"
+#include <benchmark/benchmark.h>
+#include <string.h>
+
+/**
+ * @brief Command line of every verb.
+ */
+struct DMicrobenchCommand
+{
+    const gchar* verb;
+    const gchar* line;
+};
+
+static const DMicrobenchCommand microbench_commands[] = {
+    {"HELO", "HELO client.localdomain\r\n"},
+    {"EHLO", "EHLO client.localdomain\r\n"},
+    {"MAIL", "MAIL FROM:<sender@client.localdomain>\r\n"},
+    {"RCPT", "RCPT TO:<recipient@localhost>\r\n"},
+    {"DATA", "DATA\r\n"},
+    {"QUIT", "QUIT\r\n"},
+    {"STARTTLS", "STARTTLS\r\n"},
+    {"RSET", "RSET\r\n"},
+    {"NOOP", "NOOP\r\n"},
+    {"unknown", "VRFY postmaster\r\n"},
+};
+
+/**
+ * @brief The command object life cycle of the one received command.
+ */
+static void BM_CommandProcess(benchmark::State& state)
+{
+    const DMicrobenchCommand& command = microbench_commands[state.range(0)];
+    g_autoptr(GBytes) bytes = g_bytes_new_static(command.line,strlen(command.line));
+    for(auto _ : state) {
+        auto smtp_command = d_smtp_command_new();
+        d_smtp_command_set_bytes(smtp_command,bytes);
+        benchmark::DoNotOptimize(d_smtp_command_process(smtp_command));
+        benchmark::DoNotOptimize(d_smtp_command_get_smtp_command(smtp_command));
+        g_object_unref(smtp_command);
+    }
+    state.SetLabel(command.verb);
+    state.SetBytesProcessed(state.iterations() * strlen(command.line));
+}
+BENCHMARK(BM_CommandProcess)->DenseRange(0,G_N_ELEMENTS(microbench_commands) - 1);
+
+/**
+ * @brief State changes of the one mail transaction session.
+ */
+static void BM_StateSession(benchmark::State& state)
+{
+    static const SMTP_COMMAND commands[] = {
+        SMTP_COMMAND_HELO, SMTP_COMMAND_MAIL, SMTP_COMMAND_RCPT, SMTP_COMMAND_DATA
+    };
+    DSmtpState smtp_state{};
+    gint64 transitions{0};
+    for(auto _ : state) {
+        d_smtp_state_set_next_state(&smtp_state,SMTP_STATE_GREETING_SENDING);
+        d_smtp_state_next_by_write_complete(&smtp_state);
+        for(SMTP_COMMAND command : commands) {
+            d_smtp_state_next_state_by_command(&smtp_state,command);
+            d_smtp_state_next_by_write_complete(&smtp_state);
+        }
+        d_smtp_state_next_by_event(&smtp_state,SMTP_EVENT_DATA_END);
+        d_smtp_state_next_by_write_complete(&smtp_state);
+        d_smtp_state_next_state_by_command(&smtp_state,SMTP_COMMAND_QUIT);
+        benchmark::DoNotOptimize(d_smtp_state_next_by_write_complete(&smtp_state));
+        transitions += 14;
+    }
+    state.SetItemsProcessed(transitions);
+}
+BENCHMARK(BM_StateSession);
+
+/**
+ * @brief The single transition by command and by write completion.
+ */
+static void BM_StateCommandTransition(benchmark::State& state)
+{
+    DSmtpState smtp_state{};
+    for(auto _ : state) {
+        d_smtp_state_set_next_state(&smtp_state,SMTP_STATE_HELO_ACCEPTED);
+        benchmark::DoNotOptimize(d_smtp_state_next_state_by_command(&smtp_state,SMTP_COMMAND_MAIL));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StateCommandTransition);
+
+static void BM_StateWriteCompleteTransition(benchmark::State& state)
+{
+    DSmtpState smtp_state{};
+    for(auto _ : state) {
+        d_smtp_state_set_next_state(&smtp_state,SMTP_STATE_MAIL_RECEIVED);
+        benchmark::DoNotOptimize(d_smtp_state_next_by_write_complete(&smtp_state));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StateWriteCompleteTransition);
+
+/**
+ * @brief Single pass scan of the message split to the receive blocks.
+ * @details The argument is the block size, the message is 64 KiB.
+ */
+static void BM_MessageScan(benchmark::State& state)
+{
+    GString* text = g_string_new(NULL);
+    for(guint i = 0; i < 20; i++) {
+        g_string_append_printf(text,"Received: from relay%u.localdomain by localhost\r\n",i);
+    }
+    g_string_append(text,"From: sender@client.localdomain\r\nDate: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+        "Message-ID: <microbench@client.localdomain>\r\n\r\n");
+    while(text->len < 65536) {
+        g_string_append(text,"The quick brown fox jumps over the lazy dog, the body line of 72 bytes\r\n");
+    }
+    g_string_append(text,".\r\n");
+    gsize block_size = state.range(0);
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    for(auto _ : state) {
+        d_smtp_message_parser_reset(&parser,65536);
+        gsize consumed{0};
+        for(gsize offset = 0; offset < text->len; offset += consumed) {
+            if(d_smtp_message_parser_feed(&parser,text->str + offset,
+                    MIN(block_size,text->len - offset),&consumed)) {
+                break;
+            }
+        }
+        benchmark::DoNotOptimize(parser.received_count);
+    }
+    d_smtp_message_parser_clear(&parser);
+    state.SetBytesProcessed(state.iterations() * text->len);
+    g_string_free(text,TRUE);
+}
+BENCHMARK(BM_MessageScan)->Arg(2048)->Arg(16384);
+
+/**
+ * @brief Arm and disarm of the operation timeout.
+ */
+static void BM_TimeoutStartStop(benchmark::State& state)
+{
+    g_autoptr(DTimeout) timeout = d_timeout_new();
+    for(auto _ : state) {
+        d_timeout_start(timeout,TIMEOUT_OPERATION_READ);
+        d_timeout_stop(timeout,TIMEOUT_OPERATION_READ);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TimeoutStartStop);
+
+static void microbench_log_handler(
+    const gchar* log_domain,
+    GLogLevelFlags log_level,
+    const gchar* message,
+    gpointer user_data)
+{
+    if(log_level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL)) {
+        g_log_default_handler(log_domain,log_level,message,user_data);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    g_log_set_default_handler(microbench_log_handler,NULL);
+    benchmark::Initialize(&argc,argv);
+    if(benchmark::ReportUnrecognizedArguments(argc,argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
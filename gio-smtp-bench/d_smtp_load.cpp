@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief SMTP load generator.
+ * @details Runs the asynchronous SMTP sessions from the single main loop
+ * against the server on localhost and reports the throughput and the
+ * latency histogram of connect, banner, every command and end-of-data.
+ *
+ * Closed loop (default): --concurrency sessions are kept running, the
+ * next session starts when the previous one is completed.
+ * Open loop (--rate): sessions are started at the fixed rate whatever
+ * the server speed is, --concurrency limits the sessions in flight and
+ * the sessions over the limit are counted as dropped. The connect latency
+ * is measured from the scheduled start, so the server stall isn't hidden.
+ *
+ * With --pipelining the MAIL, RCPT and DATA commands of the transaction
+ * are sent by the single write, the latency of every response is counted
+ * from that write. The server must advertise PIPELINING in the EHLO response.
+ *
+ * With --heavy-sessions the given percent of sessions sends the messages of
+ * --heavy-size bytes, the rest sends the regular ones. The end of data of
+ * the heavy messages is reported separately as heavy-eod. Such skewed mix
+ * with --messages above 1 shows how the light sessions are delayed by the
+ * heavy ones on the same worker, run it against the server with
+ * [server] rebalance-threshold=0 and with the default to compare.
+ */
+#include "d_bench_util.hpp"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static gchar* opt_host{nullptr};
+static gint opt_port{8425};
+static gint opt_duration{10};
+static gint opt_concurrency{16};
+static gint opt_messages{1};
+static gint opt_recipients{1};
+static gint opt_message_size{1024};
+static gchar* opt_size_distribution{nullptr};
+static gboolean opt_pipelining{FALSE};
+static gdouble opt_rate{0};
+static gint opt_heavy_sessions{0};
+static gint opt_heavy_size{1048576};
+
+static GOptionEntry load_entries[] =
+{
+    {"host",'H',0,G_OPTION_ARG_STRING,&opt_host,"SMTP server address","ADDRESS"},
+    {"port",'p',0,G_OPTION_ARG_INT,&opt_port,"SMTP server port","PORT"},
+    {"duration",'d',0,G_OPTION_ARG_INT,&opt_duration,"Time in seconds to start new sessions","SECONDS"},
+    {"concurrency",'c',0,G_OPTION_ARG_INT,&opt_concurrency,"Number of sessions in flight","COUNT"},
+    {"messages",'m',0,G_OPTION_ARG_INT,&opt_messages,"Messages per session","COUNT"},
+    {"recipients",'r',0,G_OPTION_ARG_INT,&opt_recipients,"Recipients per message","COUNT"},
+    {"message-size",'s',0,G_OPTION_ARG_INT,&opt_message_size,"Mean message size","BYTES"},
+    {"size-distribution",0,0,G_OPTION_ARG_STRING,&opt_size_distribution,
+     "Message size distribution: fixed, uniform or exponential","NAME"},
+    {"pipelining",'P',0,G_OPTION_ARG_NONE,&opt_pipelining,"Send the transaction commands by one write",NULL},
+    {"rate",'R',0,G_OPTION_ARG_DOUBLE,&opt_rate,"Open loop session start rate per second","RATE"},
+    {"heavy-sessions",0,0,G_OPTION_ARG_INT,&opt_heavy_sessions,"Percent of sessions sending heavy messages","PERCENT"},
+    {"heavy-size",0,0,G_OPTION_ARG_INT,&opt_heavy_size,"Message size of the heavy sessions","BYTES"},
+    {NULL}
+};
+
+/**
+ * @brief Measured stages of the session.
+ */
+enum LOAD_STAGE {
+    LOAD_STAGE_CONNECT,
+    LOAD_STAGE_BANNER,
+    LOAD_STAGE_EHLO,
+    LOAD_STAGE_MAIL,
+    LOAD_STAGE_RCPT,
+    LOAD_STAGE_DATA,
+    LOAD_STAGE_END_OF_DATA,
+    LOAD_STAGE_HEAVY_END_OF_DATA,
+    LOAD_STAGE_QUIT,
+    NR_LOAD_STAGES
+};
+
+static const gchar* load_stage_names[NR_LOAD_STAGES] = {
+    "connect", "banner", "EHLO", "MAIL", "RCPT", "DATA", "end-of-data", "heavy-eod", "QUIT"
+};
+
+/**
+ * @brief Session steps, the next step starts when all responses are read.
+ */
+enum LOAD_STEP {
+    LOAD_STEP_BANNER,
+    LOAD_STEP_EHLO,
+    LOAD_STEP_ENVELOPE,
+    LOAD_STEP_BODY,
+    LOAD_STEP_QUIT
+};
+
+enum LOAD_SIZE_DISTRIBUTION {
+    LOAD_SIZE_FIXED,
+    LOAD_SIZE_UNIFORM,
+    LOAD_SIZE_EXPONENTIAL
+};
+
+/**
+ * @brief The response expected from the server.
+ */
+struct DLoadResponse
+{
+    LOAD_STAGE stage;
+    guint code;
+};
+
+struct DLoad
+{
+    GMainLoop* loop;
+    GSocketClient* client;
+    GRand* rand;
+    LOAD_SIZE_DISTRIBUTION size_distribution;
+    /// @brief Latency samples of every stage in microseconds.
+    GArray* latencies[NR_LOAD_STAGES];
+    gint64 start_time;
+    gint64 end_time;
+    /// @brief New sessions aren't started after the duration is over.
+    gboolean stopping;
+    guint sessions_in_flight;
+    guint64 sessions_started;
+    guint64 sessions_completed;
+    guint64 sessions_dropped;
+    guint64 messages_sent;
+    guint64 bytes_sent;
+    guint64 errors;
+};
+
+struct DLoadSession
+{
+    DLoad* load;
+    GSocketConnection* connection;
+    GDataInputStream* input;
+    GOutputStream* output;
+    LOAD_STEP step;
+    /// @brief The EHLO response advertises PIPELINING.
+    gboolean pipelining;
+    /// @brief The session sends messages of --heavy-size.
+    gboolean heavy;
+    guint messages;
+    /// @brief The next envelope command: 0 - MAIL, 1..recipients - RCPT, then DATA.
+    guint command;
+    /// @brief The text being written.
+    GString* request;
+    /// @brief The time the last request is written or the session is scheduled.
+    gint64 request_time;
+    /// @brief Responses still expected for the last request.
+    GQueue responses;
+};
+
+static void load_session_start(DLoad* load, gint64 scheduled_time);
+
+static void load_add_sample(
+    DLoad* load,
+    LOAD_STAGE stage,
+    gint64 start)
+{
+    gint64 latency = g_get_monotonic_time() - start;
+    g_array_append_val(load->latencies[stage],latency);
+}
+
+/**
+ * @brief Pick the next message size by the distribution.
+ */
+static guint load_message_size(
+    DLoad* load)
+{
+    switch(load->size_distribution) {
+    case LOAD_SIZE_UNIFORM:
+        return g_rand_int_range(load->rand,1,2 * opt_message_size);
+    case LOAD_SIZE_EXPONENTIAL:
+        return guint(-log(1.0 - g_rand_double(load->rand)) * opt_message_size) + 1;
+    case LOAD_SIZE_FIXED:
+        break;
+    }
+    return opt_message_size;
+}
+
+/**
+ * @brief Append the message of about size bytes with the end of data marker.
+ */
+static void load_append_message(
+    GString* text,
+    guint size)
+{
+    static const gchar line[] =
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod.\r\n";
+    gsize start = text->len;
+    g_string_append(text,"Subject: load\r\n\r\n");
+    while(text->len - start < size) {
+        g_string_append_len(text,line,MIN(sizeof(line) - 1,size - (text->len - start)));
+    }
+    // The cut line is completed, so the marker is always at the line start.
+    if(text->str[text->len - 1] != '\n') {
+        g_string_append(text,"\r\n");
+    }
+    g_string_append(text,".\r\n");
+}
+
+static void load_session_free(
+    DLoadSession* session)
+{
+    auto load = session->load;
+    if(session->connection) {
+        g_io_stream_close(G_IO_STREAM(session->connection),NULL,NULL);
+    }
+    g_clear_object(&session->input);
+    g_clear_object(&session->connection);
+    g_queue_clear_full(&session->responses,g_free);
+    g_string_free(session->request,TRUE);
+    g_free(session);
+    load->sessions_in_flight--;
+    // The closed loop keeps the concurrency, the open loop only waits the end.
+    if(!load->stopping && opt_rate <= 0) {
+        load_session_start(load,g_get_monotonic_time());
+    } else if(load->stopping && !load->sessions_in_flight) {
+        g_main_loop_quit(load->loop);
+    }
+}
+
+static void load_session_failed(
+    DLoadSession* session,
+    const gchar* message)
+{
+    g_warning("session failed: %s",message);
+    session->load->errors++;
+    load_session_free(session);
+}
+
+static void load_session_read(DLoadSession* session);
+static void load_session_next(DLoadSession* session);
+
+static void load_session_expect(
+    DLoadSession* session,
+    LOAD_STAGE stage,
+    guint code)
+{
+    auto response = g_new(DLoadResponse,1);
+    response->stage = stage;
+    response->code = code;
+    g_queue_push_tail(&session->responses,response);
+}
+
+static void load_session_write_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto session = static_cast<DLoadSession*>(user_data);
+    GError *error{NULL};
+    if(!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source_object),res,NULL,&error)) {
+        g_autofree gchar* message = g_strdup(error->message);
+        g_error_free(error);
+        load_session_failed(session,message);
+        return;
+    }
+    session->load->bytes_sent += session->request->len;
+    load_session_read(session);
+}
+
+/**
+ * @brief Write the request, responses are expected by load_session_expect.
+ */
+static void load_session_write(
+    DLoadSession* session)
+{
+    session->request_time = g_get_monotonic_time();
+    g_output_stream_write_all_async(session->output,session->request->str,session->request->len,
+        G_PRIORITY_DEFAULT,NULL,load_session_write_handle,session);
+}
+
+static void load_session_read_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto session = static_cast<DLoadSession*>(user_data);
+    GError *error{NULL};
+    gsize length{0};
+    g_autofree gchar* line = g_data_input_stream_read_line_finish(
+        G_DATA_INPUT_STREAM(source_object),res,&length,&error);
+    if(!line) {
+        g_autofree gchar* message = error ? g_strdup(error->message) : g_strdup("connection closed");
+        g_clear_error(&error);
+        load_session_failed(session,message);
+        return;
+    }
+    if(length > 4 && g_ascii_strcasecmp(line + 4,"PIPELINING") == 0) {
+        session->pipelining = TRUE;
+    }
+    // Lines of the multiline response except the last one are skipped.
+    if(length >= 4 && line[3] == '-') {
+        load_session_read(session);
+        return;
+    }
+    auto response = static_cast<DLoadResponse*>(g_queue_pop_head(&session->responses));
+    guint code = guint(g_ascii_strtoull(line,NULL,10));
+    if(code != response->code) {
+        g_autofree gchar* message = g_strdup_printf("%s: unexpected response %s",
+            load_stage_names[response->stage],line);
+        g_free(response);
+        load_session_failed(session,message);
+        return;
+    }
+    load_add_sample(session->load,response->stage,session->request_time);
+    g_free(response);
+    if(g_queue_is_empty(&session->responses)) {
+        load_session_next(session);
+    } else {
+        load_session_read(session);
+    }
+}
+
+static void load_session_read(
+    DLoadSession* session)
+{
+    g_data_input_stream_read_line_async(session->input,G_PRIORITY_DEFAULT,NULL,
+        load_session_read_handle,session);
+}
+
+/**
+ * @brief Send the next command of the transaction envelope.
+ * @details Without pipelining every command is sent after the response
+ * to the previous one, otherwise all of them go by the one write.
+ */
+static void load_session_envelope(
+    DLoadSession* session)
+{
+    g_string_truncate(session->request,0);
+    guint last = opt_pipelining ? opt_recipients + 1 : session->command;
+    for(; session->command <= last; session->command++) {
+        guint command = session->command;
+        if(command == 0) {
+            g_string_append(session->request,"MAIL FROM:<load@load.localdomain>\r\n");
+            load_session_expect(session,LOAD_STAGE_MAIL,250);
+        } else if(command <= guint(opt_recipients)) {
+            g_string_append_printf(session->request,"RCPT TO:<user%u@localhost>\r\n",command);
+            load_session_expect(session,LOAD_STAGE_RCPT,250);
+        } else {
+            g_string_append(session->request,"DATA\r\n");
+            load_session_expect(session,LOAD_STAGE_DATA,354);
+        }
+    }
+    load_session_write(session);
+}
+
+/**
+ * @brief Continue the session when all expected responses are read.
+ */
+static void load_session_next(
+    DLoadSession* session)
+{
+    auto load = session->load;
+    switch(session->step) {
+    case LOAD_STEP_BANNER:
+        session->step = LOAD_STEP_EHLO;
+        g_string_assign(session->request,"EHLO load.localdomain\r\n");
+        load_session_expect(session,LOAD_STAGE_EHLO,250);
+        load_session_write(session);
+        break;
+    case LOAD_STEP_EHLO:
+        if(opt_pipelining && !session->pipelining) {
+            load_session_failed(session,"PIPELINING isn't advertised");
+            break;
+        }
+        session->step = LOAD_STEP_ENVELOPE;
+        session->command = 0;
+        load_session_envelope(session);
+        break;
+    case LOAD_STEP_ENVELOPE:
+        if(session->command <= guint(opt_recipients) + 1) {
+            load_session_envelope(session);
+            break;
+        }
+        session->step = LOAD_STEP_BODY;
+        g_string_truncate(session->request,0);
+        if(session->heavy) {
+            load_append_message(session->request,opt_heavy_size);
+            load_session_expect(session,LOAD_STAGE_HEAVY_END_OF_DATA,250);
+        } else {
+            load_append_message(session->request,load_message_size(load));
+            load_session_expect(session,LOAD_STAGE_END_OF_DATA,250);
+        }
+        load_session_write(session);
+        break;
+    case LOAD_STEP_BODY:
+        load->messages_sent++;
+        if(++session->messages < guint(opt_messages)) {
+            session->step = LOAD_STEP_ENVELOPE;
+            session->command = 0;
+            load_session_envelope(session);
+            break;
+        }
+        session->step = LOAD_STEP_QUIT;
+        g_string_assign(session->request,"QUIT\r\n");
+        load_session_expect(session,LOAD_STAGE_QUIT,221);
+        load_session_write(session);
+        break;
+    case LOAD_STEP_QUIT:
+        load->sessions_completed++;
+        load_session_free(session);
+        break;
+    }
+}
+
+static void load_session_connect_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto session = static_cast<DLoadSession*>(user_data);
+    GError *error{NULL};
+    session->connection = g_socket_client_connect_to_host_finish(
+        G_SOCKET_CLIENT(source_object),res,&error);
+    if(!session->connection) {
+        g_autofree gchar* message = g_strdup(error->message);
+        g_error_free(error);
+        load_session_failed(session,message);
+        return;
+    }
+    load_add_sample(session->load,LOAD_STAGE_CONNECT,session->request_time);
+    session->input = g_data_input_stream_new(
+        g_io_stream_get_input_stream(G_IO_STREAM(session->connection)));
+    g_data_input_stream_set_newline_type(session->input,G_DATA_STREAM_NEWLINE_TYPE_CR_LF);
+    session->output = g_io_stream_get_output_stream(G_IO_STREAM(session->connection));
+    session->step = LOAD_STEP_BANNER;
+    session->request_time = g_get_monotonic_time();
+    load_session_expect(session,LOAD_STAGE_BANNER,220);
+    load_session_read(session);
+}
+
+/**
+ * @brief Start the new session.
+ * @param [in] scheduled_time The time the session should have been started.
+ */
+static void load_session_start(
+    DLoad* load,
+    gint64 scheduled_time)
+{
+    if(load->sessions_in_flight >= guint(opt_concurrency)) {
+        load->sessions_dropped++;
+        return;
+    }
+    auto session = g_new0(DLoadSession,1);
+    session->load = load;
+    session->request = g_string_new(NULL);
+    session->request_time = scheduled_time;
+    session->heavy = g_rand_int_range(load->rand,0,100) < opt_heavy_sessions;
+    g_queue_init(&session->responses);
+    load->sessions_in_flight++;
+    load->sessions_started++;
+    g_socket_client_connect_to_host_async(load->client,opt_host,opt_port,NULL,
+        load_session_connect_handle,session);
+}
+
+/**
+ * @brief Open loop ticker, starts the sessions due by the rate.
+ */
+static gboolean load_rate_handle(
+    gpointer user_data)
+{
+    auto load = static_cast<DLoad*>(user_data);
+    gint64 now = g_get_monotonic_time();
+    if(now >= load->end_time) {
+        return G_SOURCE_REMOVE;
+    }
+    gdouble interval = G_USEC_PER_SEC / opt_rate;
+    guint64 due = guint64((now - load->start_time) / interval) + 1;
+    for(guint64 index = load->sessions_started + load->sessions_dropped; index < due; index++) {
+        load_session_start(load,load->start_time + gint64(index * interval));
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean load_stop_handle(
+    gpointer user_data)
+{
+    auto load = static_cast<DLoad*>(user_data);
+    load->stopping = TRUE;
+    if(!load->sessions_in_flight) {
+        g_main_loop_quit(load->loop);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Print the percentiles and the power of two histogram of the stage.
+ */
+static void load_print_stage(
+    const gchar* name,
+    GArray* samples)
+{
+    if(!samples->len) {
+        return;
+    }
+    d_bench_sort_samples(samples);
+    gint64 sum{0};
+    for(guint i = 0; i < samples->len; i++) {
+        sum += g_array_index(samples,gint64,i);
+    }
+    g_print("%-12s %9u %9.1f %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT
+        " %9" G_GINT64_FORMAT " %9" G_GINT64_FORMAT "\n",
+        name,samples->len,double(sum) / samples->len,
+        d_bench_percentile(samples,50),d_bench_percentile(samples,90),
+        d_bench_percentile(samples,99),d_bench_percentile(samples,99.9),
+        g_array_index(samples,gint64,samples->len - 1));
+    guint index{0};
+    for(gint64 bound = 1; index < samples->len; bound *= 2) {
+        guint count{0};
+        for(; index < samples->len && g_array_index(samples,gint64,index) <= bound; index++) {
+            count++;
+        }
+        if(count) {
+            g_print("    <= %9" G_GINT64_FORMAT " us %9u %5.1f%%\n",bound,count,
+                100.0 * count / samples->len);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- SMTP load generator");
+    g_option_context_add_main_entries(context,load_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(!opt_host) {
+        opt_host = g_strdup("127.0.0.1");
+    }
+    if(opt_duration <= 0 || opt_concurrency <= 0 || opt_messages <= 0 ||
+       opt_recipients <= 0 || opt_message_size <= 0) {
+        g_printerr("The duration, concurrency, messages, recipients and message size must be positive\n");
+        return EXIT_FAILURE;
+    }
+    if(opt_heavy_sessions < 0 || opt_heavy_sessions > 100 || opt_heavy_size <= 0) {
+        g_printerr("The heavy sessions must be 0..100 percent of positive size\n");
+        return EXIT_FAILURE;
+    }
+
+    DLoad load{};
+    if(!opt_size_distribution || g_str_equal(opt_size_distribution,"fixed")) {
+        load.size_distribution = LOAD_SIZE_FIXED;
+    } else if(g_str_equal(opt_size_distribution,"uniform")) {
+        load.size_distribution = LOAD_SIZE_UNIFORM;
+    } else if(g_str_equal(opt_size_distribution,"exponential")) {
+        load.size_distribution = LOAD_SIZE_EXPONENTIAL;
+    } else {
+        g_printerr("Unknown size distribution %s\n",opt_size_distribution);
+        return EXIT_FAILURE;
+    }
+    load.loop = g_main_loop_new(NULL,FALSE);
+    load.client = g_socket_client_new();
+    load.rand = g_rand_new();
+    for(guint stage = 0; stage < NR_LOAD_STAGES; stage++) {
+        load.latencies[stage] = g_array_new(FALSE,FALSE,sizeof(gint64));
+    }
+    load.start_time = g_get_monotonic_time();
+    load.end_time = load.start_time + gint64(opt_duration) * G_USEC_PER_SEC;
+    g_timeout_add_seconds(opt_duration,load_stop_handle,&load);
+    if(opt_rate > 0) {
+        g_timeout_add(1,load_rate_handle,&load);
+    } else {
+        for(gint i = 0; i < opt_concurrency; i++) {
+            load_session_start(&load,g_get_monotonic_time());
+        }
+    }
+    g_main_loop_run(load.loop);
+    gint64 elapsed = g_get_monotonic_time() - load.start_time;
+
+    g_print("%s loop, concurrency %d, %d messages of %d bytes (%s) x %d recipients per session%s\n",
+        opt_rate > 0 ? "open" : "closed",opt_concurrency,opt_messages,opt_message_size,
+        opt_size_distribution ? opt_size_distribution : "fixed",opt_recipients,
+        opt_pipelining ? ", pipelining" : "");
+    if(opt_heavy_sessions) {
+        g_print("heavy sessions: %d%% with %d bytes messages\n",opt_heavy_sessions,opt_heavy_size);
+    }
+    g_print("sessions: %" G_GUINT64_FORMAT " started, %" G_GUINT64_FORMAT " completed, %"
+        G_GUINT64_FORMAT " dropped, %" G_GUINT64_FORMAT " errors\n",
+        load.sessions_started,load.sessions_completed,load.sessions_dropped,load.errors);
+    g_print("throughput: %.1f sessions/s, %.1f messages/s, %.1f kB/s\n",
+        load.sessions_completed * 1e6 / elapsed,load.messages_sent * 1e6 / elapsed,
+        load.bytes_sent * 1e6 / 1024 / elapsed);
+    g_print("%-12s %9s %9s %9s %9s %9s %9s %9s (microseconds)\n",
+        "stage","count","mean","p50","p90","p99","p99.9","max");
+    for(guint stage = 0; stage < NR_LOAD_STAGES; stage++) {
+        load_print_stage(load_stage_names[stage],load.latencies[stage]);
+        g_array_unref(load.latencies[stage]);
+    }
+    g_rand_free(load.rand);
+    g_object_unref(load.client);
+    g_main_loop_unref(load.loop);
+    g_free(opt_host);
+    g_free(opt_size_distribution);
+    return load.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
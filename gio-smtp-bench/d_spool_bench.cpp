@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Spool deduplication benchmark.
+ * @details Messages go through the same transaction and spool path as in
+ * the server: the blocks are scanned, our Received field is prepended and
+ * the message is stored. Every message has the unique header, the body is
+ * the copy of the earlier body with the duplication probability, like the
+ * mailing list traffic. The run is repeated with the sharing disabled
+ * (every body digest is made unique) to compare the written bytes and
+ * the store rate. The spool is reopened to show the queue index load
+ * time and the queue is drained before the messages are removed.
+ */
+#include "d_smtp_transaction.hpp"
+#include "d_smtp_spool.hpp"
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static gchar* opt_directory{nullptr};
+static gint opt_messages{5000};
+static gint opt_body_size{65536};
+static gint opt_block_size{2048};
+static gdouble opt_duplication{0.8};
+
+static GOptionEntry bench_entries[] =
+{
+    {"directory",'D',0,G_OPTION_ARG_FILENAME,&opt_directory,"Spool directory, temporary if not set","DIRECTORY"},
+    {"messages",'n',0,G_OPTION_ARG_INT,&opt_messages,"Number of messages","COUNT"},
+    {"body-size",'s',0,G_OPTION_ARG_INT,&opt_body_size,"Message body size","BYTES"},
+    {"block-size",'b',0,G_OPTION_ARG_INT,&opt_block_size,"Receive block size","BYTES"},
+    {"duplication",'r',0,G_OPTION_ARG_DOUBLE,&opt_duplication,"Probability of the already seen body","RATIO"},
+    {NULL}
+};
+
+/**
+ * @brief Generate the message text with the body of the seed.
+ */
+static GString* spool_bench_message(
+    guint index,
+    guint32 body_seed)
+{
+    GString* text = g_string_new(NULL);
+    g_string_append_printf(text,
+        "From: list@lists.localdomain\r\n"
+        "To: member%u@localhost\r\n"
+        "Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+        "Message-ID: <%u.%u@lists.localdomain>\r\n"
+        "List-Unsubscribe: <mailto:leave-%u@lists.localdomain>\r\n"
+        "\r\n",index,body_seed,index,index);
+    g_autoptr(GRand) rand = g_rand_new_with_seed(body_seed);
+    gsize body_end = text->len + opt_body_size;
+    while(text->len < body_end) {
+        // The 76 characters line of the base64 like text.
+        for(gint column = 0; column < 76; column++) {
+            g_string_append_c(text,'A' + g_rand_int_range(rand,0,26));
+        }
+        g_string_append(text,"\r\n");
+    }
+    g_string_append(text,".\r\n");
+    return text;
+}
+
+/**
+ * @brief Pass the message through the transaction in the receive blocks.
+ */
+static DSmtpSpoolMessage* spool_bench_receive(
+    DSmtpTransaction* transaction,
+    GString* text)
+{
+    d_smtp_transaction_begin(transaction,"list-bounces@lists.localdomain");
+    d_smtp_transaction_add_recipient(transaction,"member@localhost");
+    for(gsize offset = 0; offset < text->len; ) {
+        g_autoptr(GBytes) bytes = g_bytes_new(text->str + offset,MIN(gsize(opt_block_size),text->len - offset));
+        gsize consumed{0};
+        gboolean found = d_smtp_transaction_add_data(transaction,bytes,&consumed);
+        offset += consumed;
+        if(found) break;
+    }
+    d_smtp_transaction_prepend(transaction,
+        d_smtp_message_received_new("localhost","lists.localdomain",NULL,"127.0.0.1",FALSE));
+    return d_smtp_transaction_complete(transaction);
+}
+
+/**
+ * @brief The result of the one store.
+ */
+struct DSpoolBenchStore
+{
+    gchar* id;
+    GError* error;
+    gboolean done;
+};
+
+static void spool_bench_store_handle(
+    GObject* source,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    auto store = static_cast<DSpoolBenchStore*>(user_data);
+    store->id = d_smtp_spool_store_finish(D_SMTP_SPOOL(source),result,&store->error);
+    store->done = TRUE;
+}
+
+/**
+ * @brief Store all messages and remove them.
+ * @param [in] share Keep the body digest, otherwise make it unique.
+ */
+static void spool_bench_run(
+    const gchar* directory,
+    gboolean share)
+{
+    GError *error{NULL};
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_new(directory,0,&error);
+    if(!spool) {
+        g_printerr("spool open failed: %s\n",error->message);
+        g_error_free(error);
+        exit(EXIT_FAILURE);
+    }
+    DSmtpTransaction transaction;
+    d_smtp_transaction_init(&transaction);
+    d_smtp_transaction_set_max_header_size(&transaction,65536);
+    // The same seeds in both runs.
+    g_autoptr(GRand) rand = g_rand_new_with_seed(1);
+    guint32 bodies{0};
+    g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func(g_free);
+    gint64 receive_time{0};
+    gint64 store_time{0};
+    for(gint index = 0; index < opt_messages; index++) {
+        guint32 body_seed = bodies && g_rand_double(rand) < opt_duplication ?
+            g_rand_int_range(rand,0,bodies) : bodies++;
+        g_autoptr(GString) text = spool_bench_message(index,body_seed);
+        gint64 start = g_get_monotonic_time();
+        DSmtpSpoolMessage* message = spool_bench_receive(&transaction,text);
+        if(!share) {
+            gchar* digest = g_strdup_printf("%s-%d",message->body_digest,index);
+            g_free(message->body_digest);
+            message->body_digest = digest;
+        }
+        gint64 stored = g_get_monotonic_time();
+        // The message is durable when the store returns, like the session waits.
+        DSpoolBenchStore store{};
+        d_smtp_spool_store_async(spool,message,NULL,spool_bench_store_handle,&store);
+        while(!store.done) {
+            g_main_context_iteration(NULL,TRUE);
+        }
+        if(!store.id) {
+            g_printerr("store failed: %s\n",store.error->message);
+            g_error_free(store.error);
+            exit(EXIT_FAILURE);
+        }
+        store_time += g_get_monotonic_time() - stored;
+        receive_time += stored - start;
+        g_ptr_array_add(ids,store.id);
+    }
+    d_smtp_transaction_clear(&transaction);
+
+    g_print("%s: %d messages, %u distinct bodies, scan %.1f us/message, store %.1f messages/s\n",
+        share ? "shared bodies" : "unique bodies",opt_messages,bodies,
+        double(receive_time) / opt_messages,opt_messages * 1e6 / MAX(store_time,1));
+    d_smtp_spool_log_metrics(spool);
+
+    // The queue is loaded by the index mapping, not by the directory walk.
+    g_clear_object(&spool);
+    gint64 start = g_get_monotonic_time();
+    spool = d_smtp_spool_new(directory,0,&error);
+    if(!spool) {
+        g_printerr("spool open failed: %s\n",error->message);
+        g_error_free(error);
+        exit(EXIT_FAILURE);
+    }
+    g_print("  reopen %.1f ms, %u messages queued\n",
+        (g_get_monotonic_time() - start) / 1000.0,d_smtp_spool_get_queued_count(spool));
+    start = g_get_monotonic_time();
+    guint dequeued{0};
+    for(gchar* id = d_smtp_spool_dequeue(spool,"localhost"); id; id = d_smtp_spool_dequeue(spool,"localhost")) {
+        g_free(id);
+        dequeued++;
+    }
+    g_print("  dequeue %u messages %.1f messages/s\n",dequeued,dequeued * 1e6 / MAX(g_get_monotonic_time() - start,1));
+
+    start = g_get_monotonic_time();
+    for(guint index = 0; index < ids->len; index++) {
+        if(!d_smtp_spool_remove(spool,static_cast<const gchar*>(g_ptr_array_index(ids,index)),&error)) {
+            g_printerr("remove failed: %s\n",error->message);
+            g_clear_error(&error);
+        }
+    }
+    g_print("  remove %.1f messages/s\n",ids->len * 1e6 / MAX(g_get_monotonic_time() - start,1));
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- SMTP spool deduplication benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(opt_messages <= 0 || opt_body_size <= 0 || opt_block_size <= 0 ||
+       opt_duplication < 0 || opt_duplication > 1) {
+        g_printerr("The positive messages, body and block size and duplication 0..1 are required\n");
+        return EXIT_FAILURE;
+    }
+    g_autofree gchar* directory = opt_directory ? g_strdup(opt_directory) : g_dir_make_tmp("spool-bench-XXXXXX",&error);
+    if(!directory) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    g_print("spool %s, duplication %.2f, body %d bytes\n",directory,opt_duplication,opt_body_size);
+    spool_bench_run(directory,FALSE);
+    spool_bench_run(directory,TRUE);
+    if(!opt_directory) {
+        g_autofree gchar* messages = g_build_filename(directory,"messages",NULL);
+        g_autofree gchar* bodies = g_build_filename(directory,"bodies",NULL);
+        g_autofree gchar* journal = g_build_filename(directory,"journal",NULL);
+        g_autofree gchar* index = g_build_filename(directory,"queue.index",NULL);
+        g_unlink(journal);
+        g_unlink(index);
+        g_rmdir(messages);
+        g_rmdir(bodies);
+        g_rmdir(directory);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief TLS handshake storm benchmark.
+ * @details Measures the command latency of the established plain sessions
+ * first on the quiet server and then while the storm threads keep opening
+ * new STARTTLS sessions with the full handshake. Run the benchmark against
+ * the server started with --tls-handshake-threads=0 (handshake in the
+ * worker) and with the non zero value (handshake threads) to compare
+ * the p99 command latency during the storm.
+ */
+#include "d_bench_util.hpp"
+#include <stdlib.h>
+
+static gchar* opt_host{nullptr};
+static gint opt_port{8425};
+static gint opt_duration{10};
+static gint opt_storm_threads{8};
+static gint opt_sessions{16};
+
+static GOptionEntry bench_entries[] =
+{
+    {"host",'H',0,G_OPTION_ARG_STRING,&opt_host,"SMTP server address","ADDRESS"},
+    {"port",'p',0,G_OPTION_ARG_INT,&opt_port,"SMTP server port","PORT"},
+    {"duration",'d',0,G_OPTION_ARG_INT,&opt_duration,"Duration of every phase in seconds","SECONDS"},
+    {"storm-threads",'t',0,G_OPTION_ARG_INT,&opt_storm_threads,"Number of threads opening TLS sessions","COUNT"},
+    {"sessions",'s',0,G_OPTION_ARG_INT,&opt_sessions,"Number of established sessions probed","COUNT"},
+    {NULL}
+};
+
+/// @brief The storm threads run while the flag is set.
+static gint storm_running{0};
+/// @brief The number of completed handshakes.
+static gint storm_handshakes{0};
+/// @brief The number of failed storm sessions.
+static gint storm_failures{0};
+
+/**
+ * @brief Accept the self-signed test certificate.
+ */
+static gboolean storm_accept_certificate(
+    GTlsConnection* connection,
+    GTlsCertificate* certificate,
+    GTlsCertificateFlags errors,
+    gpointer user_data)
+{
+    return TRUE;
+}
+
+/**
+ * @brief Open the session, switch it to TLS and close it.
+ */
+static gboolean storm_session(
+    GSocketClient* client)
+{
+    GError *error{NULL};
+    g_autoptr(GSocketConnection) connection =
+        g_socket_client_connect_to_host(client,opt_host,opt_port,NULL,&error);
+    if(!connection) {
+        g_warning("connect failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    auto socket = g_socket_connection_get_socket(connection);
+    if(!d_bench_read_response(socket,220) ||
+       !d_bench_send_text(socket,"EHLO storm.localdomain\r\n") ||
+       !d_bench_read_response(socket,250) ||
+       !d_bench_send_text(socket,"STARTTLS\r\n") ||
+       !d_bench_read_response(socket,220)) {
+        g_warning("STARTTLS isn't accepted");
+        return FALSE;
+    }
+    g_autoptr(GIOStream) tls_connection =
+        g_tls_client_connection_new(G_IO_STREAM(connection),NULL,&error);
+    if(!tls_connection) {
+        g_warning("TLS connection create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    // No session is reused, so every session is a full handshake.
+    g_signal_connect(tls_connection,"accept-certificate",G_CALLBACK(storm_accept_certificate),NULL);
+    if(!g_tls_connection_handshake(G_TLS_CONNECTION(tls_connection),NULL,&error)) {
+        g_warning("TLS handshake failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_atomic_int_inc(&storm_handshakes);
+    g_io_stream_close(tls_connection,NULL,NULL);
+    return TRUE;
+}
+
+static gpointer storm_thread(gpointer user_data)
+{
+    g_autoptr(GSocketClient) client = g_socket_client_new();
+    while(g_atomic_int_get(&storm_running)) {
+        if(!storm_session(client)) {
+            g_atomic_int_inc(&storm_failures);
+            g_usleep(10000);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Measure the latency of the commands of the one plain session.
+ * @details The session can't return to the idle state after MAIL, so
+ * every probe opens the new session and measures MAIL, RCPT and QUIT.
+ */
+static gboolean probe_session(
+    GSocketClient* client,
+    GArray* latencies)
+{
+    static const gchar* requests[] = {
+        "MAIL FROM:<sender@bench.localdomain>\r\n",
+        "RCPT TO:<recipient@localhost>\r\n",
+        "QUIT\r\n",
+    };
+    static const guint codes[] = { 250, 250, 221 };
+    g_autoptr(GSocketConnection) connection =
+        d_bench_open_idle_connection(client,opt_host,opt_port);
+    if(!connection) {
+        return FALSE;
+    }
+    auto socket = g_socket_connection_get_socket(connection);
+    for(guint index = 0; index < G_N_ELEMENTS(requests); index++) {
+        gint64 start = g_get_monotonic_time();
+        if(!d_bench_send_text(socket,requests[index]) ||
+           !d_bench_read_response(socket,codes[index])) {
+            return FALSE;
+        }
+        gint64 latency = g_get_monotonic_time() - start;
+        g_array_append_val(latencies,latency);
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Probe the command latency for the phase duration.
+ */
+static GArray* probe_phase(
+    GSocketClient* client)
+{
+    auto latencies = g_array_new(FALSE,FALSE,sizeof(gint64));
+    gint64 end = g_get_monotonic_time() + gint64(opt_duration) * G_USEC_PER_SEC;
+    while(g_get_monotonic_time() < end) {
+        if(!probe_session(client,latencies)) {
+            g_printerr("Probe session failed\n");
+            break;
+        }
+    }
+    d_bench_sort_samples(latencies);
+    return latencies;
+}
+
+static void print_phase(
+    const gchar* name,
+    GArray* latencies)
+{
+    g_print("%-8s %10u %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+        name,latencies->len,
+        d_bench_percentile(latencies,50),d_bench_percentile(latencies,99),
+        latencies->len ? g_array_index(latencies,gint64,latencies->len - 1) : 0);
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- SMTP server TLS handshake storm benchmark");
+    g_option_context_add_main_entries(context,bench_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(!opt_host) {
+        opt_host = g_strdup("127.0.0.1");
+    }
+    if(opt_duration <= 0 || opt_storm_threads <= 0) {
+        g_printerr("The positive --duration and --storm-threads are required\n");
+        return EXIT_FAILURE;
+    }
+
+    g_autoptr(GSocketClient) client = g_socket_client_new();
+    // Keep the idle sessions spread over the workers like the real load.
+    g_autoptr(GPtrArray) sessions = g_ptr_array_new_with_free_func(g_object_unref);
+    for(gint i = 0; i < opt_sessions; i++) {
+        auto connection = d_bench_open_idle_connection(client,opt_host,opt_port);
+        if(!connection) {
+            g_printerr("Only %d sessions are opened\n",i);
+            return EXIT_FAILURE;
+        }
+        g_ptr_array_add(sessions,connection);
+    }
+
+    GArray* quiet = probe_phase(client);
+
+    g_atomic_int_set(&storm_running,1);
+    g_autoptr(GPtrArray) threads = g_ptr_array_new();
+    for(gint i = 0; i < opt_storm_threads; i++) {
+        g_ptr_array_add(threads,g_thread_new("storm",storm_thread,NULL));
+    }
+    // Let the storm reach the steady state before probing.
+    g_usleep(G_USEC_PER_SEC / 2);
+    gint handshakes_before = g_atomic_int_get(&storm_handshakes);
+    GArray* storm = probe_phase(client);
+    gint handshakes = g_atomic_int_get(&storm_handshakes) - handshakes_before;
+    g_atomic_int_set(&storm_running,0);
+    for(guint i = 0; i < threads->len; i++) {
+        g_thread_join(static_cast<GThread*>(g_ptr_array_index(threads,i)));
+    }
+
+    g_print("storm: %.1f handshakes per second, %d failures\n",
+        double(handshakes) / opt_duration,g_atomic_int_get(&storm_failures));
+    g_print("%-8s %10s %10s %10s %10s (microseconds)\n","phase","commands","p50","p99","max");
+    print_phase("quiet",quiet);
+    print_phase("storm",storm);
+    g_array_unref(quiet);
+    g_array_unref(storm);
+    g_free(opt_host);
+    return handshakes > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Session trace report.
+ * @details Reads the trace ring written by the server with the trace file
+ * configured and prints the percentiles of every session phase, so it is
+ * seen if the time goes to the network, the command processing or the
+ * spool. Sessions which didn't reach the phase are not counted in it.
+ */
+#include "d_bench_util.hpp"
+#include "d_smtp_trace.hpp"
+#include <stdlib.h>
+
+static gboolean opt_per_message{FALSE};
+
+static GOptionEntry report_entries[] =
+{
+    {"per-message",'m',0,G_OPTION_ARG_NONE,&opt_per_message,"Divide the data and spool times by the session messages",NULL},
+    {NULL}
+};
+
+/**
+ * @brief The phase column of the record.
+ */
+struct DTraceReportPhase
+{
+    const gchar* name;
+    gsize offset;
+    GArray* samples;
+};
+
+static DTraceReportPhase report_phases[] = {
+    {"dispatch",G_STRUCT_OFFSET(DSmtpTraceRecord,dispatch),NULL},
+    {"greeting",G_STRUCT_OFFSET(DSmtpTraceRecord,greeting),NULL},
+    {"command_wait",G_STRUCT_OFFSET(DSmtpTraceRecord,command_wait),NULL},
+    {"command",G_STRUCT_OFFSET(DSmtpTraceRecord,command),NULL},
+    {"write",G_STRUCT_OFFSET(DSmtpTraceRecord,write),NULL},
+    {"data",G_STRUCT_OFFSET(DSmtpTraceRecord,data),NULL},
+    {"spool",G_STRUCT_OFFSET(DSmtpTraceRecord,spool),NULL},
+    {"tls",G_STRUCT_OFFSET(DSmtpTraceRecord,tls),NULL},
+    {"session",G_STRUCT_OFFSET(DSmtpTraceRecord,session),NULL},
+};
+
+static void trace_report_record(
+    const DSmtpTraceRecord* record,
+    gpointer user_data)
+{
+    for(DTraceReportPhase& phase : report_phases) {
+        gint64 value = G_STRUCT_MEMBER(guint32,record,phase.offset);
+        gboolean per_message = phase.offset == G_STRUCT_OFFSET(DSmtpTraceRecord,data) ||
+            phase.offset == G_STRUCT_OFFSET(DSmtpTraceRecord,spool);
+        if(per_message && record->messages == 0) {
+            continue;
+        }
+        if(per_message && opt_per_message) {
+            value /= record->messages;
+        }
+        // The phase the session didn't reach isn't the zero latency.
+        if(value == 0 && phase.offset != G_STRUCT_OFFSET(DSmtpTraceRecord,command_wait) &&
+           phase.offset != G_STRUCT_OFFSET(DSmtpTraceRecord,dispatch)) {
+            continue;
+        }
+        g_array_append_val(phase.samples,value);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("TRACE-FILE - SMTP session trace report");
+    g_option_context_add_main_entries(context,report_entries,NULL);
+    GError *error{NULL};
+    if(!g_option_context_parse(context,&argc,&argv,&error)) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    if(argc != 2) {
+        g_printerr("The trace file is required\n");
+        return EXIT_FAILURE;
+    }
+    for(DTraceReportPhase& phase : report_phases) {
+        phase.samples = g_array_new(FALSE,FALSE,sizeof(gint64));
+    }
+    gint count = d_smtp_trace_ring_read(argv[1],trace_report_record,NULL,&error);
+    if(count < 0) {
+        g_printerr("%s\n",error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+    g_print("%d sessions, microseconds%s\n",count,opt_per_message ? ", data and spool per message" : "");
+    g_print("%-14s %8s %10s %10s %10s %10s %10s\n","phase","count","mean","p50","p90","p99","max");
+    for(DTraceReportPhase& phase : report_phases) {
+        GArray* samples = phase.samples;
+        if(samples->len == 0) {
+            g_print("%-14s %8u\n",phase.name,0u);
+            g_array_unref(samples);
+            continue;
+        }
+        d_bench_sort_samples(samples);
+        gdouble sum{0};
+        for(guint index = 0; index < samples->len; index++) {
+            sum += g_array_index(samples,gint64,index);
+        }
+        g_print("%-14s %8u %10.0f %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+            phase.name,samples->len,sum / samples->len,
+            d_bench_percentile(samples,50),d_bench_percentile(samples,90),
+            d_bench_percentile(samples,99),g_array_index(samples,gint64,samples->len - 1));
+        g_array_unref(samples);
+    }
+    return EXIT_SUCCESS;
+}
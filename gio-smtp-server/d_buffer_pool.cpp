@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_buffer_pool.hpp"
+
+/// @brief The maximum number of free buffers kept by the shared pools.
+#define SHARED_POOL_MAX_FREE 1024
+
+extern "C" {
+
+/**
+ * @brief Header placed in front of every buffer.
+ * @details Header size keeps the buffer data aligned to 16 bytes.
+ */
+struct alignas(16) DBufferHeader
+{
+    DBufferPool* pool;
+    /// @brief The next free buffer, valid only while buffer is in the pool.
+    DBufferHeader* next;
+};
+
+struct _DBufferPool
+{
+    GObject parent;
+
+    gsize buffer_size;
+    guint max_free;
+
+    GMutex lock;
+    DBufferHeader* free_list;
+    guint free_count;
+    gint used_count;
+};
+typedef _DBufferPool DBufferPool;
+
+G_DEFINE_TYPE(DBufferPool,d_buffer_pool,G_TYPE_OBJECT)
+
+struct _DBufferPoolClass
+{
+    GObjectClass parent;
+};
+
+static DBufferHeader* buffer_header(gpointer buffer)
+{
+    return reinterpret_cast<DBufferHeader*>(buffer) - 1;
+}
+
+gsize d_buffer_pool_get_buffer_size(
+    DBufferPool* pool)
+{
+    g_return_val_if_fail(D_IS_BUFFER_POOL(pool),0);
+    return pool->buffer_size;
+}
+
+gpointer d_buffer_pool_acquire(
+    DBufferPool* pool)
+{
+    g_return_val_if_fail(D_IS_BUFFER_POOL(pool),NULL);
+    g_mutex_lock(&pool->lock);
+    DBufferHeader* header = pool->free_list;
+    if(header) {
+        pool->free_list = header->next;
+        pool->free_count--;
+    }
+    g_mutex_unlock(&pool->lock);
+    if(!header) {
+        header = static_cast<DBufferHeader*>(g_malloc(sizeof(DBufferHeader) + pool->buffer_size));
+    }
+    header->pool = D_BUFFER_POOL(g_object_ref(pool));
+    header->next = nullptr;
+    g_atomic_int_inc(&pool->used_count);
+    return header + 1;
+}
+
+void d_buffer_pool_release(
+    gpointer buffer)
+{
+    if(!buffer) return;
+    DBufferHeader* header = buffer_header(buffer);
+    DBufferPool* pool = header->pool;
+    g_atomic_int_add(&pool->used_count,-1);
+    g_mutex_lock(&pool->lock);
+    if(pool->free_count < pool->max_free) {
+        header->next = pool->free_list;
+        pool->free_list = header;
+        pool->free_count++;
+        header = nullptr;
+    }
+    g_mutex_unlock(&pool->lock);
+    // Pool is full, give memory back to the system.
+    g_free(header);
+    g_object_unref(pool);
+}
+
+GBytes* d_buffer_pool_bytes_new(
+    gpointer buffer,
+    gsize size)
+{
+    return g_bytes_new_with_free_func(buffer,size,d_buffer_pool_release,buffer);
+}
+
+guint d_buffer_pool_get_used_count(
+    DBufferPool* pool)
+{
+    g_return_val_if_fail(D_IS_BUFFER_POOL(pool),0);
+    return g_atomic_int_get(&pool->used_count);
+}
+
+guint d_buffer_pool_get_free_count(
+    DBufferPool* pool)
+{
+    g_return_val_if_fail(D_IS_BUFFER_POOL(pool),0);
+    g_mutex_lock(&pool->lock);
+    guint free_count = pool->free_count;
+    g_mutex_unlock(&pool->lock);
+    return free_count;
+}
+
+DBufferPool* d_buffer_pool_get_shared(
+    gsize buffer_size)
+{
+    G_LOCK_DEFINE_STATIC(shared_pools);
+    static GHashTable* shared_pools{nullptr};
+    G_LOCK(shared_pools);
+    if(!shared_pools) {
+        shared_pools = g_hash_table_new_full(g_direct_hash,g_direct_equal,NULL,g_object_unref);
+    }
+    auto pool = D_BUFFER_POOL(g_hash_table_lookup(shared_pools,GSIZE_TO_POINTER(buffer_size)));
+    if(!pool) {
+        pool = d_buffer_pool_new(buffer_size,SHARED_POOL_MAX_FREE);
+        g_hash_table_insert(shared_pools,GSIZE_TO_POINTER(buffer_size),pool);
+    }
+    G_UNLOCK(shared_pools);
+    return pool;
+}
+
+static void d_buffer_pool_init(DBufferPool* pool)
+{
+    g_mutex_init(&pool->lock);
+}
+
+static void d_buffer_pool_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_BUFFER_POOL(object));
+    auto pool = D_BUFFER_POOL(object);
+    // Every used buffer holds the pool reference, so only free ones left.
+    while(pool->free_list) {
+        DBufferHeader* header = pool->free_list;
+        pool->free_list = header->next;
+        g_free(header);
+    }
+    g_mutex_clear(&pool->lock);
+    G_OBJECT_CLASS(d_buffer_pool_parent_class)->finalize(object);
+}
+
+static void d_buffer_pool_class_init(DBufferPoolClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_buffer_pool_finalize;
+}
+
+/**
+ * @brief Create new instance of buffers pool.
+ */
+DBufferPool* d_buffer_pool_new(
+    gsize buffer_size,
+    guint max_free)
+{
+    auto pool = reinterpret_cast<DBufferPool*>(
+        g_object_new(
+            D_TYPE_BUFFER_POOL,
+            NULL));
+
+    pool->buffer_size = buffer_size;
+    pool->max_free = max_free;
+
+    return pool;
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__BUFFER_POOL__HPP__
+#define __D__NEW__BUFFER_POOL__HPP__
+/**
+ * @brief Pool of the fixed size I/O buffers.
+ * @details Connections take buffers only for the time of the actual
+ * receive or transmit operation and give them back when bytes are
+ * processed. So idle connections don't hold any buffer memory.
+ * Pool is thread safe, the shared pools are used by all workers.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+#define D_TYPE_BUFFER_POOL (d_buffer_pool_get_type())
+
+G_DECLARE_FINAL_TYPE(DBufferPool,d_buffer_pool,D,BUFFER_POOL,GObject)
+
+/**
+ * @brief Get the size of pool buffers.
+ */
+gsize d_buffer_pool_get_buffer_size(
+    DBufferPool* pool);
+
+/**
+ * @brief Take the buffer from pool.
+ * @details The new buffer is allocated if pool has no free buffers.
+ * The buffer keeps the pool alive until it is released.
+ * @return The buffer of d_buffer_pool_get_buffer_size bytes.
+ */
+gpointer d_buffer_pool_acquire(
+    DBufferPool* pool);
+
+/**
+ * @brief Give the buffer back to its pool.
+ * @param [in] buffer The buffer returned by d_buffer_pool_acquire.
+ */
+void d_buffer_pool_release(
+    gpointer buffer);
+
+/**
+ * @brief Wrap the pool buffer into GBytes.
+ * @details The buffer is released to the pool when the last
+ * reference to the bytes is dropped.
+ * @param [in] buffer The buffer returned by d_buffer_pool_acquire.
+ * @param [in] size The number of valid bytes in the buffer.
+ */
+GBytes* d_buffer_pool_bytes_new(
+    gpointer buffer,
+    gsize size);
+
+/**
+ * @brief Get the number of buffers taken from the pool.
+ */
+guint d_buffer_pool_get_used_count(
+    DBufferPool* pool);
+
+/**
+ * @brief Get the number of buffers kept in the pool for reuse.
+ */
+guint d_buffer_pool_get_free_count(
+    DBufferPool* pool);
+
+/**
+ * @brief Get the process wide pool for the buffer size.
+ * @return The shared pool, caller doesn't own the reference.
+ */
+DBufferPool* d_buffer_pool_get_shared(
+    gsize buffer_size);
+
+/**
+ * @brief Create new instance of buffers pool.
+ * @param [in] buffer_size The size of pool buffers.
+ * @param [in] max_free The maximum number of free buffers kept for reuse.
+ */
+DBufferPool* d_buffer_pool_new(
+    gsize buffer_size,
+    guint max_free);
+
+}
+
+#endif //#ifndef __D__NEW__BUFFER_POOL__HPP__
@@ -0,0 +1,1610 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_dkim.hpp"
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+/// @brief The maximum number of signatures checked per message.
+#define DKIM_MAX_SIGNATURES 8
+/// @brief The longest line kept for the canonicalization.
+#define DKIM_MAX_LINE_LENGTH 65536
+/// @brief RFC 8301 3.2 minimum RSA key size.
+#define DKIM_MIN_RSA_BITS 1024
+#define DKIM_DIGEST_SIZE 32
+
+extern "C" {
+
+/**
+ * @brief The parsed public key, immutable and shared by the messages.
+ */
+struct DDkimKey
+{
+    gint ref_count;
+    /// @brief The key or NULL if the key record is missing, revoked or malformed.
+    EVP_PKEY* pkey;
+    gboolean ed25519;
+};
+
+struct DDkimKeyEntry
+{
+    /// @brief The TXT answer the key is parsed from.
+    DDnsAnswer* answer;
+    DDkimKey* key;
+};
+
+/**
+ * @brief The body hash of the one signature.
+ * @details The trailing empty lines are counted and hashed only when
+ * the next non empty line comes, so they are dropped at the end.
+ */
+struct DDkimBodyHash
+{
+    GChecksum* checksum;
+    gboolean relaxed;
+    /// @brief The number of body bytes left to hash by l=, -1 for all.
+    gint64 remaining;
+    guint empty_lines;
+    /// @brief The body has the non empty line.
+    gboolean has_lines;
+};
+
+struct DDkimSignature
+{
+    /// @brief The result, DKIM_RESULT_NONE until it is known.
+    DKIM_RESULT result;
+    /// @brief The index of the DKIM-Signature field in the header.
+    guint field;
+    gboolean ed25519;
+    gboolean header_relaxed;
+    gchar* domain;
+    gchar* selector;
+    gchar** headers;
+    GBytes* body_hash;
+    GBytes* signature;
+    DDkimBodyHash body;
+    DDkimKey* key;
+    gboolean key_pending;
+};
+
+/**
+ * @brief The line splitter of the DATA stream.
+ * @details The lines are unstuffed, the header fields are kept and the
+ * body lines are passed to the owner, the verifier or the signing.
+ */
+struct DDkimMessage
+{
+    gsize max_header_size;
+    gsize header_size;
+    gboolean header_done;
+    /// @brief The end of data line is seen.
+    gboolean ended;
+    /// @brief The owner doesn't need the body lines.
+    gboolean skip_body;
+    /// @brief The incomplete line of the previous block.
+    GString* line;
+    /// @brief The header fields with the folding and CRLF, array of gchar*.
+    GPtrArray* fields;
+    void (*header_end)(gpointer owner);
+    /// @brief Take the body line without CRLF.
+    void (*body_line)(gpointer owner, const gchar* line, gsize length);
+    /// @brief The line is too long to keep, the body can't be hashed.
+    void (*line_dropped)(gpointer owner);
+    gpointer owner;
+};
+
+struct _DDkimVerifier
+{
+    gint ref_count;
+    DDkim* dkim;
+    DDkimMessage message;
+    /// @brief The canonicalized line, the scratch of the relaxed body.
+    GString* scratch;
+    /// @brief Array of DDkimSignature*.
+    GPtrArray* signatures;
+    guint keys_pending;
+    /// @brief The verify task waiting for the keys.
+    GTask* task;
+    gchar* authserv_id;
+};
+
+struct DDkimKeyFetch
+{
+    DDkimVerifier* verifier;
+    DDkimSignature* signature;
+    gchar* name;
+};
+
+struct DDkimMetrics
+{
+    guint64 messages;
+    guint64 results[NR_DKIM_RESULTS];
+    guint64 key_hits;
+    guint64 key_parses;
+};
+
+struct _DDkim
+{
+    GObject parent;
+
+    DDnsCache* cache;
+    guint max_keys;
+
+    GMutex lock;
+    /// @brief The parsed keys by the key record name.
+    GHashTable* keys;
+    DDkimMetrics metrics;
+};
+typedef _DDkim DDkim;
+
+G_DEFINE_TYPE(DDkim,d_dkim,G_TYPE_OBJECT)
+
+struct _DDkimClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(dkim_default);
+static DDkim* dkim_default{nullptr};
+
+static const gchar* dkim_result_names[NR_DKIM_RESULTS] = {
+    "none",
+    "pass",
+    "fail",
+    "neutral",
+    "temperror",
+    "permerror"
+};
+
+const gchar* d_dkim_result_to_string(
+    DKIM_RESULT result)
+{
+    g_return_val_if_fail(result < NR_DKIM_RESULTS,NULL);
+    return dkim_result_names[result];
+}
+
+static DDkimKey* d_dkim_key_ref(
+    DDkimKey* key)
+{
+    g_atomic_int_inc(&key->ref_count);
+    return key;
+}
+
+static void d_dkim_key_unref(
+    DDkimKey* key)
+{
+    if(!key) return;
+    if(g_atomic_int_dec_and_test(&key->ref_count)) {
+        if(key->pkey) {
+            EVP_PKEY_free(key->pkey);
+        }
+        g_free(key);
+    }
+}
+
+static void d_dkim_key_entry_free(gpointer data)
+{
+    auto entry = reinterpret_cast<DDkimKeyEntry*>(data);
+    d_dns_answer_unref(entry->answer);
+    d_dkim_key_unref(entry->key);
+    g_free(entry);
+}
+
+static void d_dkim_tags_free(gpointer data)
+{
+    g_hash_table_unref(reinterpret_cast<GHashTable*>(data));
+}
+
+/**
+ * @brief Parse the tag=value list, RFC 6376 3.2.
+ * @return The values by the tag name or NULL if the list is malformed.
+ */
+static GHashTable* d_dkim_tags_parse(
+    const gchar* text)
+{
+    GHashTable* tags = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,g_free);
+    g_auto(GStrv) items = g_strsplit(text,";",-1);
+    for(gchar** item = items; *item; item++) {
+        g_strstrip(*item);
+        if(!**item) {
+            continue;
+        }
+        gchar* eq = strchr(*item,'=');
+        if(!eq) {
+            d_dkim_tags_free(tags);
+            return NULL;
+        }
+        *eq = 0;
+        gchar* name = g_strstrip(g_strdup(*item));
+        if(!*name || g_hash_table_contains(tags,name)) {
+            g_free(name);
+            d_dkim_tags_free(tags);
+            return NULL;
+        }
+        g_hash_table_insert(tags,name,g_strstrip(g_strdup(eq + 1)));
+    }
+    return tags;
+}
+
+/**
+ * @brief Decode the base64 value with the folding white space.
+ */
+static GBytes* d_dkim_base64_decode(
+    const gchar* value)
+{
+    if(!value) {
+        return NULL;
+    }
+    GString* text = g_string_sized_new(strlen(value));
+    for(const gchar* p = value; *p; p++) {
+        if(!g_ascii_isspace(*p)) {
+            g_string_append_c(text,*p);
+        }
+    }
+    if(text->len == 0) {
+        g_string_free(text,TRUE);
+        return NULL;
+    }
+    gsize size{0};
+    guchar* data = g_base64_decode(text->str,&size);
+    g_string_free(text,TRUE);
+    return g_bytes_new_take(data,size);
+}
+
+/**
+ * @brief Parse the public key record, RFC 6376 3.6.1.
+ */
+static DDkimKey* d_dkim_key_parse(
+    DDnsAnswer* answer)
+{
+    auto key = g_new0(DDkimKey,1);
+    key->ref_count = 1;
+    if(answer->status != DNS_ANSWER_OK || answer->records->len == 0) {
+        return key;
+    }
+    GHashTable* tags = d_dkim_tags_parse(g_array_index(answer->records,DDnsRecord,0).data);
+    if(!tags) {
+        return key;
+    }
+    auto version = reinterpret_cast<const gchar*>(g_hash_table_lookup(tags,"v"));
+    auto type = reinterpret_cast<const gchar*>(g_hash_table_lookup(tags,"k"));
+    auto hashes = reinterpret_cast<const gchar*>(g_hash_table_lookup(tags,"h"));
+    // The empty p= is the revoked key.
+    g_autoptr(GBytes) data = d_dkim_base64_decode(
+        reinterpret_cast<const gchar*>(g_hash_table_lookup(tags,"p")));
+    key->ed25519 = type && g_ascii_strcasecmp(type,"ed25519") == 0;
+    gboolean valid = data && (!version || g_str_equal(version,"DKIM1")) &&
+        (!type || key->ed25519 || g_ascii_strcasecmp(type,"rsa") == 0) &&
+        (!hashes || strstr(hashes,"sha256"));
+    d_dkim_tags_free(tags);
+    if(!valid) {
+        return key;
+    }
+    gsize size{0};
+    auto bytes = static_cast<const guchar*>(g_bytes_get_data(data,&size));
+    if(key->ed25519) {
+        key->pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519,NULL,bytes,size);
+    } else {
+        const guchar* p = bytes;
+        key->pkey = d2i_PUBKEY(NULL,&p,size);
+        if(!key->pkey) {
+            // Some publish the bare PKCS#1 RSAPublicKey.
+            p = bytes;
+            key->pkey = d2i_PublicKey(EVP_PKEY_RSA,NULL,&p,size);
+        }
+        if(key->pkey && (EVP_PKEY_base_id(key->pkey) != EVP_PKEY_RSA ||
+           EVP_PKEY_bits(key->pkey) < DKIM_MIN_RSA_BITS)) {
+            g_clear_pointer(&key->pkey,EVP_PKEY_free);
+        }
+    }
+    return key;
+}
+
+/**
+ * @brief Get the parsed key of the answer.
+ * @details The key parsed from the same answer instance is reused, so
+ * the key expires with the TXT answer in the DNS cache.
+ */
+static DDkimKey* d_dkim_key_for_answer(
+    DDkim* dkim,
+    const gchar* name,
+    DDnsAnswer* answer)
+{
+    g_autofree gchar* key_name = g_ascii_strdown(name,-1);
+    g_mutex_lock(&dkim->lock);
+    auto entry = reinterpret_cast<DDkimKeyEntry*>(g_hash_table_lookup(dkim->keys,key_name));
+    if(entry && entry->answer == answer) {
+        dkim->metrics.key_hits++;
+        DDkimKey* key = d_dkim_key_ref(entry->key);
+        g_mutex_unlock(&dkim->lock);
+        return key;
+    }
+    g_mutex_unlock(&dkim->lock);
+
+    DDkimKey* key = d_dkim_key_parse(answer);
+
+    g_mutex_lock(&dkim->lock);
+    dkim->metrics.key_parses++;
+    if(!entry && g_hash_table_size(dkim->keys) >= dkim->max_keys) {
+        // Drop the arbitrary eighth of the keys, the hot ones come back.
+        guint evict = MAX(dkim->max_keys / 8,1);
+        GHashTableIter iter;
+        g_hash_table_iter_init(&iter,dkim->keys);
+        while(evict-- > 0 && g_hash_table_iter_next(&iter,NULL,NULL)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    entry = g_new0(DDkimKeyEntry,1);
+    entry->answer = d_dns_answer_ref(answer);
+    entry->key = d_dkim_key_ref(key);
+    g_hash_table_replace(dkim->keys,g_steal_pointer(&key_name),entry);
+    g_mutex_unlock(&dkim->lock);
+    return key;
+}
+
+static void d_dkim_body_hash_init(
+    DDkimBodyHash* body,
+    gboolean relaxed,
+    gint64 length)
+{
+    body->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    body->relaxed = relaxed;
+    body->remaining = length;
+}
+
+static void d_dkim_body_hash_update(
+    DDkimBodyHash* body,
+    const gchar* data,
+    gsize size)
+{
+    if(body->remaining >= 0) {
+        size = MIN(size,guint64(body->remaining));
+        body->remaining -= size;
+    }
+    if(size) {
+        g_checksum_update(body->checksum,reinterpret_cast<const guchar*>(data),size);
+    }
+}
+
+/**
+ * @brief Hash the canonicalized body line, RFC 6376 3.4.3 and 3.4.4.
+ * @param [in] line The line without CRLF, the relaxed one is already reduced.
+ */
+static void d_dkim_body_hash_line(
+    DDkimBodyHash* body,
+    const gchar* line,
+    gsize length)
+{
+    if(length == 0) {
+        body->empty_lines++;
+        return;
+    }
+    for(; body->empty_lines > 0; body->empty_lines--) {
+        d_dkim_body_hash_update(body,"\r\n",2);
+    }
+    body->has_lines = TRUE;
+    d_dkim_body_hash_update(body,line,length);
+    d_dkim_body_hash_update(body,"\r\n",2);
+}
+
+/**
+ * @brief Complete the body hash.
+ * @details The simple empty body is the one CRLF.
+ */
+static void d_dkim_body_hash_end(
+    DDkimBodyHash* body,
+    guint8* digest)
+{
+    if(!body->relaxed && !body->has_lines) {
+        d_dkim_body_hash_update(body,"\r\n",2);
+    }
+    gsize size = DKIM_DIGEST_SIZE;
+    g_checksum_get_digest(body->checksum,digest,&size);
+}
+
+/**
+ * @brief Reduce the white space runs and drop the trailing white space.
+ */
+static void d_dkim_relax_line(
+    GString* out,
+    const gchar* line,
+    gsize length)
+{
+    g_string_truncate(out,0);
+    gboolean space = FALSE;
+    for(gsize i = 0; i < length; i++) {
+        gchar c = line[i];
+        if(c == ' ' || c == '\t') {
+            space = TRUE;
+            continue;
+        }
+        if(space) {
+            g_string_append_c(out,' ');
+            space = FALSE;
+        }
+        g_string_append_c(out,c);
+    }
+}
+
+/**
+ * @brief Canonicalize the header field, RFC 6376 3.4.1 and 3.4.2.
+ */
+static void d_dkim_canon_header(
+    GString* out,
+    const gchar* field,
+    gboolean relaxed)
+{
+    if(!relaxed) {
+        g_string_append(out,field);
+        return;
+    }
+    const gchar* colon = strchr(field,':');
+    if(!colon) {
+        return;
+    }
+    g_autofree gchar* name = g_ascii_strdown(field,colon - field);
+    g_string_append(out,g_strstrip(name));
+    g_string_append_c(out,':');
+    // The unfolded value with the white space runs reduced and trimmed.
+    gboolean space = FALSE;
+    gboolean started = FALSE;
+    for(const gchar* p = colon + 1; *p; p++) {
+        if(*p == '\r' || *p == '\n') {
+            continue;
+        }
+        if(*p == ' ' || *p == '\t') {
+            space = TRUE;
+            continue;
+        }
+        if(space && started) {
+            g_string_append_c(out,' ');
+        }
+        space = FALSE;
+        started = TRUE;
+        g_string_append_c(out,*p);
+    }
+    g_string_append(out,"\r\n");
+}
+
+/**
+ * @brief Copy the DKIM-Signature field with the empty b= value.
+ */
+static gchar* d_dkim_strip_signature(
+    const gchar* field)
+{
+    const gchar* p = strchr(field,':') + 1;
+    GString* out = g_string_new_len(field,p - field);
+    while(*p) {
+        const gchar* semicolon = strchr(p,';');
+        const gchar* end = semicolon ? semicolon : p + strlen(p);
+        const gchar* eq = static_cast<const gchar*>(memchr(p,'=',end - p));
+        g_autofree gchar* name = eq ? g_strstrip(g_strndup(p,eq - p)) : NULL;
+        if(name && g_str_equal(name,"b")) {
+            g_string_append_len(out,p,eq + 1 - p);
+        } else {
+            g_string_append_len(out,p,end - p);
+        }
+        if(!semicolon) {
+            break;
+        }
+        g_string_append_c(out,';');
+        p = semicolon + 1;
+    }
+    return g_string_free(out,FALSE);
+}
+
+static gboolean d_dkim_field_has_name(
+    const gchar* field,
+    const gchar* name)
+{
+    gsize length = strlen(name);
+    if(g_ascii_strncasecmp(field,name,length) != 0) {
+        return FALSE;
+    }
+    const gchar* p = field + length;
+    while(*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return *p == ':';
+}
+
+static void d_dkim_signature_free(gpointer data)
+{
+    auto signature = reinterpret_cast<DDkimSignature*>(data);
+    g_free(signature->domain);
+    g_free(signature->selector);
+    g_strfreev(signature->headers);
+    g_clear_pointer(&signature->body_hash,g_bytes_unref);
+    g_clear_pointer(&signature->signature,g_bytes_unref);
+    g_clear_pointer(&signature->body.checksum,g_checksum_free);
+    d_dkim_key_unref(signature->key);
+    g_free(signature);
+}
+
+/**
+ * @brief Parse the DKIM-Signature field, RFC 6376 3.5.
+ * @return FALSE if the signature is malformed or not supported.
+ */
+static gboolean d_dkim_signature_parse(
+    DDkimSignature* signature,
+    const gchar* field)
+{
+    GHashTable* tags = d_dkim_tags_parse(strchr(field,':') + 1);
+    if(!tags) {
+        return FALSE;
+    }
+    auto tag = [tags](const gchar* name) {
+        return reinterpret_cast<const gchar*>(g_hash_table_lookup(tags,name));
+    };
+    const gchar* algorithm = tag("a");
+    const gchar* canon = tag("c");
+    const gchar* headers = tag("h");
+    const gchar* length = tag("l");
+    const gchar* expires = tag("x");
+    gboolean valid = tag("v") && g_str_equal(tag("v"),"1") && algorithm && tag("d") && tag("s") && headers;
+    if(valid) {
+        // RFC 8301 3.1, rsa-sha1 isn't accepted.
+        signature->ed25519 = g_ascii_strcasecmp(algorithm,"ed25519-sha256") == 0;
+        valid = signature->ed25519 || g_ascii_strcasecmp(algorithm,"rsa-sha256") == 0;
+    }
+    gboolean body_relaxed = FALSE;
+    if(valid && canon) {
+        g_auto(GStrv) modes = g_strsplit(canon,"/",2);
+        for(guint i = 0; modes[i] && valid; i++) {
+            gboolean relaxed = g_ascii_strcasecmp(g_strstrip(modes[i]),"relaxed") == 0;
+            valid = relaxed || g_ascii_strcasecmp(modes[i],"simple") == 0;
+            if(i == 0) {
+                signature->header_relaxed = relaxed;
+            } else {
+                body_relaxed = relaxed;
+            }
+        }
+    }
+    gint64 body_length = -1;
+    if(valid && length) {
+        gchar* end;
+        body_length = g_ascii_strtoll(length,&end,10);
+        valid = end != length && !*end && body_length >= 0;
+    }
+    if(valid && expires) {
+        valid = g_ascii_strtoll(expires,NULL,10) >= g_get_real_time() / G_USEC_PER_SEC;
+    }
+    if(valid) {
+        signature->domain = g_strdup(tag("d"));
+        signature->selector = g_strdup(tag("s"));
+        signature->headers = g_strsplit(headers,":",-1);
+        gboolean has_from = FALSE;
+        for(gchar** name = signature->headers; *name; name++) {
+            has_from = has_from || g_ascii_strcasecmp(g_strstrip(*name),"from") == 0;
+        }
+        signature->body_hash = d_dkim_base64_decode(tag("bh"));
+        signature->signature = d_dkim_base64_decode(tag("b"));
+        valid = has_from && signature->body_hash && signature->signature &&
+            g_bytes_get_size(signature->body_hash) == DKIM_DIGEST_SIZE;
+    }
+    d_dkim_tags_free(tags);
+    if(valid) {
+        d_dkim_body_hash_init(&signature->body,body_relaxed,body_length);
+    }
+    return valid;
+}
+
+static void d_dkim_verifier_check(
+    DDkimVerifier* verifier);
+
+static void d_dkim_key_fetch_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto fetch = reinterpret_cast<DDkimKeyFetch*>(user_data);
+    DDkimVerifier* verifier = fetch->verifier;
+    DDkimSignature* signature = fetch->signature;
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(answer) {
+        signature->key = d_dkim_key_for_answer(verifier->dkim,fetch->name,answer);
+    } else if(g_error_matches(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_NOT_FOUND)) {
+        // The malformed key record name has no key.
+        signature->key = g_new0(DDkimKey,1);
+        signature->key->ref_count = 1;
+    }
+    g_clear_error(&error);
+    signature->key_pending = FALSE;
+    verifier->keys_pending--;
+    if(verifier->task && verifier->keys_pending == 0) {
+        d_dkim_verifier_check(verifier);
+    }
+    d_dkim_verifier_unref(verifier);
+    g_free(fetch->name);
+    g_free(fetch);
+}
+
+static void d_dkim_message_init(
+    DDkimMessage* message,
+    gsize max_header_size,
+    gpointer owner)
+{
+    message->max_header_size = max_header_size;
+    message->line = g_string_new(NULL);
+    message->fields = g_ptr_array_new_with_free_func(g_free);
+    message->owner = owner;
+}
+
+static void d_dkim_message_clear(
+    DDkimMessage* message)
+{
+    g_string_free(message->line,TRUE);
+    g_ptr_array_unref(message->fields);
+}
+
+static void d_dkim_message_header_end(
+    DDkimMessage* message)
+{
+    message->header_done = TRUE;
+    message->header_end(message->owner);
+}
+
+/**
+ * @brief Process the one line of the message without the line end.
+ */
+static void d_dkim_message_line(
+    DDkimMessage* message,
+    const gchar* line,
+    gsize length)
+{
+    if(length && line[length - 1] == '\r') {
+        length--;
+    }
+    if(line[0] == '.' && length > 0) {
+        if(length == 1) {
+            message->ended = TRUE;
+            return;
+        }
+        // The dot stuffing isn't the message content.
+        line++;
+        length--;
+    }
+    if(!message->header_done) {
+        message->header_size += length + 2;
+        if(message->header_size > message->max_header_size) {
+            // The too large header isn't signed or verified.
+            g_ptr_array_set_size(message->fields,0);
+            d_dkim_message_header_end(message);
+            return;
+        }
+        if(length == 0) {
+            d_dkim_message_header_end(message);
+            return;
+        }
+        if((line[0] == ' ' || line[0] == '\t') && message->fields->len) {
+            // The folded line continues the last field.
+            gpointer* last = &message->fields->pdata[message->fields->len - 1];
+            gchar* field = g_strdup_printf("%s%.*s\r\n",reinterpret_cast<gchar*>(*last),int(length),line);
+            g_free(*last);
+            *last = field;
+            return;
+        }
+        if(memchr(line,':',length)) {
+            g_ptr_array_add(message->fields,g_strdup_printf("%.*s\r\n",int(length),line));
+            return;
+        }
+        // The line without the field name, the body starts without separator.
+        d_dkim_message_header_end(message);
+    }
+    if(!message->skip_body) {
+        message->body_line(message->owner,line,length);
+    }
+}
+
+/**
+ * @brief Split the block into lines.
+ * @details The complete lines are processed in place, only the
+ * incomplete last one is copied.
+ */
+static void d_dkim_message_feed(
+    DDkimMessage* message,
+    const gchar* data,
+    gsize size)
+{
+    const gchar* p = data;
+    const gchar* end = data + size;
+    while(p < end && !message->ended) {
+        if(message->header_done && message->skip_body) {
+            return;
+        }
+        auto lf = static_cast<const gchar*>(memchr(p,'\n',end - p));
+        if(!lf) {
+            if(message->line->len + (end - p) > DKIM_MAX_LINE_LENGTH) {
+                message->line_dropped(message->owner);
+                message->skip_body = TRUE;
+                g_string_truncate(message->line,0);
+            } else {
+                g_string_append_len(message->line,p,end - p);
+            }
+            return;
+        }
+        if(message->line->len) {
+            g_string_append_len(message->line,p,lf - p);
+            d_dkim_message_line(message,message->line->str,message->line->len);
+            g_string_truncate(message->line,0);
+        } else {
+            d_dkim_message_line(message,p,lf - p);
+        }
+        p = lf + 1;
+    }
+}
+
+/**
+ * @brief Parse the signatures and start their key lookups.
+ */
+static void d_dkim_verifier_header_end(
+    gpointer owner)
+{
+    auto verifier = reinterpret_cast<DDkimVerifier*>(owner);
+    GPtrArray* fields = verifier->message.fields;
+    DDnsCache* cache = verifier->dkim->cache;
+    for(guint i = 0; i < fields->len && verifier->signatures->len < DKIM_MAX_SIGNATURES; i++) {
+        auto field = reinterpret_cast<const gchar*>(fields->pdata[i]);
+        if(!d_dkim_field_has_name(field,"DKIM-Signature")) {
+            continue;
+        }
+        auto signature = g_new0(DDkimSignature,1);
+        signature->field = i;
+        g_ptr_array_add(verifier->signatures,signature);
+        if(!d_dkim_signature_parse(signature,field)) {
+            signature->result = DKIM_RESULT_PERMERROR;
+            continue;
+        }
+        auto fetch = g_new0(DDkimKeyFetch,1);
+        fetch->verifier = d_dkim_verifier_ref(verifier);
+        fetch->signature = signature;
+        fetch->name = g_strdup_printf("%s._domainkey.%s",signature->selector,signature->domain);
+        signature->key_pending = TRUE;
+        verifier->keys_pending++;
+        d_dns_cache_lookup_async(cache,DNS_RECORD_TXT,fetch->name,NULL,d_dkim_key_fetch_handle,fetch);
+    }
+    // Nothing to hash, the message isn't signed.
+    verifier->message.skip_body = verifier->signatures->len == 0;
+}
+
+static void d_dkim_verifier_body_line(
+    gpointer owner,
+    const gchar* line,
+    gsize length)
+{
+    auto verifier = reinterpret_cast<DDkimVerifier*>(owner);
+    const gchar* relaxed{nullptr};
+    gsize relaxed_length{0};
+    for(guint i = 0; i < verifier->signatures->len; i++) {
+        auto signature = reinterpret_cast<DDkimSignature*>(verifier->signatures->pdata[i]);
+        if(signature->result != DKIM_RESULT_NONE) {
+            continue;
+        }
+        if(!signature->body.relaxed) {
+            d_dkim_body_hash_line(&signature->body,line,length);
+            continue;
+        }
+        if(!relaxed) {
+            // The relaxed line is reduced once for all signatures.
+            d_dkim_relax_line(verifier->scratch,line,length);
+            relaxed = verifier->scratch->str;
+            relaxed_length = verifier->scratch->len;
+        }
+        d_dkim_body_hash_line(&signature->body,relaxed,relaxed_length);
+    }
+}
+
+/**
+ * @brief The line isn't kept, the signatures can't be checked.
+ */
+static void d_dkim_verifier_line_dropped(
+    gpointer owner)
+{
+    auto verifier = reinterpret_cast<DDkimVerifier*>(owner);
+    for(guint i = 0; i < verifier->signatures->len; i++) {
+        auto signature = reinterpret_cast<DDkimSignature*>(verifier->signatures->pdata[i]);
+        if(signature->result == DKIM_RESULT_NONE) {
+            signature->result = DKIM_RESULT_NEUTRAL;
+        }
+    }
+}
+
+void d_dkim_verifier_feed(
+    DDkimVerifier* verifier,
+    const gchar* data,
+    gsize size)
+{
+    d_dkim_message_feed(&verifier->message,data,size);
+}
+
+/**
+ * @brief Hash the signed header fields and the signature field itself.
+ */
+static void d_dkim_header_digest(
+    GPtrArray* fields,
+    gchar** headers,
+    const gchar* signature_field,
+    gboolean relaxed,
+    guint8* digest)
+{
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    GString* canon = g_string_sized_new(1024);
+    g_autofree gboolean* used = g_new0(gboolean,fields->len);
+    // The fields are taken from the bottom, the missing one is skipped.
+    for(gchar** name = headers; *name; name++) {
+        for(guint i = fields->len; i-- > 0;) {
+            auto field = reinterpret_cast<const gchar*>(fields->pdata[i]);
+            if(!used[i] && d_dkim_field_has_name(field,*name)) {
+                used[i] = TRUE;
+                d_dkim_canon_header(canon,field,relaxed);
+                break;
+            }
+        }
+    }
+    // The signature field with the empty b= value closes the data.
+    d_dkim_canon_header(canon,signature_field,relaxed);
+    if(g_str_has_suffix(canon->str,"\r\n")) {
+        g_string_truncate(canon,canon->len - 2);
+    }
+    g_checksum_update(checksum,reinterpret_cast<const guchar*>(canon->str),canon->len);
+    gsize size = DKIM_DIGEST_SIZE;
+    g_checksum_get_digest(checksum,digest,&size);
+    g_string_free(canon,TRUE);
+    g_checksum_free(checksum);
+}
+
+/**
+ * @brief Verify the signature of the header digest.
+ */
+static gboolean d_dkim_signature_verify(
+    DDkimSignature* signature,
+    const guint8* digest)
+{
+    gsize size{0};
+    auto data = static_cast<const guchar*>(g_bytes_get_data(signature->signature,&size));
+    gboolean verified = FALSE;
+    if(signature->ed25519) {
+        // RFC 8463 3, the PureEdDSA signature of the SHA-256 digest.
+        EVP_MD_CTX* context = EVP_MD_CTX_new();
+        verified = EVP_DigestVerifyInit(context,NULL,NULL,NULL,signature->key->pkey) == 1 &&
+            EVP_DigestVerify(context,data,size,digest,DKIM_DIGEST_SIZE) == 1;
+        EVP_MD_CTX_free(context);
+    } else {
+        EVP_PKEY_CTX* context = EVP_PKEY_CTX_new(signature->key->pkey,NULL);
+        verified = context && EVP_PKEY_verify_init(context) == 1 &&
+            EVP_PKEY_CTX_set_rsa_padding(context,RSA_PKCS1_PADDING) == 1 &&
+            EVP_PKEY_CTX_set_signature_md(context,EVP_sha256()) == 1 &&
+            EVP_PKEY_verify(context,data,size,digest,DKIM_DIGEST_SIZE) == 1;
+        EVP_PKEY_CTX_free(context);
+    }
+    return verified;
+}
+
+/**
+ * @brief Check the signatures and return the Authentication-Results field.
+ */
+static void d_dkim_verifier_check(
+    DDkimVerifier* verifier)
+{
+    DDkim* dkim = verifier->dkim;
+    GString* field = g_string_new(NULL);
+    g_string_printf(field,"Authentication-Results: %s",verifier->authserv_id);
+    DKIM_RESULT results[DKIM_MAX_SIGNATURES];
+    for(guint i = 0; i < verifier->signatures->len; i++) {
+        auto signature = reinterpret_cast<DDkimSignature*>(verifier->signatures->pdata[i]);
+        DKIM_RESULT result = signature->result;
+        if(result == DKIM_RESULT_NONE) {
+            guint8 digest[DKIM_DIGEST_SIZE];
+            d_dkim_body_hash_end(&signature->body,digest);
+            if(memcmp(digest,g_bytes_get_data(signature->body_hash,NULL),DKIM_DIGEST_SIZE) != 0 ||
+               signature->body.remaining > 0) {
+                // The body is changed or shorter than l=.
+                result = DKIM_RESULT_FAIL;
+            } else if(!signature->key) {
+                result = DKIM_RESULT_TEMPERROR;
+            } else if(!signature->key->pkey || signature->key->ed25519 != signature->ed25519) {
+                result = DKIM_RESULT_PERMERROR;
+            } else {
+                g_autofree gchar* stripped = d_dkim_strip_signature(reinterpret_cast<const gchar*>(
+                    verifier->message.fields->pdata[signature->field]));
+                d_dkim_header_digest(verifier->message.fields,signature->headers,stripped,
+                    signature->header_relaxed,digest);
+                result = d_dkim_signature_verify(signature,digest) ? DKIM_RESULT_PASS : DKIM_RESULT_FAIL;
+            }
+        }
+        results[i] = result;
+        g_autofree gchar* domain = g_strcanon(g_strdup(signature->domain ? signature->domain : "unknown"),
+            G_CSET_a_2_z G_CSET_A_2_Z G_CSET_DIGITS ".-_",'_');
+        g_autofree gchar* selector = g_strcanon(g_strdup(signature->selector ? signature->selector : "unknown"),
+            G_CSET_a_2_z G_CSET_A_2_Z G_CSET_DIGITS ".-_",'_');
+        g_string_append_printf(field,";\r\n\tdkim=%s header.d=%s header.s=%s",
+            dkim_result_names[result],domain,selector);
+    }
+    if(verifier->signatures->len == 0) {
+        g_string_append(field,"; dkim=none");
+    }
+    g_string_append(field,"\r\n");
+
+    g_mutex_lock(&dkim->lock);
+    dkim->metrics.messages++;
+    if(verifier->signatures->len == 0) {
+        dkim->metrics.results[DKIM_RESULT_NONE]++;
+    }
+    for(guint i = 0; i < verifier->signatures->len; i++) {
+        dkim->metrics.results[results[i]]++;
+    }
+    g_mutex_unlock(&dkim->lock);
+
+    gsize size = field->len;
+    GTask* task = verifier->task;
+    verifier->task = nullptr;
+    g_task_return_pointer(task,g_bytes_new_take(g_string_free(field,FALSE),size),
+        reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    g_object_unref(task);
+}
+
+void d_dkim_verify_async(
+    DDkim* dkim,
+    DDkimVerifier* verifier,
+    const gchar* authserv_id,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_DKIM(dkim));
+    g_return_if_fail(verifier != NULL && verifier->dkim == dkim && !verifier->task);
+    GTask* task = g_task_new(dkim,cancellable,callback,user_data);
+    g_task_set_source_tag(task,(gpointer)d_dkim_verify_async);
+    // The task keeps the verifier until the keys arrive.
+    g_task_set_task_data(task,d_dkim_verifier_ref(verifier),
+        reinterpret_cast<GDestroyNotify>(d_dkim_verifier_unref));
+    verifier->task = task;
+    g_free(verifier->authserv_id);
+    verifier->authserv_id = g_strdup(authserv_id);
+    if(!verifier->message.header_done) {
+        d_dkim_message_header_end(&verifier->message);
+    }
+    if(verifier->keys_pending == 0) {
+        d_dkim_verifier_check(verifier);
+    }
+}
+
+GBytes* d_dkim_verify_finish(
+    DDkim* dkim,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,dkim),NULL);
+    return reinterpret_cast<GBytes*>(g_task_propagate_pointer(G_TASK(result),error));
+}
+
+DDkimVerifier* d_dkim_verifier_new(
+    DDkim* dkim,
+    gsize max_header_size)
+{
+    g_return_val_if_fail(D_IS_DKIM(dkim),NULL);
+    auto verifier = g_new0(DDkimVerifier,1);
+    verifier->ref_count = 1;
+    verifier->dkim = D_DKIM(g_object_ref(dkim));
+    d_dkim_message_init(&verifier->message,max_header_size,verifier);
+    verifier->message.header_end = d_dkim_verifier_header_end;
+    verifier->message.body_line = d_dkim_verifier_body_line;
+    verifier->message.line_dropped = d_dkim_verifier_line_dropped;
+    verifier->scratch = g_string_new(NULL);
+    verifier->signatures = g_ptr_array_new_with_free_func(d_dkim_signature_free);
+    return verifier;
+}
+
+DDkimVerifier* d_dkim_verifier_ref(
+    DDkimVerifier* verifier)
+{
+    verifier->ref_count++;
+    return verifier;
+}
+
+void d_dkim_verifier_unref(
+    DDkimVerifier* verifier)
+{
+    if(!verifier || --verifier->ref_count > 0) {
+        return;
+    }
+    d_dkim_message_clear(&verifier->message);
+    g_string_free(verifier->scratch,TRUE);
+    g_ptr_array_unref(verifier->signatures);
+    g_free(verifier->authserv_id);
+    g_object_unref(verifier->dkim);
+    g_free(verifier);
+}
+
+void d_dkim_log_metrics(
+    DDkim* dkim)
+{
+    g_return_if_fail(D_IS_DKIM(dkim));
+    g_mutex_lock(&dkim->lock);
+    DDkimMetrics metrics = dkim->metrics;
+    guint keys = g_hash_table_size(dkim->keys);
+    g_mutex_unlock(&dkim->lock);
+    GString* results = g_string_new(NULL);
+    for(guint i = 0; i < NR_DKIM_RESULTS; i++) {
+        g_string_append_printf(results,"%s%s %" G_GUINT64_FORMAT,i ? ", " : "",dkim_result_names[i],metrics.results[i]);
+    }
+    g_message("DKIM: %u cached keys, messages %" G_GUINT64_FORMAT ", key hits %" G_GUINT64_FORMAT
+        ", key parses %" G_GUINT64_FORMAT ", results %s",
+        keys,metrics.messages,metrics.key_hits,metrics.key_parses,results->str);
+    g_string_free(results,TRUE);
+}
+
+void d_dkim_set_default(
+    DDkim* dkim)
+{
+    G_LOCK(dkim_default);
+    g_set_object(&dkim_default,dkim);
+    G_UNLOCK(dkim_default);
+}
+
+DDkim* d_dkim_get_default()
+{
+    G_LOCK(dkim_default);
+    DDkim* dkim = dkim_default ? D_DKIM(g_object_ref(dkim_default)) : NULL;
+    G_UNLOCK(dkim_default);
+    return dkim;
+}
+
+static void d_dkim_init(DDkim* dkim)
+{
+    g_mutex_init(&dkim->lock);
+    dkim->keys = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,d_dkim_key_entry_free);
+}
+
+static void d_dkim_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_DKIM(object));
+    auto dkim = D_DKIM(object);
+    g_hash_table_unref(dkim->keys);
+    g_clear_object(&dkim->cache);
+    g_mutex_clear(&dkim->lock);
+    G_OBJECT_CLASS(d_dkim_parent_class)->finalize(object);
+}
+
+static void d_dkim_class_init(DDkimClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_dkim_finalize;
+}
+
+/**
+ * @brief Create new instance of the DKIM verifier.
+ */
+DDkim* d_dkim_new(
+    DDnsCache* cache,
+    guint max_keys)
+{
+    auto dkim = reinterpret_cast<DDkim*>(
+        g_object_new(
+            D_TYPE_DKIM,
+            NULL));
+
+    dkim->cache = D_DNS_CACHE(g_object_ref(cache));
+    dkim->max_keys = MAX(max_keys,1);
+
+    return dkim;
+}
+
+
+/// @brief The header fields signed if the message has them, RFC 6376 5.4.1.
+static const gchar* dkim_signed_fields[] = {
+    "From",
+    "Reply-To",
+    "Subject",
+    "Date",
+    "To",
+    "Cc",
+    "Message-ID",
+    "In-Reply-To",
+    "References",
+    "MIME-Version",
+    "Content-Type",
+    "Content-Transfer-Encoding"
+};
+
+/**
+ * @brief The private key of the signing domain.
+ */
+struct DDkimSignKey
+{
+    gchar* domain;
+    gchar* selector;
+    EVP_PKEY* pkey;
+    gboolean ed25519;
+};
+
+struct _DDkimSigning
+{
+    gint ref_count;
+    DDkimSigner* signer;
+    DDkimMessage message;
+    /// @brief The canonicalized line.
+    GString* scratch;
+    /// @brief The key of the From domain or NULL if the message isn't signed.
+    DDkimSignKey* key;
+    DDkimBodyHash body;
+};
+
+/**
+ * @brief The private key operation of the one signature.
+ */
+struct DDkimSignJob
+{
+    GTask* task;
+    DDkimSignKey* key;
+    guint8 digest[DKIM_DIGEST_SIZE];
+    /// @brief The DKIM-Signature field up to the b= value.
+    gchar* field;
+};
+
+struct DDkimSignerMetrics
+{
+    guint64 signatures;
+    guint64 unsigned_messages;
+    guint64 failures;
+    guint64 batches;
+};
+
+struct _DDkimSigner
+{
+    GObject parent;
+
+    /// @brief The keys by the lower case domain, immutable after creation.
+    GHashTable* keys;
+    guint batch;
+    /// @brief The signer thread, NULL if the signatures are made in place.
+    GThreadPool* pool;
+
+    GMutex lock;
+    /// @brief The queued DDkimSignJob.
+    GQueue jobs;
+    /// @brief The signer thread is taking the jobs.
+    gboolean draining;
+    DDkimSignerMetrics metrics;
+};
+typedef _DDkimSigner DDkimSigner;
+
+G_DEFINE_TYPE(DDkimSigner,d_dkim_signer,G_TYPE_OBJECT)
+
+struct _DDkimSignerClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(dkim_signer_default);
+static DDkimSigner* dkim_signer_default{nullptr};
+
+/**
+ * @brief Take the domain of the From address.
+ * @return The lower case domain or NULL.
+ */
+static gchar* d_dkim_from_domain(
+    const gchar* field)
+{
+    const gchar* at = strrchr(field,'@');
+    if(!at) {
+        return NULL;
+    }
+    gsize length = strcspn(at + 1,">) \t\r\n;,");
+    return length ? g_ascii_strdown(at + 1,length) : NULL;
+}
+
+/**
+ * @brief Select the key by the From domain.
+ */
+static void d_dkim_signing_header_end(
+    gpointer owner)
+{
+    auto signing = reinterpret_cast<DDkimSigning*>(owner);
+    GPtrArray* fields = signing->message.fields;
+    for(guint i = 0; i < fields->len; i++) {
+        auto field = reinterpret_cast<const gchar*>(fields->pdata[i]);
+        if(d_dkim_field_has_name(field,"From")) {
+            g_autofree gchar* domain = d_dkim_from_domain(field);
+            if(domain) {
+                signing->key = reinterpret_cast<DDkimSignKey*>(
+                    g_hash_table_lookup(signing->signer->keys,domain));
+            }
+            break;
+        }
+    }
+    if(signing->key) {
+        d_dkim_body_hash_init(&signing->body,TRUE,-1);
+    }
+    signing->message.skip_body = signing->key == NULL;
+}
+
+static void d_dkim_signing_body_line(
+    gpointer owner,
+    const gchar* line,
+    gsize length)
+{
+    auto signing = reinterpret_cast<DDkimSigning*>(owner);
+    d_dkim_relax_line(signing->scratch,line,length);
+    d_dkim_body_hash_line(&signing->body,signing->scratch->str,signing->scratch->len);
+}
+
+/**
+ * @brief The line isn't kept, the message isn't signed.
+ */
+static void d_dkim_signing_line_dropped(
+    gpointer owner)
+{
+    auto signing = reinterpret_cast<DDkimSigning*>(owner);
+    signing->key = nullptr;
+}
+
+void d_dkim_signing_feed(
+    DDkimSigning* signing,
+    const gchar* data,
+    gsize size)
+{
+    d_dkim_message_feed(&signing->message,data,size);
+}
+
+/**
+ * @brief Make the signature and return the complete field.
+ */
+static void d_dkim_sign_job_run(
+    DDkimSigner* signer,
+    DDkimSignJob* job)
+{
+    EVP_PKEY* pkey = job->key->pkey;
+    gsize size{0};
+    g_autofree guchar* signature = NULL;
+    gboolean signed_ok = FALSE;
+    if(job->key->ed25519) {
+        EVP_MD_CTX* context = EVP_MD_CTX_new();
+        if(EVP_DigestSignInit(context,NULL,NULL,NULL,pkey) == 1 &&
+           EVP_DigestSign(context,NULL,&size,job->digest,DKIM_DIGEST_SIZE) == 1) {
+            signature = static_cast<guchar*>(g_malloc(size));
+            signed_ok = EVP_DigestSign(context,signature,&size,job->digest,DKIM_DIGEST_SIZE) == 1;
+        }
+        EVP_MD_CTX_free(context);
+    } else {
+        EVP_PKEY_CTX* context = EVP_PKEY_CTX_new(pkey,NULL);
+        if(context && EVP_PKEY_sign_init(context) == 1 &&
+           EVP_PKEY_CTX_set_rsa_padding(context,RSA_PKCS1_PADDING) == 1 &&
+           EVP_PKEY_CTX_set_signature_md(context,EVP_sha256()) == 1 &&
+           EVP_PKEY_sign(context,NULL,&size,job->digest,DKIM_DIGEST_SIZE) == 1) {
+            signature = static_cast<guchar*>(g_malloc(size));
+            signed_ok = EVP_PKEY_sign(context,signature,&size,job->digest,DKIM_DIGEST_SIZE) == 1;
+        }
+        EVP_PKEY_CTX_free(context);
+    }
+
+    g_mutex_lock(&signer->lock);
+    if(signed_ok) {
+        signer->metrics.signatures++;
+    } else {
+        signer->metrics.failures++;
+    }
+    g_mutex_unlock(&signer->lock);
+
+    if(!signed_ok) {
+        g_task_return_new_error(job->task,G_IO_ERROR,G_IO_ERROR_FAILED,
+            "DKIM signing failed for %s",job->key->domain);
+    } else {
+        g_autofree gchar* encoded = g_base64_encode(signature,size);
+        GString* field = g_string_new(job->field);
+        // The b= value is folded, the white space isn't the part of it.
+        gsize length = strlen(encoded);
+        for(gsize offset = 0; offset < length; offset += 64) {
+            if(offset) {
+                g_string_append(field,"\r\n\t ");
+            }
+            g_string_append_len(field,encoded + offset,MIN(64,length - offset));
+        }
+        g_string_append(field,"\r\n");
+        gsize field_size = field->len;
+        g_task_return_pointer(job->task,g_bytes_new_take(g_string_free(field,FALSE),field_size),
+            reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    }
+    g_object_unref(job->task);
+    g_free(job->field);
+    g_free(job);
+}
+
+/**
+ * @brief Take the queued jobs in batches until the queue is empty.
+ * @details The jobs queued while the batch is signed are taken by the
+ * next batch of the same wakeup.
+ */
+static void d_dkim_signer_thread(
+    gpointer data,
+    gpointer user_data)
+{
+    auto signer = D_DKIM_SIGNER(data);
+    GPtrArray* batch = g_ptr_array_sized_new(signer->batch);
+    while(TRUE) {
+        g_mutex_lock(&signer->lock);
+        while(batch->len < signer->batch && !g_queue_is_empty(&signer->jobs)) {
+            g_ptr_array_add(batch,g_queue_pop_head(&signer->jobs));
+        }
+        if(batch->len == 0) {
+            signer->draining = FALSE;
+            g_mutex_unlock(&signer->lock);
+            break;
+        }
+        signer->metrics.batches++;
+        g_mutex_unlock(&signer->lock);
+        for(guint i = 0; i < batch->len; i++) {
+            d_dkim_sign_job_run(signer,reinterpret_cast<DDkimSignJob*>(batch->pdata[i]));
+        }
+        g_ptr_array_set_size(batch,0);
+    }
+    g_ptr_array_unref(batch);
+    g_object_unref(signer);
+}
+
+void d_dkim_sign_async(
+    DDkimSigner* signer,
+    DDkimSigning* signing,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_DKIM_SIGNER(signer));
+    g_return_if_fail(signing != NULL && signing->signer == signer);
+    GTask* task = g_task_new(signer,cancellable,callback,user_data);
+    g_task_set_source_tag(task,(gpointer)d_dkim_sign_async);
+    if(!signing->message.header_done) {
+        d_dkim_message_header_end(&signing->message);
+    }
+    if(!signing->key) {
+        g_mutex_lock(&signer->lock);
+        signer->metrics.unsigned_messages++;
+        g_mutex_unlock(&signer->lock);
+        g_task_return_pointer(task,NULL,NULL);
+        g_object_unref(task);
+        return;
+    }
+    GPtrArray* fields = signing->message.fields;
+    GString* headers = g_string_new(NULL);
+    for(const gchar* name : dkim_signed_fields) {
+        // Every instance of the field is signed.
+        for(guint i = 0; i < fields->len; i++) {
+            if(d_dkim_field_has_name(reinterpret_cast<const gchar*>(fields->pdata[i]),name)) {
+                g_string_append_printf(headers,"%s%s",headers->len ? ":" : "",name);
+            }
+        }
+    }
+    guint8 body_digest[DKIM_DIGEST_SIZE];
+    d_dkim_body_hash_end(&signing->body,body_digest);
+    g_autofree gchar* body_hash = g_base64_encode(body_digest,DKIM_DIGEST_SIZE);
+
+    DDkimSignKey* key = signing->key;
+    auto job = g_new0(DDkimSignJob,1);
+    job->task = task;
+    job->key = key;
+    job->field = g_strdup_printf(
+        "DKIM-Signature: v=1; a=%s; c=relaxed/relaxed; d=%s; s=%s;\r\n"
+        "\tt=%" G_GINT64_FORMAT "; h=%s;\r\n"
+        "\tbh=%s;\r\n"
+        "\tb=",
+        key->ed25519 ? "ed25519-sha256" : "rsa-sha256",key->domain,key->selector,
+        g_get_real_time() / G_USEC_PER_SEC,headers->str,body_hash);
+    g_auto(GStrv) names = g_strsplit(headers->str,":",-1);
+    d_dkim_header_digest(fields,names,job->field,TRUE,job->digest);
+    g_string_free(headers,TRUE);
+
+    if(!signer->pool) {
+        d_dkim_sign_job_run(signer,job);
+        return;
+    }
+    g_mutex_lock(&signer->lock);
+    g_queue_push_tail(&signer->jobs,job);
+    gboolean wakeup = !signer->draining;
+    signer->draining = TRUE;
+    g_mutex_unlock(&signer->lock);
+    if(wakeup) {
+        g_thread_pool_push(signer->pool,g_object_ref(signer),NULL);
+    }
+}
+
+GBytes* d_dkim_sign_finish(
+    DDkimSigner* signer,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,signer),NULL);
+    return reinterpret_cast<GBytes*>(g_task_propagate_pointer(G_TASK(result),error));
+}
+
+DDkimSigning* d_dkim_signing_new(
+    DDkimSigner* signer,
+    gsize max_header_size)
+{
+    g_return_val_if_fail(D_IS_DKIM_SIGNER(signer),NULL);
+    auto signing = g_new0(DDkimSigning,1);
+    signing->ref_count = 1;
+    signing->signer = D_DKIM_SIGNER(g_object_ref(signer));
+    d_dkim_message_init(&signing->message,max_header_size,signing);
+    signing->message.header_end = d_dkim_signing_header_end;
+    signing->message.body_line = d_dkim_signing_body_line;
+    signing->message.line_dropped = d_dkim_signing_line_dropped;
+    signing->scratch = g_string_new(NULL);
+    return signing;
+}
+
+DDkimSigning* d_dkim_signing_ref(
+    DDkimSigning* signing)
+{
+    signing->ref_count++;
+    return signing;
+}
+
+void d_dkim_signing_unref(
+    DDkimSigning* signing)
+{
+    if(!signing || --signing->ref_count > 0) {
+        return;
+    }
+    d_dkim_message_clear(&signing->message);
+    g_string_free(signing->scratch,TRUE);
+    g_clear_pointer(&signing->body.checksum,g_checksum_free);
+    g_object_unref(signing->signer);
+    g_free(signing);
+}
+
+void d_dkim_signer_log_metrics(
+    DDkimSigner* signer)
+{
+    g_return_if_fail(D_IS_DKIM_SIGNER(signer));
+    g_mutex_lock(&signer->lock);
+    DDkimSignerMetrics metrics = signer->metrics;
+    guint queued = signer->jobs.length;
+    g_mutex_unlock(&signer->lock);
+    g_message("DKIM signer: %u keys, signatures %" G_GUINT64_FORMAT ", unsigned messages %" G_GUINT64_FORMAT
+        ", failures %" G_GUINT64_FORMAT ", batches %" G_GUINT64_FORMAT ", queued %u",
+        g_hash_table_size(signer->keys),metrics.signatures,metrics.unsigned_messages,
+        metrics.failures,metrics.batches,queued);
+}
+
+void d_dkim_signer_set_default(
+    DDkimSigner* signer)
+{
+    G_LOCK(dkim_signer_default);
+    g_set_object(&dkim_signer_default,signer);
+    G_UNLOCK(dkim_signer_default);
+}
+
+DDkimSigner* d_dkim_signer_get_default()
+{
+    G_LOCK(dkim_signer_default);
+    DDkimSigner* signer = dkim_signer_default ? D_DKIM_SIGNER(g_object_ref(dkim_signer_default)) : NULL;
+    G_UNLOCK(dkim_signer_default);
+    return signer;
+}
+
+static void d_dkim_sign_key_free(gpointer data)
+{
+    auto key = reinterpret_cast<DDkimSignKey*>(data);
+    g_free(key->domain);
+    g_free(key->selector);
+    if(key->pkey) {
+        EVP_PKEY_free(key->pkey);
+    }
+    g_free(key);
+}
+
+/**
+ * @brief Parse the domain:selector:pem-file key of the list.
+ */
+static DDkimSignKey* d_dkim_sign_key_load(
+    const gchar* spec,
+    GError** error)
+{
+    g_auto(GStrv) parts = g_strsplit(spec,":",3);
+    if(g_strv_length(parts) != 3 || !*g_strstrip(parts[0]) || !*g_strstrip(parts[1])) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_ARGUMENT,
+            "DKIM key must be domain:selector:pem-file: %s",spec);
+        return NULL;
+    }
+    const gchar* path = g_strstrip(parts[2]);
+    BIO* bio = BIO_new_file(path,"r");
+    EVP_PKEY* pkey = bio ? PEM_read_bio_PrivateKey(bio,NULL,NULL,NULL) : NULL;
+    BIO_free(bio);
+    if(!pkey) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,
+            "DKIM private key read failed: %s",path);
+        return NULL;
+    }
+    gboolean ed25519 = EVP_PKEY_base_id(pkey) == EVP_PKEY_ED25519;
+    if(!ed25519 && (EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA || EVP_PKEY_bits(pkey) < DKIM_MIN_RSA_BITS)) {
+        EVP_PKEY_free(pkey);
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,
+            "DKIM private key must be RSA of %d bits or more or Ed25519: %s",DKIM_MIN_RSA_BITS,path);
+        return NULL;
+    }
+    auto key = g_new0(DDkimSignKey,1);
+    key->domain = g_ascii_strdown(parts[0],-1);
+    key->selector = g_strdup(parts[1]);
+    key->pkey = pkey;
+    key->ed25519 = ed25519;
+    return key;
+}
+
+static void d_dkim_signer_init(DDkimSigner* signer)
+{
+    g_mutex_init(&signer->lock);
+    g_queue_init(&signer->jobs);
+    signer->keys = g_hash_table_new_full(g_str_hash,g_str_equal,NULL,d_dkim_sign_key_free);
+}
+
+static void d_dkim_signer_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_DKIM_SIGNER(object));
+    auto signer = D_DKIM_SIGNER(object);
+    // Every queued job holds the signer by its task, so the queue is empty.
+    if(signer->pool) {
+        g_thread_pool_free(signer->pool,FALSE,FALSE);
+    }
+    g_hash_table_unref(signer->keys);
+    g_mutex_clear(&signer->lock);
+    G_OBJECT_CLASS(d_dkim_signer_parent_class)->finalize(object);
+}
+
+static void d_dkim_signer_class_init(DDkimSignerClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_dkim_signer_finalize;
+}
+
+/**
+ * @brief Create new instance of the DKIM signer.
+ */
+DDkimSigner* d_dkim_signer_new(
+    const gchar* keys,
+    guint batch,
+    GError** error)
+{
+    g_autoptr(DDkimSigner) signer = reinterpret_cast<DDkimSigner*>(
+        g_object_new(
+            D_TYPE_DKIM_SIGNER,
+            NULL));
+
+    g_auto(GStrv) specs = g_strsplit(keys,",",-1);
+    for(gchar** spec = specs; *spec; spec++) {
+        if(!*g_strstrip(*spec)) {
+            continue;
+        }
+        DDkimSignKey* key = d_dkim_sign_key_load(*spec,error);
+        if(!key) {
+            return NULL;
+        }
+        g_hash_table_replace(signer->keys,key->domain,key);
+    }
+    signer->batch = batch;
+    if(batch > 0) {
+        signer->pool = g_thread_pool_new(d_dkim_signer_thread,NULL,1,FALSE,error);
+        if(!signer->pool) {
+            return NULL;
+        }
+    }
+
+    return D_DKIM_SIGNER(g_steal_pointer(&signer));
+}
+
+}
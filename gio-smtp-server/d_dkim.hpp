@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__DKIM__HPP__
+#define __D__NEW__DKIM__HPP__
+/**
+ * @brief DKIM signature verification and signing, RFC 6376 and RFC 8463.
+ * @details The verifier takes the message data as it is received. Only
+ * the header is kept for the header hash, the body is canonicalized and
+ * hashed block by block for every signature. The public key lookups are
+ * started once the header is complete, so they overlap the body
+ * transfer, only the signature check is left to the end of data. The
+ * parsed public keys are kept per selector and domain for as long as
+ * the DNS cache keeps their TXT answer.
+ *
+ * The signer hashes the message of the domain it has the key for in the
+ * same streaming pass, the spooled message is never read back. The
+ * private keys are parsed once when the signer is created. The private
+ * key operations may be queued to the signer thread, which takes the
+ * queued signatures in batches, so the connection threads never wait
+ * for them.
+ */
+
+#include "d_dns_cache.hpp"
+
+extern "C" {
+#define D_TYPE_DKIM (d_dkim_get_type())
+
+G_DECLARE_FINAL_TYPE(DDkim,d_dkim,D,DKIM,GObject)
+
+#define D_TYPE_DKIM_SIGNER (d_dkim_signer_get_type())
+
+G_DECLARE_FINAL_TYPE(DDkimSigner,d_dkim_signer,D,DKIM_SIGNER,GObject)
+
+/**
+ * @brief The signature verification result, RFC 8601 2.7.1.
+ */
+enum DKIM_RESULT
+{
+    DKIM_RESULT_NONE,
+    DKIM_RESULT_PASS,
+    DKIM_RESULT_FAIL,
+    DKIM_RESULT_NEUTRAL,
+    DKIM_RESULT_TEMPERROR,
+    DKIM_RESULT_PERMERROR,
+    NR_DKIM_RESULTS
+};
+
+/**
+ * @brief The verification state of the one message.
+ */
+typedef struct _DDkimVerifier DDkimVerifier;
+
+/**
+ * @brief The signing state of the one message.
+ */
+typedef struct _DDkimSigning DDkimSigning;
+
+/**
+ * @brief Get the result name used in the Authentication-Results field.
+ */
+const gchar* d_dkim_result_to_string(
+    DKIM_RESULT result);
+
+/**
+ * @brief Create the verifier of the next message.
+ * @param [in] max_header_size The header bigger than this size isn't verified.
+ */
+DDkimVerifier* d_dkim_verifier_new(
+    DDkim* dkim,
+    gsize max_header_size);
+
+DDkimVerifier* d_dkim_verifier_ref(
+    DDkimVerifier* verifier);
+
+void d_dkim_verifier_unref(
+    DDkimVerifier* verifier);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DDkimVerifier,d_dkim_verifier_unref)
+
+/**
+ * @brief Process the next block of the message data.
+ * @details The data is the dot stuffed DATA stream, the end of data
+ * line and the bytes after it are ignored.
+ */
+void d_dkim_verifier_feed(
+    DDkimVerifier* verifier,
+    const gchar* data,
+    gsize size);
+
+/**
+ * @brief Check the signatures of the complete message.
+ * @details The check waits for the public key lookups still in progress.
+ * @param [in] authserv_id The host name put into the result field.
+ */
+void d_dkim_verify_async(
+    DDkim* dkim,
+    DDkimVerifier* verifier,
+    const gchar* authserv_id,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the check.
+ * @return The Authentication-Results header field, caller owns the reference.
+ */
+GBytes* d_dkim_verify_finish(
+    DDkim* dkim,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Write the verification and the key cache counters to the log.
+ */
+void d_dkim_log_metrics(
+    DDkim* dkim);
+
+/**
+ * @brief Set the process wide DKIM verifier used by the connections.
+ * @param [in] dkim The verifier or NULL to disable the verification.
+ */
+void d_dkim_set_default(
+    DDkim* dkim);
+
+/**
+ * @brief Get the process wide DKIM verifier.
+ * @return The new reference or NULL if the verification is disabled.
+ */
+DDkim* d_dkim_get_default();
+
+/**
+ * @brief Create new instance of the DKIM verifier.
+ * @param [in] cache The DNS cache used for the key lookups.
+ * @param [in] max_keys The maximum number of the parsed keys kept.
+ */
+DDkim* d_dkim_new(
+    DDnsCache* cache,
+    guint max_keys);
+
+/**
+ * @brief Create the signing of the next message.
+ * @param [in] max_header_size The header bigger than this size isn't signed.
+ */
+DDkimSigning* d_dkim_signing_new(
+    DDkimSigner* signer,
+    gsize max_header_size);
+
+DDkimSigning* d_dkim_signing_ref(
+    DDkimSigning* signing);
+
+void d_dkim_signing_unref(
+    DDkimSigning* signing);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DDkimSigning,d_dkim_signing_unref)
+
+/**
+ * @brief Process the next block of the message data.
+ * @details The body is hashed only if the signer has the key of the
+ * From domain.
+ */
+void d_dkim_signing_feed(
+    DDkimSigning* signing,
+    const gchar* data,
+    gsize size);
+
+/**
+ * @brief Sign the complete message.
+ * @details The relaxed/relaxed signature of the From domain is made.
+ */
+void d_dkim_sign_async(
+    DDkimSigner* signer,
+    DDkimSigning* signing,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the signing.
+ * @return The DKIM-Signature header field or NULL if the message isn't
+ * signed, caller owns the reference.
+ */
+GBytes* d_dkim_sign_finish(
+    DDkimSigner* signer,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Write the signing counters to the log.
+ */
+void d_dkim_signer_log_metrics(
+    DDkimSigner* signer);
+
+/**
+ * @brief Set the process wide DKIM signer used by the connections.
+ * @param [in] signer The signer or NULL to disable the signing.
+ */
+void d_dkim_signer_set_default(
+    DDkimSigner* signer);
+
+/**
+ * @brief Get the process wide DKIM signer.
+ * @return The new reference or NULL if the signing is disabled.
+ */
+DDkimSigner* d_dkim_signer_get_default();
+
+/**
+ * @brief Create new instance of the DKIM signer.
+ * @param [in] keys The comma separated domain:selector:pem-file list.
+ * @param [in] batch The maximum number of signatures the signer thread
+ * makes per wakeup, 0 signs in the calling thread.
+ */
+DDkimSigner* d_dkim_signer_new(
+    const gchar* keys,
+    guint batch,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__DKIM__HPP__
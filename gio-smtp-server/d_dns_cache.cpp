@@ -0,0 +1,804 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_dns_cache.hpp"
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+/// @brief The number of the independently locked parts of the cache.
+#define DNS_CACHE_SHARDS 16
+/// @brief The size of the DNS answer buffer, EDNS answers fit in it.
+#define DNS_ANSWER_BUFFER_SIZE 8192
+/// @brief The answers with shorter TTL are not refreshed ahead.
+#define DNS_REFRESH_MIN_TTL 10
+/// @brief The maximum number of the PTR names checked by the forward confirmation.
+#define DNS_VERIFY_MAX_NAMES 3
+
+extern "C" {
+
+/**
+ * @brief The cached answer and the lookups waiting for it.
+ */
+struct DDnsCacheEntry
+{
+    DNS_RECORD_TYPE type;
+    /// @brief The absolute query name with the trailing dot.
+    gchar* name;
+    /// @brief The last answer, NULL until the first query completes.
+    DDnsAnswer* answer;
+    gint64 expires;
+    /// @brief The time the used entry is queried again ahead of expiration.
+    gint64 refresh;
+    gboolean in_flight;
+    /// @brief GTask of the lookups waiting for the query in flight.
+    GPtrArray* waiters;
+};
+
+struct DDnsCacheMetrics
+{
+    guint64 hits;
+    guint64 negative_hits;
+    guint64 misses;
+    guint64 coalesced;
+    guint64 refreshes;
+    guint64 queries;
+    guint64 failures;
+    guint64 evictions;
+};
+
+struct DDnsCacheShard
+{
+    GMutex lock;
+    /// @brief Entries by the "type:name" key.
+    GHashTable* entries;
+    DDnsCacheMetrics metrics;
+};
+
+struct _DDnsCache
+{
+    GObject parent;
+
+    struct sockaddr_in server;
+    gboolean has_server;
+    guint shard_capacity;
+    guint negative_ttl;
+    guint max_ttl;
+    GThreadPool* pool;
+    DDnsCacheShard shards[DNS_CACHE_SHARDS];
+};
+typedef _DDnsCache DDnsCache;
+
+G_DEFINE_TYPE(DDnsCache,d_dns_cache,G_TYPE_OBJECT)
+
+struct _DDnsCacheClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The query passed to the query thread.
+ */
+struct DDnsCacheQuery
+{
+    DDnsCache* cache;
+    DDnsCacheShard* shard;
+    DDnsCacheEntry* entry;
+};
+
+G_LOCK_DEFINE_STATIC(dns_cache_default);
+static DDnsCache* dns_cache_default{nullptr};
+
+static const gchar* dns_record_type_names[NR_DNS_RECORD_TYPES] = {
+    "A",
+    "AAAA",
+    "PTR",
+    "MX",
+    "TXT"
+};
+
+static const int dns_record_type_values[NR_DNS_RECORD_TYPES] = {
+    ns_t_a,
+    ns_t_aaaa,
+    ns_t_ptr,
+    ns_t_mx,
+    ns_t_txt
+};
+
+static void d_dns_record_clear(gpointer data)
+{
+    g_free(reinterpret_cast<DDnsRecord*>(data)->data);
+}
+
+static gint d_dns_record_compare(gconstpointer a, gconstpointer b)
+{
+    guint pa = reinterpret_cast<const DDnsRecord*>(a)->preference;
+    guint pb = reinterpret_cast<const DDnsRecord*>(b)->preference;
+    return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+static DDnsAnswer* d_dns_answer_new(
+    DNS_ANSWER_STATUS status,
+    guint ttl)
+{
+    auto answer = g_new0(DDnsAnswer,1);
+    answer->ref_count = 1;
+    answer->status = status;
+    answer->ttl = ttl;
+    answer->records = g_array_new(FALSE,TRUE,sizeof(DDnsRecord));
+    g_array_set_clear_func(answer->records,d_dns_record_clear);
+    return answer;
+}
+
+DDnsAnswer* d_dns_answer_ref(
+    DDnsAnswer* answer)
+{
+    g_return_val_if_fail(answer,NULL);
+    g_atomic_int_inc(&answer->ref_count);
+    return answer;
+}
+
+void d_dns_answer_unref(
+    DDnsAnswer* answer)
+{
+    if(!answer) return;
+    if(g_atomic_int_dec_and_test(&answer->ref_count)) {
+        g_array_unref(answer->records);
+        g_free(answer);
+    }
+}
+
+static void d_dns_cache_entry_free(gpointer data)
+{
+    auto entry = reinterpret_cast<DDnsCacheEntry*>(data);
+    g_free(entry->name);
+    d_dns_answer_unref(entry->answer);
+    g_ptr_array_unref(entry->waiters);
+    g_free(entry);
+}
+
+/**
+ * @brief Get the address bytes, IPv4 mapped IPv6 address is taken as IPv4.
+ * @return The number of bytes, 4 or 16.
+ */
+static gsize d_dns_address_bytes(
+    GInetAddress* address,
+    const guint8** bytes)
+{
+    *bytes = g_inet_address_to_bytes(address);
+    gsize size = g_inet_address_get_native_size(address);
+    static const guint8 mapped_prefix[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+    if(size == 16 && memcmp(*bytes,mapped_prefix,sizeof(mapped_prefix)) == 0) {
+        *bytes += sizeof(mapped_prefix);
+        size = 4;
+    }
+    return size;
+}
+
+gchar* d_dns_cache_reverse_name(
+    GInetAddress* address,
+    const gchar* zone)
+{
+    g_return_val_if_fail(G_IS_INET_ADDRESS(address),NULL);
+    const guint8* bytes;
+    gsize size = d_dns_address_bytes(address,&bytes);
+    GString* name = g_string_sized_new(80);
+    if(size == 4) {
+        g_string_printf(name,"%u.%u.%u.%u.",bytes[3],bytes[2],bytes[1],bytes[0]);
+    } else {
+        static const gchar hex[] = "0123456789abcdef";
+        for(gsize i = size; i > 0; i--) {
+            g_string_append_c(name,hex[bytes[i - 1] & 0x0f]);
+            g_string_append_c(name,'.');
+            g_string_append_c(name,hex[bytes[i - 1] >> 4]);
+            g_string_append_c(name,'.');
+        }
+    }
+    g_string_append(name,zone ? zone : (size == 4 ? "in-addr.arpa" : "ip6.arpa"));
+    return g_string_free(name,FALSE);
+}
+
+/**
+ * @brief Take the records of the type from the answer section.
+ * @details The answer TTL is the lowest TTL of the records and the CNAME
+ * records leading to them.
+ */
+static DDnsAnswer* d_dns_cache_parse(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const guchar* buffer,
+    int length)
+{
+    ns_msg message;
+    if(ns_initparse(buffer,length,&message) < 0) {
+        return NULL;
+    }
+    DDnsAnswer* answer = d_dns_answer_new(DNS_ANSWER_OK,cache->max_ttl);
+    int count = ns_msg_count(message,ns_s_an);
+    for(int i = 0; i < count; i++) {
+        ns_rr rr;
+        if(ns_parserr(&message,ns_s_an,i,&rr) < 0) {
+            break;
+        }
+        int rr_type = ns_rr_type(rr);
+        if(rr_type != dns_record_type_values[type] && rr_type != ns_t_cname) {
+            continue;
+        }
+        answer->ttl = MIN(answer->ttl,ns_rr_ttl(rr));
+        const guchar* rdata = ns_rr_rdata(rr);
+        guint rdlength = ns_rr_rdlen(rr);
+        DDnsRecord record{0,NULL};
+        gchar text[NS_MAXDNAME];
+        if(rr_type == ns_t_a && rdlength == 4) {
+            record.data = g_strdup(inet_ntop(AF_INET,rdata,text,sizeof(text)));
+        } else if(rr_type == ns_t_aaaa && rdlength == 16) {
+            record.data = g_strdup(inet_ntop(AF_INET6,rdata,text,sizeof(text)));
+        } else if(rr_type == ns_t_ptr) {
+            if(ns_name_uncompress(ns_msg_base(message),ns_msg_end(message),rdata,text,sizeof(text)) >= 0) {
+                record.data = g_strdup(text);
+            }
+        } else if(rr_type == ns_t_mx && rdlength > 2) {
+            record.preference = ns_get16(rdata);
+            if(ns_name_uncompress(ns_msg_base(message),ns_msg_end(message),rdata + 2,text,sizeof(text)) >= 0) {
+                record.data = g_strdup(text);
+            }
+        } else if(rr_type == ns_t_txt) {
+            // The record is the sequence of the length prefixed strings.
+            GString* data = g_string_sized_new(rdlength);
+            for(guint offset = 0; offset < rdlength; offset += rdata[offset] + 1) {
+                g_string_append_len(data,reinterpret_cast<const gchar*>(rdata) + offset + 1,
+                    MIN(rdata[offset],rdlength - offset - 1));
+            }
+            record.data = g_string_free(data,FALSE);
+        }
+        if(record.data) {
+            g_array_append_val(answer->records,record);
+        }
+    }
+    if(answer->records->len == 0) {
+        answer->status = DNS_ANSWER_NODATA;
+        answer->ttl = cache->negative_ttl;
+    } else if(type == DNS_RECORD_MX) {
+        g_array_sort(answer->records,d_dns_record_compare);
+    }
+    return answer;
+}
+
+/**
+ * @brief Send the query and wait for the answer.
+ * @details The resolver state is initialized for every query, so the
+ * query threads share nothing.
+ */
+static DDnsAnswer* d_dns_cache_query(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    GError** error)
+{
+    struct __res_state state;
+    memset(&state,0,sizeof(state));
+    if(res_ninit(&state) < 0) {
+        g_set_error(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_TEMPORARY_FAILURE,
+            "Resolver initialization failed");
+        return NULL;
+    }
+    if(cache->has_server) {
+        state.nsaddr_list[0] = cache->server;
+        state.nscount = 1;
+    }
+    state.options |= RES_USE_EDNS0;
+    g_autofree guchar* buffer = static_cast<guchar*>(g_malloc(DNS_ANSWER_BUFFER_SIZE));
+    int length = res_nquery(&state,name,ns_c_in,dns_record_type_values[type],
+        buffer,DNS_ANSWER_BUFFER_SIZE);
+    int h_error = state.res_h_errno;
+    res_nclose(&state);
+    if(length < 0) {
+        if(h_error == HOST_NOT_FOUND) {
+            return d_dns_answer_new(DNS_ANSWER_NXDOMAIN,cache->negative_ttl);
+        }
+        if(h_error == NO_DATA) {
+            return d_dns_answer_new(DNS_ANSWER_NODATA,cache->negative_ttl);
+        }
+        g_set_error(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_TEMPORARY_FAILURE,
+            "DNS query %s %s failed: %s",name,dns_record_type_names[type],hstrerror(h_error));
+        return NULL;
+    }
+    DDnsAnswer* answer = d_dns_cache_parse(cache,type,buffer,MIN(length,DNS_ANSWER_BUFFER_SIZE));
+    if(!answer) {
+        g_set_error(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_TEMPORARY_FAILURE,
+            "DNS query %s %s failed: malformed answer",name,dns_record_type_names[type]);
+    }
+    return answer;
+}
+
+/**
+ * @brief Run the query in the query thread and complete the waiting lookups.
+ * @details The failed query keeps the previous answer of the entry, the
+ * entry is expired and queried again by the next lookup.
+ */
+static void d_dns_cache_query_thread(
+    gpointer data,
+    gpointer user_data)
+{
+    auto query = reinterpret_cast<DDnsCacheQuery*>(data);
+    DDnsCache* cache = query->cache;
+    DDnsCacheEntry* entry = query->entry;
+    GError* error{NULL};
+    DDnsAnswer* answer = d_dns_cache_query(cache,entry->type,entry->name,&error);
+
+    g_mutex_lock(&query->shard->lock);
+    query->shard->metrics.queries++;
+    if(answer) {
+        gint64 now = g_get_monotonic_time();
+        d_dns_answer_unref(entry->answer);
+        entry->answer = d_dns_answer_ref(answer);
+        entry->expires = now + gint64(answer->ttl) * G_USEC_PER_SEC;
+        entry->refresh = answer->ttl >= DNS_REFRESH_MIN_TTL ?
+            entry->expires - gint64(answer->ttl) * G_USEC_PER_SEC / 10 : entry->expires;
+    } else {
+        query->shard->metrics.failures++;
+        entry->expires = 0;
+    }
+    entry->in_flight = FALSE;
+    GPtrArray* waiters = entry->waiters;
+    entry->waiters = g_ptr_array_new();
+    g_mutex_unlock(&query->shard->lock);
+
+    for(guint i = 0; i < waiters->len; i++) {
+        auto task = G_TASK(waiters->pdata[i]);
+        if(answer) {
+            g_task_return_pointer(task,d_dns_answer_ref(answer),
+                reinterpret_cast<GDestroyNotify>(d_dns_answer_unref));
+        } else {
+            g_task_return_error(task,g_error_copy(error));
+        }
+        g_object_unref(task);
+    }
+    g_ptr_array_unref(waiters);
+    d_dns_answer_unref(answer);
+    g_clear_error(&error);
+    g_object_unref(cache);
+    g_free(query);
+}
+
+/**
+ * @brief Make the room for the new entry in the full shard.
+ * @details The expired entries are removed first, then the arbitrary
+ * eighth of the shard. The entries with the query in flight are kept.
+ */
+static void d_dns_cache_shard_evict(
+    DDnsCache* cache,
+    DDnsCacheShard* shard,
+    gint64 now)
+{
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter,shard->entries);
+    while(g_hash_table_iter_next(&iter,NULL,&value)) {
+        auto entry = reinterpret_cast<DDnsCacheEntry*>(value);
+        if(!entry->in_flight && entry->expires <= now) {
+            g_hash_table_iter_remove(&iter);
+            shard->metrics.evictions++;
+        }
+    }
+    guint evict = MAX(cache->shard_capacity / 8,1);
+    g_hash_table_iter_init(&iter,shard->entries);
+    while(g_hash_table_size(shard->entries) >= cache->shard_capacity && evict > 0 &&
+        g_hash_table_iter_next(&iter,NULL,&value)) {
+        if(!reinterpret_cast<DDnsCacheEntry*>(value)->in_flight) {
+            g_hash_table_iter_remove(&iter);
+            shard->metrics.evictions++;
+            evict--;
+        }
+    }
+}
+
+/**
+ * @brief Queue the query of the entry, called under the shard lock.
+ */
+static void d_dns_cache_start_query(
+    DDnsCache* cache,
+    DDnsCacheShard* shard,
+    DDnsCacheEntry* entry)
+{
+    auto query = g_new0(DDnsCacheQuery,1);
+    query->cache = D_DNS_CACHE(g_object_ref(cache));
+    query->shard = shard;
+    query->entry = entry;
+    entry->in_flight = TRUE;
+    // The pool without free threads queues the query, so push doesn't fail.
+    g_thread_pool_push(cache->pool,query,NULL);
+}
+
+/**
+ * @brief Get the lower case name without the trailing dot.
+ * @return The domain or NULL if the name is empty or too long.
+ */
+static gchar* d_dns_cache_domain(
+    const gchar* name)
+{
+    gchar* domain = g_ascii_strdown(name,-1);
+    gsize length = strlen(domain);
+    if(length > 0 && domain[length - 1] == '.') {
+        domain[--length] = 0;
+    }
+    if(length == 0 || length >= NS_MAXDNAME) {
+        g_free(domain);
+        return NULL;
+    }
+    return domain;
+}
+
+void d_dns_cache_lookup_async(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_DNS_CACHE(cache));
+    g_return_if_fail(type < NR_DNS_RECORD_TYPES);
+    g_return_if_fail(name);
+    auto task = g_task_new(cache,cancellable,callback,user_data);
+    g_task_set_source_tag(task,reinterpret_cast<gpointer>(d_dns_cache_lookup_async));
+
+    g_autofree gchar* domain = d_dns_cache_domain(name);
+    if(!domain) {
+        g_task_return_new_error(task,G_RESOLVER_ERROR,G_RESOLVER_ERROR_NOT_FOUND,
+            "Invalid domain name '%s'",name);
+        g_object_unref(task);
+        return;
+    }
+    g_autofree gchar* key = g_strdup_printf("%s:%s",dns_record_type_names[type],domain);
+    DDnsCacheShard* shard = &cache->shards[g_str_hash(key) % DNS_CACHE_SHARDS];
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&shard->lock);
+    auto entry = reinterpret_cast<DDnsCacheEntry*>(g_hash_table_lookup(shard->entries,key));
+    if(entry && entry->answer && now < entry->expires) {
+        DDnsAnswer* answer = d_dns_answer_ref(entry->answer);
+        if(answer->status == DNS_ANSWER_OK) {
+            shard->metrics.hits++;
+        } else {
+            shard->metrics.negative_hits++;
+        }
+        // The hot entry is queried again before it expires.
+        if(now >= entry->refresh && !entry->in_flight) {
+            shard->metrics.refreshes++;
+            d_dns_cache_start_query(cache,shard,entry);
+        }
+        g_mutex_unlock(&shard->lock);
+        g_task_return_pointer(task,answer,reinterpret_cast<GDestroyNotify>(d_dns_answer_unref));
+        g_object_unref(task);
+        return;
+    }
+    if(!entry) {
+        if(g_hash_table_size(shard->entries) >= cache->shard_capacity) {
+            d_dns_cache_shard_evict(cache,shard,now);
+        }
+        entry = g_new0(DDnsCacheEntry,1);
+        entry->type = type;
+        entry->name = g_strconcat(domain,".",NULL);
+        entry->waiters = g_ptr_array_new();
+        g_hash_table_insert(shard->entries,g_steal_pointer(&key),entry);
+    }
+    // The task reference is passed to the waiters list.
+    g_ptr_array_add(entry->waiters,task);
+    if(entry->in_flight) {
+        shard->metrics.coalesced++;
+    } else {
+        shard->metrics.misses++;
+        d_dns_cache_start_query(cache,shard,entry);
+    }
+    g_mutex_unlock(&shard->lock);
+}
+
+DDnsAnswer* d_dns_cache_lookup_finish(
+    DDnsCache* cache,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,cache),NULL);
+    return reinterpret_cast<DDnsAnswer*>(g_task_propagate_pointer(G_TASK(result),error));
+}
+
+/**
+ * @brief The state of the forward confirmation.
+ */
+void d_dns_cache_add_static(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    const gchar* const* records)
+{
+    g_return_if_fail(D_IS_DNS_CACHE(cache));
+    g_return_if_fail(type < NR_DNS_RECORD_TYPES);
+    g_return_if_fail(name);
+    g_autofree gchar* domain = d_dns_cache_domain(name);
+    g_return_if_fail(domain);
+
+    DDnsAnswer* answer = d_dns_answer_new(!records ? DNS_ANSWER_NXDOMAIN :
+        *records ? DNS_ANSWER_OK : DNS_ANSWER_NODATA,0);
+    for(guint i = 0; records && records[i]; i++) {
+        DDnsRecord record{0,NULL};
+        const gchar* data = records[i];
+        if(type == DNS_RECORD_MX) {
+            gchar* end;
+            record.preference = guint(g_ascii_strtoull(data,&end,10));
+            for(data = end; *data == ' '; data++);
+        }
+        record.data = g_strdup(data);
+        g_array_append_val(answer->records,record);
+    }
+    if(type == DNS_RECORD_MX) {
+        g_array_sort(answer->records,d_dns_record_compare);
+    }
+
+    g_autofree gchar* key = g_strdup_printf("%s:%s",dns_record_type_names[type],domain);
+    DDnsCacheShard* shard = &cache->shards[g_str_hash(key) % DNS_CACHE_SHARDS];
+    g_mutex_lock(&shard->lock);
+    auto entry = reinterpret_cast<DDnsCacheEntry*>(g_hash_table_lookup(shard->entries,key));
+    if(!entry) {
+        entry = g_new0(DDnsCacheEntry,1);
+        entry->type = type;
+        entry->name = g_strconcat(domain,".",NULL);
+        entry->waiters = g_ptr_array_new();
+        g_hash_table_insert(shard->entries,g_steal_pointer(&key),entry);
+    }
+    d_dns_answer_unref(entry->answer);
+    entry->answer = answer;
+    entry->expires = G_MAXINT64;
+    entry->refresh = G_MAXINT64;
+    g_mutex_unlock(&shard->lock);
+}
+
+struct DDnsCacheVerify
+{
+    GInetAddress* address;
+    DDnsAnswer* names;
+    guint index;
+};
+
+static void d_dns_cache_verify_free(gpointer data)
+{
+    auto verify = reinterpret_cast<DDnsCacheVerify*>(data);
+    g_object_unref(verify->address);
+    d_dns_answer_unref(verify->names);
+    g_free(verify);
+}
+
+static void d_dns_cache_verify_forward(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data);
+
+/**
+ * @brief Look up the addresses of the next PTR name.
+ */
+static void d_dns_cache_verify_next(
+    GTask* task)
+{
+    auto verify = reinterpret_cast<DDnsCacheVerify*>(g_task_get_task_data(task));
+    if(verify->index >= MIN(verify->names->records->len,DNS_VERIFY_MAX_NAMES)) {
+        g_task_return_pointer(task,NULL,NULL);
+        g_object_unref(task);
+        return;
+    }
+    const guint8* bytes;
+    DNS_RECORD_TYPE type = d_dns_address_bytes(verify->address,&bytes) == 4 ?
+        DNS_RECORD_A : DNS_RECORD_AAAA;
+    d_dns_cache_lookup_async(D_DNS_CACHE(g_task_get_source_object(task)),type,
+        g_array_index(verify->names->records,DDnsRecord,verify->index).data,
+        g_task_get_cancellable(task),d_dns_cache_verify_forward,task);
+}
+
+static void d_dns_cache_verify_forward(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto task = G_TASK(user_data);
+    auto verify = reinterpret_cast<DDnsCacheVerify*>(g_task_get_task_data(task));
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!answer) {
+        g_task_return_error(task,error);
+        g_object_unref(task);
+        return;
+    }
+    const guint8* bytes;
+    gsize size = d_dns_address_bytes(verify->address,&bytes);
+    for(guint i = 0; i < answer->records->len; i++) {
+        g_autoptr(GInetAddress) address = g_inet_address_new_from_string(
+            g_array_index(answer->records,DDnsRecord,i).data);
+        if(address && g_inet_address_get_native_size(address) == size &&
+            memcmp(g_inet_address_to_bytes(address),bytes,size) == 0) {
+            g_task_return_pointer(task,
+                g_strdup(g_array_index(verify->names->records,DDnsRecord,verify->index).data),g_free);
+            g_object_unref(task);
+            return;
+        }
+    }
+    verify->index++;
+    d_dns_cache_verify_next(task);
+}
+
+static void d_dns_cache_verify_reverse(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto task = G_TASK(user_data);
+    auto verify = reinterpret_cast<DDnsCacheVerify*>(g_task_get_task_data(task));
+    GError* error{NULL};
+    verify->names = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!verify->names) {
+        g_task_return_error(task,error);
+        g_object_unref(task);
+        return;
+    }
+    d_dns_cache_verify_next(task);
+}
+
+void d_dns_cache_verify_address_async(
+    DDnsCache* cache,
+    GInetAddress* address,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_DNS_CACHE(cache));
+    g_return_if_fail(G_IS_INET_ADDRESS(address));
+    auto task = g_task_new(cache,cancellable,callback,user_data);
+    g_task_set_source_tag(task,reinterpret_cast<gpointer>(d_dns_cache_verify_address_async));
+    auto verify = g_new0(DDnsCacheVerify,1);
+    verify->address = G_INET_ADDRESS(g_object_ref(address));
+    g_task_set_task_data(task,verify,d_dns_cache_verify_free);
+    g_autofree gchar* name = d_dns_cache_reverse_name(address,NULL);
+    d_dns_cache_lookup_async(cache,DNS_RECORD_PTR,name,cancellable,d_dns_cache_verify_reverse,task);
+}
+
+gchar* d_dns_cache_verify_address_finish(
+    DDnsCache* cache,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,cache),NULL);
+    return reinterpret_cast<gchar*>(g_task_propagate_pointer(G_TASK(result),error));
+}
+
+void d_dns_cache_log_metrics(
+    DDnsCache* cache)
+{
+    g_return_if_fail(D_IS_DNS_CACHE(cache));
+    DDnsCacheMetrics metrics{};
+    guint entries = 0;
+    for(guint i = 0; i < DNS_CACHE_SHARDS; i++) {
+        DDnsCacheShard* shard = &cache->shards[i];
+        g_mutex_lock(&shard->lock);
+        metrics.hits += shard->metrics.hits;
+        metrics.negative_hits += shard->metrics.negative_hits;
+        metrics.misses += shard->metrics.misses;
+        metrics.coalesced += shard->metrics.coalesced;
+        metrics.refreshes += shard->metrics.refreshes;
+        metrics.queries += shard->metrics.queries;
+        metrics.failures += shard->metrics.failures;
+        metrics.evictions += shard->metrics.evictions;
+        entries += g_hash_table_size(shard->entries);
+        g_mutex_unlock(&shard->lock);
+    }
+    g_message("DNS cache: %u entries, hits %" G_GUINT64_FORMAT " (negative %" G_GUINT64_FORMAT
+        "), misses %" G_GUINT64_FORMAT ", coalesced %" G_GUINT64_FORMAT ", refreshes %" G_GUINT64_FORMAT
+        ", queries %" G_GUINT64_FORMAT " (failed %" G_GUINT64_FORMAT "), evictions %" G_GUINT64_FORMAT,
+        entries,metrics.hits,metrics.negative_hits,metrics.misses,metrics.coalesced,
+        metrics.refreshes,metrics.queries,metrics.failures,metrics.evictions);
+}
+
+void d_dns_cache_set_default(
+    DDnsCache* cache)
+{
+    G_LOCK(dns_cache_default);
+    g_set_object(&dns_cache_default,cache);
+    G_UNLOCK(dns_cache_default);
+}
+
+DDnsCache* d_dns_cache_get_default()
+{
+    G_LOCK(dns_cache_default);
+    DDnsCache* cache = dns_cache_default ? D_DNS_CACHE(g_object_ref(dns_cache_default)) : NULL;
+    G_UNLOCK(dns_cache_default);
+    return cache;
+}
+
+static void d_dns_cache_init(DDnsCache* cache)
+{
+    for(guint i = 0; i < DNS_CACHE_SHARDS; i++) {
+        g_mutex_init(&cache->shards[i].lock);
+        cache->shards[i].entries = g_hash_table_new_full(g_str_hash,g_str_equal,
+            g_free,d_dns_cache_entry_free);
+    }
+}
+
+static void d_dns_cache_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_DNS_CACHE(object));
+    auto cache = D_DNS_CACHE(object);
+    // Every query holds the cache reference, so the pool is idle. The last
+    // query may drop the reference in the pool thread, so don't wait.
+    if(cache->pool) {
+        g_thread_pool_free(cache->pool,FALSE,FALSE);
+    }
+    for(guint i = 0; i < DNS_CACHE_SHARDS; i++) {
+        g_hash_table_unref(cache->shards[i].entries);
+        g_mutex_clear(&cache->shards[i].lock);
+    }
+    G_OBJECT_CLASS(d_dns_cache_parent_class)->finalize(object);
+}
+
+static void d_dns_cache_class_init(DDnsCacheClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_dns_cache_finalize;
+}
+
+/**
+ * @brief Create new instance of the DNS cache.
+ */
+DDnsCache* d_dns_cache_new(
+    const gchar* server,
+    guint max_entries,
+    guint negative_ttl,
+    guint max_ttl,
+    guint threads,
+    GError** error)
+{
+    g_return_val_if_fail(max_entries > 0,NULL);
+    g_return_val_if_fail(threads > 0,NULL);
+    g_autoptr(DDnsCache) cache = reinterpret_cast<DDnsCache*>(
+        g_object_new(
+            D_TYPE_DNS_CACHE,
+            NULL));
+
+    if(server && *server) {
+        g_autoptr(GSocketConnectable) connectable = g_network_address_parse(server,NS_DEFAULTPORT,error);
+        if(!connectable) {
+            return NULL;
+        }
+        auto hostname = g_network_address_get_hostname(G_NETWORK_ADDRESS(connectable));
+        cache->server.sin_family = AF_INET;
+        cache->server.sin_port = htons(g_network_address_get_port(G_NETWORK_ADDRESS(connectable)));
+        if(inet_pton(AF_INET,hostname,&cache->server.sin_addr) != 1) {
+            g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_ARGUMENT,
+                "DNS server must be the IPv4 address: %s",server);
+            return NULL;
+        }
+        cache->has_server = TRUE;
+    }
+    cache->shard_capacity = MAX(max_entries / DNS_CACHE_SHARDS,1);
+    cache->negative_ttl = negative_ttl;
+    cache->max_ttl = max_ttl;
+    cache->pool = g_thread_pool_new(d_dns_cache_query_thread,NULL,threads,FALSE,error);
+    if(!cache->pool) {
+        return NULL;
+    }
+
+    return D_DNS_CACHE(g_steal_pointer(&cache));
+}
+
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__DNS_CACHE__HPP__
+#define __D__NEW__DNS_CACHE__HPP__
+/**
+ * @brief Shared caching DNS resolver.
+ * @details GResolver neither caches nor reports the record TTL, so the
+ * cache sends the queries by res_nquery from its own threads and keeps
+ * the answers for their TTL. The entries are split into the shards with
+ * own locks, so the worker threads rarely contend for the lock. The
+ * concurrent lookups of the same name and type share the one query. The
+ * negative answers (NXDOMAIN and no records) are kept for the negative
+ * TTL, the failed queries aren't cached. The entry used within the last
+ * tenth of its TTL is refreshed in background, so the hot names are
+ * answered from the cache without interruption.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+#define D_TYPE_DNS_CACHE (d_dns_cache_get_type())
+
+G_DECLARE_FINAL_TYPE(DDnsCache,d_dns_cache,D,DNS_CACHE,GObject)
+
+/**
+ * @brief The looked up record type.
+ */
+enum DNS_RECORD_TYPE
+{
+    DNS_RECORD_A,
+    DNS_RECORD_AAAA,
+    DNS_RECORD_PTR,
+    DNS_RECORD_MX,
+    DNS_RECORD_TXT,
+    NR_DNS_RECORD_TYPES
+};
+
+enum DNS_ANSWER_STATUS
+{
+    DNS_ANSWER_OK,
+    /// @brief The name doesn't exist.
+    DNS_ANSWER_NXDOMAIN,
+    /// @brief The name exists, but has no records of the type.
+    DNS_ANSWER_NODATA
+};
+
+/**
+ * @brief The one record of the answer.
+ */
+struct DDnsRecord
+{
+    /// @brief The MX preference, 0 for other types.
+    guint preference;
+    /// @brief The address text (A, AAAA), the domain name without the
+    /// trailing dot (PTR, MX) or the joined strings (TXT).
+    gchar* data;
+};
+
+/**
+ * @brief The immutable answer shared by the cache and the callers.
+ */
+struct DDnsAnswer
+{
+    gint ref_count;
+    DNS_ANSWER_STATUS status;
+    /// @brief The time in seconds the answer is cached for.
+    guint ttl;
+    /// @brief Array of DDnsRecord, MX records are sorted by preference.
+    GArray* records;
+};
+
+DDnsAnswer* d_dns_answer_ref(
+    DDnsAnswer* answer);
+
+void d_dns_answer_unref(
+    DDnsAnswer* answer);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DDnsAnswer,d_dns_answer_unref)
+
+/**
+ * @brief Build the reverse lookup name of the address.
+ * @param [in] address IPv4 or IPv6 address.
+ * @param [in] zone The zone appended to the reversed address, NULL for
+ * in-addr.arpa or ip6.arpa.
+ */
+gchar* d_dns_cache_reverse_name(
+    GInetAddress* address,
+    const gchar* zone);
+
+/**
+ * @brief Look up the records of the name.
+ * @details The callback is invoked in the thread default main context
+ * of the caller. The cached answer is returned on the next main loop
+ * iteration.
+ * @param [in] name The domain name, the trailing dot is optional.
+ */
+void d_dns_cache_lookup_async(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the lookup.
+ * @return The answer, the negative one is not an error. Function returns
+ * NULL with G_RESOLVER_ERROR if the query failed.
+ */
+DDnsAnswer* d_dns_cache_lookup_finish(
+    DDnsCache* cache,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Add the answer which never expires and is never queried.
+ * @details The tests use it to answer the lookups without the DNS server.
+ * @param [in] records The NULL terminated record data, NULL for NXDOMAIN,
+ * empty for NODATA. The MX record data is "preference name".
+ */
+void d_dns_cache_add_static(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    const gchar* const* records);
+
+/**
+ * @brief Find the forward confirmed host name of the address.
+ * @details The PTR names of the address are looked up and the first one
+ * which has the address among its A or AAAA records is the result.
+ */
+void d_dns_cache_verify_address_async(
+    DDnsCache* cache,
+    GInetAddress* address,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the forward confirmation.
+ * @return The host name or NULL if the address has no confirmed name.
+ */
+gchar* d_dns_cache_verify_address_finish(
+    DDnsCache* cache,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Write the hit, miss and query counters to the log.
+ */
+void d_dns_cache_log_metrics(
+    DDnsCache* cache);
+
+/**
+ * @brief Set the process wide cache used by the connections.
+ * @param [in] cache The cache or NULL to disable the lookups.
+ */
+void d_dns_cache_set_default(
+    DDnsCache* cache);
+
+/**
+ * @brief Get the process wide cache.
+ * @return The new reference or NULL if the lookups are disabled.
+ */
+DDnsCache* d_dns_cache_get_default();
+
+/**
+ * @brief Create new instance of the DNS cache.
+ * @param [in] server The IPv4 address[:port] of the DNS server, NULL to
+ * use the servers of resolv.conf.
+ * @param [in] max_entries The maximum number of cached answers.
+ * @param [in] negative_ttl The time in seconds to cache the negative answer.
+ * @param [in] max_ttl The upper limit of the answer TTL in seconds.
+ * @param [in] threads The maximum number of the query threads.
+ * @param [out] error The location for error or NULL.
+ */
+DDnsCache* d_dns_cache_new(
+    const gchar* server,
+    guint max_entries,
+    guint negative_ttl,
+    guint max_ttl,
+    guint threads,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__DNS_CACHE__HPP__
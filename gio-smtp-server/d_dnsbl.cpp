@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_dnsbl.hpp"
+#include <string.h>
+
+/// @brief The result of the address not listed by any zone.
+#define DNSBL_NOT_LISTED -1
+
+extern "C" {
+
+/**
+ * @brief The cached result of the address check.
+ */
+struct DDnsblEntry
+{
+    /// @brief The link in the LRU list, the most recently used first.
+    GList link;
+    gint64 expires;
+    /// @brief The index of the listing zone or DNSBL_NOT_LISTED.
+    gint16 zone;
+    guint8 size;
+    guint8 address[16];
+};
+
+struct DDnsblMetrics
+{
+    guint64 checks;
+    guint64 cache_hits;
+    guint64 listed;
+    guint64 failures;
+};
+
+struct _DDnsbl
+{
+    GObject parent;
+
+    DDnsCache* cache;
+    GStrv zones;
+    guint max_entries;
+    guint ttl;
+
+    GMutex lock;
+    /// @brief Entries by the address bytes.
+    GHashTable* entries;
+    GQueue lru;
+    DDnsblMetrics metrics;
+};
+typedef _DDnsbl DDnsbl;
+
+G_DEFINE_TYPE(DDnsbl,d_dnsbl,G_TYPE_OBJECT)
+
+struct _DDnsblClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The state of the check, shared by the zone lookups.
+ */
+struct DDnsblCheck
+{
+    DDnsblEntry key;
+    guint pending;
+    guint failed;
+    gint zone;
+};
+
+/**
+ * @brief The lookup of the address in the one zone.
+ */
+struct DDnsblLookup
+{
+    GTask* task;
+    guint zone;
+};
+
+G_LOCK_DEFINE_STATIC(dnsbl_default);
+static DDnsbl* dnsbl_default{nullptr};
+
+static guint d_dnsbl_entry_hash(gconstpointer key)
+{
+    auto entry = reinterpret_cast<const DDnsblEntry*>(key);
+    guint hash = 5381;
+    for(guint i = 0; i < entry->size; i++) {
+        hash = hash * 33 + entry->address[i];
+    }
+    return hash;
+}
+
+static gboolean d_dnsbl_entry_equal(gconstpointer a, gconstpointer b)
+{
+    auto entry_a = reinterpret_cast<const DDnsblEntry*>(a);
+    auto entry_b = reinterpret_cast<const DDnsblEntry*>(b);
+    return entry_a->size == entry_b->size &&
+        memcmp(entry_a->address,entry_b->address,entry_a->size) == 0;
+}
+
+/**
+ * @brief Find the cached result, called under the lock.
+ * @return The zone index, DNSBL_NOT_LISTED or G_MININT if not cached.
+ */
+static gint d_dnsbl_lookup_entry(
+    DDnsbl* dnsbl,
+    const DDnsblEntry* key,
+    gint64 now)
+{
+    auto entry = reinterpret_cast<DDnsblEntry*>(g_hash_table_lookup(dnsbl->entries,key));
+    if(!entry) {
+        return G_MININT;
+    }
+    if(entry->expires <= now) {
+        g_queue_unlink(&dnsbl->lru,&entry->link);
+        g_hash_table_remove(dnsbl->entries,entry);
+        return G_MININT;
+    }
+    g_queue_unlink(&dnsbl->lru,&entry->link);
+    g_queue_push_head_link(&dnsbl->lru,&entry->link);
+    return entry->zone;
+}
+
+/**
+ * @brief Keep the result, called under the lock.
+ * @details The least recently used entry gives the place to the new one.
+ */
+static void d_dnsbl_store_entry(
+    DDnsbl* dnsbl,
+    const DDnsblEntry* key,
+    gint zone,
+    gint64 now)
+{
+    if(dnsbl->max_entries == 0) {
+        return;
+    }
+    auto entry = reinterpret_cast<DDnsblEntry*>(g_hash_table_lookup(dnsbl->entries,key));
+    if(entry) {
+        g_queue_unlink(&dnsbl->lru,&entry->link);
+    } else {
+        if(dnsbl->lru.length >= dnsbl->max_entries) {
+            GList* link = g_queue_peek_tail_link(&dnsbl->lru);
+            g_queue_unlink(&dnsbl->lru,link);
+            entry = reinterpret_cast<DDnsblEntry*>(link->data);
+            g_hash_table_steal(dnsbl->entries,entry);
+        } else {
+            entry = g_new0(DDnsblEntry,1);
+            entry->link.data = entry;
+        }
+        entry->size = key->size;
+        memcpy(entry->address,key->address,key->size);
+        g_hash_table_insert(dnsbl->entries,entry,entry);
+    }
+    entry->zone = zone;
+    entry->expires = now + gint64(dnsbl->ttl) * G_USEC_PER_SEC;
+    g_queue_push_head_link(&dnsbl->lru,&entry->link);
+}
+
+static void d_dnsbl_return(
+    GTask* task,
+    gint zone)
+{
+    auto dnsbl = D_DNSBL(g_task_get_source_object(task));
+    g_task_return_pointer(task,zone == DNSBL_NOT_LISTED ? NULL : g_strdup(dnsbl->zones[zone]),g_free);
+    g_object_unref(task);
+}
+
+/**
+ * @brief Test if the answer lists the address.
+ */
+static gboolean d_dnsbl_answer_listed(
+    DDnsAnswer* answer)
+{
+    if(answer->status != DNS_ANSWER_OK) {
+        return FALSE;
+    }
+    for(guint i = 0; i < answer->records->len; i++) {
+        const gchar* data = g_array_index(answer->records,DDnsRecord,i).data;
+        if(g_str_has_prefix(data,"127.") && !g_str_has_prefix(data,"127.255.255.")) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * @brief Completion of the one zone lookup.
+ * @details The lowest listing zone index wins once all zones answered.
+ * The result isn't cached if every zone failed.
+ */
+static void d_dnsbl_zone_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto lookup = reinterpret_cast<DDnsblLookup*>(user_data);
+    auto task = lookup->task;
+    gint zone = lookup->zone;
+    g_free(lookup);
+    auto dnsbl = D_DNSBL(g_task_get_source_object(task));
+    auto check = reinterpret_cast<DDnsblCheck*>(g_task_get_task_data(task));
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!answer) {
+        g_debug("DNSBL %s lookup failed: %d %s",dnsbl->zones[zone],error->code,error->message);
+        g_error_free(error);
+        check->failed++;
+    } else if(d_dnsbl_answer_listed(answer) && (check->zone == DNSBL_NOT_LISTED || zone < check->zone)) {
+        check->zone = zone;
+    }
+    if(--check->pending > 0) {
+        g_object_unref(task);
+        return;
+    }
+    g_mutex_lock(&dnsbl->lock);
+    if(check->zone != DNSBL_NOT_LISTED) {
+        dnsbl->metrics.listed++;
+    }
+    if(check->failed > 0) {
+        dnsbl->metrics.failures++;
+    }
+    if(check->failed < g_strv_length(dnsbl->zones)) {
+        d_dnsbl_store_entry(dnsbl,&check->key,check->zone,g_get_monotonic_time());
+    }
+    g_mutex_unlock(&dnsbl->lock);
+    d_dnsbl_return(task,check->zone);
+}
+
+void d_dnsbl_check_async(
+    DDnsbl* dnsbl,
+    GInetAddress* address,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_DNSBL(dnsbl));
+    g_return_if_fail(G_IS_INET_ADDRESS(address));
+    auto task = g_task_new(dnsbl,cancellable,callback,user_data);
+    g_task_set_source_tag(task,reinterpret_cast<gpointer>(d_dnsbl_check_async));
+    auto check = g_new0(DDnsblCheck,1);
+    check->zone = DNSBL_NOT_LISTED;
+    check->key.size = MIN(g_inet_address_get_native_size(address),sizeof(check->key.address));
+    memcpy(check->key.address,g_inet_address_to_bytes(address),check->key.size);
+    g_task_set_task_data(task,check,g_free);
+
+    g_mutex_lock(&dnsbl->lock);
+    dnsbl->metrics.checks++;
+    gint zone = d_dnsbl_lookup_entry(dnsbl,&check->key,g_get_monotonic_time());
+    if(zone != G_MININT) {
+        dnsbl->metrics.cache_hits++;
+    }
+    g_mutex_unlock(&dnsbl->lock);
+    if(zone != G_MININT || !dnsbl->zones[0]) {
+        d_dnsbl_return(task,zone != G_MININT ? zone : DNSBL_NOT_LISTED);
+        return;
+    }
+    // All zones are queried at once, the task waits for the last answer.
+    check->pending = g_strv_length(dnsbl->zones);
+    for(guint index = 0; dnsbl->zones[index]; index++) {
+        g_autofree gchar* name = d_dns_cache_reverse_name(address,dnsbl->zones[index]);
+        auto lookup = g_new0(DDnsblLookup,1);
+        lookup->task = G_TASK(g_object_ref(task));
+        lookup->zone = index;
+        d_dns_cache_lookup_async(dnsbl->cache,DNS_RECORD_A,name,cancellable,
+            d_dnsbl_zone_handle,lookup);
+    }
+    g_object_unref(task);
+}
+
+gchar* d_dnsbl_check_finish(
+    DDnsbl* dnsbl,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,dnsbl),NULL);
+    return reinterpret_cast<gchar*>(g_task_propagate_pointer(G_TASK(result),error));
+}
+
+void d_dnsbl_log_metrics(
+    DDnsbl* dnsbl)
+{
+    g_return_if_fail(D_IS_DNSBL(dnsbl));
+    g_mutex_lock(&dnsbl->lock);
+    DDnsblMetrics metrics = dnsbl->metrics;
+    guint entries = dnsbl->lru.length;
+    g_mutex_unlock(&dnsbl->lock);
+    g_message("DNSBL: %u cached addresses, checks %" G_GUINT64_FORMAT ", cache hits %" G_GUINT64_FORMAT
+        ", listed %" G_GUINT64_FORMAT ", failed lookups %" G_GUINT64_FORMAT,
+        entries,metrics.checks,metrics.cache_hits,metrics.listed,metrics.failures);
+}
+
+void d_dnsbl_set_default(
+    DDnsbl* dnsbl)
+{
+    G_LOCK(dnsbl_default);
+    g_set_object(&dnsbl_default,dnsbl);
+    G_UNLOCK(dnsbl_default);
+}
+
+DDnsbl* d_dnsbl_get_default()
+{
+    G_LOCK(dnsbl_default);
+    DDnsbl* dnsbl = dnsbl_default ? D_DNSBL(g_object_ref(dnsbl_default)) : NULL;
+    G_UNLOCK(dnsbl_default);
+    return dnsbl;
+}
+
+static void d_dnsbl_init(DDnsbl* dnsbl)
+{
+    g_mutex_init(&dnsbl->lock);
+    dnsbl->entries = g_hash_table_new_full(d_dnsbl_entry_hash,d_dnsbl_entry_equal,g_free,NULL);
+    g_queue_init(&dnsbl->lru);
+}
+
+static void d_dnsbl_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_DNSBL(object));
+    auto dnsbl = D_DNSBL(object);
+    // The entries are linked into the LRU list, the table owns them.
+    g_hash_table_unref(dnsbl->entries);
+    g_strfreev(dnsbl->zones);
+    g_clear_object(&dnsbl->cache);
+    g_mutex_clear(&dnsbl->lock);
+    G_OBJECT_CLASS(d_dnsbl_parent_class)->finalize(object);
+}
+
+static void d_dnsbl_class_init(DDnsblClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_dnsbl_finalize;
+}
+
+/**
+ * @brief Create new instance of the blocklist checker.
+ */
+DDnsbl* d_dnsbl_new(
+    DDnsCache* cache,
+    const gchar* zones,
+    guint max_entries,
+    guint ttl)
+{
+    g_return_val_if_fail(D_IS_DNS_CACHE(cache),NULL);
+    g_return_val_if_fail(zones,NULL);
+    auto dnsbl = reinterpret_cast<DDnsbl*>(
+        g_object_new(
+            D_TYPE_DNSBL,
+            NULL));
+
+    dnsbl->cache = D_DNS_CACHE(g_object_ref(cache));
+    g_auto(GStrv) names = g_strsplit(zones,",",-1);
+    GPtrArray* list = g_ptr_array_new();
+    for(gchar** name = names; *name; name++) {
+        g_strstrip(*name);
+        if(**name) {
+            g_ptr_array_add(list,g_strdup(*name));
+        }
+    }
+    g_ptr_array_add(list,NULL);
+    dnsbl->zones = reinterpret_cast<GStrv>(g_ptr_array_free(list,FALSE));
+    dnsbl->max_entries = max_entries;
+    dnsbl->ttl = ttl;
+
+    return dnsbl;
+}
+
+}
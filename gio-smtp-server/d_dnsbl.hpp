@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__DNSBL__HPP__
+#define __D__NEW__DNSBL__HPP__
+/**
+ * @brief DNS blocklist check of the client address.
+ * @details The address is looked up in all zones at once, so the check
+ * takes the one round trip of the slowest zone. The combined result is
+ * kept per address in the LRU list, the repeated connections of the
+ * listed client are rejected without the DNS lookups.
+ */
+
+#include "d_dns_cache.hpp"
+
+extern "C" {
+#define D_TYPE_DNSBL (d_dnsbl_get_type())
+
+G_DECLARE_FINAL_TYPE(DDnsbl,d_dnsbl,D,DNSBL,GObject)
+
+/**
+ * @brief Look up the address in the blocklist zones.
+ * @details The address is listed if any zone has the 127.0.0.0/8 address
+ * record for it, the 127.255.255.0/24 codes of the refused queries are
+ * ignored. The zone which failed to answer doesn't list the address.
+ */
+void d_dnsbl_check_async(
+    DDnsbl* dnsbl,
+    GInetAddress* address,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the blocklist check.
+ * @return The first configured zone listing the address or NULL.
+ */
+gchar* d_dnsbl_check_finish(
+    DDnsbl* dnsbl,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Write the check and the listing counters to the log.
+ */
+void d_dnsbl_log_metrics(
+    DDnsbl* dnsbl);
+
+/**
+ * @brief Set the process wide blocklist checker used by the connections.
+ * @param [in] dnsbl The checker or NULL to disable the checks.
+ */
+void d_dnsbl_set_default(
+    DDnsbl* dnsbl);
+
+/**
+ * @brief Get the process wide blocklist checker.
+ * @return The new reference or NULL if the checks are disabled.
+ */
+DDnsbl* d_dnsbl_get_default();
+
+/**
+ * @brief Create new instance of the blocklist checker.
+ * @param [in] cache The DNS cache used for the zone lookups.
+ * @param [in] zones The comma separated list of the zones.
+ * @param [in] max_entries The maximum number of the addresses in the
+ * result cache, 0 disables the result cache.
+ * @param [in] ttl The time in seconds the result is cached for.
+ */
+DDnsbl* d_dnsbl_new(
+    DDnsCache* cache,
+    const gchar* zones,
+    guint max_entries,
+    guint ttl);
+
+}
+
+#endif //#ifndef __D__NEW__DNSBL__HPP__
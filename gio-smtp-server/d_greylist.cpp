@@ -0,0 +1,506 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_greylist.hpp"
+
+#include <string.h>
+
+/// @brief The snapshot file magic "DSGL".
+#define GREYLIST_MAGIC 0x4c475344u
+#define GREYLIST_VERSION 1u
+/// @brief The number of slots in the bucket.
+#define GREYLIST_BUCKET_SLOTS 4
+/// @brief The number of bucket locks, the power of 2.
+#define GREYLIST_LOCKS 64
+
+extern "C" {
+
+/**
+ * @brief The triplet slot.
+ * @details The zero fingerprint is the free slot, the zero first seen
+ * time is the passed triplet.
+ */
+struct DGreylistSlot
+{
+    guint64 fingerprint;
+    guint32 first_seen;
+    guint32 last_seen;
+};
+
+G_STATIC_ASSERT(sizeof(DGreylistSlot) == 16);
+
+struct DGreylistBucket
+{
+    DGreylistSlot slots[GREYLIST_BUCKET_SLOTS];
+};
+
+struct DGreylistSnapshotHeader
+{
+    guint32 magic;
+    guint32 version;
+    guint32 slot_size;
+    guint32 reserved;
+    /// @brief The number of slots following the header.
+    guint64 count;
+    /// @brief The snapshot time in seconds since the epoch.
+    guint64 saved;
+};
+
+G_STATIC_ASSERT(sizeof(DGreylistSnapshotHeader) == 32);
+
+struct DGreylistMetrics
+{
+    guint64 checks;
+    /// @brief The first attempts and the too early retries.
+    guint64 deferred;
+    /// @brief The retries which passed the triplet.
+    guint64 passed;
+    /// @brief The attempts of the already passed triplets.
+    guint64 accepted;
+    guint64 evictions;
+};
+
+/**
+ * @brief The lock of every GREYLIST_LOCKS bucket and its counters.
+ */
+struct DGreylistStripe
+{
+    GMutex lock;
+    DGreylistMetrics metrics;
+};
+
+struct _DGreylist
+{
+    GObject parent;
+
+    DGreylistBucket* buckets;
+    /// @brief The number of buckets minus 1.
+    guint64 bucket_mask;
+    DGreylistStripe stripes[GREYLIST_LOCKS];
+    guint delay;
+    guint retry_window;
+    guint pass_ttl;
+
+    gchar* snapshot_path;
+    guint snapshot_interval;
+    GThread* snapshot_thread;
+    GMutex snapshot_lock;
+    GCond snapshot_cond;
+    gboolean stopping;
+    gint snapshots;
+};
+typedef _DGreylist DGreylist;
+
+G_DEFINE_TYPE(DGreylist,d_greylist,G_TYPE_OBJECT)
+
+struct _DGreylistClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(greylist_default);
+static DGreylist* greylist_default{nullptr};
+
+static guint32 d_greylist_now()
+{
+    return guint32(g_get_real_time() / G_USEC_PER_SEC);
+}
+
+/**
+ * @brief FNV-1a of the bytes.
+ */
+static guint64 d_greylist_hash_bytes(
+    guint64 hash,
+    const guint8* data,
+    gsize size)
+{
+    for(gsize index = 0; index < size; index++) {
+        hash = (hash ^ data[index]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief FNV-1a of the lower case text and its terminating zero.
+ */
+static guint64 d_greylist_hash_text(
+    guint64 hash,
+    const gchar* text)
+{
+    for(const gchar* p = text; *p; p++) {
+        hash = (hash ^ guint8(g_ascii_tolower(*p))) * 1099511628211ull;
+    }
+    return hash * 1099511628211ull;
+}
+
+/**
+ * @brief Compute the nonzero fingerprint of the triplet.
+ * @details The final mix spreads the FNV-1a bits to the low bits which
+ * select the bucket.
+ */
+static guint64 d_greylist_fingerprint(
+    GInetAddress* address,
+    const gchar* sender,
+    const gchar* recipient)
+{
+    auto bytes = g_inet_address_to_bytes(address);
+    gboolean ipv4 = g_inet_address_get_family(address) == G_SOCKET_FAMILY_IPV4;
+    guint8 family = ipv4 ? 4 : 6;
+    guint64 hash = d_greylist_hash_bytes(14695981039346656037ull,&family,1);
+    hash = d_greylist_hash_bytes(hash,bytes,ipv4 ? 3 : 8);
+    hash = d_greylist_hash_text(hash,sender);
+    hash = d_greylist_hash_text(hash,recipient);
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash ? hash : 1;
+}
+
+/**
+ * @brief Test if the slot is free or its triplet is expired.
+ */
+static gboolean d_greylist_slot_expired(
+    DGreylist* greylist,
+    const DGreylistSlot* slot,
+    guint32 now)
+{
+    if(slot->fingerprint == 0) {
+        return TRUE;
+    }
+    if(slot->first_seen == 0) {
+        return gint64(now) - slot->last_seen > greylist->pass_ttl;
+    }
+    return gint64(now) - slot->first_seen > greylist->retry_window;
+}
+
+/**
+ * @brief Select the slot for the new triplet.
+ * @details The free or expired slot is taken first, otherwise the least
+ * recently seen triplet is evicted.
+ */
+static DGreylistSlot* d_greylist_bucket_victim(
+    DGreylist* greylist,
+    DGreylistBucket* bucket,
+    guint32 now,
+    gboolean* evicted)
+{
+    DGreylistSlot* victim = &bucket->slots[0];
+    for(DGreylistSlot& slot : bucket->slots) {
+        if(d_greylist_slot_expired(greylist,&slot,now)) {
+            *evicted = FALSE;
+            return &slot;
+        }
+        if(slot.last_seen < victim->last_seen) {
+            victim = &slot;
+        }
+    }
+    *evicted = TRUE;
+    return victim;
+}
+
+/**
+ * @brief Check the triplet in its bucket, the bucket lock is held.
+ */
+static gboolean d_greylist_bucket_check(
+    DGreylist* greylist,
+    DGreylistBucket* bucket,
+    guint64 fingerprint,
+    guint32 now,
+    DGreylistMetrics* metrics)
+{
+    metrics->checks++;
+    DGreylistSlot* found{nullptr};
+    for(DGreylistSlot& slot : bucket->slots) {
+        if(slot.fingerprint == fingerprint) {
+            found = &slot;
+            break;
+        }
+    }
+    if(found && !d_greylist_slot_expired(greylist,found,now)) {
+        if(found->first_seen == 0) {
+            found->last_seen = now;
+            metrics->accepted++;
+            return TRUE;
+        }
+        found->last_seen = now;
+        if(gint64(now) - found->first_seen < greylist->delay) {
+            metrics->deferred++;
+            return FALSE;
+        }
+        found->first_seen = 0;
+        metrics->passed++;
+        return TRUE;
+    }
+    // The expired triplet starts over in its own slot.
+    if(!found) {
+        gboolean evicted{FALSE};
+        found = d_greylist_bucket_victim(greylist,bucket,now,&evicted);
+        if(evicted) {
+            metrics->evictions++;
+        }
+    }
+    found->fingerprint = fingerprint;
+    found->first_seen = now;
+    found->last_seen = now;
+    metrics->deferred++;
+    return FALSE;
+}
+
+gboolean d_greylist_check(
+    DGreylist* greylist,
+    GInetAddress* address,
+    const gchar* sender,
+    const gchar* recipient)
+{
+    g_return_val_if_fail(D_IS_GREYLIST(greylist),TRUE);
+    guint64 fingerprint = d_greylist_fingerprint(address,sender,recipient);
+    guint64 index = fingerprint & greylist->bucket_mask;
+    DGreylistStripe* stripe = &greylist->stripes[index & (GREYLIST_LOCKS - 1)];
+    guint32 now = d_greylist_now();
+    g_mutex_lock(&stripe->lock);
+    gboolean accepted = d_greylist_bucket_check(greylist,&greylist->buckets[index],
+        fingerprint,now,&stripe->metrics);
+    g_mutex_unlock(&stripe->lock);
+    return accepted;
+}
+
+gboolean d_greylist_save(
+    DGreylist* greylist,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_GREYLIST(greylist),FALSE);
+    if(!greylist->snapshot_path) {
+        return TRUE;
+    }
+    DGreylistSnapshotHeader header{GREYLIST_MAGIC,GREYLIST_VERSION,sizeof(DGreylistSlot),0,0,0};
+    GByteArray* data = g_byte_array_sized_new(64 * 1024);
+    g_byte_array_append(data,reinterpret_cast<const guint8*>(&header),sizeof(header));
+    guint32 now = d_greylist_now();
+    // Every stripe is locked once for all of its buckets.
+    for(guint lock = 0; lock < GREYLIST_LOCKS; lock++) {
+        DGreylistStripe* stripe = &greylist->stripes[lock];
+        g_mutex_lock(&stripe->lock);
+        for(guint64 index = lock; index <= greylist->bucket_mask; index += GREYLIST_LOCKS) {
+            for(const DGreylistSlot& slot : greylist->buckets[index].slots) {
+                if(!d_greylist_slot_expired(greylist,&slot,now)) {
+                    g_byte_array_append(data,reinterpret_cast<const guint8*>(&slot),sizeof(slot));
+                    header.count++;
+                }
+            }
+        }
+        g_mutex_unlock(&stripe->lock);
+    }
+    header.saved = now;
+    memcpy(data->data,&header,sizeof(header));
+    // The temporary file is renamed over the old snapshot.
+    gboolean saved = g_file_set_contents(greylist->snapshot_path,
+        reinterpret_cast<const gchar*>(data->data),data->len,error);
+    g_byte_array_unref(data);
+    if(saved) {
+        g_atomic_int_inc(&greylist->snapshots);
+    }
+    return saved;
+}
+
+/**
+ * @brief Read the snapshot file into the empty table.
+ * @details The missing file isn't the error, the invalid one is ignored.
+ */
+static gboolean d_greylist_load(
+    DGreylist* greylist,
+    GError** error)
+{
+    const gchar* path = greylist->snapshot_path;
+    if(!g_file_test(path,G_FILE_TEST_EXISTS)) {
+        return TRUE;
+    }
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path,FALSE,error);
+    if(!file) {
+        return FALSE;
+    }
+    gsize size = g_mapped_file_get_length(file);
+    auto data = reinterpret_cast<const guint8*>(g_mapped_file_get_contents(file));
+    DGreylistSnapshotHeader header;
+    if(size >= sizeof(header)) {
+        memcpy(&header,data,sizeof(header));
+    }
+    if(size < sizeof(header) || header.magic != GREYLIST_MAGIC || header.version != GREYLIST_VERSION ||
+       header.slot_size != sizeof(DGreylistSlot) ||
+       header.count > (size - sizeof(header)) / sizeof(DGreylistSlot)) {
+        g_warning("greylist snapshot %s is invalid, ignored",path);
+        return TRUE;
+    }
+    guint32 now = d_greylist_now();
+    for(guint64 count = 0; count < header.count; count++) {
+        DGreylistSlot slot;
+        memcpy(&slot,data + sizeof(header) + count * sizeof(slot),sizeof(slot));
+        if(d_greylist_slot_expired(greylist,&slot,now)) {
+            continue;
+        }
+        gboolean evicted{FALSE};
+        DGreylistBucket* bucket = &greylist->buckets[slot.fingerprint & greylist->bucket_mask];
+        *d_greylist_bucket_victim(greylist,bucket,now,&evicted) = slot;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Write the snapshot every interval and once more at the stop.
+ */
+static gpointer d_greylist_snapshot_thread(
+    gpointer data)
+{
+    auto greylist = D_GREYLIST(data);
+    gboolean stopping{FALSE};
+    g_mutex_lock(&greylist->snapshot_lock);
+    while(!stopping) {
+        gint64 deadline = g_get_monotonic_time() + gint64(greylist->snapshot_interval) * G_TIME_SPAN_SECOND;
+        while(!greylist->stopping &&
+              g_cond_wait_until(&greylist->snapshot_cond,&greylist->snapshot_lock,deadline)) {
+        }
+        stopping = greylist->stopping;
+        g_mutex_unlock(&greylist->snapshot_lock);
+        GError* error{NULL};
+        if(!d_greylist_save(greylist,&error)) {
+            g_warning("greylist snapshot failed: %d %s",error->code,error->message);
+            g_error_free(error);
+        }
+        g_mutex_lock(&greylist->snapshot_lock);
+    }
+    g_mutex_unlock(&greylist->snapshot_lock);
+    return NULL;
+}
+
+void d_greylist_log_metrics(
+    DGreylist* greylist)
+{
+    g_return_if_fail(D_IS_GREYLIST(greylist));
+    DGreylistMetrics metrics{};
+    guint64 used{0};
+    guint32 now = d_greylist_now();
+    for(guint lock = 0; lock < GREYLIST_LOCKS; lock++) {
+        DGreylistStripe* stripe = &greylist->stripes[lock];
+        g_mutex_lock(&stripe->lock);
+        metrics.checks += stripe->metrics.checks;
+        metrics.deferred += stripe->metrics.deferred;
+        metrics.passed += stripe->metrics.passed;
+        metrics.accepted += stripe->metrics.accepted;
+        metrics.evictions += stripe->metrics.evictions;
+        for(guint64 index = lock; index <= greylist->bucket_mask; index += GREYLIST_LOCKS) {
+            for(const DGreylistSlot& slot : greylist->buckets[index].slots) {
+                used += !d_greylist_slot_expired(greylist,&slot,now);
+            }
+        }
+        g_mutex_unlock(&stripe->lock);
+    }
+    g_message("greylist: %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " triplets, checks %" G_GUINT64_FORMAT
+        ", deferred %" G_GUINT64_FORMAT ", passed %" G_GUINT64_FORMAT ", accepted %" G_GUINT64_FORMAT
+        ", evictions %" G_GUINT64_FORMAT ", snapshots %d",
+        used,(greylist->bucket_mask + 1) * GREYLIST_BUCKET_SLOTS,metrics.checks,metrics.deferred,
+        metrics.passed,metrics.accepted,metrics.evictions,g_atomic_int_get(&greylist->snapshots));
+}
+
+void d_greylist_set_default(
+    DGreylist* greylist)
+{
+    G_LOCK(greylist_default);
+    g_set_object(&greylist_default,greylist);
+    G_UNLOCK(greylist_default);
+}
+
+DGreylist* d_greylist_get_default()
+{
+    G_LOCK(greylist_default);
+    DGreylist* greylist = greylist_default ? D_GREYLIST(g_object_ref(greylist_default)) : NULL;
+    G_UNLOCK(greylist_default);
+    return greylist;
+}
+
+static void d_greylist_init(DGreylist* greylist)
+{
+    for(DGreylistStripe& stripe : greylist->stripes) {
+        g_mutex_init(&stripe.lock);
+    }
+    g_mutex_init(&greylist->snapshot_lock);
+    g_cond_init(&greylist->snapshot_cond);
+}
+
+static void d_greylist_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_GREYLIST(object));
+    auto greylist = D_GREYLIST(object);
+    if(greylist->snapshot_thread) {
+        // The thread writes the last snapshot before the exit.
+        g_mutex_lock(&greylist->snapshot_lock);
+        greylist->stopping = TRUE;
+        g_cond_signal(&greylist->snapshot_cond);
+        g_mutex_unlock(&greylist->snapshot_lock);
+        g_thread_join(greylist->snapshot_thread);
+    }
+    g_free(greylist->buckets);
+    g_free(greylist->snapshot_path);
+    for(DGreylistStripe& stripe : greylist->stripes) {
+        g_mutex_clear(&stripe.lock);
+    }
+    g_mutex_clear(&greylist->snapshot_lock);
+    g_cond_clear(&greylist->snapshot_cond);
+    G_OBJECT_CLASS(d_greylist_parent_class)->finalize(object);
+}
+
+static void d_greylist_class_init(DGreylistClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_greylist_finalize;
+}
+
+/**
+ * @brief Create new instance of the greylist.
+ */
+DGreylist* d_greylist_new(
+    guint max_entries,
+    guint delay,
+    guint retry_window,
+    guint pass_ttl,
+    const gchar* snapshot_path,
+    guint snapshot_interval,
+    GError** error)
+{
+    g_autoptr(DGreylist) greylist = reinterpret_cast<DGreylist*>(
+        g_object_new(
+            D_TYPE_GREYLIST,
+            NULL));
+
+    guint64 buckets{1};
+    while(buckets * GREYLIST_BUCKET_SLOTS < max_entries) {
+        buckets <<= 1;
+    }
+    greylist->buckets = g_new0(DGreylistBucket,buckets);
+    greylist->bucket_mask = buckets - 1;
+    greylist->delay = delay;
+    greylist->retry_window = retry_window;
+    greylist->pass_ttl = pass_ttl;
+    if(snapshot_path) {
+        greylist->snapshot_path = g_strdup(snapshot_path);
+        greylist->snapshot_interval = MAX(snapshot_interval,1u);
+        if(!d_greylist_load(greylist,error)) {
+            return NULL;
+        }
+        greylist->snapshot_thread = g_thread_new("greylist-snapshot",d_greylist_snapshot_thread,greylist);
+    }
+
+    return D_GREYLIST(g_steal_pointer(&greylist));
+}
+
+}
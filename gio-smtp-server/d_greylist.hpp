@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__GREYLIST__HPP__
+#define __D__NEW__GREYLIST__HPP__
+/**
+ * @brief Greylisting of the (client network, sender, recipient) triplets.
+ * @details The triplet is kept as the 64-bit fingerprint of the client
+ * /24 (IPv6 /64) network and the lower case sender and recipient, with
+ * the first and the last seen times. The table is allocated once: the
+ * fingerprint selects the bucket of four slots, the new triplet takes
+ * the free or the expired slot of its bucket or evicts the least recently
+ * seen one. The buckets are guarded by the striped locks, so the workers
+ * check the recipients concurrently.
+ * The first delivery attempt of the triplet is deferred, the retry after
+ * the delay and within the retry window passes the triplet, the passed
+ * triplet is accepted until it isn't seen for the pass TTL.
+ * The used slots are written to the snapshot file by the snapshot thread
+ * periodically and when the greylist is destroyed, the file is replaced
+ * by the atomic rename. The snapshot is loaded by the constructor.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+#define D_TYPE_GREYLIST (d_greylist_get_type())
+
+G_DECLARE_FINAL_TYPE(DGreylist,d_greylist,D,GREYLIST,GObject)
+
+/**
+ * @brief Check the recipient of the delivery attempt.
+ * @details Function can be called from any thread.
+ * @param [in] address The client address.
+ * @param [in] sender The MAIL FROM path, empty for the null sender.
+ * @param [in] recipient The RCPT TO path.
+ * @return TRUE if the recipient is accepted, FALSE if it's deferred.
+ */
+gboolean d_greylist_check(
+    DGreylist* greylist,
+    GInetAddress* address,
+    const gchar* sender,
+    const gchar* recipient);
+
+/**
+ * @brief Write the used slots to the snapshot file.
+ * @details The buckets are copied one by one under their locks, the
+ * checks aren't stopped. Function does nothing if the greylist has no
+ * snapshot file.
+ * @return In case of success function returns TRUE.
+ */
+gboolean d_greylist_save(
+    DGreylist* greylist,
+    GError** error);
+
+/**
+ * @brief Write the check counters and the table usage to the log.
+ */
+void d_greylist_log_metrics(
+    DGreylist* greylist);
+
+/**
+ * @brief Set the process wide greylist used by the connections.
+ * @param [in] greylist The greylist or NULL to disable the greylisting.
+ */
+void d_greylist_set_default(
+    DGreylist* greylist);
+
+/**
+ * @brief Get the process wide greylist.
+ * @return The new reference or NULL if the greylisting is disabled.
+ */
+DGreylist* d_greylist_get_default();
+
+/**
+ * @brief Create new instance of the greylist.
+ * @details The snapshot file is loaded if exists, the expired triplets
+ * are skipped.
+ * @param [in] max_entries The number of the triplets kept, rounded up to
+ * the whole buckets of the power of 2.
+ * @param [in] delay The time in seconds the retry is deferred for.
+ * @param [in] retry_window The time in seconds since the first attempt
+ * the retry passes the triplet within.
+ * @param [in] pass_ttl The time in seconds the passed triplet is kept since
+ * it's seen last time.
+ * @param [in] snapshot_path The snapshot file or NULL.
+ * @param [in] snapshot_interval The time in seconds between the snapshots.
+ * @param [out] error The location for error or NULL.
+ * @return The greylist or NULL if the snapshot file can't be read.
+ */
+DGreylist* d_greylist_new(
+    guint max_entries,
+    guint delay,
+    guint retry_window,
+    guint pass_ttl,
+    const gchar* snapshot_path,
+    guint snapshot_interval,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__GREYLIST__HPP__
@@ -0,0 +1,526 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_loop_watchdog.hpp"
+#include "d_smtp_probes.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define D_LOOP_WATCHDOG_BACKTRACE 1
+#endif
+#endif
+
+/// @brief The number of log2 histogram buckets in microseconds.
+#define LOOP_WATCHDOG_BUCKETS 32
+/// @brief The maximum depth of the stack sample.
+#define LOOP_WATCHDOG_MAX_FRAMES 64
+/// @brief The monitor thread check period in microseconds.
+#define LOOP_WATCHDOG_MONITOR_PERIOD (50 * G_TIME_SPAN_MILLISECOND)
+/// @brief The time the monitor waits for the stack sample in microseconds.
+#define LOOP_WATCHDOG_SAMPLE_WAIT (50 * G_TIME_SPAN_MILLISECOND)
+/// @brief The signal used to take the stack sample, ignored by default.
+#define LOOP_WATCHDOG_SIGNAL SIGURG
+
+extern "C" {
+
+struct DLoopWatchdogHistogram
+{
+    /// @brief Bucket N counts values below 2^N microseconds.
+    guint64 buckets[LOOP_WATCHDOG_BUCKETS];
+    guint64 count;
+    gint64 max;
+};
+
+struct DLoopWatchdogSource
+{
+    GSource source;
+    /// @brief The watchdog destroys the source before it is freed.
+    DLoopWatchdog* watchdog;
+};
+
+/**
+ * @brief The stack sample taken by the signal handler in the loop thread.
+ * @details Only the monitor thread requests samples, so one is enough.
+ */
+struct DLoopWatchdogSample
+{
+    /// @brief The request flag, the handler and the monitor race for it.
+    gint pending;
+    gint done;
+    gint depth;
+    gpointer frames[LOOP_WATCHDOG_MAX_FRAMES];
+    gchar source[64];
+};
+
+struct _DLoopWatchdog
+{
+    GObject parent;
+
+    gchar* name;
+    GMainContext* context;
+    GSource* source;
+    /// @brief The tick interval in microseconds.
+    gint64 interval;
+    /// @brief The stall threshold in microseconds, accessed atomically.
+    gint64 threshold;
+    /// @brief The time of the next tick, accessed only from the loop thread.
+    gint64 next_tick;
+    /// @brief The time the loop left poll, 0 while it polls. Accessed atomically.
+    gint64 dispatch_start;
+    /// @brief The loop thread, valid once has_thread is set.
+    pthread_t thread;
+    gint has_thread;
+    /// @brief The last reported stall, accessed only from the monitor thread.
+    gint64 reported;
+    /// @brief The dispatch time since the last tick, accessed only from the loop thread.
+    gint64 busy;
+    /// @brief The time of the last tick, accessed only from the loop thread.
+    gint64 last_tick;
+    /// @brief The smoothed busy share in permille, accessed atomically.
+    gint load;
+    /// @brief The watchdog is registered in the monitor.
+    gboolean started;
+
+    GMutex lock;
+    DLoopWatchdogHistogram lag;
+    DLoopWatchdogHistogram dispatch;
+    guint stalls;
+};
+typedef _DLoopWatchdog DLoopWatchdog;
+
+G_DEFINE_TYPE(DLoopWatchdog,d_loop_watchdog,G_TYPE_OBJECT)
+
+struct _DLoopWatchdogClass
+{
+    GObjectClass parent;
+};
+
+/// @brief The monitor lock protects the watchdogs list and the thread.
+static GMutex loop_watchdog_lock;
+static GCond loop_watchdog_cond;
+static GPtrArray* loop_watchdogs{nullptr};
+static GThread* loop_watchdog_thread{nullptr};
+static DLoopWatchdogSample loop_watchdog_sample;
+
+static void loop_watchdog_histogram_add(
+    DLoopWatchdogHistogram* histogram,
+    gint64 value)
+{
+    value = MAX(value,0);
+    guint bucket = MIN(g_bit_storage(gulong(value)),LOOP_WATCHDOG_BUCKETS - 1);
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->max = MAX(histogram->max,value);
+}
+
+/**
+ * @brief Get the upper bound of the bucket which holds the percentile.
+ */
+static gint64 loop_watchdog_histogram_percentile(
+    const DLoopWatchdogHistogram* histogram,
+    gdouble percentile)
+{
+    guint64 rank = guint64(percentile * histogram->count / 100.0);
+    guint64 sum{0};
+    for(guint bucket = 0; bucket < LOOP_WATCHDOG_BUCKETS; bucket++) {
+        sum += histogram->buckets[bucket];
+        if(sum > rank) {
+            return MIN(gint64(1) << bucket,histogram->max);
+        }
+    }
+    return histogram->max;
+}
+
+static gchar* loop_watchdog_histogram_to_string(
+    const DLoopWatchdogHistogram* histogram)
+{
+    GString* string = g_string_new(NULL);
+    for(guint bucket = 0; bucket < LOOP_WATCHDOG_BUCKETS; bucket++) {
+        if(histogram->buckets[bucket]) {
+            g_string_append_printf(string," <%" G_GINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                gint64(1) << bucket,histogram->buckets[bucket]);
+        }
+    }
+    return g_string_free(string,FALSE);
+}
+
+static gboolean d_loop_watchdog_source_prepare(
+    GSource* source,
+    gint* timeout)
+{
+    auto watchdog = reinterpret_cast<DLoopWatchdogSource*>(source)->watchdog;
+    gint64 now = g_get_monotonic_time();
+    // The loop is back to poll, all callbacks of the iteration are done.
+    gint64 start = __atomic_exchange_n(&watchdog->dispatch_start,0,__ATOMIC_ACQ_REL);
+    if(start) {
+        watchdog->busy += now - start;
+        g_mutex_lock(&watchdog->lock);
+        loop_watchdog_histogram_add(&watchdog->dispatch,now - start);
+        g_mutex_unlock(&watchdog->lock);
+    }
+    if(now >= watchdog->next_tick) {
+        *timeout = 0;
+        return TRUE;
+    }
+    *timeout = gint((watchdog->next_tick - now + G_TIME_SPAN_MILLISECOND - 1) / G_TIME_SPAN_MILLISECOND);
+    return FALSE;
+}
+
+static gboolean d_loop_watchdog_source_check(
+    GSource* source)
+{
+    auto watchdog = reinterpret_cast<DLoopWatchdogSource*>(source)->watchdog;
+    if(!g_atomic_int_get(&watchdog->has_thread)) {
+        watchdog->thread = pthread_self();
+        // Create the thread dispatch state, so the signal handler doesn't allocate.
+        g_main_current_source();
+        g_atomic_int_set(&watchdog->has_thread,TRUE);
+    }
+    gint64 now = g_get_monotonic_time();
+    __atomic_store_n(&watchdog->dispatch_start,now,__ATOMIC_RELEASE);
+    return now >= watchdog->next_tick;
+}
+
+static gboolean d_loop_watchdog_source_dispatch(
+    GSource* source,
+    GSourceFunc callback,
+    gpointer user_data)
+{
+    auto watchdog = reinterpret_cast<DLoopWatchdogSource*>(source)->watchdog;
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&watchdog->lock);
+    loop_watchdog_histogram_add(&watchdog->lag,now - watchdog->next_tick);
+    g_mutex_unlock(&watchdog->lock);
+    gint64 elapsed = now - watchdog->last_tick;
+    if(elapsed > 0) {
+        gint sample = gint(MIN(watchdog->busy * 1000 / elapsed,1000));
+        // Smooth the load over about four ticks.
+        g_atomic_int_set(&watchdog->load,(g_atomic_int_get(&watchdog->load) * 3 + sample) / 4);
+    }
+    watchdog->busy = 0;
+    watchdog->last_tick = now;
+    watchdog->next_tick += watchdog->interval;
+    if(watchdog->next_tick <= now) {
+        // The ticks missed by the stalled loop are not replayed.
+        watchdog->next_tick = now + watchdog->interval;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs d_loop_watchdog_source_funcs =
+{
+    d_loop_watchdog_source_prepare,
+    d_loop_watchdog_source_check,
+    d_loop_watchdog_source_dispatch,
+    NULL
+};
+
+/**
+ * @brief Take the stack sample of the interrupted loop thread.
+ * @details Only async signal safe calls here, the backtrace is loaded
+ * before the handler is installed.
+ */
+static void loop_watchdog_signal_handler(int signal_number)
+{
+    auto sample = &loop_watchdog_sample;
+    if(!__atomic_exchange_n(&sample->pending,0,__ATOMIC_ACQ_REL)) {
+        return;
+    }
+    int saved_errno = errno;
+    GSource* source = g_main_current_source();
+    const gchar* name = source ? g_source_get_name(source) : NULL;
+    gsize length{0};
+    for(; name && name[length] && length < sizeof(sample->source) - 1; length++) {
+        sample->source[length] = name[length];
+    }
+    sample->source[length] = '\0';
+#ifdef D_LOOP_WATCHDOG_BACKTRACE
+    sample->depth = backtrace(sample->frames,LOOP_WATCHDOG_MAX_FRAMES);
+#endif
+    errno = saved_errno;
+    __atomic_store_n(&sample->done,1,__ATOMIC_RELEASE);
+}
+
+static void loop_watchdog_install_handler()
+{
+    static gsize installed = 0;
+    if(g_once_init_enter(&installed)) {
+#ifdef D_LOOP_WATCHDOG_BACKTRACE
+        // The first call loads the unwinder library, it must not happen in the handler.
+        gpointer frame;
+        backtrace(&frame,1);
+#endif
+        struct sigaction action;
+        memset(&action,0,sizeof(action));
+        action.sa_handler = loop_watchdog_signal_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if(sigaction(LOOP_WATCHDOG_SIGNAL,&action,NULL) < 0) {
+            int e = errno;
+            g_warning("loop watchdog: signal handler install failed: %d %s",e,g_strerror(e));
+        }
+        g_once_init_leave(&installed,1);
+    }
+}
+
+/**
+ * @brief Interrupt the loop thread and wait for the stack sample.
+ * @return Function returns FALSE if the sample isn't taken.
+ */
+static gboolean loop_watchdog_take_sample(DLoopWatchdog* watchdog)
+{
+    auto sample = &loop_watchdog_sample;
+    if(!g_atomic_int_get(&watchdog->has_thread)) {
+        return FALSE;
+    }
+    sample->depth = 0;
+    sample->source[0] = '\0';
+    __atomic_store_n(&sample->done,0,__ATOMIC_RELEASE);
+    __atomic_store_n(&sample->pending,1,__ATOMIC_RELEASE);
+    if(pthread_kill(watchdog->thread,LOOP_WATCHDOG_SIGNAL) != 0) {
+        __atomic_store_n(&sample->pending,0,__ATOMIC_RELEASE);
+        return FALSE;
+    }
+    for(gint64 waited = 0; !__atomic_load_n(&sample->done,__ATOMIC_ACQUIRE) &&
+            waited < LOOP_WATCHDOG_SAMPLE_WAIT; waited += G_TIME_SPAN_MILLISECOND) {
+        g_usleep(G_TIME_SPAN_MILLISECOND);
+    }
+    if(__atomic_exchange_n(&sample->pending,0,__ATOMIC_ACQ_REL)) {
+        // The handler didn't run, the request is cancelled.
+        return FALSE;
+    }
+    // The handler took the request, it finishes shortly.
+    while(!__atomic_load_n(&sample->done,__ATOMIC_ACQUIRE)) {
+        g_usleep(100);
+    }
+    return TRUE;
+}
+
+static void loop_watchdog_report_stall(
+    DLoopWatchdog* watchdog,
+    gint64 stalled)
+{
+    auto sample = &loop_watchdog_sample;
+    D_SMTP_PROBE2(loop_stall,watchdog->name,stalled);
+    if(!loop_watchdog_take_sample(watchdog)) {
+        g_warning("loop watchdog %s: stalled for %" G_GINT64_FORMAT " ms, no stack sample",
+            watchdog->name,stalled / G_TIME_SPAN_MILLISECOND);
+        return;
+    }
+    GString* stack = g_string_new(NULL);
+#ifdef D_LOOP_WATCHDOG_BACKTRACE
+    gchar** symbols = backtrace_symbols(sample->frames,sample->depth);
+    for(gint frame = 0; symbols && frame < sample->depth; frame++) {
+        g_string_append_printf(stack,"\n  #%d %s",frame,symbols[frame]);
+    }
+    free(symbols);
+#endif
+    g_warning("loop watchdog %s: stalled for %" G_GINT64_FORMAT " ms in source \"%s\"%s",
+        watchdog->name,stalled / G_TIME_SPAN_MILLISECOND,
+        sample->source[0] ? sample->source : "unnamed",stack->str);
+    g_string_free(stack,TRUE);
+}
+
+static void loop_watchdog_check(
+    DLoopWatchdog* watchdog,
+    gint64 now)
+{
+    gint64 threshold = __atomic_load_n(&watchdog->threshold,__ATOMIC_RELAXED);
+    gint64 start = __atomic_load_n(&watchdog->dispatch_start,__ATOMIC_ACQUIRE);
+    // Every stalled iteration is reported once.
+    if(!threshold || !start || start == watchdog->reported || now - start < threshold) {
+        return;
+    }
+    watchdog->reported = start;
+    g_mutex_lock(&watchdog->lock);
+    watchdog->stalls++;
+    g_mutex_unlock(&watchdog->lock);
+    loop_watchdog_report_stall(watchdog,now - start);
+}
+
+static gpointer loop_watchdog_monitor(gpointer user_data)
+{
+    g_mutex_lock(&loop_watchdog_lock);
+    // The thread runs until the last watchdog clears the thread pointer.
+    while(loop_watchdog_thread == g_thread_self()) {
+        gint64 now = g_get_monotonic_time();
+        for(guint index = 0; index < loop_watchdogs->len; index++) {
+            loop_watchdog_check(D_LOOP_WATCHDOG(g_ptr_array_index(loop_watchdogs,index)),now);
+        }
+        g_cond_wait_until(&loop_watchdog_cond,&loop_watchdog_lock,
+            g_get_monotonic_time() + LOOP_WATCHDOG_MONITOR_PERIOD);
+    }
+    g_mutex_unlock(&loop_watchdog_lock);
+    return NULL;
+}
+
+static void loop_watchdog_register(DLoopWatchdog* watchdog)
+{
+    loop_watchdog_install_handler();
+    g_mutex_lock(&loop_watchdog_lock);
+    if(!loop_watchdogs) {
+        loop_watchdogs = g_ptr_array_new();
+    }
+    g_ptr_array_add(loop_watchdogs,watchdog);
+    if(!loop_watchdog_thread) {
+        loop_watchdog_thread = g_thread_new("loop-watchdog",loop_watchdog_monitor,NULL);
+    }
+    g_mutex_unlock(&loop_watchdog_lock);
+}
+
+static void loop_watchdog_unregister(DLoopWatchdog* watchdog)
+{
+    GThread* thread{nullptr};
+    g_mutex_lock(&loop_watchdog_lock);
+    g_ptr_array_remove_fast(loop_watchdogs,watchdog);
+    if(loop_watchdogs->len == 0) {
+        thread = loop_watchdog_thread;
+        loop_watchdog_thread = nullptr;
+        g_cond_broadcast(&loop_watchdog_cond);
+    }
+    g_mutex_unlock(&loop_watchdog_lock);
+    if(thread) {
+        g_thread_join(thread);
+    }
+}
+
+void d_loop_watchdog_set_threshold(
+    DLoopWatchdog* watchdog,
+    guint threshold)
+{
+    g_return_if_fail(D_IS_LOOP_WATCHDOG(watchdog));
+    __atomic_store_n(&watchdog->threshold,gint64(threshold) * G_TIME_SPAN_MILLISECOND,__ATOMIC_RELAXED);
+}
+
+guint d_loop_watchdog_get_load(
+    DLoopWatchdog* watchdog)
+{
+    g_return_val_if_fail(D_IS_LOOP_WATCHDOG(watchdog),0);
+    return g_atomic_int_get(&watchdog->load);
+}
+
+void d_loop_watchdog_stop(
+    DLoopWatchdog* watchdog)
+{
+    g_return_if_fail(D_IS_LOOP_WATCHDOG(watchdog));
+    if(!watchdog->started) {
+        return;
+    }
+    watchdog->started = FALSE;
+    // The monitor doesn't touch the watchdog after unregister.
+    loop_watchdog_unregister(watchdog);
+    g_source_destroy(watchdog->source);
+    g_clear_pointer(&watchdog->source,g_source_unref);
+}
+
+void d_loop_watchdog_log_metrics(
+    DLoopWatchdog* watchdog)
+{
+    g_return_if_fail(D_IS_LOOP_WATCHDOG(watchdog));
+    g_mutex_lock(&watchdog->lock);
+    DLoopWatchdogHistogram lag = watchdog->lag;
+    DLoopWatchdogHistogram dispatch = watchdog->dispatch;
+    guint stalls = watchdog->stalls;
+    g_mutex_unlock(&watchdog->lock);
+    g_message("loop watchdog %s: lag ticks %" G_GUINT64_FORMAT
+        " p50 %" G_GINT64_FORMAT " p99 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT " us,"
+        " dispatch %" G_GUINT64_FORMAT
+        " p50 %" G_GINT64_FORMAT " p99 %" G_GINT64_FORMAT " max %" G_GINT64_FORMAT " us,"
+        " stalls %u",
+        watchdog->name,
+        lag.count,loop_watchdog_histogram_percentile(&lag,50),
+        loop_watchdog_histogram_percentile(&lag,99),lag.max,
+        dispatch.count,loop_watchdog_histogram_percentile(&dispatch,50),
+        loop_watchdog_histogram_percentile(&dispatch,99),dispatch.max,
+        stalls);
+    g_autofree gchar* lag_string = loop_watchdog_histogram_to_string(&lag);
+    g_autofree gchar* dispatch_string = loop_watchdog_histogram_to_string(&dispatch);
+    g_message("loop watchdog %s: lag histogram us%s",watchdog->name,lag_string);
+    g_message("loop watchdog %s: dispatch histogram us%s",watchdog->name,dispatch_string);
+}
+
+void d_loop_watchdog_log_all_metrics()
+{
+    // Watchdogs are removed from the list in finalize, the lock keeps them alive.
+    g_mutex_lock(&loop_watchdog_lock);
+    for(guint index = 0; loop_watchdogs && index < loop_watchdogs->len; index++) {
+        d_loop_watchdog_log_metrics(D_LOOP_WATCHDOG(g_ptr_array_index(loop_watchdogs,index)));
+    }
+    g_mutex_unlock(&loop_watchdog_lock);
+}
+
+static void d_loop_watchdog_init(DLoopWatchdog* watchdog)
+{
+    g_mutex_init(&watchdog->lock);
+}
+
+static void d_loop_watchdog_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_LOOP_WATCHDOG(object));
+    auto watchdog = D_LOOP_WATCHDOG(object);
+    d_loop_watchdog_stop(watchdog);
+    g_clear_pointer(&watchdog->context,g_main_context_unref);
+    g_free(watchdog->name);
+    g_mutex_clear(&watchdog->lock);
+    G_OBJECT_CLASS(d_loop_watchdog_parent_class)->finalize(object);
+}
+
+static void d_loop_watchdog_class_init(DLoopWatchdogClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_loop_watchdog_finalize;
+}
+
+/**
+ * @brief Create new instance of the main loop watchdog.
+ */
+DLoopWatchdog* d_loop_watchdog_new(
+    GMainContext* context,
+    const gchar* name,
+    guint interval,
+    guint threshold)
+{
+    auto watchdog = reinterpret_cast<DLoopWatchdog*>(
+        g_object_new(
+            D_TYPE_LOOP_WATCHDOG,
+            NULL));
+
+    watchdog->name = g_strdup(name);
+    watchdog->context = g_main_context_ref(context);
+    watchdog->interval = gint64(MAX(interval,1u)) * G_TIME_SPAN_MILLISECOND;
+    watchdog->threshold = gint64(threshold) * G_TIME_SPAN_MILLISECOND;
+    watchdog->last_tick = g_get_monotonic_time();
+    watchdog->next_tick = watchdog->last_tick + watchdog->interval;
+    watchdog->started = TRUE;
+    loop_watchdog_register(watchdog);
+
+    watchdog->source = g_source_new(&d_loop_watchdog_source_funcs,sizeof(DLoopWatchdogSource));
+    reinterpret_cast<DLoopWatchdogSource*>(watchdog->source)->watchdog = watchdog;
+    // The source must be prepared and checked before all others of the context.
+    g_source_set_priority(watchdog->source,G_MININT);
+    g_source_set_name(watchdog->source,"loop watchdog");
+    g_source_attach(watchdog->source,context);
+
+    return watchdog;
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__LOOP_WATCHDOG__HPP__
+#define __D__NEW__LOOP_WATCHDOG__HPP__
+/**
+ * @brief Main loop lag watchdog and stall profiler.
+ * @details The watchdog attaches the highest priority source to the main
+ * context. The source is prepared before and checked after every poll, so
+ * it sees the time the loop spends dispatching the callbacks of one
+ * iteration. The source also ticks with the fixed interval, the tick
+ * lateness is the dispatch lag seen by all other sources of the context.
+ * Both values are collected into the log2 histograms.
+ *
+ * The shared monitor thread checks all watchdogs. If the loop doesn't
+ * return to poll for the stall threshold, the monitor interrupts the loop
+ * thread with a signal and logs the name of the current source with the
+ * stack sample of the blocked callback.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+#define D_TYPE_LOOP_WATCHDOG (d_loop_watchdog_get_type())
+
+G_DECLARE_FINAL_TYPE(DLoopWatchdog,d_loop_watchdog,D,LOOP_WATCHDOG,GObject)
+
+/**
+ * @brief Set the stall threshold.
+ * @details Function can be called from any thread.
+ * @param [in] threshold The stall threshold in milliseconds, 0 disables
+ * the stall reports, the histograms are still collected.
+ */
+void d_loop_watchdog_set_threshold(
+    DLoopWatchdog* watchdog,
+    guint threshold);
+
+/**
+ * @brief Get the share of time the loop spends in the callbacks.
+ * @details The value is smoothed over the last ticks. Function can be
+ * called from any thread.
+ * @return The load in permille.
+ */
+guint d_loop_watchdog_get_load(
+    DLoopWatchdog* watchdog);
+
+/**
+ * @brief Remove the watchdog source and stop the stall reports.
+ * @details Function must be called from the loop thread or when the loop
+ * doesn't run. The metrics and the last load stay available.
+ */
+void d_loop_watchdog_stop(
+    DLoopWatchdog* watchdog);
+
+/**
+ * @brief Write the lag and dispatch histograms to the log.
+ */
+void d_loop_watchdog_log_metrics(
+    DLoopWatchdog* watchdog);
+
+/**
+ * @brief Write the metrics of every existing watchdog to the log.
+ */
+void d_loop_watchdog_log_all_metrics();
+
+/**
+ * @brief Create new instance of the main loop watchdog.
+ * @details The watchdog source is removed from the context by
+ * d_loop_watchdog_stop or when the watchdog is destroyed.
+ * @param [in] context The watched main context.
+ * @param [in] name The name used in the log, usually the thread name.
+ * @param [in] interval The tick interval in milliseconds.
+ * @param [in] threshold The stall threshold in milliseconds, 0 disables
+ * the stall reports.
+ */
+DLoopWatchdog* d_loop_watchdog_new(
+    GMainContext* context,
+    const gchar* name,
+    guint interval,
+    guint threshold);
+
+}
+
+#endif //#ifndef __D__NEW__LOOP_WATCHDOG__HPP__
@@ -14,6 +14,7 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "d_smtp_command.hpp"
+#include "d_smtp_probes.hpp"
 
 #define CRLF "\r\n"
 
@@ -25,6 +26,10 @@ struct _DSmtpCommand
 
     SMTP_COMMAND command;
     guint response_code;
+    /// @brief The MAIL FROM or RCPT TO path.
+    gchar* path;
+    /// @brief The HELO or EHLO domain.
+    gchar* domain;
 
     GBytes* command_bytes;    
 };
@@ -104,13 +109,17 @@ static gboolean d_smtp_command_process_command_helo(
 {
     gsize count{0};
     auto line = reinterpret_cast<const gchar*>(g_bytes_get_data(smtp_command->command_bytes,&count));
-    auto end = strstr(line,CRLF);
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
     const gchar* p = line + 4;
     for(; *p == ' '; p++);
     gsize l = end - p;
     auto str = g_string_new_len(p,end-p);
-    g_autofree gchar* domain = g_string_free(str,FALSE);
+    gchar* domain = g_string_free(str,FALSE);
     g_message("HELO from \"%s\"",domain);
+    smtp_command->domain = domain;
     smtp_command->command = SMTP_COMMAND_HELO;
     smtp_command->response_code = 250;
     return TRUE;
@@ -121,8 +130,22 @@ static gboolean d_smtp_command_process_command_ehlo(
     SMTP_COMMAND command)
 {
     gsize count{0};
-    reinterpret_cast<const gchar*>(g_bytes_get_data(smtp_command->command_bytes,&count));
-    return FALSE;
+    auto line = reinterpret_cast<const gchar*>(g_bytes_get_data(smtp_command->command_bytes,&count));
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
+    const gchar* p = line + 4;
+    for(; *p == ' '; p++);
+    if(p >= end) {
+        return FALSE;
+    }
+    gchar* domain = g_strndup(p,end-p);
+    g_message("EHLO from \"%s\"",domain);
+    smtp_command->domain = domain;
+    smtp_command->command = SMTP_COMMAND_EHLO;
+    smtp_command->response_code = 250;
+    return TRUE;
 }
 
 static gboolean d_smtp_command_process_command_mail(
@@ -132,7 +155,10 @@ static gboolean d_smtp_command_process_command_mail(
     gsize count{0};
     auto line = reinterpret_cast<const gchar *>(
         g_bytes_get_data(smtp_command->command_bytes, &count));
-    auto end = strstr(line,CRLF);
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
     const gchar* begin = line;
 
     gchar* token{nullptr};
@@ -146,7 +172,7 @@ static gboolean d_smtp_command_process_command_mail(
         smtp_command->command = SMTP_COMMAND_MAIL;
         smtp_command->response_code = 250;
         g_message("mail from token \"%s\"",token);
-        g_free(token);
+        smtp_command->path = token;
         return TRUE;
     }
     return FALSE;
@@ -159,7 +185,10 @@ static gboolean d_smtp_command_process_command_rcpt(
     gsize count{0};
     auto line = reinterpret_cast<const gchar *>(
         g_bytes_get_data(smtp_command->command_bytes, &count));
-    auto end = strstr(line,CRLF);
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
     const gchar* begin = line;
 
     gchar* token{nullptr};
@@ -172,8 +201,8 @@ static gboolean d_smtp_command_process_command_rcpt(
     if(begin) {
         smtp_command->command = SMTP_COMMAND_RCPT;
         smtp_command->response_code = 250;
-        g_message("mail from token \"%s\"",token);
-        g_free(token);
+        g_message("rcpt to token \"%s\"",token);
+        smtp_command->path = token;
         return TRUE;
     }
     return FALSE;
@@ -186,7 +215,10 @@ static gboolean d_smtp_command_process_command_data(
     gsize count{0};
     auto line = reinterpret_cast<const gchar *>(
         g_bytes_get_data(smtp_command->command_bytes, &count));
-    auto end = strstr(line,CRLF);
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
     const gchar* begin = line;
 
     gchar* token{nullptr};
@@ -206,7 +238,10 @@ static gboolean d_smtp_command_process_command_quit(
     gsize count{0};
     auto line = reinterpret_cast<const gchar *>(
         g_bytes_get_data(smtp_command->command_bytes, &count));
-    auto end = strstr(line,CRLF);
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
     const gchar* begin = line;
 
     gchar* token{nullptr};
@@ -218,6 +253,73 @@ static gboolean d_smtp_command_process_command_quit(
     }
     return FALSE;
 }
+static gboolean d_smtp_command_process_command_starttls(
+    DSmtpCommand* smtp_command,
+    SMTP_COMMAND command)
+{
+    gsize count{0};
+    auto line = reinterpret_cast<const gchar *>(
+        g_bytes_get_data(smtp_command->command_bytes, &count));
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
+    const gchar* begin = line;
+
+    begin = eat_tok(begin,end,"STARTTLS");
+    // STARTTLS has no parameters.
+    if(begin && begin == end) {
+        smtp_command->command = SMTP_COMMAND_STARTTLS;
+        smtp_command->response_code = 220;
+        return TRUE;
+    }
+    return FALSE;
+}
+static gboolean d_smtp_command_process_command_rset(
+    DSmtpCommand* smtp_command,
+    SMTP_COMMAND command)
+{
+    gsize count{0};
+    auto line = reinterpret_cast<const gchar *>(
+        g_bytes_get_data(smtp_command->command_bytes, &count));
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
+    const gchar* begin = line;
+
+    begin = eat_tok(begin,end,"RSET");
+    // RSET has no parameters.
+    if(begin && begin == end) {
+        smtp_command->command = SMTP_COMMAND_RSET;
+        smtp_command->response_code = 250;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean d_smtp_command_process_command_noop(
+    DSmtpCommand* smtp_command,
+    SMTP_COMMAND command)
+{
+    gsize count{0};
+    auto line = reinterpret_cast<const gchar *>(
+        g_bytes_get_data(smtp_command->command_bytes, &count));
+    auto end = g_strstr_len(line,count,CRLF);
+    if(!end) {
+        return FALSE;
+    }
+    const gchar* begin = line;
+
+    // The NOOP parameter string is ignored.
+    begin = eat_tok(begin,end,"NOOP");
+    if(begin && (begin == end || *begin == ' ')) {
+        smtp_command->command = SMTP_COMMAND_NOOP;
+        smtp_command->response_code = 250;
+        return TRUE;
+    }
+    return FALSE;
+}
 /**
  * @brief SMTP command process command.
  */
@@ -238,6 +340,15 @@ static gboolean d_smtp_command_process_command(
         return d_smtp_command_process_command_data(smtp_command,command);
     case SMTP_COMMAND_QUIT:
         return d_smtp_command_process_command_quit(smtp_command,command);
+    case SMTP_COMMAND_STARTTLS:
+        return d_smtp_command_process_command_starttls(smtp_command,command);
+    case SMTP_COMMAND_RSET:
+        return d_smtp_command_process_command_rset(smtp_command,command);
+    case SMTP_COMMAND_NOOP:
+        return d_smtp_command_process_command_noop(smtp_command,command);
+    case SMTP_COMMAND_UNKNOWN:
+    case NR_SMTP_COMMANDS:
+        break;
     }
     return FALSE;
 }
@@ -265,8 +376,14 @@ gboolean d_smtp_command_process(
         g_bytes_get_data(smtp_command->command_bytes, &count));
     g_message("PROCESSING: [%.*s]",(int)count,buffer);
     // Test for minimal and maximum command length requirements.
-    if(count < 4 || count > 1024) {
-        g_warning("command length less than four or more than 1024 symbols");
+    if(count < 4 || count > SMTP_COMMAND_MAX_LENGTH) {
+        g_warning("command length less than four or more than %d symbols",SMTP_COMMAND_MAX_LENGTH);
+        return FALSE;
+    }
+    // The command is the one line, the parsers scan it up to the CRLF.
+    auto line_end = g_strstr_len(buffer,count,CRLF);
+    if(!line_end || line_end + strlen(CRLF) != buffer + count) {
+        g_warning("command line doesn't end by CRLF");
         return FALSE;
     }
     // Test for valid commands.
@@ -285,10 +402,18 @@ gboolean d_smtp_command_process(
         command = SMTP_COMMAND_RCPT;
     } else if(g_str_equal(cmd,"DATA")) {
         command = SMTP_COMMAND_DATA;
+    } else if(g_str_equal(cmd,"STAR")) {
+        command = SMTP_COMMAND_STARTTLS;
+    } else if(g_str_equal(cmd,"RSET")) {
+        command = SMTP_COMMAND_RSET;
+    } else if(g_str_equal(cmd,"NOOP")) {
+        command = SMTP_COMMAND_NOOP;
     } else {
         g_warning("unknown command %s",cmd);
+        D_SMTP_PROBE2(command,gint(SMTP_COMMAND_UNKNOWN),count);
         return FALSE;
     }
+    D_SMTP_PROBE2(command,gint(command),count);
 
     return d_smtp_command_process_command(smtp_command,command);
 }
@@ -305,12 +430,26 @@ gint d_smtp_command_get_response_code(
     return smtp_command->response_code;
 }
 
+const gchar* d_smtp_command_get_path(
+    DSmtpCommand* smtp_command)
+{
+    return smtp_command->path;
+}
+
+const gchar* d_smtp_command_get_domain(
+    DSmtpCommand* smtp_command)
+{
+    return smtp_command->domain;
+}
+
 static void d_smtp_command_finalize(GObject* object)
 {
     auto smtp_command = D_SMTP_COMMAND(object);
     if(smtp_command->command_bytes) {
         g_bytes_unref(smtp_command->command_bytes);
     }
+    g_free(smtp_command->path);
+    g_free(smtp_command->domain);
     G_OBJECT_CLASS(d_smtp_command_parent_class)->finalize(object);
 }
 
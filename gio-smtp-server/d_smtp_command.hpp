@@ -31,8 +31,16 @@ enum SMTP_COMMAND
     SMTP_COMMAND_RCPT,
     SMTP_COMMAND_DATA,
     SMTP_COMMAND_QUIT,
+    SMTP_COMMAND_STARTTLS,
+    SMTP_COMMAND_RSET,
+    SMTP_COMMAND_NOOP,
+    NR_SMTP_COMMANDS
 };
 
+/**
+ * @brief The longest command line with CRLF, RFC 5321 4.5.3.1.4 allows 512.
+ */
+#define SMTP_COMMAND_MAX_LENGTH 1024
 
 extern "C" {
 #define D_TYPE_SMTP_COMMAND (d_smtp_command_get_type())
@@ -72,6 +80,22 @@ SMTP_COMMAND d_smtp_command_get_smtp_command(
 gint d_smtp_command_get_response_code(
     DSmtpCommand* command);
 
+/**
+ * @brief Get the path of MAIL FROM or RCPT TO command.
+ * @note Function only valid after call d_smtp_command_process_command.
+ * @return The path without angle brackets or NULL, owned by the command.
+ */
+const gchar* d_smtp_command_get_path(
+    DSmtpCommand* command);
+
+/**
+ * @brief Get the domain of HELO or EHLO command.
+ * @note Function only valid after call d_smtp_command_process_command.
+ * @return The client domain or NULL, owned by the command.
+ */
+const gchar* d_smtp_command_get_domain(
+    DSmtpCommand* command);
+
 /**
  * @brief Create new instance of SMTP command.
  */
@@ -0,0 +1,560 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_compress.hpp"
+
+#include <string.h>
+#include <zlib.h>
+
+/// @brief The size of the compressed blocks.
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+/// @brief The longest header line taken by the dictionary training.
+#define COMPRESS_TRAIN_MAX_LINE 200
+
+extern "C" {
+
+/**
+ * @brief The built-in dictionary, the most common strings are at the end.
+ */
+static const gchar compress_default_dictionary[] =
+    "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.0 Transitional//EN\" "
+    "\"http://www.w3.org/TR/xhtml1/DTD/xhtml1-transitional.dtd\">\r\n"
+    "<html xmlns=\"http://www.w3.org/1999/xhtml\"><head>\r\n"
+    "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\r\n"
+    "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">\r\n"
+    "</head><body><table width=\"100%\" cellpadding=\"0\" cellspacing=\"0\" border=\"0\">"
+    "<tr><td align=\"center\" valign=\"top\" style=\"font-family: Arial, Helvetica, sans-serif; "
+    "font-size: 14px; color: #333333;\"><a href=\"https://www.\" target=\"_blank\">"
+    "<img src=\"https://\" alt=\"\" width=\"\" height=\"\" border=\"0\" /></a></td></tr>"
+    "</table></body></html>\r\n<div><br></div><div dir=\"ltr\">&nbsp;</div>\r\n"
+    "This is a multi-part message in MIME format.\r\n"
+    "Content-Disposition: inline\r\n"
+    "Content-Disposition: attachment; filename=\"\r\n"
+    "Content-Type: application/pdf; name=\"\r\n"
+    "Content-Type: image/png; name=\"\r\n"
+    "Content-Type: image/jpeg; name=\"\r\n"
+    "Content-ID: <\r\n"
+    "Content-Type: multipart/related; boundary=\"\r\n"
+    "Content-Type: multipart/mixed; boundary=\"\r\n"
+    "Content-Type: multipart/alternative; boundary=\"\r\n"
+    "Content-Transfer-Encoding: 8bit\r\n"
+    "Content-Transfer-Encoding: 7bit\r\n"
+    "Content-Transfer-Encoding: base64\r\n"
+    "Content-Transfer-Encoding: quoted-printable\r\n"
+    "Content-Type: text/html; charset=\"utf-8\"\r\n"
+    "Content-Type: text/html; charset=\"UTF-8\"\r\n"
+    "Content-Type: text/plain; charset=\"utf-8\"\r\n"
+    "Content-Type: text/plain; charset=\"UTF-8\"\r\n";
+
+struct DSmtpCompressorMetrics
+{
+    guint64 compressed;
+    /// @brief The bodies which aren't made smaller.
+    guint64 stored;
+    guint64 raw_bytes;
+    guint64 compressed_bytes;
+    /// @brief The compression time in microseconds.
+    guint64 time;
+};
+
+struct _DSmtpCompressor
+{
+    GObject parent;
+
+    gint level;
+    GBytes* dictionary;
+    guint32 dictionary_id;
+
+    GMutex lock;
+    DSmtpCompressorMetrics metrics;
+};
+typedef _DSmtpCompressor DSmtpCompressor;
+
+G_DEFINE_TYPE(DSmtpCompressor,d_smtp_compressor,G_TYPE_OBJECT)
+
+struct _DSmtpCompressorClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(smtp_compressor_default);
+static DSmtpCompressor* smtp_compressor_default{nullptr};
+
+struct _DSmtpDeflate
+{
+    DSmtpCompressor* compressor;
+    z_stream stream;
+    gboolean failed;
+    /// @brief The filled compressed blocks, array of GBytes.
+    GPtrArray* blocks;
+    /// @brief The block being filled.
+    guint8* block;
+    gsize raw_size;
+    gint64 time;
+    /// @brief The blocks are taken before the finish, the body is stored compressed.
+    gboolean taken;
+};
+
+struct _DSmtpInflater
+{
+    GObject parent;
+
+    gchar* dictionaries;
+    z_stream stream;
+};
+typedef _DSmtpInflater DSmtpInflater;
+
+static void d_smtp_inflater_converter_init(GConverterIface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(DSmtpInflater,d_smtp_inflater,G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE(G_TYPE_CONVERTER,d_smtp_inflater_converter_init))
+
+struct _DSmtpInflaterClass
+{
+    GObjectClass parent;
+};
+
+GBytes* d_smtp_compressor_get_dictionary(
+    DSmtpCompressor* compressor,
+    guint32* id)
+{
+    g_return_val_if_fail(D_IS_SMTP_COMPRESSOR(compressor),NULL);
+    *id = compressor->dictionary_id;
+    return compressor->dictionary;
+}
+
+void d_smtp_compressor_log_metrics(
+    DSmtpCompressor* compressor)
+{
+    g_return_if_fail(D_IS_SMTP_COMPRESSOR(compressor));
+    g_mutex_lock(&compressor->lock);
+    DSmtpCompressorMetrics metrics = compressor->metrics;
+    g_mutex_unlock(&compressor->lock);
+    g_message("compression: bodies compressed %" G_GUINT64_FORMAT " stored %" G_GUINT64_FORMAT
+        ", %" G_GUINT64_FORMAT " to %" G_GUINT64_FORMAT " bytes (%.1f%%), %.1f ms per MB",
+        metrics.compressed,metrics.stored,metrics.raw_bytes,metrics.compressed_bytes,
+        metrics.raw_bytes ? 100.0 * metrics.compressed_bytes / metrics.raw_bytes : 0.0,
+        metrics.raw_bytes ? metrics.time / 1000.0 / (metrics.raw_bytes / 1048576.0) : 0.0);
+}
+
+void d_smtp_compressor_set_default(
+    DSmtpCompressor* compressor)
+{
+    G_LOCK(smtp_compressor_default);
+    g_set_object(&smtp_compressor_default,compressor);
+    G_UNLOCK(smtp_compressor_default);
+}
+
+DSmtpCompressor* d_smtp_compressor_get_default()
+{
+    G_LOCK(smtp_compressor_default);
+    DSmtpCompressor* compressor = smtp_compressor_default ?
+        D_SMTP_COMPRESSOR(g_object_ref(smtp_compressor_default)) : NULL;
+    G_UNLOCK(smtp_compressor_default);
+    return compressor;
+}
+
+static void d_smtp_compressor_init(DSmtpCompressor* compressor)
+{
+    g_mutex_init(&compressor->lock);
+}
+
+static void d_smtp_compressor_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_COMPRESSOR(object));
+    auto compressor = D_SMTP_COMPRESSOR(object);
+    g_clear_pointer(&compressor->dictionary,g_bytes_unref);
+    g_mutex_clear(&compressor->lock);
+    G_OBJECT_CLASS(d_smtp_compressor_parent_class)->finalize(object);
+}
+
+static void d_smtp_compressor_class_init(DSmtpCompressorClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_compressor_finalize;
+}
+
+/**
+ * @brief Create new instance of the body compressor.
+ */
+DSmtpCompressor* d_smtp_compressor_new(
+    guint level,
+    GBytes* dictionary)
+{
+    auto compressor = reinterpret_cast<DSmtpCompressor*>(
+        g_object_new(
+            D_TYPE_SMTP_COMPRESSOR,
+            NULL));
+
+    compressor->level = CLAMP(level,1u,9u);
+    if(!dictionary) {
+        compressor->dictionary = g_bytes_new_static(compress_default_dictionary,
+            sizeof(compress_default_dictionary) - 1);
+    } else if(g_bytes_get_size(dictionary) > SMTP_COMPRESS_MAX_DICTIONARY) {
+        // The window holds only the dictionary end.
+        gsize size = g_bytes_get_size(dictionary);
+        compressor->dictionary = g_bytes_new_from_bytes(dictionary,
+            size - SMTP_COMPRESS_MAX_DICTIONARY,SMTP_COMPRESS_MAX_DICTIONARY);
+    } else if(g_bytes_get_size(dictionary) > 0) {
+        compressor->dictionary = g_bytes_ref(dictionary);
+    }
+    if(compressor->dictionary) {
+        gsize size{0};
+        auto data = static_cast<const Bytef*>(g_bytes_get_data(compressor->dictionary,&size));
+        compressor->dictionary_id = adler32(adler32(0,NULL,0),data,size);
+    }
+
+    return compressor;
+}
+
+DSmtpDeflate* d_smtp_deflate_new(
+    DSmtpCompressor* compressor)
+{
+    g_return_val_if_fail(D_IS_SMTP_COMPRESSOR(compressor),NULL);
+    auto deflate = g_new0(DSmtpDeflate,1);
+    deflate->compressor = D_SMTP_COMPRESSOR(g_object_ref(compressor));
+    deflate->blocks = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    if(deflateInit(&deflate->stream,compressor->level) != Z_OK) {
+        deflate->failed = TRUE;
+        return deflate;
+    }
+    if(compressor->dictionary) {
+        gsize size{0};
+        auto data = static_cast<const Bytef*>(g_bytes_get_data(compressor->dictionary,&size));
+        deflate->failed = deflateSetDictionary(&deflate->stream,data,size) != Z_OK;
+    }
+    return deflate;
+}
+
+/**
+ * @brief Run the deflate until the input is taken or the stream is finished.
+ */
+static void d_smtp_deflate_run(
+    DSmtpDeflate* deflate,
+    gint flush)
+{
+    gint64 start = g_get_monotonic_time();
+    while(!deflate->failed) {
+        if(!deflate->block) {
+            deflate->block = static_cast<guint8*>(g_malloc(COMPRESS_BLOCK_SIZE));
+            deflate->stream.next_out = deflate->block;
+            deflate->stream.avail_out = COMPRESS_BLOCK_SIZE;
+        }
+        gint result = ::deflate(&deflate->stream,flush);
+        if(result == Z_STREAM_ERROR) {
+            deflate->failed = TRUE;
+            break;
+        }
+        if(deflate->stream.avail_out == 0) {
+            g_ptr_array_add(deflate->blocks,g_bytes_new_take(g_steal_pointer(&deflate->block),COMPRESS_BLOCK_SIZE));
+            continue;
+        }
+        // The output space is left, so all input is taken.
+        if(flush == Z_NO_FLUSH || result == Z_STREAM_END) {
+            break;
+        }
+    }
+    deflate->time += g_get_monotonic_time() - start;
+}
+
+void d_smtp_deflate_update(
+    DSmtpDeflate* deflate,
+    const gchar* data,
+    gsize size)
+{
+    deflate->raw_size += size;
+    deflate->stream.next_in = reinterpret_cast<Bytef*>(const_cast<gchar*>(data));
+    deflate->stream.avail_in = size;
+    d_smtp_deflate_run(deflate,Z_NO_FLUSH);
+}
+
+GPtrArray* d_smtp_deflate_take_blocks(
+    DSmtpDeflate* deflate)
+{
+    deflate->taken = TRUE;
+    GPtrArray* blocks = deflate->blocks;
+    deflate->blocks = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    return blocks;
+}
+
+GPtrArray* d_smtp_deflate_finish(
+    DSmtpDeflate* deflate)
+{
+    deflate->stream.next_in = NULL;
+    deflate->stream.avail_in = 0;
+    d_smtp_deflate_run(deflate,Z_FINISH);
+    gsize compressed_size = deflate->stream.total_out;
+    // The part already taken can't be stored as is.
+    gboolean compressed = !deflate->failed && (deflate->taken || compressed_size < deflate->raw_size);
+    if(compressed && deflate->block) {
+        gsize size = COMPRESS_BLOCK_SIZE - deflate->stream.avail_out;
+        g_ptr_array_add(deflate->blocks,g_bytes_new_take(
+            g_realloc(g_steal_pointer(&deflate->block),size),size));
+    }
+
+    DSmtpCompressor* compressor = deflate->compressor;
+    g_mutex_lock(&compressor->lock);
+    if(compressed) {
+        compressor->metrics.compressed++;
+        compressor->metrics.compressed_bytes += compressed_size;
+    } else {
+        compressor->metrics.stored++;
+        compressor->metrics.compressed_bytes += deflate->raw_size;
+    }
+    compressor->metrics.raw_bytes += deflate->raw_size;
+    compressor->metrics.time += deflate->time;
+    g_mutex_unlock(&compressor->lock);
+    return compressed ? g_ptr_array_ref(deflate->blocks) : NULL;
+}
+
+void d_smtp_deflate_free(
+    DSmtpDeflate* deflate)
+{
+    if(!deflate) return;
+    deflateEnd(&deflate->stream);
+    g_free(deflate->block);
+    g_ptr_array_unref(deflate->blocks);
+    g_object_unref(deflate->compressor);
+    g_free(deflate);
+}
+
+/**
+ * @brief Set the dictionary the stream is compressed with.
+ */
+static gboolean d_smtp_inflater_set_dictionary(
+    DSmtpInflater* inflater,
+    GError** error)
+{
+    g_autofree gchar* name = g_strdup_printf("%08x",guint(inflater->stream.adler));
+    g_autofree gchar* path = g_build_filename(inflater->dictionaries,name,NULL);
+    g_autofree gchar* dictionary = NULL;
+    gsize size{0};
+    if(!g_file_get_contents(path,&dictionary,&size,error)) {
+        return FALSE;
+    }
+    if(inflateSetDictionary(&inflater->stream,reinterpret_cast<const Bytef*>(dictionary),size) != Z_OK) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"compression dictionary %s doesn't match",path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static GConverterResult d_smtp_inflater_convert(
+    GConverter* converter,
+    const void* inbuf,
+    gsize inbuf_size,
+    void* outbuf,
+    gsize outbuf_size,
+    GConverterFlags flags,
+    gsize* bytes_read,
+    gsize* bytes_written,
+    GError** error)
+{
+    auto inflater = D_SMTP_INFLATER(converter);
+    z_stream* stream = &inflater->stream;
+    stream->next_in = static_cast<Bytef*>(const_cast<void*>(inbuf));
+    stream->avail_in = inbuf_size;
+    stream->next_out = static_cast<Bytef*>(outbuf);
+    stream->avail_out = outbuf_size;
+    gint result = inflate(stream,Z_NO_FLUSH);
+    if(result == Z_NEED_DICT) {
+        if(!d_smtp_inflater_set_dictionary(inflater,error)) {
+            return G_CONVERTER_ERROR;
+        }
+        result = inflate(stream,Z_NO_FLUSH);
+    }
+    *bytes_read = inbuf_size - stream->avail_in;
+    *bytes_written = outbuf_size - stream->avail_out;
+    switch(result) {
+    case Z_OK:
+        return G_CONVERTER_CONVERTED;
+    case Z_STREAM_END:
+        return G_CONVERTER_FINISHED;
+    case Z_BUF_ERROR:
+        if(flags & G_CONVERTER_FLUSH) {
+            return G_CONVERTER_FLUSHED;
+        }
+        // The output space is given, so the input is needed.
+        g_set_error_literal(error,G_IO_ERROR,
+            flags & G_CONVERTER_INPUT_AT_END ? G_IO_ERROR_INVALID_DATA : G_IO_ERROR_PARTIAL_INPUT,
+            flags & G_CONVERTER_INPUT_AT_END ? "compressed body is truncated" : "need more input");
+        return G_CONVERTER_ERROR;
+    default:
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"compressed body is damaged: %s",
+            stream->msg ? stream->msg : "unknown error");
+        return G_CONVERTER_ERROR;
+    }
+}
+
+static void d_smtp_inflater_reset(
+    GConverter* converter)
+{
+    inflateReset(&D_SMTP_INFLATER(converter)->stream);
+}
+
+static void d_smtp_inflater_converter_init(GConverterIface* iface)
+{
+    iface->convert = d_smtp_inflater_convert;
+    iface->reset = d_smtp_inflater_reset;
+}
+
+static void d_smtp_inflater_init(DSmtpInflater* inflater)
+{
+    inflateInit(&inflater->stream);
+}
+
+static void d_smtp_inflater_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_INFLATER(object));
+    auto inflater = D_SMTP_INFLATER(object);
+    inflateEnd(&inflater->stream);
+    g_free(inflater->dictionaries);
+    G_OBJECT_CLASS(d_smtp_inflater_parent_class)->finalize(object);
+}
+
+static void d_smtp_inflater_class_init(DSmtpInflaterClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_inflater_finalize;
+}
+
+/**
+ * @brief Create the converter of the compressed body.
+ */
+DSmtpInflater* d_smtp_inflater_new(
+    const gchar* dictionaries)
+{
+    auto inflater = reinterpret_cast<DSmtpInflater*>(
+        g_object_new(
+            D_TYPE_SMTP_INFLATER,
+            NULL));
+
+    inflater->dictionaries = g_strdup(dictionaries);
+
+    return inflater;
+}
+
+/**
+ * @brief Count the dictionary candidate once per message.
+ */
+static void compress_train_count(
+    GHashTable* counts,
+    GHashTable* seen,
+    const gchar* text,
+    gsize length)
+{
+    g_autofree gchar* key = g_strndup(text,length);
+    if(g_hash_table_contains(seen,key)) {
+        return;
+    }
+    gpointer original{nullptr};
+    gpointer count{nullptr};
+    if(g_hash_table_lookup_extended(counts,key,&original,&count)) {
+        g_hash_table_insert(counts,original,GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+    } else {
+        original = g_steal_pointer(&key);
+        g_hash_table_insert(counts,original,GUINT_TO_POINTER(1));
+    }
+    g_hash_table_add(seen,original);
+}
+
+struct DSmtpCompressCandidate
+{
+    const gchar* text;
+    gsize length;
+    guint64 score;
+};
+
+GBytes* d_smtp_compress_train_dictionary(
+    GPtrArray* samples,
+    gsize max_size)
+{
+    // The keys are owned by the counts, the seen set is cleared per message.
+    g_autoptr(GHashTable) counts = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,NULL);
+    g_autoptr(GHashTable) seen = g_hash_table_new(g_str_hash,g_str_equal);
+    for(guint index = 0; index < samples->len; index++) {
+        gsize size{0};
+        auto data = static_cast<const gchar*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(samples,index)),&size));
+        const gchar* end = data + size;
+        g_hash_table_remove_all(seen);
+        gboolean header{TRUE};
+        for(const gchar* line = data; line < end; ) {
+            auto lf = static_cast<const gchar*>(memchr(line,'\n',end - line));
+            const gchar* next = lf ? lf + 1 : end;
+            gsize length = (lf ? lf : end) - line;
+            if(length && line[length - 1] == '\r') {
+                length--;
+            }
+            if(!header) {
+                // The MIME part header follows the boundary line.
+                header = length > 2 && line[0] == '-' && line[1] == '-';
+            } else if(length == 0) {
+                header = FALSE;
+            } else if(length <= COMPRESS_TRAIN_MAX_LINE) {
+                g_autofree gchar* text = g_strdup_printf("%.*s\r\n",int(length),line);
+                compress_train_count(counts,seen,text,length + 2);
+                // The field name is common even if the value is unique.
+                auto colon = static_cast<const gchar*>(memchr(line,':',length));
+                if(colon && colon > line && line[0] != ' ' && line[0] != '\t') {
+                    g_autofree gchar* name = g_strdup_printf("%.*s: ",int(colon - line),line);
+                    compress_train_count(counts,seen,name,colon - line + 2);
+                }
+            }
+            line = next;
+        }
+    }
+
+    g_autoptr(GArray) candidates = g_array_new(FALSE,FALSE,sizeof(DSmtpCompressCandidate));
+    GHashTableIter iter;
+    gpointer key{nullptr};
+    gpointer value{nullptr};
+    g_hash_table_iter_init(&iter,counts);
+    while(g_hash_table_iter_next(&iter,&key,&value)) {
+        guint count = GPOINTER_TO_UINT(value);
+        if(count < 2) {
+            continue;
+        }
+        auto text = static_cast<const gchar*>(key);
+        gsize length = strlen(text);
+        DSmtpCompressCandidate candidate{text,length,guint64(count - 1) * length};
+        g_array_append_val(candidates,candidate);
+    }
+    g_array_sort(candidates,[](gconstpointer a, gconstpointer b) -> gint {
+        auto first = static_cast<const DSmtpCompressCandidate*>(a);
+        auto second = static_cast<const DSmtpCompressCandidate*>(b);
+        return first->score < second->score ? 1 : first->score > second->score ? -1 :
+            strcmp(first->text,second->text);
+    });
+    // The best candidates are taken first and written last.
+    guint taken{0};
+    gsize size{0};
+    for(; taken < candidates->len; taken++) {
+        gsize length = g_array_index(candidates,DSmtpCompressCandidate,taken).length;
+        if(size + length > max_size) {
+            break;
+        }
+        size += length;
+    }
+    GString* dictionary = g_string_sized_new(size);
+    while(taken > 0) {
+        const DSmtpCompressCandidate* candidate = &g_array_index(candidates,DSmtpCompressCandidate,--taken);
+        g_string_append_len(dictionary,candidate->text,candidate->length);
+    }
+    size = dictionary->len;
+    return g_bytes_new_take(g_string_free(dictionary,FALSE),size);
+}
+
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_COMPRESS__HPP__
+#define __D__NEW__SMTP_COMPRESS__HPP__
+/**
+ * @brief Streaming compression of the spooled message bodies.
+ * @details The body is deflated block by block as the message data is
+ * received, the spool gets the compressed blocks and writes them to the
+ * journal and the body file. The zlib stream starts with the preset
+ * dictionary of the common MIME part header fields and HTML text, so
+ * even the small bodies are compressed. The dictionary can be trained on
+ * the sample messages by d_smtp_compress_train_dictionary.
+ * The zlib stream carries the dictionary identifier and the checksum of
+ * the body, the inflater takes the dictionary by its identifier from the
+ * spool, so the dictionary may be changed while the old bodies are
+ * queued.
+ */
+
+#include <gio/gio.h>
+
+/// @brief The maximum size of the zlib preset dictionary.
+#define SMTP_COMPRESS_MAX_DICTIONARY (32 * 1024)
+
+extern "C" {
+#define D_TYPE_SMTP_COMPRESSOR (d_smtp_compressor_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpCompressor,d_smtp_compressor,D,SMTP_COMPRESSOR,GObject)
+
+#define D_TYPE_SMTP_INFLATER (d_smtp_inflater_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpInflater,d_smtp_inflater,D,SMTP_INFLATER,GObject)
+
+/**
+ * @brief The compression of the one body.
+ */
+typedef struct _DSmtpDeflate DSmtpDeflate;
+
+/**
+ * @brief Get the preset dictionary.
+ * @param [out] id The zlib identifier of the dictionary, the Adler-32
+ * checksum of it.
+ * @return The dictionary or NULL if the compressor has no dictionary.
+ */
+GBytes* d_smtp_compressor_get_dictionary(
+    DSmtpCompressor* compressor,
+    guint32* id);
+
+/**
+ * @brief Write the compressed and stored as is bodies counters and the
+ * compression time to the log.
+ */
+void d_smtp_compressor_log_metrics(
+    DSmtpCompressor* compressor);
+
+/**
+ * @brief Set the process wide compressor used by the transactions.
+ * @param [in] compressor The compressor or NULL, the bodies are stored as is.
+ */
+void d_smtp_compressor_set_default(
+    DSmtpCompressor* compressor);
+
+/**
+ * @brief Get the process wide compressor.
+ * @return The new reference or NULL if the compression is disabled.
+ */
+DSmtpCompressor* d_smtp_compressor_get_default();
+
+/**
+ * @brief Create new instance of the body compressor.
+ * @param [in] level The zlib compression level 1..9.
+ * @param [in] dictionary The preset dictionary, the built-in one if NULL,
+ * the empty one disables the dictionary. Only the last
+ * SMTP_COMPRESS_MAX_DICTIONARY bytes are used.
+ */
+DSmtpCompressor* d_smtp_compressor_new(
+    guint level,
+    GBytes* dictionary);
+
+/**
+ * @brief Start the compression of the body.
+ * @details The deflate state takes about 256 KB until freed.
+ */
+DSmtpDeflate* d_smtp_deflate_new(
+    DSmtpCompressor* compressor);
+
+/**
+ * @brief Compress the next body bytes.
+ */
+void d_smtp_deflate_update(
+    DSmtpDeflate* deflate,
+    const gchar* data,
+    gsize size);
+
+/**
+ * @brief Take the compressed blocks filled so far.
+ * @details Used to write the big body out while it is received, the body
+ * is stored compressed then whatever its compressed size.
+ * @return The compressed blocks, array of GBytes, may be empty.
+ */
+GPtrArray* d_smtp_deflate_take_blocks(
+    DSmtpDeflate* deflate);
+
+/**
+ * @brief Complete the compressed stream.
+ * @details The body which isn't made smaller is counted as stored as is,
+ * unless its blocks are taken already.
+ * @return The compressed blocks, array of GBytes, or NULL if the body
+ * must be stored as is or the compression failed.
+ */
+GPtrArray* d_smtp_deflate_finish(
+    DSmtpDeflate* deflate);
+
+/**
+ * @brief Free the deflate state.
+ */
+void d_smtp_deflate_free(
+    DSmtpDeflate* deflate);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DSmtpDeflate,d_smtp_deflate_free)
+
+/**
+ * @brief Create the converter of the compressed body to the original one.
+ * @details The converter is used with g_converter_input_stream_new.
+ * @param [in] dictionaries The directory of the dictionaries named by
+ * their identifiers in 8 hex digits.
+ */
+DSmtpInflater* d_smtp_inflater_new(
+    const gchar* dictionaries);
+
+/**
+ * @brief Build the preset dictionary from the sample messages.
+ * @details The header fields of the messages and of their MIME parts are
+ * counted once per message, the fields seen in more messages and the
+ * longer ones are taken first and placed closer to the dictionary end.
+ * @param [in] samples The messages, array of GBytes.
+ * @param [in] max_size The maximum dictionary size.
+ * @return The dictionary, empty if the samples have no repeated fields.
+ */
+GBytes* d_smtp_compress_train_dictionary(
+    GPtrArray* samples,
+    gsize max_size);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_COMPRESS__HPP__
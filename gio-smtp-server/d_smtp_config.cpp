@@ -0,0 +1,701 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_config.hpp"
+
+extern "C" {
+
+/**
+ * @brief Configuration values indexes.
+ * @details Property identifier is the index plus PROP_SMTP_CONFIG_BASE.
+ */
+enum SMTP_CONFIG_PARAM {
+    SMTP_CONFIG_LISTEN_ADDRESS,
+    SMTP_CONFIG_LISTEN_PORT,
+    SMTP_CONFIG_LISTEN_BACKLOG,
+    SMTP_CONFIG_WORKERS,
+    SMTP_CONFIG_MAX_CONNECTIONS,
+    SMTP_CONFIG_READ_BUFFER_SIZE,
+    SMTP_CONFIG_IO_ENGINE,
+    SMTP_CONFIG_REBALANCE_THRESHOLD,
+    SMTP_CONFIG_READ_TIMEOUT,
+    SMTP_CONFIG_DATA_TIMEOUT,
+    SMTP_CONFIG_WRITE_TIMEOUT,
+    SMTP_CONFIG_CLOSE_TIMEOUT,
+    SMTP_CONFIG_SPOOL_DIRECTORY,
+    SMTP_CONFIG_SPOOL_COMMIT_WINDOW,
+    SMTP_CONFIG_SPOOL_COMPRESSION,
+    SMTP_CONFIG_SPOOL_DICTIONARY,
+    SMTP_CONFIG_TLS_CERTIFICATE,
+    SMTP_CONFIG_TLS_KEY,
+    SMTP_CONFIG_TLS_HANDSHAKE_THREADS,
+    SMTP_CONFIG_MAX_HEADER_SIZE,
+    SMTP_CONFIG_MAX_MESSAGE_SIZE,
+    SMTP_CONFIG_TRACE_FILE,
+    SMTP_CONFIG_TRACE_RECORDS,
+    SMTP_CONFIG_WATCHDOG_INTERVAL,
+    SMTP_CONFIG_WATCHDOG_STALL_THRESHOLD,
+    SMTP_CONFIG_DNS_SERVER,
+    SMTP_CONFIG_DNS_CACHE_SIZE,
+    SMTP_CONFIG_DNS_NEGATIVE_TTL,
+    SMTP_CONFIG_DNS_MAX_TTL,
+    SMTP_CONFIG_DNS_THREADS,
+    SMTP_CONFIG_DNSBL_ZONES,
+    SMTP_CONFIG_DNSBL_CACHE_SIZE,
+    SMTP_CONFIG_DNSBL_CACHE_TTL,
+    SMTP_CONFIG_SPF_CACHE_SIZE,
+    SMTP_CONFIG_DKIM_KEY_CACHE_SIZE,
+    SMTP_CONFIG_DKIM_SIGN_KEYS,
+    SMTP_CONFIG_DKIM_SIGN_BATCH,
+    SMTP_CONFIG_GREYLIST_SIZE,
+    SMTP_CONFIG_GREYLIST_DELAY,
+    SMTP_CONFIG_GREYLIST_RETRY_WINDOW,
+    SMTP_CONFIG_GREYLIST_PASS_TTL,
+    SMTP_CONFIG_GREYLIST_SNAPSHOT_FILE,
+    SMTP_CONFIG_GREYLIST_SNAPSHOT_INTERVAL,
+    SMTP_CONFIG_LOG_LEVEL,
+    NR_SMTP_CONFIG_PARAMS
+};
+
+enum {
+    PROP_SMTP_CONFIG_BASE = 3000
+};
+
+/**
+ * @brief Description of the one configuration value.
+ * @details Single table drives the properties, key file and
+ * command line options.
+ */
+struct DSmtpConfigParam
+{
+    /// @brief Property and command line long option name.
+    const gchar* name;
+    /// @brief Key file group name.
+    const gchar* group;
+    /// @brief Key file key name.
+    const gchar* key;
+    /// @brief TRUE for string value and FALSE for unsigned integer.
+    gboolean is_string;
+    guint minimum;
+    guint maximum;
+    guint default_value;
+    const gchar* default_string;
+    /// @brief Value used only at server start and can't be reloaded.
+    gboolean restart;
+    const gchar* description;
+    const gchar* arg_description;
+};
+
+static const DSmtpConfigParam smtp_config_params[NR_SMTP_CONFIG_PARAMS] = {
+    { "listen-address", "server", "listen-address", TRUE, 0, 0, 0, "127.0.0.1", TRUE,
+      "The listen address of SMTP server", "ADDRESS" },
+    { "listen-port", "server", "listen-port", FALSE, 1, 0xFFFF, 8425, NULL, TRUE,
+      "The listen port of SMTP server", "PORT" },
+    { "listen-backlog", "server", "listen-backlog", FALSE, 1, 0xFFFF, 128, NULL, TRUE,
+      "The listen queue length of SMTP server socket", "COUNT" },
+    { "workers", "server", "workers", FALSE, 0, 256, 0, NULL, TRUE,
+      "The number of worker threads, 0 - serve connections in the main thread", "COUNT" },
+    { "max-connections", "server", "max-connections", FALSE, 1, 1000000, 100, NULL, FALSE,
+      "The maximum number of simultaneous connections", "COUNT" },
+    { "read-buffer-size", "server", "read-buffer-size", FALSE, 512, 1048576, 2048, NULL, FALSE,
+      "The size in bytes of the one socket read request", "BYTES" },
+    { "io-engine", "server", "io-engine", TRUE, 0, 0, 0, "gio", TRUE,
+      "The connections I/O engine: gio, socket or uring", "ENGINE" },
+    { "rebalance-threshold", "server", "rebalance-threshold", FALSE, 0, 1000, 750, NULL, FALSE,
+      "The worker busy share in permille to move sessions to idle workers, 0 - disabled", "PERMILLE" },
+    { "read-timeout", "timeouts", "read", FALSE, 1, 240, 60, NULL, FALSE,
+      "The maximum amount of time in seconds to wait the next command", "SECONDS" },
+    { "data-timeout", "timeouts", "data", FALSE, 1, 600, 180, NULL, FALSE,
+      "The maximum amount of time in seconds to wait the next block of message data", "SECONDS" },
+    { "write-timeout", "timeouts", "write", FALSE, 1, 240, 10, NULL, FALSE,
+      "The maximum amount of time in seconds to complete the response write", "SECONDS" },
+    { "close-timeout", "timeouts", "close", FALSE, 1, 240, 10, NULL, FALSE,
+      "The maximum amount of time in seconds to complete the socket close", "SECONDS" },
+    { "spool-directory", "spool", "directory", TRUE, 0, 0, 0, NULL, TRUE,
+      "The directory for the received messages", "DIRECTORY" },
+    { "spool-commit-window", "spool", "commit-window", FALSE, 0, 100000, 0, NULL, TRUE,
+      "The time in microseconds to gather messages into the one journal sync", "MICROSECONDS" },
+    { "spool-compression", "spool", "compression", FALSE, 0, 9, 0, NULL, TRUE,
+      "The body compression level, 0 stores the bodies as is", "LEVEL" },
+    { "spool-dictionary", "spool", "dictionary", TRUE, 0, 0, 0, NULL, TRUE,
+      "The body compression dictionary file, the built-in one is used if not set", "FILE" },
+    { "tls-certificate", "tls", "certificate", TRUE, 0, 0, 0, NULL, FALSE,
+      "The PEM certificate chain file, enables STARTTLS", "FILE" },
+    { "tls-key", "tls", "key", TRUE, 0, 0, 0, NULL, FALSE,
+      "The PEM private key file, the certificate file is used if not set", "FILE" },
+    { "tls-handshake-threads", "tls", "handshake-threads", FALSE, 0, 64, 2, NULL, FALSE,
+      "The number of TLS handshake threads, 0 - handshake in the worker thread", "COUNT" },
+    { "max-header-size", "message", "max-header-size", FALSE, 1024, 1048576, 65536, NULL, FALSE,
+      "The maximum size in bytes of the message header", "BYTES" },
+    { "max-message-size", "message", "max-message-size", FALSE, 65536, G_MAXUINT, 26214400, NULL, FALSE,
+      "The maximum size in bytes of the message", "BYTES" },
+    { "trace-file", "trace", "file", TRUE, 0, 0, 0, NULL, TRUE,
+      "The session latency trace ring file, enables the tracing", "FILE" },
+    { "trace-records", "trace", "records", FALSE, 1024, 16777216, 65536, NULL, TRUE,
+      "The number of sessions kept in the trace ring", "COUNT" },
+    { "watchdog-interval", "watchdog", "interval", FALSE, 10, 10000, 100, NULL, TRUE,
+      "The main loop lag sampling interval in milliseconds", "MILLISECONDS" },
+    { "watchdog-stall-threshold", "watchdog", "stall-threshold", FALSE, 0, 600000, 1000, NULL, FALSE,
+      "The main loop stall report threshold in milliseconds, 0 - disabled", "MILLISECONDS" },
+    { "dns-server", "dns", "server", TRUE, 0, 0, 0, NULL, TRUE,
+      "The IPv4 ADDRESS[:PORT] of the DNS server, resolv.conf servers if not set", "ADDRESS" },
+    { "dns-cache-size", "dns", "cache-size", FALSE, 0, 16777216, 65536, NULL, TRUE,
+      "The maximum number of cached DNS answers, 0 - DNS lookups disabled", "COUNT" },
+    { "dns-negative-ttl", "dns", "negative-ttl", FALSE, 0, 86400, 60, NULL, TRUE,
+      "The time in seconds to cache the nonexistent names", "SECONDS" },
+    { "dns-max-ttl", "dns", "max-ttl", FALSE, 1, 604800, 86400, NULL, TRUE,
+      "The maximum time in seconds to cache the DNS answer", "SECONDS" },
+    { "dns-threads", "dns", "threads", FALSE, 1, 64, 4, NULL, TRUE,
+      "The number of DNS query threads", "COUNT" },
+    { "dnsbl-zones", "dnsbl", "zones", TRUE, 0, 0, 0, NULL, TRUE,
+      "The comma separated DNS blocklist zones, enables the client address check", "ZONES" },
+    { "dnsbl-cache-size", "dnsbl", "cache-size", FALSE, 0, 1048576, 16384, NULL, TRUE,
+      "The number of client addresses with cached blocklist result", "COUNT" },
+    { "dnsbl-cache-ttl", "dnsbl", "cache-ttl", FALSE, 0, 86400, 300, NULL, TRUE,
+      "The time in seconds the blocklist result is cached for", "SECONDS" },
+    { "spf-cache-size", "spf", "cache-size", FALSE, 0, 1048576, 16384, NULL, TRUE,
+      "The number of compiled SPF records kept, 0 disables the SPF check", "COUNT" },
+    { "dkim-key-cache-size", "dkim", "key-cache-size", FALSE, 0, 1048576, 16384, NULL, TRUE,
+      "The number of parsed DKIM public keys kept, 0 disables the DKIM verification", "COUNT" },
+    { "dkim-sign-keys", "dkim", "sign-keys", TRUE, 0, 0, 0, NULL, TRUE,
+      "The comma separated domain:selector:pem-file keys, enables the signing", "KEYS" },
+    { "dkim-sign-batch", "dkim", "sign-batch", FALSE, 0, 1024, 64, NULL, TRUE,
+      "The number of signatures made per signer thread wakeup, 0 - sign in the worker thread", "COUNT" },
+    { "greylist-size", "greylist", "size", FALSE, 0, 67108864, 0, NULL, TRUE,
+      "The number of greylisted triplets kept, 0 disables the greylisting", "COUNT" },
+    { "greylist-delay", "greylist", "delay", FALSE, 0, 86400, 300, NULL, TRUE,
+      "The time in seconds the new triplet is deferred for", "SECONDS" },
+    { "greylist-retry-window", "greylist", "retry-window", FALSE, 60, 604800, 14400, NULL, TRUE,
+      "The time in seconds since the first attempt the retry is accepted within", "SECONDS" },
+    { "greylist-pass-ttl", "greylist", "pass-ttl", FALSE, 3600, 31536000, 3110400, NULL, TRUE,
+      "The time in seconds the passed triplet is kept since its last attempt", "SECONDS" },
+    { "greylist-snapshot-file", "greylist", "snapshot-file", TRUE, 0, 0, 0, NULL, TRUE,
+      "The greylist snapshot file, keeps the triplets over the restart", "FILE" },
+    { "greylist-snapshot-interval", "greylist", "snapshot-interval", FALSE, 10, 86400, 300, NULL, TRUE,
+      "The time in seconds between the greylist snapshots", "SECONDS" },
+    { "log-level", "log", "level", TRUE, 0, 0, 0, "message", FALSE,
+      "The log level: error, critical, warning, message, info or debug", "LEVEL" },
+};
+
+static GParamSpec* d_smtp_config_properties[NR_SMTP_CONFIG_PARAMS];
+
+struct _DSmtpConfig
+{
+    GObject parent;
+
+    GValue values[NR_SMTP_CONFIG_PARAMS];
+};
+typedef _DSmtpConfig DSmtpConfig;
+
+G_DEFINE_TYPE(DSmtpConfig,d_smtp_config,G_TYPE_OBJECT)
+
+struct _DSmtpConfigClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief Convert log level name to the log level flag.
+ * @return Return 0 if the name isn't known.
+ */
+static GLogLevelFlags smtp_config_log_level_from_text(const gchar* text)
+{
+    if(!text) return GLogLevelFlags(0);
+    if(g_ascii_strcasecmp(text,"error") == 0) return G_LOG_LEVEL_ERROR;
+    if(g_ascii_strcasecmp(text,"critical") == 0) return G_LOG_LEVEL_CRITICAL;
+    if(g_ascii_strcasecmp(text,"warning") == 0) return G_LOG_LEVEL_WARNING;
+    if(g_ascii_strcasecmp(text,"message") == 0) return G_LOG_LEVEL_MESSAGE;
+    if(g_ascii_strcasecmp(text,"info") == 0) return G_LOG_LEVEL_INFO;
+    if(g_ascii_strcasecmp(text,"debug") == 0) return G_LOG_LEVEL_DEBUG;
+    return GLogLevelFlags(0);
+}
+
+/**
+ * @brief Convert I/O engine name to the engine enumeration value.
+ * @return Return -1 if the name isn't known.
+ */
+static gint smtp_config_io_engine_from_text(const gchar* text)
+{
+    if(!text) return -1;
+    if(g_ascii_strcasecmp(text,"gio") == 0) return SMTP_IO_ENGINE_GIO;
+    if(g_ascii_strcasecmp(text,"socket") == 0) return SMTP_IO_ENGINE_SOCKET;
+    if(g_ascii_strcasecmp(text,"uring") == 0) return SMTP_IO_ENGINE_URING;
+    return -1;
+}
+
+/**
+ * @brief Validate and store the new configuration value.
+ * @param [in] config Configuration object instance.
+ * @param [in] param The index of configuration value.
+ * @param [in] value The new value, type must match the property type.
+ * @param [in] error_domain The error domain used in case of invalid value.
+ * @param [in] error_code The error code used in case of invalid value.
+ * @param [out] error The location for error or NULL.
+ */
+static gboolean d_smtp_config_set_param(
+    DSmtpConfig* config,
+    guint param,
+    GValue* value,
+    GQuark error_domain,
+    gint error_code,
+    GError** error)
+{
+    const DSmtpConfigParam* desc = &smtp_config_params[param];
+    if(g_param_value_validate(d_smtp_config_properties[param],value)) {
+        g_set_error(error,error_domain,error_code,
+            "value of \"%s\" is out of range %u..%u",
+            desc->name,desc->minimum,desc->maximum);
+        return FALSE;
+    }
+    if(param == SMTP_CONFIG_LOG_LEVEL &&
+       !smtp_config_log_level_from_text(g_value_get_string(value))) {
+        g_set_error(error,error_domain,error_code,
+            "unknown log level \"%s\"",g_value_get_string(value));
+        return FALSE;
+    }
+    if(param == SMTP_CONFIG_IO_ENGINE &&
+       smtp_config_io_engine_from_text(g_value_get_string(value)) < 0) {
+        g_set_error(error,error_domain,error_code,
+            "unknown I/O engine \"%s\"",g_value_get_string(value));
+        return FALSE;
+    }
+    g_object_set_property(G_OBJECT(config),desc->name,value);
+    return TRUE;
+}
+
+const GOptionEntry* d_smtp_config_get_option_entries()
+{
+    static GOptionEntry* entries{nullptr};
+    if(g_once_init_enter(&entries)) {
+        // The last entry is zeroed and terminates the array.
+        auto new_entries = g_new0(GOptionEntry,NR_SMTP_CONFIG_PARAMS + 1);
+        for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+            const DSmtpConfigParam* desc = &smtp_config_params[param];
+            new_entries[param].long_name = desc->name;
+            new_entries[param].arg = desc->is_string ? G_OPTION_ARG_STRING : G_OPTION_ARG_INT;
+            new_entries[param].description = desc->description;
+            new_entries[param].arg_description = desc->arg_description;
+        }
+        g_once_init_leave(&entries,new_entries);
+    }
+    return entries;
+}
+
+gboolean d_smtp_config_load_file(
+    DSmtpConfig* config,
+    const gchar* file_name,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONFIG(config),FALSE);
+    g_autoptr(GKeyFile) key_file = g_key_file_new();
+    if(!g_key_file_load_from_file(key_file,file_name,G_KEY_FILE_NONE,error)) {
+        return FALSE;
+    }
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        const DSmtpConfigParam* desc = &smtp_config_params[param];
+        if(!g_key_file_has_key(key_file,desc->group,desc->key,NULL)) {
+            continue;
+        }
+        GError* local_error{nullptr};
+        g_auto(GValue) value = G_VALUE_INIT;
+        if(desc->is_string) {
+            gchar* text = g_key_file_get_string(key_file,desc->group,desc->key,&local_error);
+            if(!text) {
+                g_propagate_error(error,local_error);
+                return FALSE;
+            }
+            g_value_init(&value,G_TYPE_STRING);
+            g_value_take_string(&value,text);
+        } else {
+            guint64 number = g_key_file_get_uint64(key_file,desc->group,desc->key,&local_error);
+            if(local_error) {
+                g_propagate_error(error,local_error);
+                return FALSE;
+            }
+            if(number > G_MAXUINT) {
+                number = G_MAXUINT;
+            }
+            g_value_init(&value,G_TYPE_UINT);
+            g_value_set_uint(&value,guint(number));
+        }
+        if(!d_smtp_config_set_param(config,param,&value,
+            G_KEY_FILE_ERROR,G_KEY_FILE_ERROR_INVALID_VALUE,error)) {
+            g_prefix_error(error,"%s: [%s] %s: ",file_name,desc->group,desc->key);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean d_smtp_config_load_options(
+    DSmtpConfig* config,
+    GVariantDict* options,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONFIG(config),FALSE);
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        const DSmtpConfigParam* desc = &smtp_config_params[param];
+        g_auto(GValue) value = G_VALUE_INIT;
+        if(desc->is_string) {
+            const gchar* text{nullptr};
+            if(!g_variant_dict_lookup(options,desc->name,"&s",&text)) {
+                continue;
+            }
+            g_value_init(&value,G_TYPE_STRING);
+            g_value_set_string(&value,text);
+        } else {
+            gint32 number{0};
+            if(!g_variant_dict_lookup(options,desc->name,"i",&number)) {
+                continue;
+            }
+            if(number < 0) {
+                g_set_error(error,G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,
+                    "value of \"%s\" must not be negative",desc->name);
+                return FALSE;
+            }
+            g_value_init(&value,G_TYPE_UINT);
+            g_value_set_uint(&value,guint(number));
+        }
+        if(!d_smtp_config_set_param(config,param,&value,
+            G_OPTION_ERROR,G_OPTION_ERROR_BAD_VALUE,error)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+gboolean d_smtp_config_restart_required(
+    DSmtpConfig* config,
+    DSmtpConfig* new_config)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONFIG(config),FALSE);
+    g_return_val_if_fail(D_IS_SMTP_CONFIG(new_config),FALSE);
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        const DSmtpConfigParam* desc = &smtp_config_params[param];
+        if(!desc->restart) {
+            continue;
+        }
+        if(g_param_values_cmp(d_smtp_config_properties[param],
+            &config->values[param],&new_config->values[param]) != 0) {
+            g_message("config: \"%s\" can't be changed without restart",desc->name);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+const gchar* d_smtp_config_get_listen_address(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_LISTEN_ADDRESS]);
+}
+
+guint d_smtp_config_get_listen_port(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_LISTEN_PORT]);
+}
+
+guint d_smtp_config_get_listen_backlog(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_LISTEN_BACKLOG]);
+}
+
+guint d_smtp_config_get_workers(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_WORKERS]);
+}
+
+guint d_smtp_config_get_max_connections(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_MAX_CONNECTIONS]);
+}
+
+guint d_smtp_config_get_read_buffer_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_READ_BUFFER_SIZE]);
+}
+
+guint d_smtp_config_get_read_timeout(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_READ_TIMEOUT]);
+}
+
+guint d_smtp_config_get_data_timeout(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DATA_TIMEOUT]);
+}
+
+guint d_smtp_config_get_write_timeout(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_WRITE_TIMEOUT]);
+}
+
+guint d_smtp_config_get_close_timeout(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_CLOSE_TIMEOUT]);
+}
+
+const gchar* d_smtp_config_get_spool_directory(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_SPOOL_DIRECTORY]);
+}
+
+guint d_smtp_config_get_spool_commit_window(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_SPOOL_COMMIT_WINDOW]);
+}
+
+guint d_smtp_config_get_spool_compression(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_SPOOL_COMPRESSION]);
+}
+
+const gchar* d_smtp_config_get_spool_dictionary(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_SPOOL_DICTIONARY]);
+}
+
+const gchar* d_smtp_config_get_tls_certificate(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_TLS_CERTIFICATE]);
+}
+
+const gchar* d_smtp_config_get_tls_key(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_TLS_KEY]);
+}
+
+guint d_smtp_config_get_tls_handshake_threads(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_TLS_HANDSHAKE_THREADS]);
+}
+
+guint d_smtp_config_get_max_header_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_MAX_HEADER_SIZE]);
+}
+
+guint d_smtp_config_get_max_message_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_MAX_MESSAGE_SIZE]);
+}
+
+const gchar* d_smtp_config_get_trace_file(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_TRACE_FILE]);
+}
+
+guint d_smtp_config_get_trace_records(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_TRACE_RECORDS]);
+}
+
+guint d_smtp_config_get_rebalance_threshold(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_REBALANCE_THRESHOLD]);
+}
+
+guint d_smtp_config_get_watchdog_interval(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_WATCHDOG_INTERVAL]);
+}
+
+guint d_smtp_config_get_watchdog_stall_threshold(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_WATCHDOG_STALL_THRESHOLD]);
+}
+
+const gchar* d_smtp_config_get_dns_server(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_DNS_SERVER]);
+}
+
+guint d_smtp_config_get_dns_cache_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNS_CACHE_SIZE]);
+}
+
+guint d_smtp_config_get_dns_negative_ttl(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNS_NEGATIVE_TTL]);
+}
+
+guint d_smtp_config_get_dns_max_ttl(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNS_MAX_TTL]);
+}
+
+guint d_smtp_config_get_dns_threads(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNS_THREADS]);
+}
+
+const gchar* d_smtp_config_get_dnsbl_zones(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_DNSBL_ZONES]);
+}
+
+guint d_smtp_config_get_dnsbl_cache_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNSBL_CACHE_SIZE]);
+}
+
+guint d_smtp_config_get_dnsbl_cache_ttl(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DNSBL_CACHE_TTL]);
+}
+
+guint d_smtp_config_get_spf_cache_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_SPF_CACHE_SIZE]);
+}
+
+guint d_smtp_config_get_dkim_key_cache_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DKIM_KEY_CACHE_SIZE]);
+}
+
+const gchar* d_smtp_config_get_dkim_sign_keys(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_DKIM_SIGN_KEYS]);
+}
+
+guint d_smtp_config_get_dkim_sign_batch(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_DKIM_SIGN_BATCH]);
+}
+
+guint d_smtp_config_get_greylist_size(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_GREYLIST_SIZE]);
+}
+
+guint d_smtp_config_get_greylist_delay(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_GREYLIST_DELAY]);
+}
+
+guint d_smtp_config_get_greylist_retry_window(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_GREYLIST_RETRY_WINDOW]);
+}
+
+guint d_smtp_config_get_greylist_pass_ttl(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_GREYLIST_PASS_TTL]);
+}
+
+const gchar* d_smtp_config_get_greylist_snapshot_file(DSmtpConfig* config)
+{
+    return g_value_get_string(&config->values[SMTP_CONFIG_GREYLIST_SNAPSHOT_FILE]);
+}
+
+guint d_smtp_config_get_greylist_snapshot_interval(DSmtpConfig* config)
+{
+    return g_value_get_uint(&config->values[SMTP_CONFIG_GREYLIST_SNAPSHOT_INTERVAL]);
+}
+
+SMTP_IO_ENGINE d_smtp_config_get_io_engine(DSmtpConfig* config)
+{
+    return SMTP_IO_ENGINE(smtp_config_io_engine_from_text(
+        g_value_get_string(&config->values[SMTP_CONFIG_IO_ENGINE])));
+}
+
+GLogLevelFlags d_smtp_config_get_log_level(DSmtpConfig* config)
+{
+    return smtp_config_log_level_from_text(
+        g_value_get_string(&config->values[SMTP_CONFIG_LOG_LEVEL]));
+}
+
+static void d_smtp_config_get_property(GObject *object, guint prop_id,
+                                           GValue *value, GParamSpec *pspec)
+{
+    auto config = D_SMTP_CONFIG(object);
+    guint param = prop_id - PROP_SMTP_CONFIG_BASE;
+    if(param >= NR_SMTP_CONFIG_PARAMS) {
+        g_error("unknown get property: %s",g_param_spec_get_name(pspec));
+    }
+    g_value_copy(&config->values[param],value);
+}
+
+static void d_smtp_config_set_property(GObject *object, guint prop_id,
+                                           const GValue *value,
+                                           GParamSpec *pspec)
+{
+    auto config = D_SMTP_CONFIG(object);
+    guint param = prop_id - PROP_SMTP_CONFIG_BASE;
+    if(param >= NR_SMTP_CONFIG_PARAMS) {
+        g_error("unknown set property: %s",g_param_spec_get_name(pspec));
+    }
+    g_value_copy(value,&config->values[param]);
+}
+
+static void d_smtp_config_init(DSmtpConfig* config)
+{
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        g_param_value_set_default(d_smtp_config_properties[param],
+            g_value_init(&config->values[param],
+                G_PARAM_SPEC_VALUE_TYPE(d_smtp_config_properties[param])));
+    }
+}
+
+static void d_smtp_config_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_CONFIG(object));
+    auto config = D_SMTP_CONFIG(object);
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        g_value_unset(&config->values[param]);
+    }
+    G_OBJECT_CLASS(d_smtp_config_parent_class)->finalize(object);
+}
+
+static void d_smtp_config_class_init(DSmtpConfigClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->get_property = d_smtp_config_get_property;
+    object_class->set_property = d_smtp_config_set_property;
+    object_class->finalize = d_smtp_config_finalize;
+
+    for(guint param = 0; param < NR_SMTP_CONFIG_PARAMS; param++) {
+        const DSmtpConfigParam* desc = &smtp_config_params[param];
+        auto flags = GParamFlags(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+        if(desc->is_string) {
+            d_smtp_config_properties[param] = g_param_spec_string(
+                desc->name, desc->name, desc->description,
+                desc->default_string, flags);
+        } else {
+            d_smtp_config_properties[param] = g_param_spec_uint(
+                desc->name, desc->name, desc->description,
+                desc->minimum, desc->maximum, desc->default_value, flags);
+        }
+        g_object_class_install_property(
+            object_class, PROP_SMTP_CONFIG_BASE + param,
+            d_smtp_config_properties[param]);
+    }
+}
+
+/**
+ * @brief Create new instance of configuration with default values.
+ */
+DSmtpConfig* d_smtp_config_new()
+{
+    auto config = reinterpret_cast<DSmtpConfig*>(
+        g_object_new(
+            D_TYPE_SMTP_CONFIG,
+            NULL));
+
+    return config;
+}
+
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_CONFIG__HPP__
+#define __D__NEW__SMTP_CONFIG__HPP__
+/**
+ * @brief SMTP server configuration object.
+ * @details Every tunable value of the server is a property of this object.
+ * Values are taken from the built in defaults, then from the GKeyFile
+ * configuration file and at last from the command line options.
+ * The object is treated as immutable once it has been handed over to the
+ * server: reloading the configuration creates a new instance.
+ *
+ * Configuration file layout:
+ * @code
+ * [server]
+ * listen-address=127.0.0.1
+ * listen-port=8425
+ * listen-backlog=128
+ * workers=4
+ * max-connections=10000
+ * read-buffer-size=2048
+ * io-engine=socket
+ * rebalance-threshold=750
+ *
+ * [timeouts]
+ * read=60
+ * data=120
+ * write=10
+ * close=10
+ *
+ * [spool]
+ * directory=/var/spool/dsmtp
+ * commit-window=0
+ * compression=6
+ * dictionary=/etc/dsmtp/spool.dict
+ *
+ * [tls]
+ * certificate=/etc/dsmtp/cert.pem
+ * key=/etc/dsmtp/key.pem
+ * handshake-threads=2
+ *
+ * [message]
+ * max-header-size=65536
+ * max-message-size=26214400
+ *
+ * [trace]
+ * file=/var/run/dsmtp/trace.ring
+ * records=65536
+ *
+ * [watchdog]
+ * interval=100
+ * stall-threshold=1000
+ *
+ * [dns]
+ * server=127.0.0.1:53
+ * cache-size=65536
+ * negative-ttl=60
+ * max-ttl=86400
+ * threads=4
+ *
+ * [dnsbl]
+ * zones=zen.spamhaus.org,bl.spamcop.net
+ * cache-size=16384
+ * cache-ttl=300
+ *
+ * [spf]
+ * cache-size=16384
+ *
+ * [dkim]
+ * key-cache-size=16384
+ * sign-keys=example.com:mail:/etc/dkim/example.com.pem
+ * sign-batch=64
+ *
+ * [greylist]
+ * size=1048576
+ * delay=300
+ * retry-window=14400
+ * pass-ttl=3110400
+ * snapshot-file=/var/lib/gio-smtp/greylist
+ * snapshot-interval=300
+ *
+ * [log]
+ * level=message
+ * @endcode
+ */
+
+#include <gio/gio.h>
+
+/**
+ * @brief The connections I/O engine.
+ */
+enum SMTP_IO_ENGINE
+{
+    /// @brief GSocketConnection streams and GIO async operations.
+    SMTP_IO_ENGINE_GIO,
+    /// @brief Non-blocking GSocket calls driven by the socket readiness.
+    SMTP_IO_ENGINE_SOCKET,
+    /// @brief Linux io_uring, falls back to GIO if isn't supported.
+    SMTP_IO_ENGINE_URING
+};
+
+extern "C" {
+#define D_TYPE_SMTP_CONFIG (d_smtp_config_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpConfig,d_smtp_config,D,SMTP_CONFIG,GObject)
+
+/**
+ * @brief Get the command line option entries for configuration values.
+ * @details The entries are suitable for g_application_add_main_option_entries.
+ * The long name of every entry is the same as configuration property name.
+ */
+const GOptionEntry* d_smtp_config_get_option_entries();
+
+/**
+ * @brief Load values from GKeyFile configuration file.
+ * @param [in] config Configuration object instance.
+ * @param [in] file_name The configuration file path.
+ * @param [out] error The location for error or NULL.
+ * @return In case of success function returns TRUE.
+ */
+gboolean d_smtp_config_load_file(
+    DSmtpConfig* config,
+    const gchar* file_name,
+    GError** error);
+
+/**
+ * @brief Load values from the parsed command line options.
+ * @details Only the options present in dictionary are changed.
+ * @param [in] config Configuration object instance.
+ * @param [in] options The options dictionary of the command line.
+ * @param [out] error The location for error or NULL.
+ * @return In case of success function returns TRUE.
+ */
+gboolean d_smtp_config_load_options(
+    DSmtpConfig* config,
+    GVariantDict* options,
+    GError** error);
+
+/**
+ * @brief Test if value can't be changed without the server restart.
+ * @details Compare the values which are used only at server start
+ * (listen address and port, backlog, workers count, I/O engine, spool
+ * directory and compression, trace file, watchdog interval, DNS resolver, DNSBL zones,
+ * SPF record and DKIM key caches, DKIM signing keys, greylist).
+ * @return Function returns TRUE if any of such values are differs.
+ */
+gboolean d_smtp_config_restart_required(
+    DSmtpConfig* config,
+    DSmtpConfig* new_config);
+
+const gchar* d_smtp_config_get_listen_address(DSmtpConfig* config);
+guint d_smtp_config_get_listen_port(DSmtpConfig* config);
+guint d_smtp_config_get_listen_backlog(DSmtpConfig* config);
+guint d_smtp_config_get_workers(DSmtpConfig* config);
+guint d_smtp_config_get_max_connections(DSmtpConfig* config);
+guint d_smtp_config_get_read_buffer_size(DSmtpConfig* config);
+guint d_smtp_config_get_read_timeout(DSmtpConfig* config);
+guint d_smtp_config_get_data_timeout(DSmtpConfig* config);
+guint d_smtp_config_get_write_timeout(DSmtpConfig* config);
+guint d_smtp_config_get_close_timeout(DSmtpConfig* config);
+const gchar* d_smtp_config_get_spool_directory(DSmtpConfig* config);
+guint d_smtp_config_get_spool_commit_window(DSmtpConfig* config);
+guint d_smtp_config_get_spool_compression(DSmtpConfig* config);
+const gchar* d_smtp_config_get_spool_dictionary(DSmtpConfig* config);
+SMTP_IO_ENGINE d_smtp_config_get_io_engine(DSmtpConfig* config);
+guint d_smtp_config_get_rebalance_threshold(DSmtpConfig* config);
+const gchar* d_smtp_config_get_tls_certificate(DSmtpConfig* config);
+const gchar* d_smtp_config_get_tls_key(DSmtpConfig* config);
+guint d_smtp_config_get_tls_handshake_threads(DSmtpConfig* config);
+guint d_smtp_config_get_max_header_size(DSmtpConfig* config);
+guint d_smtp_config_get_max_message_size(DSmtpConfig* config);
+const gchar* d_smtp_config_get_trace_file(DSmtpConfig* config);
+guint d_smtp_config_get_trace_records(DSmtpConfig* config);
+guint d_smtp_config_get_watchdog_interval(DSmtpConfig* config);
+guint d_smtp_config_get_watchdog_stall_threshold(DSmtpConfig* config);
+const gchar* d_smtp_config_get_dns_server(DSmtpConfig* config);
+guint d_smtp_config_get_dns_cache_size(DSmtpConfig* config);
+guint d_smtp_config_get_dns_negative_ttl(DSmtpConfig* config);
+guint d_smtp_config_get_dns_max_ttl(DSmtpConfig* config);
+guint d_smtp_config_get_dns_threads(DSmtpConfig* config);
+const gchar* d_smtp_config_get_dnsbl_zones(DSmtpConfig* config);
+guint d_smtp_config_get_dnsbl_cache_size(DSmtpConfig* config);
+guint d_smtp_config_get_dnsbl_cache_ttl(DSmtpConfig* config);
+guint d_smtp_config_get_spf_cache_size(DSmtpConfig* config);
+guint d_smtp_config_get_dkim_key_cache_size(DSmtpConfig* config);
+const gchar* d_smtp_config_get_dkim_sign_keys(DSmtpConfig* config);
+guint d_smtp_config_get_dkim_sign_batch(DSmtpConfig* config);
+guint d_smtp_config_get_greylist_size(DSmtpConfig* config);
+guint d_smtp_config_get_greylist_delay(DSmtpConfig* config);
+guint d_smtp_config_get_greylist_retry_window(DSmtpConfig* config);
+guint d_smtp_config_get_greylist_pass_ttl(DSmtpConfig* config);
+const gchar* d_smtp_config_get_greylist_snapshot_file(DSmtpConfig* config);
+guint d_smtp_config_get_greylist_snapshot_interval(DSmtpConfig* config);
+
+/**
+ * @brief Get the maximum log level will be passed to the log output.
+ */
+GLogLevelFlags d_smtp_config_get_log_level(DSmtpConfig* config);
+
+/**
+ * @brief Create new instance of configuration with default values.
+ */
+DSmtpConfig* d_smtp_config_new();
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_CONFIG__HPP__
@@ -14,26 +14,109 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "d_smtp_connection.hpp"
+#include "d_smtp_config.hpp"
+#include "d_buffer_pool.hpp"
+#include "d_uring.hpp"
+#include "d_smtp_tls.hpp"
 #include "d_smtp_command.hpp"
 #include "d_smtp_state.hpp"
+#include "d_smtp_transaction.hpp"
+#include "d_smtp_spool.hpp"
+#include "d_smtp_trace.hpp"
+#include "d_smtp_probes.hpp"
+#include "d_dns_cache.hpp"
+#include "d_dnsbl.hpp"
+#include "d_spf.hpp"
+#include "d_dkim.hpp"
+#include "d_greylist.hpp"
 #include "d_timeout.hpp"
 
-#define DATA_END ".\r\n"
+#include <errno.h>
 
 extern "C" {
 
 struct _DSmtpConnection
 {
     GObject parent;
+    GSocket* socket;
+    /// @brief Stream wrapper of the socket, used only by the GIO engine.
     GSocketConnection* socket_connection;
+    /// @brief The I/O engine selected at construction time.
+    SMTP_IO_ENGINE io_engine;
+    /// @brief The close is initiated, the disconnected is emitted once.
+    gboolean closing;
+    /// @brief The "safe-point" signal is being emitted.
+    gboolean at_safe_point;
+    /// @brief The connection is handed over to other context at the safe point.
+    gboolean detached;
 
     gchar* my_host_name;
     // Read, write and close operations timeout processor.
     DTimeout* timeout;
     /// @brief Current connection state.
-    DSmtpState* state;
+    DSmtpState state;
+    /// @brief Current mail transaction, reset between the messages.
+    DSmtpTransaction transaction;
+    /// @brief The client domain of the last HELO/EHLO.
+    gchar* helo_domain;
+    /// @brief The forward confirmed host name of the client or NULL.
+    gchar* remote_host;
+    /// @brief The client host name lookup is in progress.
+    gboolean dns_pending;
+    /// @brief The client address blocklist check is in progress.
+    gboolean dnsbl_pending;
+    /// @brief The next command read waits for the blocklist check.
+    gboolean dnsbl_waiting;
+    /// @brief The blocklist zone listing the client or NULL.
+    gchar* dnsbl_listed;
+    /// @brief The SPF check of the MAIL FROM is in progress.
+    gboolean spf_pending;
+    /// @brief The state the rejected MAIL returns to.
+    SMTP_STATE spf_previous_state;
+    /// @brief The SPF result of the current transaction is known.
+    gboolean spf_checked;
+    SPF_RESULT spf_result;
+    /// @brief The DKIM verification of the message being received or NULL.
+    DDkimVerifier* dkim_verifier;
+    /// @brief The DKIM signing of the message being received or NULL.
+    DDkimSigning* dkim_signing;
+    /// @brief The DKIM signatures check or signing of the received message is in progress.
+    gboolean dkim_pending;
     /// @brief Transient write buffer.
     GBytes* writing_bytes;
+    /// @brief The size of the one read request.
+    guint read_buffer_size;
+    /// @brief Shared pool of receive and transmit buffers of read_buffer_size.
+    DBufferPool* buffer_pool;
+    /// @brief Readiness source used while waiting for the next command.
+    GSource* read_source;
+    /// @brief Received bytes not processed yet: the partial or pipelined
+    /// command lines and the bytes after the end of data.
+    GByteArray* input;
+    /// @brief The rest of the too long command line is skipped.
+    gboolean input_discarding;
+    /// @brief The read for the next command or data is started.
+    gboolean awaiting_input;
+    /// @brief Readiness source used while the send is blocked, socket engine only.
+    GSource* write_source;
+    /// @brief The number of writing_bytes already sent, socket and io_uring engines.
+    gsize written_count;
+    /// @brief The ring of the connection thread, io_uring engine only.
+    DUring* uring;
+    /// @brief The receive in flight, io_uring engine only.
+    DUringOperation* recv_operation;
+    /// @brief The send in flight, io_uring engine only.
+    DUringOperation* send_operation;
+    /// @brief TLS context, NULL if STARTTLS isn't offered.
+    DSmtpTls* tls;
+    /// @brief The TLS stream over socket_connection after STARTTLS.
+    GIOStream* tls_connection;
+    /// @brief The client offered the session resumption.
+    gboolean tls_resumption_offered;
+    /// @brief Monotonic time of the handshake start.
+    gint64 handshake_start;
+    /// @brief The session phases latency trace.
+    DSmtpTrace trace;
 };
 typedef _DSmtpConnection DSmtpConnection;
 
@@ -47,11 +130,15 @@ struct _DSmtpConnectionClass
 enum {
     PROP_READ_TIMEOUT = 2000,
     PROP_WRITE_TIMEOUT,
-    PROP_CLOSE_TIMEOUT
+    PROP_CLOSE_TIMEOUT,
+    PROP_DATA_TIMEOUT,
+    PROP_READ_BUFFER_SIZE,
+    PROP_IO_ENGINE
 };
 
 enum {
     SIGNAL_DISCONNECTED,
+    SIGNAL_SAFE_POINT,
     NR_SIGNALS
 };
 static guint d_smtp_connection_signals[NR_SIGNALS];
@@ -61,11 +148,40 @@ static void d_smtp_connection_canceled(
     gpointer user_data)
 {
     g_message("canceled!!!");
-    /// TODO: Perform actions that need to be executed in case of operation has been canceled.
+    auto connection = D_SMTP_CONNECTION(user_data);
+    // The ring operations aren't bound to the cancellable object.
+    if(connection->io_engine == SMTP_IO_ENGINE_URING) {
+        d_smtp_connection_close(connection);
+    }
 }
 
+/**
+ * @brief Completion handler of the client host name lookup.
+ */
+static void d_smtp_connection_verify_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    connection->dns_pending = FALSE;
+    connection->remote_host = d_dns_cache_verify_address_finish(D_DNS_CACHE(source_object),res,&error);
+    if(error) {
+        g_debug("client host name lookup failed: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+}
+
+static void d_smtp_connection_dnsbl_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data);
+
 /**
  * @brief Setup socket.
+ * @details The client host name is looked up and the client address is
+ * checked in the blocklists while the greeting is sent.
  */
 static void d_smtp_connection_set_socket(DSmtpConnection* connection,GSocket* socket)
 {
@@ -75,10 +191,41 @@ static void d_smtp_connection_set_socket(DSmtpConnection* connection,GSocket* so
         auto raddr = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote));
         g_autofree gchar* addr_str = g_inet_address_to_string(raddr);
         g_message("new remote connection from: %s:%d", addr_str, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(remote)));
+        g_autoptr(DDnsCache) dns_cache = d_dns_cache_get_default();
+        if(dns_cache) {
+            connection->dns_pending = TRUE;
+            d_dns_cache_verify_address_async(dns_cache,raddr,NULL,
+                d_smtp_connection_verify_handle,g_object_ref(connection));
+        }
+        g_autoptr(DDnsbl) dnsbl = d_dnsbl_get_default();
+        if(dnsbl) {
+            connection->dnsbl_pending = TRUE;
+            d_dnsbl_check_async(dnsbl,raddr,NULL,
+                d_smtp_connection_dnsbl_handle,g_object_ref(connection));
+        }
         g_object_unref(remote);
     }
-    connection->socket_connection = g_socket_connection_factory_create_connection(socket);
-    d_smtp_state_set_next_state(connection->state,SMTP_STATE_GREETING_SENDING);
+    connection->socket = G_SOCKET(g_object_ref(socket));
+    if(connection->io_engine == SMTP_IO_ENGINE_URING) {
+        auto uring = d_uring_is_supported() ?
+            d_uring_get_thread_default(connection->read_buffer_size,&error) : NULL;
+        if(uring) {
+            connection->uring = D_URING(g_object_ref(uring));
+        } else {
+            if(error) {
+                g_warning("io_uring create failed: %d %s",error->code,error->message);
+                g_clear_error(&error);
+            }
+            connection->io_engine = SMTP_IO_ENGINE_GIO;
+        }
+    }
+    if(connection->io_engine == SMTP_IO_ENGINE_GIO) {
+        connection->socket_connection = g_socket_connection_factory_create_connection(socket);
+    } else {
+        // Direct calls must never block the worker thread.
+        g_socket_set_blocking(socket,FALSE);
+    }
+    d_smtp_state_set_next_state(&connection->state,SMTP_STATE_GREETING_SENDING);
 }
 
 static void d_smtp_connection_send_response_text(
@@ -89,83 +236,994 @@ static void d_smtp_connection_send_response_code(
     DSmtpConnection* connection,
     guint response_code);
 
+static void d_smtp_connection_read_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data);
+
+static gboolean d_smtp_connection_readable_handle(
+    GSocket* socket,
+    GIOCondition condition,
+    gpointer user_data);
+
+static gboolean d_smtp_connection_writable_handle(
+    GSocket* socket,
+    GIOCondition condition,
+    gpointer user_data);
+
+static void d_smtp_connection_uring_handle(
+    DUringOperation* operation,
+    gint result,
+    guint buffer_id,
+    gboolean more,
+    gpointer user_data);
+
+static gboolean d_smtp_connection_stream_readable_handle(
+    GObject* stream,
+    gpointer user_data);
+
+/**
+ * @brief Get the stream of the GIO engine.
+ * @details The TLS stream replaces the socket stream after STARTTLS.
+ */
+static GIOStream* d_smtp_connection_get_stream(
+    DSmtpConnection* connection)
+{
+    if(connection->tls_connection) {
+        return connection->tls_connection;
+    }
+    return G_IO_STREAM(connection->socket_connection);
+}
+
+/**
+ * @brief Wait until the socket becomes readable.
+ * @details Idle connection doesn't hold any read buffer or pending
+ * async operation, only the socket readiness source.
+ */
+static void d_smtp_connection_wait_readable(
+    DSmtpConnection* connection)
+{
+    if(connection->tls_connection) {
+        // The TLS stream may have already decrypted bytes buffered.
+        auto is = g_io_stream_get_input_stream(connection->tls_connection);
+        connection->read_source = g_pollable_input_stream_create_source(
+            G_POLLABLE_INPUT_STREAM(is),d_timeout_get_cancelable(connection->timeout));
+        g_source_set_callback(connection->read_source,
+            G_SOURCE_FUNC(d_smtp_connection_stream_readable_handle), connection, NULL);
+        g_source_attach(connection->read_source, g_main_context_get_thread_default());
+        return;
+    }
+    connection->read_source = g_socket_create_source(connection->socket,
+        GIOCondition(G_IO_IN | G_IO_HUP | G_IO_ERR),
+        d_timeout_get_cancelable(connection->timeout));
+    g_source_set_callback(connection->read_source,
+        G_SOURCE_FUNC(d_smtp_connection_readable_handle), connection, NULL);
+    g_source_attach(connection->read_source, g_main_context_get_thread_default());
+}
+
+/**
+ * @brief Wait until the socket send buffer has a room.
+ */
+static void d_smtp_connection_wait_writable(
+    DSmtpConnection* connection)
+{
+    connection->write_source = g_socket_create_source(connection->socket,
+        GIOCondition(G_IO_OUT | G_IO_HUP | G_IO_ERR),
+        d_timeout_get_cancelable(connection->timeout));
+    g_source_set_callback(connection->write_source,
+        G_SOURCE_FUNC(d_smtp_connection_writable_handle), connection, NULL);
+    g_source_attach(connection->write_source, g_main_context_get_thread_default());
+}
+
+/**
+ * @brief Submit the ring receive to the provided buffer.
+ */
+static void d_smtp_connection_uring_recv(
+    DSmtpConnection* connection)
+{
+    // The operation in flight holds the connection reference.
+    connection->recv_operation = d_uring_recv(connection->uring,
+        g_socket_get_fd(connection->socket),
+        d_smtp_connection_uring_handle,g_object_ref(connection));
+    if(!connection->recv_operation) {
+        g_object_unref(connection);
+        d_smtp_connection_close(connection);
+    }
+}
+
+static void d_smtp_connection_process_input(
+    DSmtpConnection* connection);
+
 /**
- * @brief Test for valid command input
+ * @brief Idle handler of the buffered input.
  */
-static gboolean d_smtp_connection_test_input(
+static gboolean d_smtp_connection_input_handle(
+    gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    // The source is destroyed by returning G_SOURCE_REMOVE.
+    g_clear_pointer(&connection->read_source,g_source_unref);
+    d_smtp_connection_process_input(connection);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Check the buffered input is processed without reading.
+ * @return TRUE if the input has the message data, the complete
+ * command line or the rest of the too long line.
+ */
+static gboolean d_smtp_connection_has_input(
+    DSmtpConnection* connection,
+    SMTP_STATE state)
+{
+    if(!connection->input->len) {
+        return FALSE;
+    }
+    if(d_smtp_state_is_data_accepted(state) || connection->input_discarding) {
+        return TRUE;
+    }
+    return memchr(connection->input->data,'\n',connection->input->len) != NULL;
+}
+
+/**
+ * @brief Start async operation for reading next portion of bytes.
+ * @details The message data and commands are waited with the different timeouts.
+ * Commands are read on socket readiness, the message data is read by the
+ * stream async operation of the GIO engine or on readiness by the socket engine.
+ * The io_uring engine receives both to the ring provided buffers.
+ * After STARTTLS everything is read on the TLS stream readiness.
+ * The buffered pipelined commands are processed before any read.
+ */
+static void d_smtp_connection_read_next(
+    DSmtpConnection* connection)
+{
+    SMTP_STATE state = d_smtp_state_get_current_state(&connection->state);
+    if(d_smtp_connection_has_input(connection,state)) {
+        if(!d_smtp_state_is_data_accepted(state) && connection->dnsbl_pending) {
+            connection->dnsbl_waiting = TRUE;
+            return;
+        }
+        // Processed from the main loop, the synchronous send of the
+        // socket engine doesn't recurse through the pipelined commands.
+        connection->read_source = g_idle_source_new();
+        g_source_set_priority(connection->read_source,G_PRIORITY_DEFAULT);
+        g_source_set_callback(connection->read_source,
+            d_smtp_connection_input_handle, connection, NULL);
+        g_source_attach(connection->read_source, g_main_context_get_thread_default());
+        return;
+    }
+    connection->awaiting_input = TRUE;
+    if(connection->io_engine == SMTP_IO_ENGINE_URING) {
+        d_timeout_start(connection->timeout,
+            d_smtp_state_is_data_accepted(state) ? TIMEOUT_OPERATION_DATA : TIMEOUT_OPERATION_READ);
+        // The receive is usually linked to the response send and already in flight.
+        if(!connection->recv_operation) {
+            d_smtp_connection_uring_recv(connection);
+        }
+        return;
+    }
+    if(!d_smtp_state_is_data_accepted(state)) {
+        if(connection->dnsbl_pending) {
+            // The first command is read when the blocklist check completes.
+            connection->dnsbl_waiting = TRUE;
+            return;
+        }
+        // Nothing is in flight between the commands, the owner may move
+        // the connection to other context from the signal handler.
+        connection->at_safe_point = TRUE;
+        g_signal_emit(connection,d_smtp_connection_signals[SIGNAL_SAFE_POINT],0,NULL);
+        connection->at_safe_point = FALSE;
+        if(connection->detached) {
+            return;
+        }
+        d_timeout_start(connection->timeout,TIMEOUT_OPERATION_READ);
+        d_smtp_connection_wait_readable(connection);
+        return;
+    }
+    // Set the read timeout.
+    d_timeout_start(connection->timeout,TIMEOUT_OPERATION_DATA);
+    if(connection->io_engine == SMTP_IO_ENGINE_SOCKET || connection->tls_connection) {
+        d_smtp_connection_wait_readable(connection);
+        return;
+    }
+    // Switch to reading.
+    auto is = g_io_stream_get_input_stream(d_smtp_connection_get_stream(connection));
+    g_input_stream_read_bytes_async(is, connection->read_buffer_size, G_PRIORITY_DEFAULT,
+                                    d_timeout_get_cancelable(connection->timeout),
+                                    d_smtp_connection_read_handle, connection);
+}
+
+/**
+ * @brief Get the client address as text.
+ * @return The address string or NULL, caller owns the string.
+ */
+static gchar* d_smtp_connection_get_remote_address(
+    DSmtpConnection* connection)
+{
+    g_autoptr(GSocketAddress) remote = g_socket_get_remote_address(connection->socket,NULL);
+    if(!remote || !G_IS_INET_SOCKET_ADDRESS(remote)) {
+        return NULL;
+    }
+    return g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote)));
+}
+
+/**
+ * @brief Completion handler of the client address blocklist check.
+ * @details The deferred command read continues.
+ */
+static void d_smtp_connection_dnsbl_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    connection->dnsbl_pending = FALSE;
+    connection->dnsbl_listed = d_dnsbl_check_finish(D_DNSBL(source_object),res,&error);
+    if(error) {
+        g_warning("DNSBL check failed: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+    if(connection->dnsbl_waiting && !connection->closing) {
+        connection->dnsbl_waiting = FALSE;
+        d_smtp_connection_read_next(connection);
+    }
+}
+
+/**
+ * @brief Reject the command of the listed client and close the session.
+ */
+static void d_smtp_connection_reject_listed(
+    DSmtpConnection* connection)
+{
+    g_autofree gchar* address = d_smtp_connection_get_remote_address(connection);
+    g_message("client %s is listed by %s",address ? address : "unknown",connection->dnsbl_listed);
+    d_smtp_state_set_next_state(&connection->state,SMTP_STATE_QUIT_RECEIVED);
+    g_autofree gchar* response_text = g_strdup_printf(
+        "554 5.7.1 Service unavailable; client host [%s] blocked using %s\r\n",
+        address ? address : "unknown",connection->dnsbl_listed);
+    d_smtp_connection_send_response_text(connection,response_text);
+}
+
+/**
+ * @brief Completion handler of the MAIL FROM SPF check.
+ * @details The deferred MAIL response is sent, the failed sender is
+ * rejected and the session returns to the state before the MAIL.
+ */
+static void d_smtp_connection_spf_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    SPF_RESULT result = d_spf_check_host_finish(D_SPF(source_object),res,&error);
+    if(error) {
+        g_warning("SPF check failed: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+    connection->spf_pending = FALSE;
+    if(connection->closing) {
+        return;
+    }
+    connection->spf_checked = TRUE;
+    connection->spf_result = result;
+    if(result != SPF_RESULT_FAIL && result != SPF_RESULT_TEMPERROR) {
+        d_smtp_connection_send_response_code(connection,250);
+        return;
+    }
+    g_message("SPF %s for sender \"%s\"",d_spf_result_to_string(result),
+        connection->transaction.reverse_path->str);
+    d_smtp_state_set_next_state(&connection->state,connection->spf_previous_state);
+    d_smtp_transaction_reset(&connection->transaction);
+    d_smtp_connection_send_response_text(connection,result == SPF_RESULT_FAIL ?
+        "550 5.7.23 SPF validation failed\r\n" : "451 4.7.24 SPF validation error\r\n");
+}
+
+/**
+ * @brief Start the SPF check of the MAIL FROM sender.
+ * @return TRUE if the MAIL response waits for the check.
+ */
+static gboolean d_smtp_connection_check_spf(
+    DSmtpConnection* connection,
+    SMTP_STATE previous_state)
+{
+    g_autoptr(DSpf) spf = d_spf_get_default();
+    if(!spf) {
+        return FALSE;
+    }
+    g_autoptr(GSocketAddress) remote = g_socket_get_remote_address(connection->socket,NULL);
+    if(!remote || !G_IS_INET_SOCKET_ADDRESS(remote)) {
+        return FALSE;
+    }
+    connection->spf_pending = TRUE;
+    connection->spf_previous_state = previous_state;
+    d_spf_check_host_async(spf,g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote)),
+        connection->transaction.reverse_path->str,connection->helo_domain,NULL,
+        d_smtp_connection_spf_handle,g_object_ref(connection));
+    return TRUE;
+}
+
+/**
+ * @brief Check the recipient triplet in the greylist.
+ * @return TRUE if the recipient is accepted.
+ */
+static gboolean d_smtp_connection_check_greylist(
+    DSmtpConnection* connection,
+    const gchar* recipient)
+{
+    g_autoptr(DGreylist) greylist = d_greylist_get_default();
+    if(!greylist) {
+        return TRUE;
+    }
+    g_autoptr(GSocketAddress) remote = g_socket_get_remote_address(connection->socket,NULL);
+    if(!remote || !G_IS_INET_SOCKET_ADDRESS(remote)) {
+        return TRUE;
+    }
+    return d_greylist_check(greylist,g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(remote)),
+        connection->transaction.reverse_path->str,recipient);
+}
+
+/**
+ * @brief Send the EHLO response with the list of extensions.
+ * @details STARTTLS is offered until the TLS is established, the client
+ * sends EHLO again over the TLS stream.
+ */
+static void d_smtp_connection_send_ehlo_response(
+    DSmtpConnection* connection)
+{
+    g_autofree gchar* response_text = NULL;
+    // The commands are framed by lines, the pipelined ones are buffered.
+    if(connection->tls && !connection->tls_connection) {
+        response_text = g_strdup_printf("250-%s\r\n250-PIPELINING\r\n250 STARTTLS\r\n",connection->my_host_name);
+    } else {
+        response_text = g_strdup_printf("250-%s\r\n250 PIPELINING\r\n",connection->my_host_name);
+    }
+    d_smtp_connection_send_response_text(connection,response_text);
+}
+
+/**
+ * @brief Process the one command line.
+ * @details The unknown or malformed command and the command out of
+ * sequence are answered with the error, the session continues.
+ */
+static void d_smtp_connection_test_input(
     DSmtpConnection* connection,
     GBytes* bytes)
 {
     auto smtp_command = d_smtp_command_new();
     d_smtp_command_set_bytes(smtp_command,bytes);
-    if(!d_smtp_command_process(smtp_command)) {
+    if(!d_smtp_command_process(smtp_command) ||
+       d_smtp_command_get_smtp_command(smtp_command) == SMTP_COMMAND_UNKNOWN) {
         g_object_unref(smtp_command);
-        return FALSE;
+        d_smtp_connection_send_response_text(connection,"500 5.5.2 Syntax error, command unrecognized\r\n");
+        return;
     }
     SMTP_COMMAND command = d_smtp_command_get_smtp_command(smtp_command);
-    if(command == SMTP_COMMAND_UNKNOWN) {
+    // The listed client gets the rejection instead of the first response.
+    if(connection->dnsbl_listed && command != SMTP_COMMAND_QUIT) {
         g_object_unref(smtp_command);
-        return FALSE;
+        d_smtp_connection_reject_listed(connection);
+        return;
+    }
+    // The session continues without TLS, RFC 3207 4.
+    if(command == SMTP_COMMAND_STARTTLS && (!connection->tls || connection->tls_connection)) {
+        g_object_unref(smtp_command);
+        d_smtp_connection_send_response_text(connection,connection->tls_connection ?
+            "503 5.5.1 TLS already active\r\n" : "454 4.7.0 TLS not available\r\n");
+        return;
     }
 
-    if(!d_smtp_state_next_state_by_command(connection->state,command)) {
-        return FALSE;
+    SMTP_STATE previous_state = d_smtp_state_get_current_state(&connection->state);
+    if(!d_smtp_state_next_state_by_command(&connection->state,command)) {
+        g_object_unref(smtp_command);
+        d_smtp_state_set_next_state(&connection->state,previous_state);
+        d_smtp_connection_send_response_text(connection,"503 5.5.1 Bad sequence of commands\r\n");
+        return;
+    }
+
+    switch(command) {
+    case SMTP_COMMAND_HELO:
+    case SMTP_COMMAND_EHLO:
+        g_free(connection->helo_domain);
+        connection->helo_domain = g_strdup(d_smtp_command_get_domain(smtp_command));
+        d_smtp_transaction_reset(&connection->transaction);
+        break;
+    case SMTP_COMMAND_RSET:
+        d_smtp_transaction_reset(&connection->transaction);
+        break;
+    case SMTP_COMMAND_MAIL:
+        d_smtp_transaction_begin(&connection->transaction,d_smtp_command_get_path(smtp_command));
+        connection->spf_checked = FALSE;
+        // The MAIL response is sent when the sender policy is evaluated.
+        if(d_smtp_connection_check_spf(connection,previous_state)) {
+            g_object_unref(smtp_command);
+            return;
+        }
+        break;
+    case SMTP_COMMAND_RCPT:
+        // The deferred recipient isn't added, the session returns to the state before the RCPT.
+        if(!d_smtp_connection_check_greylist(connection,d_smtp_command_get_path(smtp_command))) {
+            g_object_unref(smtp_command);
+            d_smtp_state_set_next_state(&connection->state,previous_state);
+            d_smtp_connection_send_response_text(connection,"451 4.7.1 Greylisted, please try again later\r\n");
+            return;
+        }
+        d_smtp_transaction_add_recipient(&connection->transaction,d_smtp_command_get_path(smtp_command));
+        break;
+    default:
+        break;
+    }
+
+    guint response_code = d_smtp_command_get_response_code(smtp_command);
+    g_object_unref(smtp_command);
+    if(command == SMTP_COMMAND_EHLO) {
+        d_smtp_connection_send_ehlo_response(connection);
+    } else if(command == SMTP_COMMAND_STARTTLS) {
+        d_smtp_connection_send_response_text(connection,"220 Ready to start TLS\r\n");
+    } else {
+        d_smtp_connection_send_response_code(connection,response_code);
+    }
+}
+/**
+ * @brief Completion handler of the message store.
+ */
+static void d_smtp_connection_spool_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    g_autofree gchar* id = d_smtp_spool_store_finish(D_SMTP_SPOOL(source_object),res,&error);
+    if(connection->closing) {
+        g_clear_error(&error);
+        return;
+    }
+    if(!id) {
+        g_warning("message store failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_smtp_connection_send_response_text(connection,"451 4.3.0 Message store failed\r\n");
+        return;
+    }
+    g_autofree gchar* response_text = g_strdup_printf("250 2.0.0 Ok: queued as %s\r\n",id);
+    d_smtp_connection_send_response_text(connection,response_text);
+}
+/**
+ * @brief Put our fields in front of the message and store it.
+ * @details Our Received field is on top, the Received-SPF field is below
+ * it. The DKIM fields are already prepended.
+ */
+static void d_smtp_connection_message_store(
+    DSmtpConnection* connection)
+{
+    g_autofree gchar* address = d_smtp_connection_get_remote_address(connection);
+    if(connection->spf_checked) {
+        d_smtp_transaction_prepend(&connection->transaction,
+            d_spf_received_new(connection->spf_result,address ? address : "unknown",
+                connection->transaction.reverse_path->str,connection->helo_domain));
+    }
+    d_smtp_transaction_prepend(&connection->transaction,
+        d_smtp_message_received_new(connection->my_host_name,connection->helo_domain,
+            connection->remote_host,address,connection->tls_connection != NULL));
+    DSmtpSpoolMessage* message = d_smtp_transaction_complete(&connection->transaction);
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_get_default();
+    if(!spool) {
+        // No spool directory, the message is accepted and dropped.
+        d_smtp_spool_message_free(message);
+        d_smtp_connection_send_response_code(connection,250);
+        return;
+    }
+    // The 250 is sent when the message is on the disk.
+    d_smtp_spool_store_async(spool,message,NULL,
+        d_smtp_connection_spool_handle,g_object_ref(connection));
+}
+/**
+ * @brief Completion handler of the DKIM signing.
+ */
+static void d_smtp_connection_sign_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    GBytes* signature = d_dkim_sign_finish(D_DKIM_SIGNER(source_object),res,&error);
+    if(error) {
+        // The message is stored unsigned.
+        g_warning("DKIM signing failed: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+    connection->dkim_pending = FALSE;
+    if(connection->closing) {
+        g_clear_pointer(&signature,g_bytes_unref);
+        return;
+    }
+    if(signature) {
+        d_smtp_transaction_prepend(&connection->transaction,signature);
+    }
+    d_smtp_connection_message_store(connection);
+}
+/**
+ * @brief Sign the message of our domain and store it.
+ * @details The body is already hashed, only the private key operation
+ * is left, it is made by the signer thread if the batching is enabled.
+ */
+static void d_smtp_connection_message_sign(
+    DSmtpConnection* connection)
+{
+    g_autoptr(DDkimSigning) signing = g_steal_pointer(&connection->dkim_signing);
+    g_autoptr(DDkimSigner) signer = d_dkim_signer_get_default();
+    if(!signing || !signer) {
+        d_smtp_connection_message_store(connection);
+        return;
+    }
+    connection->dkim_pending = TRUE;
+    d_dkim_sign_async(signer,signing,NULL,
+        d_smtp_connection_sign_handle,g_object_ref(connection));
+}
+/**
+ * @brief Completion handler of the DKIM signatures check.
+ */
+static void d_smtp_connection_dkim_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    GError* error{NULL};
+    GBytes* authentication_results = d_dkim_verify_finish(D_DKIM(source_object),res,&error);
+    if(error) {
+        g_warning("DKIM check failed: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+    connection->dkim_pending = FALSE;
+    if(connection->closing) {
+        g_clear_pointer(&authentication_results,g_bytes_unref);
+        return;
+    }
+    if(authentication_results) {
+        d_smtp_transaction_prepend(&connection->transaction,authentication_results);
+    }
+    d_smtp_connection_message_sign(connection);
+}
+/**
+ * @brief Check the received message and answer the end of data.
+ * @details The message with too large header or size, with too many
+ * Received fields or with the body not kept is rejected. The accepted one is stored once its DKIM signatures are
+ * checked and our signature is made, the session stays open for the
+ * next MAIL.
+ */
+static void d_smtp_connection_message_received(
+    DSmtpConnection* connection)
+{
+    g_autoptr(DDkimVerifier) verifier = g_steal_pointer(&connection->dkim_verifier);
+    const DSmtpMessageParser* parser = &connection->transaction.message;
+    if(parser->header_too_large) {
+        g_warning("message header is bigger than %" G_GSIZE_FORMAT " bytes",parser->max_header_size);
+        g_clear_pointer(&connection->dkim_signing,d_dkim_signing_unref);
+        d_smtp_transaction_reset(&connection->transaction);
+        d_smtp_connection_send_response_text(connection,"552 5.3.4 Message header too large\r\n");
+        return;
+    }
+    if(connection->transaction.too_large) {
+        g_warning("message is bigger than %" G_GSIZE_FORMAT " bytes",connection->transaction.max_message_size);
+        g_clear_pointer(&connection->dkim_signing,d_dkim_signing_unref);
+        d_smtp_transaction_reset(&connection->transaction);
+        d_smtp_connection_send_response_text(connection,"552 5.3.4 Message size exceeds fixed maximum message size\r\n");
+        return;
+    }
+    if(connection->transaction.failed) {
+        g_clear_pointer(&connection->dkim_signing,d_dkim_signing_unref);
+        d_smtp_transaction_reset(&connection->transaction);
+        d_smtp_connection_send_response_text(connection,"451 4.3.0 Message store failed\r\n");
+        return;
+    }
+    if(parser->received_count >= SMTP_MESSAGE_MAX_RECEIVED) {
+        g_warning("message has %u Received fields, mail loop",parser->received_count);
+        g_clear_pointer(&connection->dkim_signing,d_dkim_signing_unref);
+        d_smtp_transaction_reset(&connection->transaction);
+        d_smtp_connection_send_response_text(connection,"554 5.4.6 Too many hops\r\n");
+        return;
+    }
+    g_autoptr(DDkim) dkim = d_dkim_get_default();
+    if(!verifier || !dkim) {
+        d_smtp_connection_message_sign(connection);
+        return;
+    }
+    // The body is already hashed, only the keys may still be looked up.
+    connection->dkim_pending = TRUE;
+    d_dkim_verify_async(dkim,verifier,connection->my_host_name,NULL,
+        d_smtp_connection_dkim_handle,g_object_ref(connection));
+}
+/**
+ * @brief Process the block of the message data.
+ */
+static void d_smtp_connection_process_data(
+    DSmtpConnection* connection,
+    GBytes* bytes)
+{
+    // The end of data search and the header parsing is the single pass.
+    D_SMTP_PROBE2(data_read,&connection->state,g_bytes_get_size(bytes));
+    if(!connection->dkim_verifier) {
+        g_autoptr(DDkim) dkim = d_dkim_get_default();
+        if(dkim) {
+            connection->dkim_verifier = d_dkim_verifier_new(dkim,connection->transaction.max_header_size);
+        }
+    }
+    if(!connection->dkim_signing) {
+        g_autoptr(DDkimSigner) signer = d_dkim_signer_get_default();
+        if(signer) {
+            connection->dkim_signing = d_dkim_signing_new(signer,connection->transaction.max_header_size);
+        }
+    }
+    gsize consumed{0};
+    gboolean ended = d_smtp_transaction_add_data(&connection->transaction,bytes,&consumed);
+    // The signatures are hashed and made as the data streams in.
+    if(connection->dkim_verifier) {
+        d_dkim_verifier_feed(connection->dkim_verifier,
+            static_cast<const gchar*>(g_bytes_get_data(bytes,NULL)),consumed);
+    }
+    if(connection->dkim_signing) {
+        d_dkim_signing_feed(connection->dkim_signing,
+            static_cast<const gchar*>(g_bytes_get_data(bytes,NULL)),consumed);
+    }
+    if(ended) {
+        // The pipelined commands after the end of data are processed next.
+        gsize size = g_bytes_get_size(bytes);
+        if(consumed < size) {
+            g_byte_array_append(connection->input,
+                static_cast<const guint8*>(g_bytes_get_data(bytes,NULL)) + consumed,size - consumed);
+        }
+        d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_DATA_END);
+        d_smtp_state_next_by_event(&connection->state,SMTP_EVENT_DATA_END);
+        d_smtp_connection_message_received(connection);
+    } else {
+        // Continue to read the client data.
+        d_smtp_connection_read_next(connection);
+    }
+}
+/**
+ * @brief Process the buffered input.
+ * @details The command is taken by the one CRLF terminated line, the
+ * rest of the pipelined commands waits for the response to be written.
+ */
+static void d_smtp_connection_process_input(
+    DSmtpConnection* connection)
+{
+    if(d_smtp_state_is_data_accepted(d_smtp_state_get_current_state(&connection->state))) {
+        g_autoptr(GBytes) bytes = g_byte_array_free_to_bytes(connection->input);
+        connection->input = g_byte_array_new();
+        d_smtp_connection_process_data(connection,bytes);
+        return;
+    }
+    auto data = reinterpret_cast<const gchar*>(connection->input->data);
+    auto end = static_cast<const gchar*>(memchr(data,'\n',connection->input->len));
+    if(connection->input_discarding) {
+        // Skip the rest of the too long line.
+        if(!end) {
+            g_byte_array_set_size(connection->input,0);
+        } else {
+            g_byte_array_remove_range(connection->input,0,end - data + 1);
+            connection->input_discarding = FALSE;
+        }
+        d_smtp_connection_read_next(connection);
+        return;
+    }
+    if(!end) {
+        if(connection->input->len > SMTP_COMMAND_MAX_LENGTH) {
+            connection->input_discarding = TRUE;
+            g_byte_array_set_size(connection->input,0);
+            d_smtp_connection_send_response_text(connection,"500 5.5.2 Line too long\r\n");
+            return;
+        }
+        d_smtp_connection_read_next(connection);
+        return;
+    }
+    gsize length = end - data + 1;
+    // The bare LF doesn't end the command line, RFC 5321 2.3.8.
+    if(length < 2 || data[length - 2] != '\r') {
+        g_byte_array_remove_range(connection->input,0,length);
+        d_smtp_connection_send_response_text(connection,"500 5.5.2 Line must end with CRLF\r\n");
+        return;
+    }
+    // The command parser expects the terminating zero after the line.
+    auto line = static_cast<gchar*>(g_malloc(length + 1));
+    memcpy(line,data,length);
+    line[length] = 0;
+    g_autoptr(GBytes) bytes = g_bytes_new_take(line,length);
+    g_byte_array_remove_range(connection->input,0,length);
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_COMMAND_READ);
+    d_smtp_connection_test_input(connection,bytes);
+}
+/**
+ * @brief Process bytes received from the client.
+ * @details The message data goes as is while nothing is buffered,
+ * the rest is buffered and processed by the command lines. The bytes
+ * received while the response is being sent are only buffered.
+ */
+static void d_smtp_connection_process_bytes(
+    DSmtpConnection* connection,
+    GBytes* bytes)
+{
+    gboolean awaiting = connection->awaiting_input;
+    connection->awaiting_input = FALSE;
+    if(awaiting && !connection->input->len &&
+       d_smtp_state_is_data_accepted(d_smtp_state_get_current_state(&connection->state))) {
+        d_smtp_connection_process_data(connection,bytes);
+        return;
+    }
+    gsize size{0};
+    auto data = g_bytes_get_data(bytes,&size);
+    g_byte_array_append(connection->input,static_cast<const guint8*>(data),size);
+    if(awaiting) {
+        d_smtp_connection_process_input(connection);
+    }
+}
+/**
+ * @brief Receive and process the bytes available on the connection.
+ * @details The pool buffer is taken only for the time of the bytes
+ * processing and returned when the bytes are released.
+ */
+static void d_smtp_connection_receive(
+    DSmtpConnection* connection)
+{
+    TIMEOUT_OPERATION operation =
+        d_smtp_state_is_data_accepted(d_smtp_state_get_current_state(&connection->state)) ?
+        TIMEOUT_OPERATION_DATA : TIMEOUT_OPERATION_READ;
+    GError *error{NULL};
+    if(g_cancellable_set_error_if_cancelled(d_timeout_get_cancelable(connection->timeout),&error)) {
+        g_warning("wait readable failed: %d %s",error->code,error->message);
+        g_message("connection read opertion was canceled");
+        g_error_free(error);
+        d_smtp_connection_close(connection);
+        return;
+    }
+    auto buffer = reinterpret_cast<gchar*>(d_buffer_pool_acquire(connection->buffer_pool));
+    // Reserve one byte for the terminating zero used by the command parser.
+    gsize size = d_buffer_pool_get_buffer_size(connection->buffer_pool) - 1;
+    gssize count{0};
+    if(connection->tls_connection) {
+        auto is = g_io_stream_get_input_stream(connection->tls_connection);
+        count = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(is),
+            buffer,size,NULL,&error);
+    } else {
+        count = g_socket_receive_with_blocking(connection->socket,buffer,size,FALSE,NULL,&error);
+    }
+    if(count < 0) {
+        d_buffer_pool_release(buffer);
+        if(error->code == G_IO_ERROR_WOULD_BLOCK) {
+            // Spurious wakeup, the read timeout keeps running.
+            g_error_free(error);
+            d_smtp_connection_wait_readable(connection);
+            return;
+        }
+        g_warning("receive failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_timeout_stop(connection->timeout,operation);
+        d_smtp_connection_close(connection);
+        return;
+    }
+    d_timeout_stop(connection->timeout,operation);
+    if(count == 0) {
+        g_message("connection closed by peer");
+        d_buffer_pool_release(buffer);
+        d_smtp_connection_close(connection);
+        return;
+    }
+    buffer[count] = 0;
+    auto bytes = d_buffer_pool_bytes_new(buffer,count);
+    d_smtp_connection_process_bytes(connection,bytes);
+    g_bytes_unref(bytes);
+}
+/**
+ * @brief Readiness handler for the command and socket engine data read.
+ */
+static gboolean d_smtp_connection_readable_handle(
+    GSocket* socket,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    // The source is destroyed by returning G_SOURCE_REMOVE.
+    g_clear_pointer(&connection->read_source,g_source_unref);
+    d_smtp_connection_receive(connection);
+    return G_SOURCE_REMOVE;
+}
+/**
+ * @brief Readiness handler of the TLS stream.
+ */
+static gboolean d_smtp_connection_stream_readable_handle(
+    GObject* stream,
+    gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    // The source is destroyed by returning G_SOURCE_REMOVE.
+    g_clear_pointer(&connection->read_source,g_source_unref);
+    d_smtp_connection_receive(connection);
+    return G_SOURCE_REMOVE;
+}
+/**
+ * @brief Completion handler for async read.
+ */
+static void d_smtp_connection_read_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_DATA);
+    GError *error{NULL};
+    auto bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(source_object),res,&error);
+    if(!bytes) {
+        g_warning("read bytes finish failed: %d %s",error->code,error->message);
+        if(error->code == G_IO_ERROR_CANCELLED) {
+        // Process some extra in case of operation has been canceled.
+            g_message("connection read opertion was canceled");
+        }
+        // In most cases we couldn't (wantn't?) to continue in case async operation was failed.
+        // So just clos the connection.
+        d_smtp_connection_close(connection);
+        return;
+    }
+    d_smtp_connection_process_bytes(connection,bytes);
+    g_bytes_unref(bytes);
+}
+/**
+ * @brief Completion handler for the TLS handshake.
+ */
+static void d_smtp_connection_handshake_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_READ);
+    GError *error{NULL};
+    gboolean success = d_smtp_tls_handshake_finish(G_IO_STREAM(source_object),res,&error);
+    d_smtp_tls_handshake_completed(connection->tls_resumption_offered,
+        g_get_monotonic_time() - connection->handshake_start,success);
+    if(!success) {
+        g_warning("TLS handshake failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_smtp_connection_close(connection);
+        return;
+    }
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_TLS_END);
+    g_message("TLS established, resumption %s",connection->tls_resumption_offered ? "offered" : "not offered");
+    connection->tls_connection = G_IO_STREAM(g_object_ref(source_object));
+    d_smtp_state_next_by_event(&connection->state,SMTP_EVENT_TLS_ESTABLISHED);
+    // The client starts over with EHLO.
+    d_smtp_connection_read_next(connection);
+}
+/**
+ * @brief Start the TLS handshake over the socket stream.
+ */
+static void d_smtp_connection_handshake(
+    DSmtpConnection* connection)
+{
+    GError *error{NULL};
+    auto tls_stream = d_smtp_tls_server_connection_new(connection->tls,
+        G_IO_STREAM(connection->socket_connection),&error);
+    if(!tls_stream) {
+        g_warning("TLS connection create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_smtp_connection_close(connection);
+        return;
     }
-
-    guint response_code = d_smtp_command_get_response_code(smtp_command);
-    g_object_unref(smtp_command);
-    d_smtp_connection_send_response_code(connection,response_code);
-
-    return TRUE;
+    connection->handshake_start = g_get_monotonic_time();
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_TLS_START);
+    d_timeout_start(connection->timeout,TIMEOUT_OPERATION_READ);
+    // The handshake thread holds the stream until completion, the read
+    // timeout cancels the blocking handshake as well.
+    d_smtp_tls_handshake_async(tls_stream,
+        d_timeout_get_cancelable(connection->timeout),
+        d_smtp_connection_handshake_handle,connection);
+    g_object_unref(tls_stream);
 }
 /**
- * @brief Completion handler for async read.
+ * @brief Readiness handler for the ClientHello.
+ * @details The ClientHello is peeked to find out if the client offers the
+ * session resumption, the bytes stay in the socket for the handshake.
+ * The hello split over several segments is accounted as not offered.
  */
-static void d_smtp_connection_read_handle(
-    GObject *source_object,
-	GAsyncResult *res,
-	gpointer user_data)
+static gboolean d_smtp_connection_client_hello_handle(
+    GSocket* socket,
+    GIOCondition condition,
+    gpointer user_data)
 {
     auto connection = D_SMTP_CONNECTION(user_data);
+    // The source is destroyed by returning G_SOURCE_REMOVE.
+    g_clear_pointer(&connection->read_source,g_source_unref);
     d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_READ);
     GError *error{NULL};
-    auto bytes = g_input_stream_read_bytes_finish(G_INPUT_STREAM(source_object),res,&error);
-    if(!bytes) {
-        g_warning("read bytes finish failed: %d %s",error->code,error->message);
-        if(error->code == G_IO_ERROR_CANCELLED) {
-        // Process some extra in case of operation has been canceled.
-            g_message("connection read opertion was canceled");
+    if(g_cancellable_set_error_if_cancelled(d_timeout_get_cancelable(connection->timeout),&error)) {
+        g_warning("wait ClientHello failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_smtp_connection_close(connection);
+        return G_SOURCE_REMOVE;
+    }
+    auto buffer = d_buffer_pool_acquire(connection->buffer_pool);
+    GInputVector vector{buffer,d_buffer_pool_get_buffer_size(connection->buffer_pool)};
+    gint flags = G_SOCKET_MSG_PEEK;
+    gssize count = g_socket_receive_message(socket,NULL,&vector,1,NULL,NULL,&flags,NULL,&error);
+    if(count < 0) {
+        d_buffer_pool_release(buffer);
+        if(error->code == G_IO_ERROR_WOULD_BLOCK) {
+            g_error_free(error);
+            d_timeout_start(connection->timeout,TIMEOUT_OPERATION_READ);
+            connection->read_source = g_socket_create_source(socket,
+                GIOCondition(G_IO_IN | G_IO_HUP | G_IO_ERR),
+                d_timeout_get_cancelable(connection->timeout));
+            g_source_set_callback(connection->read_source,
+                G_SOURCE_FUNC(d_smtp_connection_client_hello_handle), connection, NULL);
+            g_source_attach(connection->read_source, g_main_context_get_thread_default());
+            return G_SOURCE_REMOVE;
         }
-        // In most cases we couldn't (wantn't?) to continue in case async operation was failed.
-        // So just clos the connection.
+        g_warning("receive ClientHello failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_smtp_connection_close(connection);
+        return G_SOURCE_REMOVE;
+    }
+    connection->tls_resumption_offered = d_smtp_tls_client_hello_offers_resumption(
+        static_cast<const guint8*>(buffer),count);
+    d_buffer_pool_release(buffer);
+    d_smtp_connection_handshake(connection);
+    return G_SOURCE_REMOVE;
+}
+/**
+ * @brief Switch the connection to TLS after the STARTTLS response is sent.
+ * @details TLS works over the GIO streams, so connection of any engine
+ * continues with the GIO engine.
+ */
+static void d_smtp_connection_start_tls(
+    DSmtpConnection* connection)
+{
+    if(!connection->socket_connection) {
+        connection->socket_connection = g_socket_connection_factory_create_connection(connection->socket);
+    }
+    connection->io_engine = SMTP_IO_ENGINE_GIO;
+    // The plain text pipelined after STARTTLS isn't taken into the TLS session, RFC 3207 6.
+    g_byte_array_set_size(connection->input,0);
+    connection->input_discarding = FALSE;
+    d_timeout_start(connection->timeout,TIMEOUT_OPERATION_READ);
+    connection->read_source = g_socket_create_source(connection->socket,
+        GIOCondition(G_IO_IN | G_IO_HUP | G_IO_ERR),
+        d_timeout_get_cancelable(connection->timeout));
+    g_source_set_callback(connection->read_source,
+        G_SOURCE_FUNC(d_smtp_connection_client_hello_handle), connection, NULL);
+    g_source_attach(connection->read_source, g_main_context_get_thread_default());
+}
+/**
+ * @brief Process the write completion of the response.
+ */
+static void d_smtp_connection_write_complete(
+    DSmtpConnection* connection)
+{
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_RESPONSE_WRITTEN);
+    // Try to get the new SMTP state based on write completed.
+    // Basically we sent some response code and bytes are written.
+    if(!d_smtp_state_next_by_write_complete(&connection->state)) {
+        g_warning("write all bytes finish unexpected state");
         d_smtp_connection_close(connection);
         return;
     }
-    // Client sending the RAW data until the end of sequence marker.
-    SMTP_STATE state = d_smtp_state_get_current_state(connection->state);
-    if(state == SMTP_STATE_DATA_ACCEPTED) {
-        gsize count{0};
-        auto line = reinterpret_cast<const gchar*>(g_bytes_get_data(bytes,&count));
-        g_print("DATA:  [%.*s]\n",(int)count,line);
-        if(g_strstr_len(line,count,DATA_END)) {
-            g_print("DATA END detected\n");
-            d_smtp_state_set_next_state(connection->state, SMTP_STATE_DATA_ENDED);
-            d_smtp_connection_send_response_code(connection,250);
-        } else {
-            // Continue to read the client data.
-            auto is = g_io_stream_get_input_stream(G_IO_STREAM(connection->socket_connection));
-            g_input_stream_read_bytes_async(is, 2048, G_PRIORITY_DEFAULT,
-                                            d_timeout_get_cancelable(connection->timeout),
-                                            d_smtp_connection_read_handle, connection);
-        }
-    } else {
-        if(!d_smtp_connection_test_input(connection,bytes)) {
-            d_smtp_connection_close(connection);
-            g_bytes_unref(bytes);
-            return;        
-        }
+
+    SMTP_STATE state = d_smtp_state_get_current_state(&connection->state);
+    if(state == SMTP_STATE_CLOSE) {
+        g_message("write all bytes finish client quit requested");
+        d_smtp_connection_close(connection);
+        return;
     }
-    g_bytes_unref(bytes);
+    if(state == SMTP_STATE_TLS_HANDSHAKE) {
+        d_smtp_connection_start_tls(connection);
+        return;
+    }
+    if(d_smtp_state_is_data_accepted(state)) {
+        d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_DATA_START);
+    }
+    // Switch to reading.
+    d_smtp_connection_read_next(connection);
 }
 /**
  * @brief Completion handler for async write.
@@ -179,64 +1237,228 @@ static void d_smtp_connection_write_handle(
     d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
     gsize bytes_written{0};
     GError *error{NULL};
+    // Transmit buffer goes back to the pool as soon as write is completed.
+    g_autoptr(GBytes) writing_bytes = reinterpret_cast<GBytes*>(g_steal_pointer(&connection->writing_bytes));
     if(!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source_object),res,&bytes_written,&error)) {
-        g_bytes_unref(connection->writing_bytes);
         g_warning("write all bytes finish failed: %d %s",error->code,error->message);
         d_smtp_connection_close(connection);
         return;
     }
-    auto expected_bytes = g_bytes_get_size(connection->writing_bytes);
+    auto expected_bytes = g_bytes_get_size(writing_bytes);
     if(bytes_written != expected_bytes) {
-        g_bytes_unref(connection->writing_bytes);
         g_warning("write all bytes finish unexpected bytes wrriten: %ld != %ld",bytes_written,expected_bytes);
         d_smtp_connection_close(connection);
         return;
     }
-    // Try to get the new SMTP state based on write completed.
-    // Basically we sent some response code and bytes are written.
-    if(!d_smtp_state_next_by_write_complete(connection->state)) {
-        g_bytes_unref(connection->writing_bytes);
-        g_warning("write all bytes finish unexpected state");
+    d_smtp_connection_write_complete(connection);
+}
+/**
+ * @brief Send the rest of writing bytes by the direct socket call.
+ * @details Function waits the socket readiness if the send buffer is full.
+ */
+static void d_smtp_connection_send_next(
+    DSmtpConnection* connection)
+{
+    gsize count{0};
+    auto buffer = reinterpret_cast<const gchar*>(g_bytes_get_data(connection->writing_bytes,&count));
+    GOutputVector vector{buffer + connection->written_count,count - connection->written_count};
+    GError *error{NULL};
+    gssize sent = g_socket_send_message(connection->socket,NULL,&vector,1,NULL,0,0,NULL,&error);
+    if(sent < 0) {
+        if(error->code == G_IO_ERROR_WOULD_BLOCK) {
+            g_error_free(error);
+            d_smtp_connection_wait_writable(connection);
+            return;
+        }
+        g_warning("send message failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
+        g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
         d_smtp_connection_close(connection);
         return;
     }
-
-    SMTP_STATE state = d_smtp_state_get_current_state(connection->state);
-    if(state == SMTP_STATE_CLOSE) {
-        g_bytes_unref(connection->writing_bytes);
-        g_message("write all bytes finish client quit requested");
+    connection->written_count += sent;
+    if(connection->written_count < count) {
+        d_smtp_connection_wait_writable(connection);
+        return;
+    }
+    d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
+    // Transmit buffer goes back to the pool as soon as write is completed.
+    g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
+    d_smtp_connection_write_complete(connection);
+}
+/**
+ * @brief Readiness handler for the blocked send.
+ */
+static gboolean d_smtp_connection_writable_handle(
+    GSocket* socket,
+    GIOCondition condition,
+    gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    // The source is destroyed by returning G_SOURCE_REMOVE.
+    g_clear_pointer(&connection->write_source,g_source_unref);
+    GError *error{NULL};
+    if(g_cancellable_set_error_if_cancelled(d_timeout_get_cancelable(connection->timeout),&error)) {
+        g_warning("wait writable failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
+        d_smtp_connection_close(connection);
+        return G_SOURCE_REMOVE;
+    }
+    d_smtp_connection_send_next(connection);
+    return G_SOURCE_REMOVE;
+}
+/**
+ * @brief Submit the ring send of the rest of writing bytes.
+ * @details The receive of the next command is linked to the send, so the
+ * command/response turn takes the single submission.
+ */
+static void d_smtp_connection_uring_send(
+    DSmtpConnection* connection)
+{
+    gsize count{0};
+    auto buffer = reinterpret_cast<const gchar*>(g_bytes_get_data(connection->writing_bytes,&count));
+    DUringOperation* recv_operation{nullptr};
+    // The socket is handed over to TLS after the STARTTLS response.
+    gboolean link_recv = connection->recv_operation == NULL &&
+        d_smtp_state_get_current_state(&connection->state) != SMTP_STATE_STARTTLS_RECEIVED;
+    connection->send_operation = d_uring_send(connection->uring,
+        g_socket_get_fd(connection->socket),
+        buffer + connection->written_count,count - connection->written_count,
+        d_smtp_connection_uring_handle,g_object_ref(connection),
+        link_recv,&recv_operation);
+    if(!connection->send_operation) {
+        g_object_unref(connection);
+        d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
         d_smtp_connection_close(connection);
         return;
     }
-    g_bytes_unref(connection->writing_bytes);
-    // Set the read timeout.
-    d_timeout_start(connection->timeout,TIMEOUT_OPERATION_READ);
-    // Switch to reading.
-    auto is = g_io_stream_get_input_stream(G_IO_STREAM(connection->socket_connection));
-    g_input_stream_read_bytes_async(is, 2048, G_PRIORITY_DEFAULT,
-                                    d_timeout_get_cancelable(connection->timeout),
-                                    d_smtp_connection_read_handle, connection);
+    if(recv_operation) {
+        connection->recv_operation = recv_operation;
+        g_object_ref(connection);
+    }
+}
+/**
+ * @brief Completion handler for the ring send.
+ */
+static void d_smtp_connection_uring_send_handle(
+    DSmtpConnection* connection,
+    gint result)
+{
+    connection->send_operation = NULL;
+    if(connection->closing) {
+        return;
+    }
+    if(result < 0) {
+        g_warning("io_uring send failed: %d %s",-result,g_strerror(-result));
+        d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
+        d_smtp_connection_close(connection);
+        return;
+    }
+    connection->written_count += result;
+    if(connection->written_count < g_bytes_get_size(connection->writing_bytes)) {
+        // The short send breaks the link, the receive is canceled.
+        d_smtp_connection_uring_send(connection);
+        return;
+    }
+    d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_WRITE);
+    // Transmit buffer goes back to the pool as soon as write is completed.
+    g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
+    d_smtp_connection_write_complete(connection);
+}
+/**
+ * @brief Completion handler for the ring receive.
+ */
+static void d_smtp_connection_uring_recv_handle(
+    DSmtpConnection* connection,
+    DUringOperation* operation,
+    gint result,
+    guint buffer_id)
+{
+    gboolean current = operation == connection->recv_operation;
+    if(current) {
+        connection->recv_operation = NULL;
+    }
+    // Skip the receive canceled by the close or by the short linked send.
+    if(!current || connection->closing || (result == -ECANCELED && connection->writing_bytes)) {
+        if(buffer_id != G_MAXUINT) {
+            d_uring_buffer_return(connection->uring,buffer_id);
+        }
+        return;
+    }
+    // The receive linked to the send completes while the write timeout runs.
+    if(connection->awaiting_input) {
+        d_timeout_stop(connection->timeout,
+            d_smtp_state_is_data_accepted(d_smtp_state_get_current_state(&connection->state)) ?
+            TIMEOUT_OPERATION_DATA : TIMEOUT_OPERATION_READ);
+    }
+    if(result <= 0) {
+        if(result < 0) {
+            g_warning("io_uring receive failed: %d %s",-result,g_strerror(-result));
+        } else {
+            g_message("connection closed by peer");
+        }
+        if(buffer_id != G_MAXUINT) {
+            d_uring_buffer_return(connection->uring,buffer_id);
+        }
+        d_smtp_connection_close(connection);
+        return;
+    }
+    auto bytes = d_uring_buffer_bytes_new(connection->uring,buffer_id,result);
+    d_smtp_connection_process_bytes(connection,bytes);
+    g_bytes_unref(bytes);
+}
+/**
+ * @brief Completion handler for the ring operations.
+ */
+static void d_smtp_connection_uring_handle(
+    DUringOperation* operation,
+    gint result,
+    guint buffer_id,
+    gboolean more,
+    gpointer user_data)
+{
+    // Drop the reference held by the operation.
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(user_data);
+    if(operation == connection->send_operation) {
+        d_smtp_connection_uring_send_handle(connection,result);
+    } else {
+        d_smtp_connection_uring_recv_handle(connection,operation,result,buffer_id);
+    }
 }
 /**
  * @brief Start async operation for writing bytes.
+ * @param [in] bytes The bytes to write, connection takes the ownership.
  */
 static void d_smtp_connection_write_bytes(
     DSmtpConnection* connection,
     GBytes* bytes
     )
 {
-    auto os = g_io_stream_get_output_stream(G_IO_STREAM(connection->socket_connection));
     gsize count{0};
     auto buffer = g_bytes_get_data(bytes,&count);
     g_message("sending %ld bytes",count);
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_RESPONSE_WRITE);
+    connection->writing_bytes = bytes;
+    connection->written_count = 0;
     // Set timeout.
     d_timeout_start(connection->timeout,TIMEOUT_OPERATION_WRITE);
+    if(connection->io_engine == SMTP_IO_ENGINE_URING) {
+        d_smtp_connection_uring_send(connection);
+        return;
+    }
+    if(connection->io_engine == SMTP_IO_ENGINE_SOCKET) {
+        // The short response usually fits to the socket buffer,
+        // so write completes without going to the main loop.
+        d_smtp_connection_send_next(connection);
+        return;
+    }
     // Switch to write.
+    auto os = g_io_stream_get_output_stream(d_smtp_connection_get_stream(connection));
     g_output_stream_write_all_async(os, buffer, count, G_PRIORITY_DEFAULT,
                                     d_timeout_get_cancelable(connection->timeout),
                                     d_smtp_connection_write_handle, connection);
-    connection->writing_bytes = bytes;
-    g_bytes_ref(bytes);
 }
 
 static void d_smtp_connection_send_response_text(
@@ -244,15 +1466,30 @@ static void d_smtp_connection_send_response_text(
     const gchar* response_text)
 {
     gsize count = strlen(response_text);
-    d_smtp_connection_write_bytes(connection,g_bytes_new(response_text,count));
+    if(count > d_buffer_pool_get_buffer_size(connection->buffer_pool)) {
+        d_smtp_connection_write_bytes(connection,g_bytes_new(response_text,count));
+        return;
+    }
+    auto buffer = d_buffer_pool_acquire(connection->buffer_pool);
+    memcpy(buffer,response_text,count);
+    d_smtp_connection_write_bytes(connection,d_buffer_pool_bytes_new(buffer,count));
 }
 
 static void d_smtp_connection_send_response_code(
     DSmtpConnection* connection,
     guint response_code)
 {
-    g_autofree gchar* response_text = g_strdup_printf("%d %s\r\n",response_code,connection->my_host_name);
-    d_smtp_connection_send_response_text(connection,response_text);
+    // Format the response directly to the transmit buffer.
+    gsize size = d_buffer_pool_get_buffer_size(connection->buffer_pool);
+    auto buffer = reinterpret_cast<gchar*>(d_buffer_pool_acquire(connection->buffer_pool));
+    gint count = g_snprintf(buffer,size,"%d %s\r\n",response_code,connection->my_host_name);
+    if(count < 0 || gsize(count) >= size) {
+        d_buffer_pool_release(buffer);
+        g_autofree gchar* response_text = g_strdup_printf("%d %s\r\n",response_code,connection->my_host_name);
+        d_smtp_connection_write_bytes(connection,g_bytes_new(response_text,strlen(response_text)));
+        return;
+    }
+    d_smtp_connection_write_bytes(connection,d_buffer_pool_bytes_new(buffer,count));
 }
 
 
@@ -264,7 +1501,8 @@ static void d_smtp_connection_close_handle(
 	GAsyncResult *res,
 	gpointer user_data)
 {
-    auto connection = D_SMTP_CONNECTION(user_data);
+    // The owner usually drops the last reference in the "disconnected" handler.
+    g_autoptr(DSmtpConnection) connection = D_SMTP_CONNECTION(g_object_ref(user_data));
     d_timeout_stop(connection->timeout,TIMEOUT_OPERATION_CLOSE);
     g_signal_emit(connection,d_smtp_connection_signals[SIGNAL_DISCONNECTED],0,NULL);
     GError *error{NULL};
@@ -290,13 +1528,106 @@ static void d_smtp_connection_close_handle(
     g_message("connection closed\n");
 }
 
+/**
+ * @brief Emit the disconnected signal of the socket engine connection.
+ * @details Signal is emitted from the main loop, so the owner can drop
+ * the last reference while none of connection functions is on the stack.
+ */
+static gboolean d_smtp_connection_closed_handle(
+    gpointer user_data)
+{
+    auto connection = D_SMTP_CONNECTION(user_data);
+    g_signal_emit(connection,d_smtp_connection_signals[SIGNAL_DISCONNECTED],0,NULL);
+    g_message("connection closed\n");
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Close the socket by the direct calls.
+ */
+static void d_smtp_connection_close_socket(
+    DSmtpConnection* connection)
+{
+    GError *error{NULL};
+    if(!g_socket_shutdown(connection->socket,TRUE,TRUE,&error)) {
+        g_message("shutdown socket failed: %d %s",error->code,error->message);
+        g_clear_error(&error);
+    }
+    if(!g_socket_close(connection->socket,&error)) {
+        g_warning("close socket failed: %d %s",error->code,error->message);
+        g_clear_error(&error);
+    }
+    auto source = g_idle_source_new();
+    g_source_set_callback(source,d_smtp_connection_closed_handle,
+        g_object_ref(connection),g_object_unref);
+    g_source_attach(source,g_main_context_get_thread_default());
+    g_source_unref(source);
+}
+
+gboolean d_smtp_connection_detach(
+    DSmtpConnection* connection)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONNECTION(connection),FALSE);
+    // The ring operations are bound to the ring of the connection thread,
+    // the DNS lookups complete in the context they were started from.
+    if(!connection->at_safe_point || connection->closing ||
+       connection->io_engine == SMTP_IO_ENGINE_URING || connection->dns_pending ||
+       connection->dnsbl_pending || connection->spf_pending || connection->dkim_pending) {
+        return FALSE;
+    }
+    connection->detached = TRUE;
+    return TRUE;
+}
+
+void d_smtp_connection_attach(
+    DSmtpConnection* connection)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(connection));
+    g_return_if_fail(connection->detached);
+    connection->detached = FALSE;
+    // The timeout and the readiness source go to the new thread default context.
+    d_smtp_connection_read_next(connection);
+}
+
 void d_smtp_connection_close(DSmtpConnection* connection)
 {
+    if(connection->closing) {
+        return;
+    }
+    connection->closing = TRUE;
+    d_smtp_trace_mark(&connection->trace,SMTP_TRACE_EVENT_CLOSE);
+    D_SMTP_PROBE1(close,&connection->state);
+    // Stop waiting for the socket readiness.
+    if(connection->read_source) {
+        g_source_destroy(connection->read_source);
+        g_clear_pointer(&connection->read_source,g_source_unref);
+    }
+    if(connection->write_source) {
+        g_source_destroy(connection->write_source);
+        g_clear_pointer(&connection->write_source,g_source_unref);
+    }
+    if(connection->io_engine == SMTP_IO_ENGINE_SOCKET) {
+        g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
+        d_smtp_connection_close_socket(connection);
+        return;
+    }
+    if(connection->io_engine == SMTP_IO_ENGINE_URING) {
+        // The writing bytes are kept until the send completion,
+        // operations hold the connection reference.
+        if(connection->recv_operation) {
+            d_uring_cancel(connection->uring,connection->recv_operation);
+        }
+        if(connection->send_operation) {
+            d_uring_cancel(connection->uring,connection->send_operation);
+        }
+        d_smtp_connection_close_socket(connection);
+        return;
+    }
     // Set close operation timeout.
     d_timeout_start(connection->timeout,TIMEOUT_OPERATION_CLOSE);
     // Initiate the asynchrnous close socket operation.
     g_io_stream_close_async(
-        G_IO_STREAM(connection->socket_connection),
+        d_smtp_connection_get_stream(connection),
         G_PRIORITY_DEFAULT,
         d_timeout_get_cancelable(connection->timeout),
         d_smtp_connection_close_handle,
@@ -308,10 +1639,13 @@ static void d_smtp_connection_init(DSmtpConnection* connection)
 {
     // Create new timeout processing object.
     connection->timeout = d_timeout_new();
-    // Create new instance of SMTP FSM.
-    connection->state = d_smtp_state_new();
     /// TODO: place host name to the object properties.
     connection->my_host_name = g_strdup("localhost");
+    connection->read_buffer_size = 2048;
+    connection->buffer_pool = d_buffer_pool_get_shared(connection->read_buffer_size);
+    connection->input = g_byte_array_new();
+    d_smtp_transaction_init(&connection->transaction);
+    d_smtp_trace_init(&connection->trace);
     // Connect out handler to the cancelabel object.
     d_timeout_connect(connection->timeout,G_CALLBACK(d_smtp_connection_canceled),connection);
 }
@@ -332,6 +1666,15 @@ static void d_smtp_connection_get_property(GObject *object, guint prop_id,
     case PROP_CLOSE_TIMEOUT:
         g_value_set_uint(value,d_timeout_get_value(connection->timeout,TIMEOUT_OPERATION_CLOSE));
         break;
+    case PROP_DATA_TIMEOUT:
+        g_value_set_uint(value,d_timeout_get_value(connection->timeout,TIMEOUT_OPERATION_DATA));
+        break;
+    case PROP_READ_BUFFER_SIZE:
+        g_value_set_uint(value,connection->read_buffer_size);
+        break;
+    case PROP_IO_ENGINE:
+        g_value_set_uint(value,connection->io_engine);
+        break;
     }
 }
 
@@ -351,6 +1694,15 @@ static void d_smtp_connection_set_property(GObject *object, guint prop_id,
     case PROP_CLOSE_TIMEOUT:
         d_smtp_connection_set_close_timeout(connection,g_value_get_uint(value));
         break;
+    case PROP_DATA_TIMEOUT:
+        d_smtp_connection_set_data_timeout(connection,g_value_get_uint(value));
+        break;
+    case PROP_READ_BUFFER_SIZE:
+        d_smtp_connection_set_read_buffer_size(connection,g_value_get_uint(value));
+        break;
+    case PROP_IO_ENGINE:
+        connection->io_engine = SMTP_IO_ENGINE(g_value_get_uint(value));
+        break;
     }
 
 }
@@ -360,6 +1712,28 @@ static void d_smtp_connection_finalize(GObject* object)
     g_message("d_smtp_connection_finalize");
     g_return_if_fail(D_IS_SMTP_CONNECTION(object));
     auto connection = D_SMTP_CONNECTION(object);
+    if(connection->read_source) {
+        g_source_destroy(connection->read_source);
+        g_source_unref(connection->read_source);
+    }
+    if(connection->write_source) {
+        g_source_destroy(connection->write_source);
+        g_source_unref(connection->write_source);
+    }
+    g_clear_pointer(&connection->writing_bytes,g_bytes_unref);
+    g_byte_array_unref(connection->input);
+    d_smtp_transaction_clear(&connection->transaction);
+    d_smtp_trace_clear(&connection->trace);
+    g_free(connection->helo_domain);
+    g_free(connection->remote_host);
+    g_free(connection->dnsbl_listed);
+    g_clear_pointer(&connection->dkim_verifier,d_dkim_verifier_unref);
+    g_clear_pointer(&connection->dkim_signing,d_dkim_signing_unref);
+    g_clear_object(&connection->tls_connection);
+    g_clear_object(&connection->tls);
+    g_clear_object(&connection->socket_connection);
+    g_clear_object(&connection->socket);
+    g_clear_object(&connection->uring);
     g_object_unref(connection->timeout);
     g_free(connection->my_host_name);
     G_OBJECT_CLASS(d_smtp_connection_parent_class)->finalize(object);
@@ -387,6 +1761,16 @@ static void d_smtp_connection_class_init(DSmtpConnectionClass* klass)
                   NULL, NULL,
                   NULL,
                   G_TYPE_NONE, 0);
+    // Register signal "safe-point". Signal is emitted when the connection
+    // starts to wait the next command and has no operation in flight.
+    d_smtp_connection_signals[SIGNAL_SAFE_POINT] =
+        g_signal_new("safe-point",
+                  D_TYPE_SMTP_CONNECTION,
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 0);
 
     g_object_class_install_property(
         object_class, PROP_READ_TIMEOUT,
@@ -417,6 +1801,36 @@ static void d_smtp_connection_class_init(DSmtpConnectionClass* klass)
             1,240,10,
             GParamFlags(G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
                         G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        object_class, PROP_DATA_TIMEOUT,
+        g_param_spec_uint(
+            "data-timeout",
+            "data timeout",
+            "The maximum amount of time in seconds until the next block of message data will be available",
+            1,600,10,
+            GParamFlags(G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+                        G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        object_class, PROP_READ_BUFFER_SIZE,
+        g_param_spec_uint(
+            "read-buffer-size",
+            "read buffer size",
+            "The size in bytes of the one socket read request",
+            512,1048576,2048,
+            GParamFlags(G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+                        G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        object_class, PROP_IO_ENGINE,
+        g_param_spec_uint(
+            "io-engine",
+            "I/O engine",
+            "The SMTP_IO_ENGINE value of the engine used for the socket I/O",
+            SMTP_IO_ENGINE_GIO,SMTP_IO_ENGINE_URING,SMTP_IO_ENGINE_GIO,
+            GParamFlags(G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY |
+                        G_PARAM_STATIC_STRINGS)));
 }
 
 guint d_smtp_connection_get_read_timeout(
@@ -440,6 +1854,27 @@ guint d_smtp_connection_get_close_timeout(
     return d_timeout_get_value(connection->timeout,TIMEOUT_OPERATION_CLOSE);
 }
 
+guint d_smtp_connection_get_data_timeout(
+    DSmtpConnection* connection)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONNECTION(connection),0);
+    return d_timeout_get_value(connection->timeout,TIMEOUT_OPERATION_DATA);
+}
+
+guint d_smtp_connection_get_read_buffer_size(
+    DSmtpConnection* connection)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONNECTION(connection),0);
+    return connection->read_buffer_size;
+}
+
+SMTP_IO_ENGINE d_smtp_connection_get_io_engine(
+    DSmtpConnection* connection)
+{
+    g_return_val_if_fail(D_IS_SMTP_CONNECTION(connection),SMTP_IO_ENGINE_GIO);
+    return connection->io_engine;
+}
+
 void d_smtp_connection_set_read_timeout(
     DSmtpConnection* connection,
     guint timeout_value)
@@ -467,6 +1902,54 @@ void d_smtp_connection_set_close_timeout(
     g_object_notify(G_OBJECT(connection),"close-timeout");
 }
 
+void d_smtp_connection_set_data_timeout(
+    DSmtpConnection* connection,
+    guint timeout_value)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(connection));
+    d_timeout_set_value(connection->timeout,TIMEOUT_OPERATION_DATA,timeout_value);
+    g_object_notify(G_OBJECT(connection),"data-timeout");
+}
+
+void d_smtp_connection_set_read_buffer_size(
+    DSmtpConnection* connection,
+    guint buffer_size)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(connection));
+    connection->read_buffer_size = buffer_size;
+    connection->buffer_pool = d_buffer_pool_get_shared(buffer_size);
+    g_object_notify(G_OBJECT(connection),"read-buffer-size");
+}
+
+void d_smtp_connection_set_accept_time(
+    DSmtpConnection* connection,
+    gint64 accept_time)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(connection));
+    d_smtp_trace_set_accept_time(&connection->trace,accept_time);
+}
+
+void d_smtp_connection_apply_config(
+    DSmtpConnection* connection,
+    DSmtpConfig* config)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(connection));
+    // New values are used by the next started operation,
+    // the operation in progress keeps its timeout.
+    g_object_freeze_notify(G_OBJECT(connection));
+    d_smtp_connection_set_read_timeout(connection,d_smtp_config_get_read_timeout(config));
+    d_smtp_connection_set_data_timeout(connection,d_smtp_config_get_data_timeout(config));
+    d_smtp_connection_set_write_timeout(connection,d_smtp_config_get_write_timeout(config));
+    d_smtp_connection_set_close_timeout(connection,d_smtp_config_get_close_timeout(config));
+    d_smtp_connection_set_read_buffer_size(connection,d_smtp_config_get_read_buffer_size(config));
+    d_smtp_transaction_set_max_header_size(&connection->transaction,d_smtp_config_get_max_header_size(config));
+    d_smtp_transaction_set_max_message_size(&connection->transaction,d_smtp_config_get_max_message_size(config));
+    // The established TLS keeps its certificate.
+    g_clear_object(&connection->tls);
+    connection->tls = d_smtp_tls_get_for_config(config,NULL);
+    g_object_thaw_notify(G_OBJECT(connection));
+}
+
 /**
  * @brief Create new instance of SMTP connection.
  */
@@ -482,7 +1965,6 @@ DSmtpConnection* d_smtp_connection_new(
     d_smtp_connection_set_socket(connection,smtp_client_socket);
     g_autofree gchar* response = g_strdup_printf("220 %s SMTP example mail server\r\n",connection->my_host_name);
     d_smtp_connection_send_response_text(connection,response);
-    d_smtp_state_set_next_state(connection->state, SMTP_STATE_GREETING_SENDING);
 
     return connection;
 }
@@ -505,7 +1987,32 @@ DSmtpConnection* d_smtp_connection_new_with_timeouts(
     d_smtp_connection_set_socket(connection,smtp_client_socket);
     g_autofree gchar* response = g_strdup_printf("220 %s SMTP example mail server\r\n",connection->my_host_name);
     d_smtp_connection_send_response_text(connection,response);
-    d_smtp_state_set_next_state(connection->state, SMTP_STATE_GREETING_SENDING);
+
+    return connection;
+}
+
+DSmtpConnection* d_smtp_connection_new_with_config(
+    GSocket* smtp_client_socket,
+    DSmtpConfig* config)
+{
+    auto connection = reinterpret_cast<DSmtpConnection*>(
+        g_object_new(
+            D_TYPE_SMTP_CONNECTION,
+            "read-timeout",d_smtp_config_get_read_timeout(config),
+            "data-timeout",d_smtp_config_get_data_timeout(config),
+            "write-timeout",d_smtp_config_get_write_timeout(config),
+            "close-timeout",d_smtp_config_get_close_timeout(config),
+            "read-buffer-size",d_smtp_config_get_read_buffer_size(config),
+            "io-engine",guint(d_smtp_config_get_io_engine(config)),
+            NULL
+        ));
+
+    connection->tls = d_smtp_tls_get_for_config(config,NULL);
+    d_smtp_transaction_set_max_header_size(&connection->transaction,d_smtp_config_get_max_header_size(config));
+    d_smtp_transaction_set_max_message_size(&connection->transaction,d_smtp_config_get_max_message_size(config));
+    d_smtp_connection_set_socket(connection,smtp_client_socket);
+    g_autofree gchar* response = g_strdup_printf("220 %s SMTP example mail server\r\n",connection->my_host_name);
+    d_smtp_connection_send_response_text(connection,response);
 
     return connection;
 }
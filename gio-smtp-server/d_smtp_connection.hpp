@@ -17,6 +17,7 @@
 #define __D__NEW__SMTP_CONNECTION__HPP__
 
 #include <gio/gio.h>
+#include "d_smtp_config.hpp"
 
 extern "C" {
 #define D_TYPE_SMTP_CONNECTION (d_smtp_connection_get_type())
@@ -28,6 +29,25 @@ G_DECLARE_FINAL_TYPE(DSmtpConnection,d_smtp_connection,D,SMTP_CONNECTION,GObject
  */
 void d_smtp_connection_close(DSmtpConnection* connection);
 
+/**
+ * @brief Stop the connection at the safe point to move it to other context.
+ * @details Function can be called only from the "safe-point" signal
+ * handler. The connection doesn't start the next command read, the owner
+ * passes it to the thread of other main context which continues the
+ * session by d_smtp_connection_attach. The io_uring connections can't be
+ * detached, they are bound to the ring of the thread. The connection
+ * isn't detached until the client host name and blocklist lookups complete.
+ * @return Function returns TRUE if the connection is detached.
+ */
+gboolean d_smtp_connection_detach(
+    DSmtpConnection* connection);
+
+/**
+ * @brief Continue the detached connection in the thread default context.
+ */
+void d_smtp_connection_attach(
+    DSmtpConnection* connection);
+
 /**
  * @brief Get SMTP connection read operation timeout value.
  */
@@ -46,6 +66,24 @@ guint d_smtp_connection_get_write_timeout(
 guint d_smtp_connection_get_close_timeout(
     DSmtpConnection* connection);
 
+/**
+ * @brief Get SMTP connection message data read operation timeout value.
+ */
+guint d_smtp_connection_get_data_timeout(
+    DSmtpConnection* connection);
+
+/**
+ * @brief Get SMTP connection size of the one read request.
+ */
+guint d_smtp_connection_get_read_buffer_size(
+    DSmtpConnection* connection);
+
+/**
+ * @brief Get SMTP connection I/O engine.
+ */
+SMTP_IO_ENGINE d_smtp_connection_get_io_engine(
+    DSmtpConnection* connection);
+
 /**
  * @brief Set SMTP connection read operation timeout value.
  */
@@ -67,6 +105,36 @@ void d_smtp_connection_set_close_timeout(
     DSmtpConnection* connection,
     guint timeout_value);
 
+/**
+ * @brief Set SMTP connection message data read operation timeout value.
+ */
+void d_smtp_connection_set_data_timeout(
+    DSmtpConnection* connection,
+    guint timeout_value);
+
+/**
+ * @brief Set SMTP connection size of the one read request.
+ */
+void d_smtp_connection_set_read_buffer_size(
+    DSmtpConnection* connection,
+    guint buffer_size);
+
+/**
+ * @brief Set the monotonic time of the socket accept for the session trace.
+ */
+void d_smtp_connection_set_accept_time(
+    DSmtpConnection* connection,
+    gint64 accept_time);
+
+/**
+ * @brief Apply reloadable configuration values to the live connection.
+ * @details Timeouts and buffer sizes are changed without interrupting
+ * the session, new values are used starting from the next operation.
+ */
+void d_smtp_connection_apply_config(
+    DSmtpConnection* connection,
+    DSmtpConfig* config);
+
 /**
  * @brief Create new instance of SMTP connection.
  * @details Create new instance of SMTP connection and immediately
@@ -92,6 +160,18 @@ DSmtpConnection* d_smtp_connection_new_with_timeouts(
     guint read_timeout,
     guint write_timeout,
     guint close_timeout);
+
+/**
+ * @brief Create new instance of SMTP connection configured by the server configuration.
+ * @details Create new instance of SMTP connection and immediately
+ * send the invitation with response code 220. Timeouts, buffer sizes
+ * and I/O engine are taken from the configuration object.
+ * @param [in] smtp_client_socket The new listsner accepted socket.
+ * @param [in] config The server configuration.
+ */
+DSmtpConnection* d_smtp_connection_new_with_config(
+    GSocket* smtp_client_socket,
+    DSmtpConfig* config);
 }
 
 #endif //#ifndef __D__NEW__SMTP_CONNECTION__HPP__
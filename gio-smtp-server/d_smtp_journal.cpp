@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_journal.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/// @brief The record frame magic "DSJR".
+#define JOURNAL_MAGIC 0x524a5344u
+
+extern "C" {
+
+/**
+ * @brief The record frame header, followed by the record bytes.
+ */
+struct DSmtpJournalFrame
+{
+    guint32 magic;
+    guint32 size;
+    guint32 checksum;
+    guint32 reserved;
+};
+
+/**
+ * @brief The record waiting for the commit.
+ */
+struct DSmtpJournalEntry
+{
+    GBytes* record;
+    GTask* task;
+};
+
+struct DSmtpJournalMetrics
+{
+    guint64 records;
+    guint64 commits;
+    guint64 checkpoints;
+    /// @brief The sum of commit times in microseconds.
+    guint64 commit_time;
+};
+
+struct _DSmtpJournal
+{
+    GObject parent;
+
+    gchar* path;
+    gint fd;
+    /// @brief The journal size, accessed only by the journal thread.
+    gsize size;
+    guint commit_window;
+    guint max_batch;
+    gsize checkpoint_size;
+    /// @brief The sync has failed, accessed only by the journal thread.
+    gboolean failed;
+    GAsyncQueue* queue;
+    GThread* thread;
+
+    DSmtpJournalCommitFunc commit_func;
+    DSmtpJournalCheckpointFunc checkpoint_func;
+    gpointer user_data;
+
+    GMutex lock;
+    DSmtpJournalMetrics metrics;
+};
+typedef _DSmtpJournal DSmtpJournal;
+
+G_DEFINE_TYPE(DSmtpJournal,d_smtp_journal,G_TYPE_OBJECT)
+
+struct _DSmtpJournalClass
+{
+    GObjectClass parent;
+};
+
+/// @brief The queue item which stops the journal thread.
+static DSmtpJournalEntry journal_stop_entry;
+
+/**
+ * @brief FNV-1a of the record, detects the torn tail after crash.
+ */
+static guint32 journal_checksum(const guint8* data, gsize size)
+{
+    guint32 hash = 2166136261u;
+    for(gsize index = 0; index < size; index++) {
+        hash = (hash ^ data[index]) * 16777619u;
+    }
+    return hash;
+}
+
+static void journal_entry_free(DSmtpJournalEntry* entry)
+{
+    g_bytes_unref(entry->record);
+    g_object_unref(entry->task);
+    g_free(entry);
+}
+
+static gboolean journal_write_all(
+    gint fd,
+    const guint8* data,
+    gsize size,
+    GError** error)
+{
+    while(size) {
+        gssize written = write(fd,data,size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            gint saved_errno = errno;
+            g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+                "journal write: %s",g_strerror(saved_errno));
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Write the batch and make it durable by the one sync.
+ */
+static gboolean journal_write_batch(
+    DSmtpJournal* journal,
+    GPtrArray* batch,
+    GError** error)
+{
+    if(journal->failed) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_FAILED,"journal is failed by the previous sync");
+        return FALSE;
+    }
+    g_autoptr(GByteArray) buffer = g_byte_array_new();
+    for(guint index = 0; index < batch->len; index++) {
+        auto entry = static_cast<DSmtpJournalEntry*>(g_ptr_array_index(batch,index));
+        gsize size{0};
+        auto data = static_cast<const guint8*>(g_bytes_get_data(entry->record,&size));
+        DSmtpJournalFrame frame{JOURNAL_MAGIC,guint32(size),journal_checksum(data,size),0};
+        g_byte_array_append(buffer,reinterpret_cast<const guint8*>(&frame),sizeof(frame));
+        g_byte_array_append(buffer,data,size);
+    }
+    if(!journal_write_all(journal->fd,buffer->data,buffer->len,error)) {
+        // Drop the partial batch, the next records must follow the valid ones.
+        if(ftruncate(journal->fd,journal->size) != 0) {
+            g_critical("journal %s truncate failed: %s",journal->path,g_strerror(errno));
+        }
+        return FALSE;
+    }
+    if(fdatasync(journal->fd) != 0) {
+        gint saved_errno = errno;
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+            "journal sync: %s",g_strerror(saved_errno));
+        // The state of the written pages is unknown after the failed sync,
+        // so no later record is confirmed until the restart replays the journal.
+        journal->failed = TRUE;
+        g_critical("journal %s sync failed, the stores are rejected",journal->path);
+        return FALSE;
+    }
+    journal->size += buffer->len;
+    return TRUE;
+}
+
+/**
+ * @brief Truncate the journal when the committed records are durable.
+ */
+static void journal_checkpoint(
+    DSmtpJournal* journal)
+{
+    if(journal->checkpoint_func && !journal->checkpoint_func(journal->user_data)) {
+        g_warning("journal %s checkpoint isn't completed",journal->path);
+        return;
+    }
+    if(ftruncate(journal->fd,0) != 0 || fdatasync(journal->fd) != 0) {
+        g_critical("journal %s truncate failed: %s",journal->path,g_strerror(errno));
+        return;
+    }
+    journal->size = 0;
+    g_mutex_lock(&journal->lock);
+    journal->metrics.checkpoints++;
+    g_mutex_unlock(&journal->lock);
+}
+
+static void journal_commit(
+    DSmtpJournal* journal,
+    GPtrArray* batch)
+{
+    gint64 start = g_get_monotonic_time();
+    GError* error{NULL};
+    gboolean durable = journal_write_batch(journal,batch,&error);
+    for(guint index = 0; index < batch->len; index++) {
+        auto entry = static_cast<DSmtpJournalEntry*>(g_ptr_array_index(batch,index));
+        if(durable) {
+            g_task_return_boolean(entry->task,TRUE);
+        } else {
+            g_task_return_error(entry->task,g_error_copy(error));
+        }
+    }
+    if(!durable) {
+        g_warning("journal %s commit failed: %d %s",journal->path,error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    g_mutex_lock(&journal->lock);
+    journal->metrics.records += batch->len;
+    journal->metrics.commits++;
+    journal->metrics.commit_time += g_get_monotonic_time() - start;
+    g_mutex_unlock(&journal->lock);
+    // The records are applied after the responses are on the way.
+    if(journal->commit_func) {
+        g_autoptr(GPtrArray) records = g_ptr_array_new_full(batch->len,NULL);
+        for(guint index = 0; index < batch->len; index++) {
+            g_ptr_array_add(records,static_cast<DSmtpJournalEntry*>(g_ptr_array_index(batch,index))->record);
+        }
+        journal->commit_func(records,journal->user_data);
+    }
+    if(journal->size >= journal->checkpoint_size) {
+        journal_checkpoint(journal);
+    }
+}
+
+static gpointer d_smtp_journal_thread(gpointer user_data)
+{
+    auto journal = D_SMTP_JOURNAL(user_data);
+    g_autoptr(GPtrArray) batch = g_ptr_array_new_with_free_func(
+        reinterpret_cast<GDestroyNotify>(journal_entry_free));
+    gboolean stopping{FALSE};
+    while(!stopping) {
+        auto entry = static_cast<DSmtpJournalEntry*>(g_async_queue_pop(journal->queue));
+        if(entry == &journal_stop_entry) {
+            break;
+        }
+        g_ptr_array_add(batch,entry);
+        // Everything waiting is the part of this commit, the window lets
+        // the concurrent sessions join it.
+        gint64 deadline = g_get_monotonic_time() + journal->commit_window;
+        while(batch->len < journal->max_batch) {
+            gint64 remaining = deadline - g_get_monotonic_time();
+            entry = static_cast<DSmtpJournalEntry*>(remaining > 0 ?
+                g_async_queue_timeout_pop(journal->queue,remaining) :
+                g_async_queue_try_pop(journal->queue));
+            if(!entry) {
+                break;
+            }
+            if(entry == &journal_stop_entry) {
+                stopping = TRUE;
+                break;
+            }
+            g_ptr_array_add(batch,entry);
+        }
+        journal_commit(journal,batch);
+        g_ptr_array_set_size(batch,0);
+    }
+    // The clean stop leaves the empty journal, nothing to replay.
+    if(journal->size && !journal->failed) {
+        journal_checkpoint(journal);
+    }
+    return NULL;
+}
+
+void d_smtp_journal_append(
+    DSmtpJournal* journal,
+    GBytes* record,
+    GTask* task)
+{
+    g_return_if_fail(D_IS_SMTP_JOURNAL(journal));
+    auto entry = g_new0(DSmtpJournalEntry,1);
+    entry->record = g_bytes_ref(record);
+    entry->task = G_TASK(g_object_ref(task));
+    g_async_queue_push(journal->queue,entry);
+}
+
+void d_smtp_journal_set_funcs(
+    DSmtpJournal* journal,
+    DSmtpJournalCommitFunc commit_func,
+    DSmtpJournalCheckpointFunc checkpoint_func,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_SMTP_JOURNAL(journal));
+    journal->commit_func = commit_func;
+    journal->checkpoint_func = checkpoint_func;
+    journal->user_data = user_data;
+}
+
+void d_smtp_journal_log_metrics(
+    DSmtpJournal* journal)
+{
+    g_return_if_fail(D_IS_SMTP_JOURNAL(journal));
+    g_mutex_lock(&journal->lock);
+    DSmtpJournalMetrics metrics = journal->metrics;
+    g_mutex_unlock(&journal->lock);
+    g_message("journal: %" G_GUINT64_FORMAT " records in %" G_GUINT64_FORMAT
+        " commits (%.1f per commit, mean %.1f us), %" G_GUINT64_FORMAT " checkpoints",
+        metrics.records,metrics.commits,
+        metrics.commits ? double(metrics.records) / metrics.commits : 0.0,
+        metrics.commits ? double(metrics.commit_time) / metrics.commits : 0.0,
+        metrics.checkpoints);
+}
+
+gint d_smtp_journal_replay(
+    const gchar* path,
+    DSmtpJournalReplayFunc replay_func,
+    gpointer user_data,
+    gsize* valid_size,
+    GError** error)
+{
+    if(valid_size) {
+        *valid_size = 0;
+    }
+    if(!g_file_test(path,G_FILE_TEST_EXISTS)) {
+        return 0;
+    }
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path,FALSE,error);
+    if(!file) {
+        return -1;
+    }
+    g_autoptr(GBytes) bytes = g_mapped_file_get_bytes(file);
+    gsize size{0};
+    auto data = static_cast<const guint8*>(g_bytes_get_data(bytes,&size));
+    gsize offset{0};
+    gint count{0};
+    while(size - offset >= sizeof(DSmtpJournalFrame)) {
+        DSmtpJournalFrame frame;
+        memcpy(&frame,data + offset,sizeof(frame));
+        offset += sizeof(frame);
+        if(frame.magic != JOURNAL_MAGIC || frame.size > size - offset ||
+           frame.checksum != journal_checksum(data + offset,frame.size)) {
+            g_warning("journal %s: torn record at %" G_GSIZE_FORMAT " is dropped",path,offset - sizeof(frame));
+            break;
+        }
+        g_autoptr(GBytes) record = g_bytes_new_from_bytes(bytes,offset,frame.size);
+        replay_func(record,user_data);
+        offset += frame.size;
+        count++;
+        if(valid_size) {
+            *valid_size = offset;
+        }
+    }
+    return count;
+}
+
+static void d_smtp_journal_init(DSmtpJournal* journal)
+{
+    journal->fd = -1;
+    journal->queue = g_async_queue_new();
+    g_mutex_init(&journal->lock);
+}
+
+static void d_smtp_journal_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_JOURNAL(object));
+    auto journal = D_SMTP_JOURNAL(object);
+    if(journal->thread) {
+        // The records queued before are committed first.
+        g_async_queue_push(journal->queue,&journal_stop_entry);
+        g_thread_join(journal->thread);
+    }
+    if(journal->fd >= 0) {
+        close(journal->fd);
+    }
+    g_async_queue_unref(journal->queue);
+    g_free(journal->path);
+    g_mutex_clear(&journal->lock);
+    G_OBJECT_CLASS(d_smtp_journal_parent_class)->finalize(object);
+}
+
+static void d_smtp_journal_class_init(DSmtpJournalClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_journal_finalize;
+}
+
+/**
+ * @brief Create new instance of journal.
+ */
+DSmtpJournal* d_smtp_journal_new(
+    const gchar* path,
+    gsize keep_size,
+    guint commit_window,
+    guint max_batch,
+    gsize checkpoint_size,
+    GError** error)
+{
+    // The torn tail after the kept records is dropped, the new records
+    // must follow the valid ones.
+    gint fd = open(path,O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,0600);
+    if(fd < 0 || ftruncate(fd,keep_size) != 0 || fdatasync(fd) != 0) {
+        gint saved_errno = errno;
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+            "journal %s: %s",path,g_strerror(saved_errno));
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+
+    auto journal = reinterpret_cast<DSmtpJournal*>(
+        g_object_new(
+            D_TYPE_SMTP_JOURNAL,
+            NULL));
+
+    journal->path = g_strdup(path);
+    journal->fd = fd;
+    journal->size = keep_size;
+    journal->commit_window = commit_window;
+    journal->max_batch = MAX(max_batch,1u);
+    journal->checkpoint_size = checkpoint_size;
+    journal->thread = g_thread_new("smtp-journal",d_smtp_journal_thread,journal);
+
+    return journal;
+}
+
+}
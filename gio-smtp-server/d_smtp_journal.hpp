@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_JOURNAL__HPP__
+#define __D__NEW__SMTP_JOURNAL__HPP__
+/**
+ * @brief Append only journal with the group commit.
+ * @details Records appended from any thread are written by the single
+ * journal thread. The records waiting while the previous batch is synced,
+ * or arriving during the commit window, are written together and made
+ * durable by the one fdatasync. The append task of every record returns
+ * after its batch is durable.
+ * The record is framed by the size and checksum, the replay stops at the
+ * first torn or damaged record. When the journal grows over the checkpoint
+ * size, and at the journal stop, the owner makes the applied records
+ * durable elsewhere and the journal is truncated. The owner refuses the
+ * checkpoint while any record isn't applied, the journal is its only copy.
+ */
+
+#include <gio/gio.h>
+
+/**
+ * @brief Called in the journal thread after the batch is durable.
+ * @param [in] records The batch records in order, array of GBytes.
+ */
+typedef void (*DSmtpJournalCommitFunc)(
+    GPtrArray* records,
+    gpointer user_data);
+
+/**
+ * @brief Called in the journal thread before the journal is truncated.
+ * @return The owner returns TRUE if all committed records are durable.
+ */
+typedef gboolean (*DSmtpJournalCheckpointFunc)(
+    gpointer user_data);
+
+/**
+ * @brief Called for every valid record of the journal replay.
+ */
+typedef void (*DSmtpJournalReplayFunc)(
+    GBytes* record,
+    gpointer user_data);
+
+extern "C" {
+#define D_TYPE_SMTP_JOURNAL (d_smtp_journal_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpJournal,d_smtp_journal,D,SMTP_JOURNAL,GObject)
+
+/**
+ * @brief Append the record.
+ * @details Function can be called from any thread. The task returns TRUE
+ * when the record is durable or the error, the task callback is invoked
+ * in the task context.
+ * @param [in] record The record bytes.
+ * @param [in] task The task to return, journal takes the reference.
+ */
+void d_smtp_journal_append(
+    DSmtpJournal* journal,
+    GBytes* record,
+    GTask* task);
+
+/**
+ * @brief Set the functions called by the journal thread.
+ */
+void d_smtp_journal_set_funcs(
+    DSmtpJournal* journal,
+    DSmtpJournalCommitFunc commit_func,
+    DSmtpJournalCheckpointFunc checkpoint_func,
+    gpointer user_data);
+
+/**
+ * @brief Write the records and commits statistics to the log.
+ */
+void d_smtp_journal_log_metrics(
+    DSmtpJournal* journal);
+
+/**
+ * @brief Read the valid records of the journal file.
+ * @param [out] valid_size The size of the valid records or NULL.
+ * @return The number of records or -1 in case of failure.
+ */
+gint d_smtp_journal_replay(
+    const gchar* path,
+    DSmtpJournalReplayFunc replay_func,
+    gpointer user_data,
+    gsize* valid_size,
+    GError** error);
+
+/**
+ * @brief Create new instance of journal.
+ * @details The journal file is truncated to the kept records, replay it
+ * before.
+ * @param [in] path The journal file path.
+ * @param [in] keep_size The size of the replayed records kept in the
+ * journal until the next checkpoint, 0 - the journal is emptied.
+ * @param [in] commit_window The time in microseconds to wait for more
+ * records after the first one, 0 - write what is already waiting.
+ * @param [in] max_batch The maximum number of records of the one commit.
+ * @param [in] checkpoint_size The journal size which triggers checkpoint.
+ * @return The journal or NULL in case of failure.
+ */
+DSmtpJournal* d_smtp_journal_new(
+    const gchar* path,
+    gsize keep_size,
+    guint commit_window,
+    guint max_batch,
+    gsize checkpoint_size,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_JOURNAL__HPP__
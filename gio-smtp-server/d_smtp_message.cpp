@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_message.hpp"
+
+#include <string.h>
+
+/// @brief The maximum length of the taken header value.
+#define SMTP_MESSAGE_MAX_VALUE 998
+
+enum SMTP_MESSAGE_HEADER
+{
+    /// @brief The first byte of the header line.
+    SMTP_MESSAGE_HEADER_LINE_START,
+    SMTP_MESSAGE_HEADER_NAME,
+    SMTP_MESSAGE_HEADER_VALUE,
+    /// @brief The header is over, only the end of data is searched.
+    SMTP_MESSAGE_BODY
+};
+
+enum SMTP_MESSAGE_END
+{
+    SMTP_MESSAGE_END_LINE,
+    SMTP_MESSAGE_END_LINE_START,
+    SMTP_MESSAGE_END_DOT,
+    SMTP_MESSAGE_END_DOT_CR
+};
+
+extern "C" {
+
+void d_smtp_message_parser_init(
+    DSmtpMessageParser* parser)
+{
+    memset(parser,0,sizeof(*parser));
+    parser->message_id = g_string_new(NULL);
+    parser->from = g_string_new(NULL);
+    parser->date = g_string_new(NULL);
+    parser->body_checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    parser->spans = g_array_new(FALSE,FALSE,sizeof(DSmtpMessageSpan));
+    d_smtp_message_parser_reset(parser,G_MAXSIZE);
+}
+
+void d_smtp_message_parser_clear(
+    DSmtpMessageParser* parser)
+{
+    GString** values[] = {&parser->message_id,&parser->from,&parser->date};
+    for(GString** value : values) {
+        if(*value) {
+            g_string_free(*value,TRUE);
+            *value = nullptr;
+        }
+    }
+    g_clear_pointer(&parser->body_checksum,g_checksum_free);
+    g_clear_pointer(&parser->spans,g_array_unref);
+    parser->value = nullptr;
+}
+
+void d_smtp_message_parser_reset(
+    DSmtpMessageParser* parser,
+    gsize max_header_size)
+{
+    parser->header_state = SMTP_MESSAGE_HEADER_LINE_START;
+    // The CRLF of the DATA command precedes the first line.
+    parser->end_state = SMTP_MESSAGE_END_LINE_START;
+    parser->name_length = 0;
+    parser->value = nullptr;
+    g_string_truncate(parser->message_id,0);
+    g_string_truncate(parser->from,0);
+    g_string_truncate(parser->date,0);
+    parser->received_count = 0;
+    parser->header_size = 0;
+    parser->max_header_size = max_header_size;
+    parser->header_too_large = FALSE;
+    parser->size = 0;
+    g_checksum_reset(parser->body_checksum);
+    g_array_set_size(parser->spans,0);
+}
+
+/**
+ * @brief Select the value to take by the field name.
+ * @details The first field of the name is taken, the others are ignored.
+ */
+static GString* smtp_message_field_value(
+    DSmtpMessageParser* parser)
+{
+    if(parser->name_length >= sizeof(parser->name)) {
+        return nullptr;
+    }
+    const gchar* name = parser->name;
+    GString* value{nullptr};
+    if(g_ascii_strcasecmp(name,"Received") == 0) {
+        parser->received_count++;
+    } else if(g_ascii_strcasecmp(name,"Message-ID") == 0) {
+        value = parser->message_id;
+    } else if(g_ascii_strcasecmp(name,"From") == 0) {
+        value = parser->from;
+    } else if(g_ascii_strcasecmp(name,"Date") == 0) {
+        value = parser->date;
+    }
+    return value && value->len == 0 ? value : nullptr;
+}
+
+static void smtp_message_header_end(
+    DSmtpMessageParser* parser)
+{
+    parser->header_state = SMTP_MESSAGE_BODY;
+    parser->value = nullptr;
+    // Drop the trailing white space of the folded values.
+    GString* values[] = {parser->message_id,parser->from,parser->date};
+    for(GString* value : values) {
+        while(value->len && g_ascii_isspace(value->str[value->len - 1])) {
+            g_string_truncate(value,value->len - 1);
+        }
+    }
+}
+
+static void smtp_message_header_byte(
+    DSmtpMessageParser* parser,
+    gchar c)
+{
+    if(++parser->header_size > parser->max_header_size) {
+        parser->header_too_large = TRUE;
+        smtp_message_header_end(parser);
+        return;
+    }
+    switch(parser->header_state) {
+    case SMTP_MESSAGE_HEADER_LINE_START:
+        if(c == '\r') {
+            return;
+        }
+        if(c == '\n') {
+            // The empty line separates the header and the body.
+            smtp_message_header_end(parser);
+            return;
+        }
+        if(c == ' ' || c == '\t') {
+            // The folded line continues the current field value.
+            parser->header_state = SMTP_MESSAGE_HEADER_VALUE;
+            if(parser->value && parser->value->len) {
+                g_string_append_c(parser->value,' ');
+            }
+            return;
+        }
+        parser->header_state = SMTP_MESSAGE_HEADER_NAME;
+        parser->name_length = 0;
+        parser->value = nullptr;
+        [[fallthrough]];
+    case SMTP_MESSAGE_HEADER_NAME:
+        if(c == ':') {
+            parser->name[MIN(parser->name_length,sizeof(parser->name) - 1)] = '\0';
+            parser->value = smtp_message_field_value(parser);
+            parser->header_state = SMTP_MESSAGE_HEADER_VALUE;
+        } else if(c == '\n') {
+            // The line without the field name, the body starts without separator.
+            smtp_message_header_end(parser);
+        } else if(parser->name_length < sizeof(parser->name)) {
+            parser->name[parser->name_length++] = c;
+        }
+        return;
+    case SMTP_MESSAGE_HEADER_VALUE:
+        if(c == '\n') {
+            parser->header_state = SMTP_MESSAGE_HEADER_LINE_START;
+            return;
+        }
+        if(c == '\r' || !parser->value || parser->value->len >= SMTP_MESSAGE_MAX_VALUE) {
+            return;
+        }
+        if(parser->value->len || (c != ' ' && c != '\t')) {
+            g_string_append_c(parser->value,c);
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Advance the end of data marker "\r\n.\r\n" search.
+ * @return Return TRUE if the marker is complete.
+ */
+static gboolean smtp_message_end_byte(
+    DSmtpMessageParser* parser,
+    gchar c)
+{
+    switch(parser->end_state) {
+    case SMTP_MESSAGE_END_LINE_START:
+        parser->end_state = c == '.' ? SMTP_MESSAGE_END_DOT :
+            c == '\n' ? SMTP_MESSAGE_END_LINE_START : SMTP_MESSAGE_END_LINE;
+        return FALSE;
+    case SMTP_MESSAGE_END_DOT:
+        parser->end_state = c == '\r' ? SMTP_MESSAGE_END_DOT_CR :
+            c == '\n' ? SMTP_MESSAGE_END_LINE_START : SMTP_MESSAGE_END_LINE;
+        return FALSE;
+    case SMTP_MESSAGE_END_DOT_CR:
+        if(c == '\n') {
+            return TRUE;
+        }
+        parser->end_state = SMTP_MESSAGE_END_LINE;
+        return FALSE;
+    default:
+        if(c == '\n') {
+            parser->end_state = SMTP_MESSAGE_END_LINE_START;
+        }
+        return FALSE;
+    }
+}
+
+/**
+ * @brief Take the [begin,end) content range of the fed block.
+ * @details The header is already scanned up to the end of the range,
+ * the part after it is the body and goes to the digest.
+ */
+static void smtp_message_content(
+    DSmtpMessageParser* parser,
+    const gchar* data,
+    const gchar* begin,
+    const gchar* end)
+{
+    if(begin >= end) {
+        return;
+    }
+    DSmtpMessageSpan span{gsize(begin - data),gsize(end - begin)};
+    g_array_append_val(parser->spans,span);
+    gsize offset = parser->size;
+    parser->size += span.length;
+    if(parser->header_state == SMTP_MESSAGE_BODY && parser->size > parser->header_size) {
+        gsize skip = parser->header_size > offset ? parser->header_size - offset : 0;
+        g_checksum_update(parser->body_checksum,reinterpret_cast<const guchar*>(begin + skip),span.length - skip);
+    }
+}
+
+gboolean d_smtp_message_parser_feed(
+    DSmtpMessageParser* parser,
+    const gchar* data,
+    gsize size,
+    gsize* consumed)
+{
+    const gchar* p = data;
+    const gchar* end = data + size;
+    // The content between the dropped bytes is taken by the one span.
+    const gchar* content = data;
+    gboolean found{FALSE};
+    g_array_set_size(parser->spans,0);
+    while(p < end) {
+        if(parser->header_state == SMTP_MESSAGE_BODY && parser->end_state == SMTP_MESSAGE_END_LINE) {
+            // The body is only searched for the next line start.
+            auto lf = static_cast<const gchar*>(memchr(p,'\n',end - p));
+            if(!lf) {
+                p = end;
+                break;
+            }
+            p = lf + 1;
+            parser->end_state = SMTP_MESSAGE_END_LINE_START;
+            continue;
+        }
+        guint end_state = parser->end_state;
+        gchar c = *p++;
+        if(smtp_message_end_byte(parser,c)) {
+            found = TRUE;
+            break;
+        }
+        // The dot of the line start is the stuffing or the marker, RFC 5321 4.5.2.
+        // The CR after it is the marker or the bare CR which isn't allowed, 2.3.8.
+        if((end_state == SMTP_MESSAGE_END_LINE_START && c == '.') ||
+           (end_state == SMTP_MESSAGE_END_DOT && c == '\r')) {
+            smtp_message_content(parser,data,content,p - 1);
+            content = p;
+            continue;
+        }
+        if(parser->header_state != SMTP_MESSAGE_BODY) {
+            smtp_message_header_byte(parser,c);
+        }
+    }
+    smtp_message_content(parser,data,content,found ? content : p);
+    *consumed = p - data;
+    if(found && parser->header_state != SMTP_MESSAGE_BODY) {
+        smtp_message_header_end(parser);
+    }
+    return found;
+}
+
+gboolean d_smtp_message_parser_body_started(
+    const DSmtpMessageParser* parser)
+{
+    return parser->header_state == SMTP_MESSAGE_BODY;
+}
+
+GBytes* d_smtp_message_received_new(
+    const gchar* by_host,
+    const gchar* helo_domain,
+    const gchar* remote_host,
+    const gchar* address,
+    gboolean tls)
+{
+    g_autoptr(GDateTime) now = g_date_time_new_now_local();
+    g_autofree gchar* date = g_date_time_format(now,"%a, %d %b %Y %H:%M:%S %z");
+    gchar* text = g_strdup_printf("Received: from %s (%s%s[%s])\r\n\tby %s with %s; %s\r\n",
+        helo_domain ? helo_domain : "unknown",remote_host ? remote_host : "",remote_host ? " " : "",
+        address ? address : "unknown",
+        by_host,tls ? "ESMTPS" : "ESMTP",date);
+    return g_bytes_new_take(text,strlen(text));
+}
+
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_MESSAGE__HPP__
+#define __D__NEW__SMTP_MESSAGE__HPP__
+/**
+ * @brief Streaming scanner of the message data.
+ * @details The received blocks are scanned once: the same pass finds the
+ * end of data marker, removes the dot stuffing, measures the header and
+ * takes the Message-ID, From and Date values and the number of Received
+ * fields, and the body digest is updated. The message itself isn't
+ * buffered, only the taken values are copied, the content is reported
+ * as the spans of the fed block.
+ */
+
+#include <gio/gio.h>
+
+/// @brief The maximum number of Received fields, RFC 5321 6.3.
+#define SMTP_MESSAGE_MAX_RECEIVED 100
+
+/**
+ * @brief The range of the message content in the fed block.
+ */
+struct DSmtpMessageSpan
+{
+    gsize offset;
+    gsize length;
+};
+
+/**
+ * @brief Message scanner, the plain value embedded into the transaction.
+ */
+struct DSmtpMessageParser
+{
+    /// @brief Position in the header, one of the SMTP_MESSAGE_HEADER values.
+    guint header_state;
+    /// @brief Position in the end of data marker.
+    guint end_state;
+    /// @brief The name of the current header field.
+    gchar name[32];
+    guint name_length;
+    /// @brief The value taken from the current field or NULL.
+    GString* value;
+    GString* message_id;
+    GString* from;
+    GString* date;
+    guint received_count;
+    /// @brief The header size including the empty line.
+    gsize header_size;
+    gsize max_header_size;
+    gboolean header_too_large;
+    /// @brief The content size, the dot stuffing and the end of data marker excluded.
+    gsize size;
+    /// @brief SHA-256 of the body content.
+    GChecksum* body_checksum;
+    /// @brief The content spans of the last fed block, array of DSmtpMessageSpan.
+    GArray* spans;
+};
+
+extern "C" {
+
+/**
+ * @brief Allocate the parser storage.
+ */
+void d_smtp_message_parser_init(
+    DSmtpMessageParser* parser);
+
+/**
+ * @brief Free the parser storage.
+ */
+void d_smtp_message_parser_clear(
+    DSmtpMessageParser* parser);
+
+/**
+ * @brief Prepare the parser for the next message, the storage is kept.
+ * @param [in] max_header_size The header part bigger than this size
+ * isn't parsed and the message is marked with header_too_large.
+ */
+void d_smtp_message_parser_reset(
+    DSmtpMessageParser* parser,
+    gsize max_header_size);
+
+/**
+ * @brief Scan the next block of the message data.
+ * @details The content of the block is left in the spans, the dot of the
+ * line start and the end of data marker aren't the content.
+ * @param [in] data The received bytes.
+ * @param [in] size The number of received bytes.
+ * @param [out] consumed The number of message bytes in the block
+ * including the end of data marker.
+ * @return Function returns TRUE if the end of data marker is found.
+ */
+gboolean d_smtp_message_parser_feed(
+    DSmtpMessageParser* parser,
+    const gchar* data,
+    gsize size,
+    gsize* consumed);
+
+/**
+ * @brief Check the header is scanned and the body bytes are fed.
+ * @details The body starts at header_size of the message data.
+ */
+gboolean d_smtp_message_parser_body_started(
+    const DSmtpMessageParser* parser);
+
+/**
+ * @brief Build our Received header field.
+ * @param [in] by_host Our host name.
+ * @param [in] helo_domain The client HELO/EHLO domain or NULL.
+ * @param [in] remote_host The forward confirmed client host name or NULL.
+ * @param [in] address The client address or NULL.
+ * @param [in] tls The message is received over TLS.
+ * @return The header field bytes, caller owns the reference.
+ */
+GBytes* d_smtp_message_received_new(
+    const gchar* by_host,
+    const gchar* helo_domain,
+    const gchar* remote_host,
+    const gchar* address,
+    gboolean tls);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_MESSAGE__HPP__
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_PROBES__HPP__
+#define __D__NEW__SMTP_PROBES__HPP__
+/**
+ * @brief USDT probes of the "dsmtp" provider.
+ * @details The probes are compiled in when <sys/sdt.h> is available, the
+ * disabled probe is the single nop instruction. Without the header, or
+ * with D_SMTP_DISABLE_PROBES defined, the probes are not compiled at all.
+ * Probes and arguments:
+ * @code
+ * accept            fd, connections count
+ * reject            fd, connections count
+ * command           command, line length
+ * state             session, old state, new state, event
+ * data_read         session, bytes count
+ * close             session
+ * timeout_start     timeout, operation, seconds
+ * timeout_stop      timeout, operation
+ * timeout_fire      timeout, operation
+ * loop_stall        loop name, stalled microseconds
+ * @endcode
+ * The session is the address of the connection state, it is the same for
+ * all probes of the one connection. The bpftrace scripts are in probes/.
+ */
+
+#if defined(__has_include) && !defined(D_SMTP_DISABLE_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define D_SMTP_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef D_SMTP_PROBES_ENABLED
+#define D_SMTP_PROBE1(name,a1) DTRACE_PROBE1(dsmtp,name,a1)
+#define D_SMTP_PROBE2(name,a1,a2) DTRACE_PROBE2(dsmtp,name,a1,a2)
+#define D_SMTP_PROBE3(name,a1,a2,a3) DTRACE_PROBE3(dsmtp,name,a1,a2,a3)
+#define D_SMTP_PROBE4(name,a1,a2,a3,a4) DTRACE_PROBE4(dsmtp,name,a1,a2,a3,a4)
+#else
+#define D_SMTP_PROBE1(name,a1) do {} while(0)
+#define D_SMTP_PROBE2(name,a1,a2) do {} while(0)
+#define D_SMTP_PROBE3(name,a1,a2,a3) do {} while(0)
+#define D_SMTP_PROBE4(name,a1,a2,a3,a4) do {} while(0)
+#endif
+
+#endif //#ifndef __D__NEW__SMTP_PROBES__HPP__
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_queue_index.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief The index file magic "DSQI".
+#define QUEUE_INDEX_MAGIC 0x49515344u
+#define QUEUE_INDEX_VERSION 1u
+/// @brief The records capacity of the new index file.
+#define QUEUE_INDEX_INITIAL_CAPACITY 1024u
+
+extern "C" {
+
+struct DSmtpQueueIndexHeader
+{
+    guint32 magic;
+    guint32 version;
+    /// @brief Set by the close, cleared while the index is open.
+    guint32 clean;
+    guint32 max_destinations;
+    /// @brief The size of the records array.
+    guint32 capacity;
+    /// @brief The number of records ever taken, the next are never used.
+    guint32 used;
+    guint32 free_head;
+    /// @brief The number of queued records.
+    guint32 count;
+    guint32 reserved[8];
+};
+
+struct DSmtpQueueIndexDestination
+{
+    /// @brief The lower case name, empty for the free slot.
+    gchar name[SMTP_QUEUE_INDEX_MAX_DESTINATION + 1];
+    guint32 head;
+    guint32 tail;
+    guint32 count;
+    guint32 reserved;
+};
+
+struct DSmtpQueueIndexRecord
+{
+    gchar id[SMTP_QUEUE_INDEX_MAX_ID + 1];
+    guint32 destination;
+    /// @brief The destination list links or the free list link.
+    guint32 prev;
+    guint32 next;
+    /// @brief TRUE while the record is in the destination list.
+    guint32 queued;
+};
+
+struct _DSmtpQueueIndex
+{
+    GObject parent;
+
+    gchar* path;
+    gint fd;
+    guint8* map;
+    gsize map_size;
+    gboolean needs_rebuild;
+    GMutex lock;
+};
+typedef _DSmtpQueueIndex DSmtpQueueIndex;
+
+G_DEFINE_TYPE(DSmtpQueueIndex,d_smtp_queue_index,G_TYPE_OBJECT)
+
+struct _DSmtpQueueIndexClass
+{
+    GObjectClass parent;
+};
+
+static DSmtpQueueIndexHeader* queue_index_header(DSmtpQueueIndex* index)
+{
+    return reinterpret_cast<DSmtpQueueIndexHeader*>(index->map);
+}
+
+static DSmtpQueueIndexDestination* queue_index_destinations(DSmtpQueueIndex* index)
+{
+    return reinterpret_cast<DSmtpQueueIndexDestination*>(index->map + sizeof(DSmtpQueueIndexHeader));
+}
+
+static gsize queue_index_records_offset(guint32 max_destinations)
+{
+    return sizeof(DSmtpQueueIndexHeader) + gsize(max_destinations) * sizeof(DSmtpQueueIndexDestination);
+}
+
+static DSmtpQueueIndexRecord* queue_index_record(DSmtpQueueIndex* index, guint32 record)
+{
+    auto records = reinterpret_cast<DSmtpQueueIndexRecord*>(
+        index->map + queue_index_records_offset(queue_index_header(index)->max_destinations));
+    return records + record;
+}
+
+static void queue_index_set_errno_error(
+    GError** error,
+    gint saved_errno,
+    const gchar* operation,
+    const gchar* path)
+{
+    g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+        "queue index %s %s: %s",operation,path,g_strerror(saved_errno));
+}
+
+/**
+ * @brief Map the whole index file.
+ */
+static gboolean queue_index_map(
+    DSmtpQueueIndex* index,
+    gsize size,
+    GError** error)
+{
+    if(index->map) {
+        munmap(index->map,index->map_size);
+        index->map = nullptr;
+    }
+    void* map = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,index->fd,0);
+    if(map == MAP_FAILED) {
+        queue_index_set_errno_error(error,errno,"mmap",index->path);
+        return FALSE;
+    }
+    index->map = static_cast<guint8*>(map);
+    index->map_size = size;
+    return TRUE;
+}
+
+/**
+ * @brief Extend the file and the mapping to the records capacity.
+ */
+static gboolean queue_index_resize(
+    DSmtpQueueIndex* index,
+    guint32 max_destinations,
+    guint32 capacity,
+    GError** error)
+{
+    gsize size = queue_index_records_offset(max_destinations) + gsize(capacity) * sizeof(DSmtpQueueIndexRecord);
+    if(ftruncate(index->fd,size) != 0) {
+        queue_index_set_errno_error(error,errno,"truncate",index->path);
+        return FALSE;
+    }
+    if(!queue_index_map(index,size,error)) {
+        return FALSE;
+    }
+    queue_index_header(index)->capacity = capacity;
+    return TRUE;
+}
+
+/**
+ * @brief Find the destination slot.
+ * @param [in] create Take the free slot if the destination isn't found.
+ * @return The slot number or SMTP_QUEUE_INDEX_NONE.
+ */
+static guint32 queue_index_find_destination(
+    DSmtpQueueIndex* index,
+    const gchar* destination,
+    gboolean create)
+{
+    gchar name[SMTP_QUEUE_INDEX_MAX_DESTINATION + 1];
+    gsize length = strlen(destination);
+    if(length == 0 || length > SMTP_QUEUE_INDEX_MAX_DESTINATION) {
+        return SMTP_QUEUE_INDEX_NONE;
+    }
+    for(gsize position = 0; position <= length; position++) {
+        name[position] = g_ascii_tolower(destination[position]);
+    }
+    guint32 max_destinations = queue_index_header(index)->max_destinations;
+    DSmtpQueueIndexDestination* destinations = queue_index_destinations(index);
+    guint32 slot = g_str_hash(name) % max_destinations;
+    // The slots are never freed, so the probe ends at the first empty one.
+    for(guint32 probe = 0; probe < max_destinations; probe++) {
+        DSmtpQueueIndexDestination* entry = &destinations[slot];
+        if(entry->name[0] == '\0') {
+            if(!create) {
+                return SMTP_QUEUE_INDEX_NONE;
+            }
+            memcpy(entry->name,name,length + 1);
+            entry->head = SMTP_QUEUE_INDEX_NONE;
+            entry->tail = SMTP_QUEUE_INDEX_NONE;
+            entry->count = 0;
+            return slot;
+        }
+        if(strcmp(entry->name,name) == 0) {
+            return slot;
+        }
+        slot = (slot + 1) % max_destinations;
+    }
+    return SMTP_QUEUE_INDEX_NONE;
+}
+
+/**
+ * @brief Unlink the record from the destination list and free it.
+ */
+static void queue_index_release(
+    DSmtpQueueIndex* index,
+    guint32 record)
+{
+    DSmtpQueueIndexHeader* header = queue_index_header(index);
+    DSmtpQueueIndexRecord* entry = queue_index_record(index,record);
+    DSmtpQueueIndexDestination* destination = &queue_index_destinations(index)[entry->destination];
+    if(entry->prev != SMTP_QUEUE_INDEX_NONE) {
+        queue_index_record(index,entry->prev)->next = entry->next;
+    } else {
+        destination->head = entry->next;
+    }
+    if(entry->next != SMTP_QUEUE_INDEX_NONE) {
+        queue_index_record(index,entry->next)->prev = entry->prev;
+    } else {
+        destination->tail = entry->prev;
+    }
+    destination->count--;
+    header->count--;
+    entry->queued = FALSE;
+    entry->prev = SMTP_QUEUE_INDEX_NONE;
+    entry->next = header->free_head;
+    header->free_head = record;
+}
+
+gboolean d_smtp_queue_index_needs_rebuild(
+    DSmtpQueueIndex* index)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),TRUE);
+    return index->needs_rebuild;
+}
+
+void d_smtp_queue_index_clear(
+    DSmtpQueueIndex* index)
+{
+    g_return_if_fail(D_IS_SMTP_QUEUE_INDEX(index));
+    g_mutex_lock(&index->lock);
+    DSmtpQueueIndexHeader* header = queue_index_header(index);
+    memset(queue_index_destinations(index),0,gsize(header->max_destinations) * sizeof(DSmtpQueueIndexDestination));
+    header->used = 0;
+    header->free_head = SMTP_QUEUE_INDEX_NONE;
+    header->count = 0;
+    index->needs_rebuild = FALSE;
+    g_mutex_unlock(&index->lock);
+}
+
+/**
+ * @brief Add the record to the tail of the destination list, the lock is held.
+ */
+static guint32 queue_index_append(
+    DSmtpQueueIndex* index,
+    guint32 slot,
+    const gchar* id,
+    GError** error)
+{
+    DSmtpQueueIndexHeader* header = queue_index_header(index);
+    guint32 record = header->free_head;
+    if(record != SMTP_QUEUE_INDEX_NONE) {
+        header->free_head = queue_index_record(index,record)->next;
+    } else {
+        if(header->used == header->capacity &&
+           !queue_index_resize(index,header->max_destinations,header->capacity * 2,error)) {
+            return SMTP_QUEUE_INDEX_NONE;
+        }
+        // The mapping may be moved by the resize.
+        header = queue_index_header(index);
+        record = header->used++;
+    }
+    DSmtpQueueIndexDestination* entry = &queue_index_destinations(index)[slot];
+    DSmtpQueueIndexRecord* item = queue_index_record(index,record);
+    g_strlcpy(item->id,id,sizeof(item->id));
+    item->destination = slot;
+    item->prev = entry->tail;
+    item->next = SMTP_QUEUE_INDEX_NONE;
+    item->queued = TRUE;
+    if(entry->tail != SMTP_QUEUE_INDEX_NONE) {
+        queue_index_record(index,entry->tail)->next = record;
+    } else {
+        entry->head = record;
+    }
+    entry->tail = record;
+    entry->count++;
+    header->count++;
+    return record;
+}
+
+/**
+ * @brief Add the message to the destination queue, the lock is held.
+ * @param [in] unique Return the queued record of the same message if any.
+ */
+static guint32 queue_index_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination,
+    gboolean unique,
+    GError** error)
+{
+    if(strlen(id) > SMTP_QUEUE_INDEX_MAX_ID) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_ARGUMENT,"queue index: identifier %s is too long",id);
+        return SMTP_QUEUE_INDEX_NONE;
+    }
+    guint32 slot = queue_index_find_destination(index,destination,TRUE);
+    if(slot == SMTP_QUEUE_INDEX_NONE) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE,
+            "queue index: destination %s isn't added, the table is full",destination);
+        return SMTP_QUEUE_INDEX_NONE;
+    }
+    if(unique) {
+        // The recent messages are near the tail.
+        guint32 record = queue_index_destinations(index)[slot].tail;
+        for(; record != SMTP_QUEUE_INDEX_NONE; record = queue_index_record(index,record)->prev) {
+            if(strcmp(queue_index_record(index,record)->id,id) == 0) {
+                return record;
+            }
+        }
+    }
+    return queue_index_append(index,slot,id,error);
+}
+
+guint32 d_smtp_queue_index_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),SMTP_QUEUE_INDEX_NONE);
+    g_mutex_lock(&index->lock);
+    guint32 record = queue_index_enqueue(index,id,destination,FALSE,error);
+    g_mutex_unlock(&index->lock);
+    return record;
+}
+
+guint32 d_smtp_queue_index_lookup_or_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),SMTP_QUEUE_INDEX_NONE);
+    g_mutex_lock(&index->lock);
+    guint32 record = queue_index_enqueue(index,id,destination,TRUE,error);
+    g_mutex_unlock(&index->lock);
+    return record;
+}
+
+gchar* d_smtp_queue_index_dequeue(
+    DSmtpQueueIndex* index,
+    const gchar* destination)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),NULL);
+    gchar* id{nullptr};
+    g_mutex_lock(&index->lock);
+    guint32 slot = queue_index_find_destination(index,destination,FALSE);
+    guint32 record = slot != SMTP_QUEUE_INDEX_NONE ?
+        queue_index_destinations(index)[slot].head : SMTP_QUEUE_INDEX_NONE;
+    if(record != SMTP_QUEUE_INDEX_NONE) {
+        id = g_strdup(queue_index_record(index,record)->id);
+        queue_index_release(index,record);
+    }
+    g_mutex_unlock(&index->lock);
+    return id;
+}
+
+void d_smtp_queue_index_remove(
+    DSmtpQueueIndex* index,
+    guint32 record)
+{
+    g_return_if_fail(D_IS_SMTP_QUEUE_INDEX(index));
+    g_mutex_lock(&index->lock);
+    if(record < queue_index_header(index)->used && queue_index_record(index,record)->queued) {
+        queue_index_release(index,record);
+    }
+    g_mutex_unlock(&index->lock);
+}
+
+guint d_smtp_queue_index_get_count(
+    DSmtpQueueIndex* index,
+    const gchar* destination)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),0);
+    g_mutex_lock(&index->lock);
+    guint count{0};
+    if(!destination) {
+        count = queue_index_header(index)->count;
+    } else {
+        guint32 slot = queue_index_find_destination(index,destination,FALSE);
+        count = slot != SMTP_QUEUE_INDEX_NONE ? queue_index_destinations(index)[slot].count : 0;
+    }
+    g_mutex_unlock(&index->lock);
+    return count;
+}
+
+gchar** d_smtp_queue_index_get_destinations(
+    DSmtpQueueIndex* index)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),NULL);
+    GPtrArray* names = g_ptr_array_new();
+    g_mutex_lock(&index->lock);
+    guint32 max_destinations = queue_index_header(index)->max_destinations;
+    DSmtpQueueIndexDestination* destinations = queue_index_destinations(index);
+    for(guint32 slot = 0; slot < max_destinations; slot++) {
+        if(destinations[slot].count) {
+            g_ptr_array_add(names,g_strdup(destinations[slot].name));
+        }
+    }
+    g_mutex_unlock(&index->lock);
+    g_ptr_array_add(names,NULL);
+    return reinterpret_cast<gchar**>(g_ptr_array_free(names,FALSE));
+}
+
+gboolean d_smtp_queue_index_sync(
+    DSmtpQueueIndex* index,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_QUEUE_INDEX(index),FALSE);
+    g_mutex_lock(&index->lock);
+    gint result = msync(index->map,index->map_size,MS_SYNC);
+    gint saved_errno = errno;
+    g_mutex_unlock(&index->lock);
+    if(result != 0) {
+        queue_index_set_errno_error(error,saved_errno,"msync",index->path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Check the header and the file size of the opened index.
+ */
+static gboolean queue_index_is_valid(
+    DSmtpQueueIndex* index,
+    gsize size)
+{
+    if(size < sizeof(DSmtpQueueIndexHeader)) {
+        return FALSE;
+    }
+    DSmtpQueueIndexHeader header;
+    if(pread(index->fd,&header,sizeof(header),0) != gssize(sizeof(header))) {
+        return FALSE;
+    }
+    return header.magic == QUEUE_INDEX_MAGIC && header.version == QUEUE_INDEX_VERSION &&
+        header.max_destinations > 0 && header.used <= header.capacity &&
+        size >= queue_index_records_offset(header.max_destinations) +
+            gsize(header.capacity) * sizeof(DSmtpQueueIndexRecord);
+}
+
+static void d_smtp_queue_index_init(DSmtpQueueIndex* index)
+{
+    index->fd = -1;
+    g_mutex_init(&index->lock);
+}
+
+static void d_smtp_queue_index_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_QUEUE_INDEX(object));
+    auto index = D_SMTP_QUEUE_INDEX(object);
+    if(index->map) {
+        // The clean flag is written only after the records are on the disk.
+        if(msync(index->map,index->map_size,MS_SYNC) == 0) {
+            queue_index_header(index)->clean = TRUE;
+            msync(index->map,index->map_size,MS_SYNC);
+        } else {
+            g_warning("queue index %s sync failed: %s",index->path,g_strerror(errno));
+        }
+        munmap(index->map,index->map_size);
+    }
+    if(index->fd >= 0) {
+        close(index->fd);
+    }
+    g_free(index->path);
+    g_mutex_clear(&index->lock);
+    G_OBJECT_CLASS(d_smtp_queue_index_parent_class)->finalize(object);
+}
+
+static void d_smtp_queue_index_class_init(DSmtpQueueIndexClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_queue_index_finalize;
+}
+
+/**
+ * @brief Create new instance of queue index.
+ */
+DSmtpQueueIndex* d_smtp_queue_index_new(
+    const gchar* path,
+    guint max_destinations,
+    GError** error)
+{
+    g_autoptr(DSmtpQueueIndex) index = reinterpret_cast<DSmtpQueueIndex*>(
+        g_object_new(
+            D_TYPE_SMTP_QUEUE_INDEX,
+            NULL));
+
+    index->path = g_strdup(path);
+    index->fd = open(path,O_RDWR | O_CREAT | O_CLOEXEC,0600);
+    if(index->fd < 0) {
+        queue_index_set_errno_error(error,errno,"open",path);
+        return NULL;
+    }
+    struct stat index_stat;
+    if(fstat(index->fd,&index_stat) != 0) {
+        queue_index_set_errno_error(error,errno,"stat",path);
+        return NULL;
+    }
+    if(queue_index_is_valid(index,index_stat.st_size)) {
+        if(!queue_index_map(index,index_stat.st_size,error)) {
+            return NULL;
+        }
+        index->needs_rebuild = !queue_index_header(index)->clean;
+    } else {
+        if(index_stat.st_size) {
+            g_warning("queue index %s is damaged, created again",path);
+        }
+        // The new file is filled by the zeros, the empty destinations.
+        max_destinations = MAX(max_destinations,1u);
+        if(ftruncate(index->fd,0) != 0) {
+            queue_index_set_errno_error(error,errno,"truncate",path);
+            return NULL;
+        }
+        if(!queue_index_resize(index,max_destinations,QUEUE_INDEX_INITIAL_CAPACITY,error)) {
+            return NULL;
+        }
+        DSmtpQueueIndexHeader* header = queue_index_header(index);
+        header->magic = QUEUE_INDEX_MAGIC;
+        header->version = QUEUE_INDEX_VERSION;
+        header->max_destinations = max_destinations;
+        header->free_head = SMTP_QUEUE_INDEX_NONE;
+        index->needs_rebuild = TRUE;
+    }
+    // The crash while the index is open leaves it not clean.
+    queue_index_header(index)->clean = FALSE;
+    if(msync(index->map,sizeof(DSmtpQueueIndexHeader),MS_SYNC) != 0) {
+        queue_index_set_errno_error(error,errno,"msync",path);
+        return NULL;
+    }
+
+    return g_steal_pointer(&index);
+}
+
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_QUEUE_INDEX__HPP__
+#define __D__NEW__SMTP_QUEUE_INDEX__HPP__
+/**
+ * @brief Memory mapped index of the queued messages.
+ * @details The index file is the header, the fixed table of destinations
+ * and the array of fixed size records:
+ * @code
+ * header        magic, version, clean flag, capacities, free list head
+ * destinations  open addressing table, destination name, head, tail, count
+ * records       message identifier, destination, previous, next
+ * @endcode
+ * Every destination owns the doubly linked list of its records in the
+ * queue order, the released records form the free list. Enqueue, dequeue
+ * and record removal update the mapping in place in O(1), the records
+ * array grows by the file extension. Open is the one mmap, the queue
+ * isn't read from the spool directory.
+ * The index is marked clean only by the finalize, the index left by the
+ * crash is reported by d_smtp_queue_index_needs_rebuild.
+ * All functions are thread safe.
+ */
+
+#include <gio/gio.h>
+
+/// @brief No record, the end of list.
+#define SMTP_QUEUE_INDEX_NONE G_MAXUINT32
+/// @brief The maximum length of the message identifier.
+#define SMTP_QUEUE_INDEX_MAX_ID 47
+/// @brief The maximum length of the destination name.
+#define SMTP_QUEUE_INDEX_MAX_DESTINATION 255
+
+extern "C" {
+#define D_TYPE_SMTP_QUEUE_INDEX (d_smtp_queue_index_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpQueueIndex,d_smtp_queue_index,D,SMTP_QUEUE_INDEX,GObject)
+
+/**
+ * @brief Test if the index wasn't closed cleanly or just created.
+ * @details The owner clears the index and enqueues its messages again.
+ */
+gboolean d_smtp_queue_index_needs_rebuild(
+    DSmtpQueueIndex* index);
+
+/**
+ * @brief Remove all records and destinations.
+ */
+void d_smtp_queue_index_clear(
+    DSmtpQueueIndex* index);
+
+/**
+ * @brief Add the message to the tail of the destination queue.
+ * @param [in] id The message identifier.
+ * @param [in] destination The destination name, compared case insensitive.
+ * @return The record number or SMTP_QUEUE_INDEX_NONE in case of failure.
+ */
+guint32 d_smtp_queue_index_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination,
+    GError** error);
+
+/**
+ * @brief Add the message to the destination queue unless it's queued there.
+ * @details The queue is searched from the tail, so it's meant for the
+ * few recent messages, e.g. the replayed ones.
+ * @return The record number of the queued or added message or
+ * SMTP_QUEUE_INDEX_NONE in case of failure.
+ */
+guint32 d_smtp_queue_index_lookup_or_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination,
+    GError** error);
+
+/**
+ * @brief Take the message from the head of the destination queue.
+ * @return The message identifier or NULL if the queue is empty.
+ */
+gchar* d_smtp_queue_index_dequeue(
+    DSmtpQueueIndex* index,
+    const gchar* destination);
+
+/**
+ * @brief Remove the record from its destination queue.
+ */
+void d_smtp_queue_index_remove(
+    DSmtpQueueIndex* index,
+    guint32 record);
+
+/**
+ * @brief Get the number of queued records.
+ * @param [in] destination The destination or NULL for all destinations.
+ */
+guint d_smtp_queue_index_get_count(
+    DSmtpQueueIndex* index,
+    const gchar* destination);
+
+/**
+ * @brief Get the names of destinations with the queued records.
+ * @return The NULL terminated array, free with g_strfreev.
+ */
+gchar** d_smtp_queue_index_get_destinations(
+    DSmtpQueueIndex* index);
+
+/**
+ * @brief Write the changed pages of the index to the file.
+ */
+gboolean d_smtp_queue_index_sync(
+    DSmtpQueueIndex* index,
+    GError** error);
+
+/**
+ * @brief Create new instance of queue index.
+ * @details The index file is created if not exists.
+ * @param [in] path The index file path.
+ * @param [in] max_destinations The destinations table size of the new file.
+ * @return The index or NULL in case of failure.
+ */
+DSmtpQueueIndex* d_smtp_queue_index_new(
+    const gchar* path,
+    guint max_destinations,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_QUEUE_INDEX__HPP__
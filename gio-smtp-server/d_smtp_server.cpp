@@ -14,7 +14,21 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "d_smtp_server.hpp"
-#include "d_smtp_connection.hpp"
+#include "d_smtp_worker.hpp"
+#include "d_uring.hpp"
+#include "d_smtp_tls.hpp"
+#include "d_smtp_spool.hpp"
+#include "d_smtp_compress.hpp"
+#include "d_smtp_trace.hpp"
+#include "d_dns_cache.hpp"
+#include "d_dnsbl.hpp"
+#include "d_spf.hpp"
+#include "d_dkim.hpp"
+#include "d_greylist.hpp"
+#include "d_smtp_probes.hpp"
+
+#include <errno.h>
+#include <unistd.h>
 
 extern "C" {
 struct _DSmtpServer
@@ -25,8 +39,16 @@ struct _DSmtpServer
     guint listen_port;
     GSocketListener* listener;
     GCancellable* cancelable;
-    GList* connections;
     guint max_connections_count;
+    DSmtpConfig* config;
+    /// @brief Connections owners, at least one worker exists after start.
+    GPtrArray* workers;
+    /// @brief The worker index for the next accepted socket.
+    guint next_worker;
+    /// @brief The listen socket accepted by io_uring, NULL for GIO listener.
+    GSocket* listen_socket;
+    DUring* uring;
+    gboolean accept_multishot;
 };
 typedef _DSmtpServer DSmtpServer;
 
@@ -42,22 +64,44 @@ enum {
     PROP_SMTP_LISTEN_PORT
 };
 
-static void d_smtp_server_connection_disconnected(
-    GObject* source,
-    gpointer user_data)
+/**
+ * @brief Get the number of connections of all workers.
+ */
+static guint d_smtp_server_get_connections_count(DSmtpServer* smtp_server)
 {
-    g_return_if_fail(D_IS_SMTP_CONNECTION(source));
-    g_return_if_fail(D_IS_SMTP_SERVER(user_data));
-    auto connection = D_SMTP_CONNECTION(source);
-    auto smtp_server = D_SMTP_SERVER(user_data);
-    g_message("SMTP server connection disconnect");
-    auto list = g_list_find(smtp_server->connections,connection);
-    if(list) {
-        smtp_server->connections = g_list_remove(smtp_server->connections,connection);    
-    } else {
-        g_critical("SMTP server disconnected connection isn't in list");
+    guint connections_count{0};
+    for(guint index = 0; index < smtp_server->workers->len; index++) {
+        auto worker = D_SMTP_WORKER(g_ptr_array_index(smtp_server->workers,index));
+        connections_count += d_smtp_worker_get_connections_count(worker);
+    }
+    return connections_count;
+}
+
+/**
+ * @brief Pass the accepted socket to the worker.
+ * @param [in] client_socket The accepted socket, function takes the ownership.
+ */
+static void d_smtp_server_add_client_socket(
+    DSmtpServer* smtp_server,
+    GSocket* client_socket)
+{
+    GError* error{NULL};
+    guint connections_count = d_smtp_server_get_connections_count(smtp_server);
+    if(connections_count >= smtp_server->max_connections_count) {
+        D_SMTP_PROBE2(reject,g_socket_get_fd(client_socket),connections_count);
+        g_socket_shutdown(client_socket,TRUE,TRUE,&error);
+        g_clear_error(&error);
+        g_socket_close(client_socket,&error);
+        g_clear_error(&error);
+        g_object_unref(client_socket);
+        g_warning("maximum connections has reached: %d",connections_count);
+        return;
     }
-    g_object_unref(connection);
+    D_SMTP_PROBE2(accept,g_socket_get_fd(client_socket),connections_count);
+    // Distribute connections between workers in round robin order.
+    auto worker = D_SMTP_WORKER(g_ptr_array_index(smtp_server->workers,smtp_server->next_worker));
+    smtp_server->next_worker = (smtp_server->next_worker + 1) % smtp_server->workers->len;
+    d_smtp_worker_add_socket(worker,client_socket);
 }
 
 static void d_smtp_server_accept_handler(
@@ -72,27 +116,114 @@ static void d_smtp_server_accept_handler(
         g_socket_listener_accept_socket_finish(G_SOCKET_LISTENER(source_object),res,NULL,&error);
     if(!client_socket) {
         g_warning("async accept socket failed: %d %s",error->code,error->message);
-        g_socket_listener_accept_socket_async(smtp_server->listener,NULL,d_smtp_server_accept_handler,smtp_server);
-        return;
+        g_error_free(error);
+    } else {
+        d_smtp_server_add_client_socket(smtp_server,client_socket);
     }
-    guint connections_count = g_list_length(smtp_server->connections);
-    if(connections_count >= smtp_server->max_connections_count) {
-        g_socket_shutdown(client_socket,TRUE,TRUE,&error);
-        g_socket_close(client_socket,&error);
-        g_warning("maximum connections has reached: %d",connections_count);
-        g_socket_listener_accept_socket_async(smtp_server->listener,NULL,d_smtp_server_accept_handler,smtp_server);
+    g_socket_listener_accept_socket_async(smtp_server->listener,NULL,d_smtp_server_accept_handler,smtp_server);
+}
+
+static void d_smtp_server_uring_accept(DSmtpServer* smtp_server);
+
+/**
+ * @brief Completion handler for io_uring accept.
+ * @details The multishot accept completes once per accepted socket and
+ * stays active until the completion without the more flag.
+ */
+static void d_smtp_server_uring_accept_handler(
+    DUringOperation* operation,
+    gint result,
+    guint buffer_id,
+    gboolean more,
+    gpointer user_data)
+{
+    auto smtp_server = D_SMTP_SERVER(user_data);
+    if(result >= 0) {
+        GError* error{NULL};
+        auto client_socket = g_socket_new_from_fd(result,&error);
+        if(client_socket) {
+            d_smtp_server_add_client_socket(smtp_server,client_socket);
+        } else {
+            g_warning("socket from accepted fd failed: %d %s",error->code,error->message);
+            g_error_free(error);
+            close(result);
+        }
+    } else if(result == -EINVAL && smtp_server->accept_multishot) {
+        // Kernel older than 5.19 doesn't support multishot accept.
+        g_message("io_uring multishot accept isn't supported");
+        smtp_server->accept_multishot = FALSE;
+    } else if(result == -ECANCELED) {
         return;
+    } else {
+        g_warning("io_uring accept failed: %d %s",-result,g_strerror(-result));
     }
-    auto connection = d_smtp_connection_new_with_timeouts(client_socket,60,10,10);
-    g_signal_connect(connection,"disconnected",G_CALLBACK(d_smtp_server_connection_disconnected),smtp_server);
-    smtp_server->connections = g_list_append(smtp_server->connections,connection);
-    g_socket_listener_accept_socket_async(smtp_server->listener,NULL,d_smtp_server_accept_handler,smtp_server);
+    if(!more) {
+        d_smtp_server_uring_accept(smtp_server);
+    }
+}
+
+static void d_smtp_server_uring_accept(DSmtpServer* smtp_server)
+{
+    if(!d_uring_accept(smtp_server->uring,g_socket_get_fd(smtp_server->listen_socket),
+        smtp_server->accept_multishot,d_smtp_server_uring_accept_handler,smtp_server)) {
+        g_warning("io_uring accept submit failed");
+    }
+}
+
+/**
+ * @brief Start accepting connections by io_uring.
+ * @return Return FALSE if io_uring can't be used.
+ */
+static gboolean d_smtp_server_start_uring_listener(DSmtpServer* smtp_server)
+{
+    if(!d_uring_is_supported()) {
+        return FALSE;
+    }
+    GError* error{NULL};
+    auto uring = d_uring_get_thread_default(d_smtp_config_get_read_buffer_size(smtp_server->config),&error);
+    if(!uring) {
+        g_warning("io_uring create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_autoptr(GSocketAddress) addr =
+        g_inet_socket_address_new_from_string(smtp_server->listen_address,smtp_server->listen_port);
+    if(!addr) {
+        g_warning("invalid listen address: %s",smtp_server->listen_address);
+        return FALSE;
+    }
+    g_autoptr(GSocket) socket = g_socket_new(g_socket_address_get_family(addr),
+        G_SOCKET_TYPE_STREAM,G_SOCKET_PROTOCOL_TCP,&error);
+    if(!socket) {
+        g_warning("listen socket create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_socket_set_listen_backlog(socket,d_smtp_config_get_listen_backlog(smtp_server->config));
+    if(!g_socket_bind(socket,addr,TRUE,&error) || !g_socket_listen(socket,&error)) {
+        g_warning("listen socket bind failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    smtp_server->uring = D_URING(g_object_ref(uring));
+    smtp_server->listen_socket = G_SOCKET(g_steal_pointer(&socket));
+    smtp_server->accept_multishot = TRUE;
+    d_smtp_server_uring_accept(smtp_server);
+    g_message("SMTP server accepts connections by io_uring");
+    return TRUE;
 }
 
 static void d_smtp_server_start_listener(DSmtpServer* smtp_server)
 {
+    if(d_smtp_config_get_io_engine(smtp_server->config) == SMTP_IO_ENGINE_URING) {
+        if(d_smtp_server_start_uring_listener(smtp_server)) {
+            return;
+        }
+        g_warning("SMTP server: io_uring isn't available, fallback to GIO");
+    }
     auto addr = g_inet_socket_address_new_from_string(smtp_server->listen_address,smtp_server->listen_port);
     smtp_server->listener = g_socket_listener_new();
+    g_socket_listener_set_backlog(smtp_server->listener,d_smtp_config_get_listen_backlog(smtp_server->config));
     GError* error{NULL};
     if(!g_socket_listener_add_address(smtp_server->listener,addr,G_SOCKET_TYPE_STREAM,G_SOCKET_PROTOCOL_TCP,NULL,NULL,&error)) {
         g_warning("listener add address failed: %d %s",error->code,error->message);
@@ -101,10 +232,205 @@ static void d_smtp_server_start_listener(DSmtpServer* smtp_server)
     g_socket_listener_accept_socket_async(smtp_server->listener,NULL,d_smtp_server_accept_handler,smtp_server);
 }
 
+/**
+ * @brief Open the spool directory.
+ * @details The messages aren't stored if the directory isn't configured.
+ */
+static void d_smtp_server_start_spool(DSmtpServer* smtp_server)
+{
+    const gchar* directory = d_smtp_config_get_spool_directory(smtp_server->config);
+    if(!directory) {
+        g_warning("SMTP server: spool directory isn't set, messages are dropped");
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_new(directory,
+        d_smtp_config_get_spool_commit_window(smtp_server->config),&error);
+    if(!spool) {
+        g_warning("SMTP server: spool open failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    d_smtp_spool_set_default(spool);
+}
+
+/**
+ * @brief Create the body compressor if the spool compression is enabled.
+ * @details The dictionary is saved to the spool before the first message
+ * is compressed with it. The built-in dictionary is used if the configured
+ * one can't be loaded.
+ */
+static void d_smtp_server_start_compression(DSmtpServer* smtp_server)
+{
+    guint level = d_smtp_config_get_spool_compression(smtp_server->config);
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_get_default();
+    if(!level || !spool) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(GBytes) dictionary = NULL;
+    const gchar* path = d_smtp_config_get_spool_dictionary(smtp_server->config);
+    if(path) {
+        g_autoptr(GFile) file = g_file_new_for_path(path);
+        dictionary = g_file_load_bytes(file,NULL,NULL,&error);
+        if(!dictionary) {
+            g_warning("SMTP server: compression dictionary load failed: %d %s",error->code,error->message);
+            g_clear_error(&error);
+        }
+    }
+    g_autoptr(DSmtpCompressor) compressor = d_smtp_compressor_new(level,dictionary);
+    guint32 id{0};
+    GBytes* compressor_dictionary = d_smtp_compressor_get_dictionary(compressor,&id);
+    if(compressor_dictionary && !d_smtp_spool_save_dictionary(spool,compressor_dictionary,id,&error)) {
+        g_warning("SMTP server: compression dictionary save failed, bodies are stored as is: %d %s",
+            error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    d_smtp_compressor_set_default(compressor);
+}
+
+/**
+ * @brief Create the session trace ring if the trace file is configured.
+ */
+static void d_smtp_server_start_trace(DSmtpServer* smtp_server)
+{
+    const gchar* path = d_smtp_config_get_trace_file(smtp_server->config);
+    if(!path) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(DSmtpTraceRing) ring = d_smtp_trace_ring_new(path,
+        d_smtp_config_get_trace_records(smtp_server->config),&error);
+    if(!ring) {
+        g_warning("SMTP server: trace ring create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    g_message("SMTP server: session trace to %s",path);
+    d_smtp_trace_ring_set_default(ring);
+}
+
+/**
+ * @brief Create the shared DNS cache unless the lookups are disabled.
+ * @details The blocklist checker is created over the cache if the zones
+ * are configured, the SPF evaluator and the DKIM verifier unless their
+ * caches are disabled.
+ */
+static void d_smtp_server_start_dns(DSmtpServer* smtp_server)
+{
+    guint cache_size = d_smtp_config_get_dns_cache_size(smtp_server->config);
+    if(cache_size == 0) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(DDnsCache) cache = d_dns_cache_new(
+        d_smtp_config_get_dns_server(smtp_server->config),
+        cache_size,
+        d_smtp_config_get_dns_negative_ttl(smtp_server->config),
+        d_smtp_config_get_dns_max_ttl(smtp_server->config),
+        d_smtp_config_get_dns_threads(smtp_server->config),
+        &error);
+    if(!cache) {
+        g_warning("SMTP server: DNS cache create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    d_dns_cache_set_default(cache);
+    const gchar* zones = d_smtp_config_get_dnsbl_zones(smtp_server->config);
+    if(zones && *zones) {
+        g_autoptr(DDnsbl) dnsbl = d_dnsbl_new(cache,zones,
+            d_smtp_config_get_dnsbl_cache_size(smtp_server->config),
+            d_smtp_config_get_dnsbl_cache_ttl(smtp_server->config));
+        g_message("SMTP server: DNSBL zones %s",zones);
+        d_dnsbl_set_default(dnsbl);
+    }
+    guint spf_cache_size = d_smtp_config_get_spf_cache_size(smtp_server->config);
+    if(spf_cache_size > 0) {
+        g_autoptr(DSpf) spf = d_spf_new(cache,spf_cache_size);
+        d_spf_set_default(spf);
+    }
+    guint dkim_key_cache_size = d_smtp_config_get_dkim_key_cache_size(smtp_server->config);
+    if(dkim_key_cache_size > 0) {
+        g_autoptr(DDkim) dkim = d_dkim_new(cache,dkim_key_cache_size);
+        d_dkim_set_default(dkim);
+    }
+}
+
+/**
+ * @brief Create the DKIM signer if the signing keys are configured.
+ */
+static void d_smtp_server_start_dkim_signer(DSmtpServer* smtp_server)
+{
+    const gchar* keys = d_smtp_config_get_dkim_sign_keys(smtp_server->config);
+    if(!keys || !*keys) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(DDkimSigner) signer = d_dkim_signer_new(keys,
+        d_smtp_config_get_dkim_sign_batch(smtp_server->config),&error);
+    if(!signer) {
+        g_warning("SMTP server: DKIM signer create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    g_message("SMTP server: DKIM signing keys %s",keys);
+    d_dkim_signer_set_default(signer);
+}
+
+/**
+ * @brief Create the greylist unless its size is 0.
+ */
+static void d_smtp_server_start_greylist(DSmtpServer* smtp_server)
+{
+    guint size = d_smtp_config_get_greylist_size(smtp_server->config);
+    if(size == 0) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(DGreylist) greylist = d_greylist_new(size,
+        d_smtp_config_get_greylist_delay(smtp_server->config),
+        d_smtp_config_get_greylist_retry_window(smtp_server->config),
+        d_smtp_config_get_greylist_pass_ttl(smtp_server->config),
+        d_smtp_config_get_greylist_snapshot_file(smtp_server->config),
+        d_smtp_config_get_greylist_snapshot_interval(smtp_server->config),
+        &error);
+    if(!greylist) {
+        g_warning("SMTP server: greylist create failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    d_greylist_set_default(greylist);
+}
+
+/**
+ * @brief Create the workers by the configuration.
+ * @details Zero workers count means the connections are served by the
+ * single worker in the default main context.
+ */
+static void d_smtp_server_start_workers(DSmtpServer* smtp_server)
+{
+    guint workers = d_smtp_config_get_workers(smtp_server->config);
+    if(workers == 0) {
+        g_ptr_array_add(smtp_server->workers,d_smtp_worker_new(0,FALSE,smtp_server->config));
+    }
+    for(guint index = 0; index < workers; index++) {
+        g_ptr_array_add(smtp_server->workers,d_smtp_worker_new(index,TRUE,smtp_server->config));
+    }
+    // Every worker may move the sessions to any other one.
+    for(guint index = 0; index < workers; index++) {
+        auto worker = D_SMTP_WORKER(g_ptr_array_index(smtp_server->workers,index));
+        d_smtp_worker_set_peers(worker,smtp_server->workers);
+        d_smtp_worker_start(worker);
+    }
+    g_message("SMTP server started %u workers",smtp_server->workers->len);
+}
+
 static void d_smtp_server_init(DSmtpServer* smtp_server)
 {
     smtp_server->max_connections_count = 100;
     smtp_server->cancelable = g_cancellable_new();
+    smtp_server->workers = g_ptr_array_new_with_free_func(g_object_unref);
 }
 
 static void d_smtp_server_finalize(GObject* object)
@@ -112,8 +438,13 @@ static void d_smtp_server_finalize(GObject* object)
     g_return_if_fail(D_IS_SMTP_SERVER(object));
     auto smtp_server = D_SMTP_SERVER(object);
     g_free(smtp_server->listen_address);
-    g_object_unref(smtp_server->listener);
+    g_clear_object(&smtp_server->listener);
+    g_clear_object(&smtp_server->listen_socket);
+    g_clear_object(&smtp_server->uring);
     g_object_unref(smtp_server->cancelable);
+    g_ptr_array_unref(smtp_server->workers);
+    g_clear_object(&smtp_server->config);
+    G_OBJECT_CLASS(d_smtp_server_parent_class)->finalize(object);
 }
 
 static void d_smtp_server_get_property(GObject *object, guint prop_id,
@@ -180,12 +511,62 @@ static void d_smtp_server_class_init(DSmtpServerClass* klass)
 
 void d_smtp_server_start(DSmtpServer* smtp_server)
 {
+    d_smtp_server_start_spool(smtp_server);
+    d_smtp_server_start_compression(smtp_server);
+    d_smtp_server_start_trace(smtp_server);
+    d_smtp_server_start_dns(smtp_server);
+    d_smtp_server_start_dkim_signer(smtp_server);
+    d_smtp_server_start_greylist(smtp_server);
+    d_smtp_server_start_workers(smtp_server);
     d_smtp_server_start_listener(smtp_server);
 }
 
 void d_smtp_server_stop(DSmtpServer* server)
 {
-    g_socket_listener_close(server->listener);
+    if(server->listener) {
+        g_socket_listener_close(server->listener);
+    }
+    if(server->listen_socket) {
+        g_socket_close(server->listen_socket,NULL);
+    }
+    for(guint index = 0; index < server->workers->len; index++) {
+        d_smtp_worker_stop(D_SMTP_WORKER(g_ptr_array_index(server->workers,index)));
+    }
+    d_smtp_compressor_set_default(NULL);
+    d_smtp_spool_set_default(NULL);
+    d_smtp_trace_ring_set_default(NULL);
+    d_greylist_set_default(NULL);
+    d_dkim_signer_set_default(NULL);
+    d_dkim_set_default(NULL);
+    d_spf_set_default(NULL);
+    d_dnsbl_set_default(NULL);
+    d_dns_cache_set_default(NULL);
+}
+
+void d_smtp_server_set_config(
+    DSmtpServer* smtp_server,
+    DSmtpConfig* config)
+{
+    g_return_if_fail(D_IS_SMTP_SERVER(smtp_server));
+    g_return_if_fail(D_IS_SMTP_CONFIG(config));
+    if(smtp_server->config && d_smtp_config_restart_required(smtp_server->config,config)) {
+        g_warning("SMTP server: some of configuration values will be applied after restart");
+    }
+    g_set_object(&smtp_server->config,config);
+    // Load the certificate now to report the error once, connections
+    // get the same context from the configuration.
+    GError* error{NULL};
+    g_autoptr(DSmtpTls) tls = d_smtp_tls_get_for_config(config,&error);
+    if(error) {
+        g_warning("SMTP server: STARTTLS disabled: %d %s",error->code,error->message);
+        g_error_free(error);
+    }
+    d_smtp_tls_set_handshake_threads(d_smtp_config_get_tls_handshake_threads(config));
+    smtp_server->max_connections_count = d_smtp_config_get_max_connections(config);
+    // Established sessions are not dropped, workers apply new values in place.
+    for(guint index = 0; index < smtp_server->workers->len; index++) {
+        d_smtp_worker_set_config(D_SMTP_WORKER(g_ptr_array_index(smtp_server->workers,index)),config);
+    }
 }
 
 /**
@@ -201,6 +582,22 @@ DSmtpServer* d_smtp_server_new(
         "smtp-listen-port",listen_port,
         NULL
         ));
+    g_autoptr(DSmtpConfig) config = d_smtp_config_new();
+    d_smtp_server_set_config(smtp_server,config);
+
+    return smtp_server;
+}
+
+DSmtpServer* d_smtp_server_new_with_config(
+    DSmtpConfig* config)
+{
+    auto smtp_server = reinterpret_cast<DSmtpServer*>(g_object_new(
+        D_TYPE_SMTP_SERVER,
+        "smtp-listen-address",d_smtp_config_get_listen_address(config),
+        "smtp-listen-port",d_smtp_config_get_listen_port(config),
+        NULL
+        ));
+    d_smtp_server_set_config(smtp_server,config);
 
     return smtp_server;
 }
@@ -17,6 +17,7 @@
 #define __D__NEW__SMTP_SERVER__HPP__
 
 #include <gio/gio.h>
+#include "d_smtp_config.hpp"
 
 extern "C" {
 #define D_TYPE_SMTP_SERVER (d_smtp_server_get_type())
@@ -27,6 +28,16 @@ void d_smtp_server_start(DSmtpServer*);
 
 void d_smtp_server_stop(DSmtpServer*);
 
+/**
+ * @brief Apply the new configuration to the running server.
+ * @details Connection limits, timeouts and buffer sizes are applied to
+ * the new and already established connections. Listen address, workers
+ * and spool values are used only at server start.
+ */
+void d_smtp_server_set_config(
+    DSmtpServer* smtp_server,
+    DSmtpConfig* config);
+
 /**
  * @brief Create new instance of SMTP server.
  */
@@ -34,6 +45,12 @@ DSmtpServer* d_smtp_server_new(
     const gchar* listen_address,
     guint listen_port);
 
+/**
+ * @brief Create new instance of SMTP server by the configuration.
+ */
+DSmtpServer* d_smtp_server_new_with_config(
+    DSmtpConfig* config);
+
 }
 
 #endif //#ifndef __D__NEW__SMTP_SERVER__HPP__
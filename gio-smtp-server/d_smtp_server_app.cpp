@@ -15,7 +15,19 @@
  */
 #include "d_smtp_server_app.hpp"
 #include "d_smtp_server.hpp"
+#include "d_smtp_config.hpp"
+#include "d_smtp_tls.hpp"
+#include "d_smtp_spool.hpp"
+#include "d_smtp_compress.hpp"
+#include "d_loop_watchdog.hpp"
+#include "d_dns_cache.hpp"
+#include "d_dnsbl.hpp"
+#include "d_spf.hpp"
+#include "d_dkim.hpp"
+#include "d_greylist.hpp"
 #include <gio/gunixinputstream.h>
+#include <glib-unix.h>
+#include <signal.h>
 
 
 extern "C" {
@@ -23,6 +35,12 @@ struct _DSmtpServerApp {
     GApplication parent;
 
     DSmtpServer* server;
+    /// @brief The configuration file name from command line, can be NULL.
+    gchar* config_file;
+    /// @brief Command line options, applied over configuration file on every reload.
+    GVariantDict* options;
+    guint sighup_source_id;
+    guint sigusr1_source_id;
 };
 
 typedef _DSmtpServerApp DSmtpServerApp;
@@ -33,13 +51,136 @@ struct _DSmtpServerAppClass {
     GApplicationClass parent;    
 };
 
+static const GOptionEntry d_smtp_server_app_options[] = {
+    { "config", 'c', 0, G_OPTION_ARG_FILENAME, NULL,
+      "The configuration file, reloaded by SIGHUP", "FILE" },
+    { NULL }
+};
+
+/// @brief The most verbose log level passed to the log output.
+static gint d_smtp_server_app_log_level = G_LOG_LEVEL_MESSAGE;
+
+static void d_smtp_server_app_log_handler(
+    const gchar* log_domain,
+    GLogLevelFlags log_level,
+    const gchar* message,
+    gpointer user_data)
+{
+    // More severe levels have the lower flag values.
+    if((log_level & G_LOG_LEVEL_MASK) > g_atomic_int_get(&d_smtp_server_app_log_level)) {
+        return;
+    }
+    g_log_default_handler(log_domain,log_level,message,user_data);
+}
+
+static void d_smtp_server_app_set_log_level(GLogLevelFlags log_level)
+{
+    g_atomic_int_set(&d_smtp_server_app_log_level,log_level);
+#if GLIB_CHECK_VERSION(2,72,0)
+    g_log_set_debug_enabled(log_level >= G_LOG_LEVEL_INFO);
+#endif
+}
+
+/**
+ * @brief Build the configuration from file and command line options.
+ */
+static DSmtpConfig* d_smtp_server_app_load_config(
+    DSmtpServerApp* app,
+    GError** error)
+{
+    g_autoptr(DSmtpConfig) config = d_smtp_config_new();
+    if(app->config_file && !d_smtp_config_load_file(config,app->config_file,error)) {
+        return NULL;
+    }
+    // Command line has priority over the configuration file.
+    if(app->options && !d_smtp_config_load_options(config,app->options,error)) {
+        return NULL;
+    }
+    return reinterpret_cast<DSmtpConfig*>(g_steal_pointer(&config));
+}
+
+/**
+ * @brief SIGHUP handler, reload the configuration.
+ * @details Established sessions stay alive, only the values allowed
+ * for reload are applied.
+ */
+static gboolean d_smtp_server_app_reload(gpointer user_data)
+{
+    auto myapp = D_SMTP_SERVER_APP(user_data);
+    g_message("reload configuration");
+    GError* error{NULL};
+    g_autoptr(DSmtpConfig) config = d_smtp_server_app_load_config(myapp,&error);
+    if(!config) {
+        g_warning("reload configuration failed: %s",error->message);
+        g_error_free(error);
+        return G_SOURCE_CONTINUE;
+    }
+    d_smtp_server_app_set_log_level(d_smtp_config_get_log_level(config));
+    if(myapp->server) {
+        d_smtp_server_set_config(myapp->server,config);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * @brief SIGUSR1 handler, write the runtime metrics to the log.
+ */
+static gboolean d_smtp_server_app_log_metrics(gpointer user_data)
+{
+    d_smtp_tls_log_metrics();
+    d_loop_watchdog_log_all_metrics();
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_get_default();
+    if(spool) {
+        d_smtp_spool_log_metrics(spool);
+    }
+    g_autoptr(DSmtpCompressor) compressor = d_smtp_compressor_get_default();
+    if(compressor) {
+        d_smtp_compressor_log_metrics(compressor);
+    }
+    g_autoptr(DDnsCache) dns_cache = d_dns_cache_get_default();
+    if(dns_cache) {
+        d_dns_cache_log_metrics(dns_cache);
+    }
+    g_autoptr(DDnsbl) dnsbl = d_dnsbl_get_default();
+    if(dnsbl) {
+        d_dnsbl_log_metrics(dnsbl);
+    }
+    g_autoptr(DSpf) spf = d_spf_get_default();
+    if(spf) {
+        d_spf_log_metrics(spf);
+    }
+    g_autoptr(DDkim) dkim = d_dkim_get_default();
+    if(dkim) {
+        d_dkim_log_metrics(dkim);
+    }
+    g_autoptr(DDkimSigner) dkim_signer = d_dkim_signer_get_default();
+    if(dkim_signer) {
+        d_dkim_signer_log_metrics(dkim_signer);
+    }
+    g_autoptr(DGreylist) greylist = d_greylist_get_default();
+    if(greylist) {
+        d_greylist_log_metrics(greylist);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
 static void d_smtp_server_app_shutdown(
     GApplication* app)
 {
     G_APPLICATION_CLASS(d_smtp_server_app_parent_class)->shutdown(app);
     g_message("shutdown");
     auto myapp = D_SMTP_SERVER_APP(app);
-    d_smtp_server_stop(myapp->server);
+    if(myapp->sighup_source_id) {
+        g_source_remove(myapp->sighup_source_id);
+        myapp->sighup_source_id = 0;
+    }
+    if(myapp->sigusr1_source_id) {
+        g_source_remove(myapp->sigusr1_source_id);
+        myapp->sigusr1_source_id = 0;
+    }
+    if(myapp->server) {
+        d_smtp_server_stop(myapp->server);
+    }
 }
 
 static void d_smtp_server_app_startup(
@@ -48,6 +189,8 @@ static void d_smtp_server_app_startup(
     G_APPLICATION_CLASS(d_smtp_server_app_parent_class)->startup(app);
     g_message("startup");
     auto myapp = D_SMTP_SERVER_APP(app);
+    myapp->sighup_source_id = g_unix_signal_add(SIGHUP,d_smtp_server_app_reload,myapp);
+    myapp->sigusr1_source_id = g_unix_signal_add(SIGUSR1,d_smtp_server_app_log_metrics,myapp);
 }
 
 int d_smtp_server_app_command_line(
@@ -55,14 +198,28 @@ int d_smtp_server_app_command_line(
     GApplicationCommandLine* command_line)
 {
     g_message("command-line");
-    int argc{0};
-    gchar** argv = g_application_command_line_get_arguments(command_line,&argc);
+    auto myapp = D_SMTP_SERVER_APP(app);
+    if(myapp->server) {
+        g_application_command_line_printerr(command_line,"SMTP server already running\n");
+        return 1;
+    }
+    auto options = g_application_command_line_get_options_dict(command_line);
+    g_variant_dict_lookup(options,"config","^ay",&myapp->config_file);
+    myapp->options = g_variant_dict_ref(options);
 
+    GError* error{NULL};
+    g_autoptr(DSmtpConfig) config = d_smtp_server_app_load_config(myapp,&error);
+    if(!config) {
+        g_application_command_line_printerr(command_line,"%s\n",error->message);
+        g_error_free(error);
+        return 1;
+    }
+    d_smtp_server_app_set_log_level(d_smtp_config_get_log_level(config));
+    myapp->server = d_smtp_server_new_with_config(config);
 
-    int ret_val = G_APPLICATION_CLASS(d_smtp_server_app_parent_class)->command_line(app,command_line);
     g_application_activate(app);
 
-    return ret_val;
+    return 0;
 }
 
 static void d_smtp_server_app_activate(
@@ -81,15 +238,19 @@ static void d_smtp_server_app_finalize(
 {
     g_message("finalize");
     auto myapp = D_SMTP_SERVER_APP(object);
+    g_clear_object(&myapp->server);
+    g_clear_pointer(&myapp->options,g_variant_dict_unref);
+    g_free(myapp->config_file);
+    G_OBJECT_CLASS(d_smtp_server_app_parent_class)->finalize(object);
 }
 
 static void d_smtp_server_app_init(DSmtpServerApp* app)
 {
     g_message("init");
-    // g_application_add_main_option_entries(G_APPLICATION(app),);
-    app->server = d_smtp_server_new("127.0.0.1",8425);
+    g_log_set_default_handler(d_smtp_server_app_log_handler,NULL);
+    g_application_add_main_option_entries(G_APPLICATION(app),d_smtp_server_app_options);
+    g_application_add_main_option_entries(G_APPLICATION(app),d_smtp_config_get_option_entries());
 }
-
 static void d_smtp_server_app_class_init(DSmtpServerAppClass* klass)
 {
     G_OBJECT_CLASS(klass)->finalize = d_smtp_server_app_finalize;
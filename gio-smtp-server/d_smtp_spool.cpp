@@ -0,0 +1,1059 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_spool.hpp"
+#include "d_smtp_compress.hpp"
+#include "d_smtp_journal.hpp"
+#include "d_smtp_queue_index.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief The maximum number of messages of the one journal commit.
+#define SPOOL_JOURNAL_MAX_BATCH 1024
+/// @brief The journal size which triggers the spool sync and journal truncate.
+#define SPOOL_JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+/// @brief The destinations table size of the new queue index.
+#define SPOOL_QUEUE_MAX_DESTINATIONS 16384
+
+extern "C" {
+
+/**
+ * @brief The deduplication statistics.
+ */
+struct DSmtpSpoolMetrics
+{
+    guint64 messages;
+    /// @brief The bodies written to the disk.
+    guint64 bodies_stored;
+    /// @brief The bodies linked to the already stored one.
+    guint64 bodies_shared;
+    guint64 bytes_written;
+    /// @brief The body bytes which are not written because of sharing.
+    guint64 bytes_shared;
+};
+
+struct _DSmtpSpool
+{
+    GObject parent;
+
+    gchar* directory;
+    gchar* messages_directory;
+    gchar* bodies_directory;
+    gchar* dictionaries_directory;
+    gchar* spill_directory;
+    /// @brief The spool directory descriptor for the checkpoint sync.
+    gint directory_fd;
+    /// @brief The message identifier sequence, accessed atomically.
+    gint sequence;
+    DSmtpJournal* journal;
+    /// @brief The queue of the stored messages by the recipient domain.
+    DSmtpQueueIndex* index;
+    /// @brief The journal of the previous run is replayed.
+    gboolean replaying;
+    /// @brief The records failed to apply in order, array of GBytes,
+    /// accessed by the journal thread.
+    GPtrArray* unapplied;
+
+    GMutex lock;
+    /// @brief The known bodies, digest to the number of not applied records.
+    GHashTable* bodies;
+    DSmtpSpoolMetrics metrics;
+};
+typedef _DSmtpSpool DSmtpSpool;
+
+struct _DSmtpSpoolSpill
+{
+    gchar* path;
+    gint fd;
+    /// @brief The body is the zlib stream.
+    gboolean compressed;
+    /// @brief The number of written bytes.
+    gsize size;
+};
+
+G_DEFINE_TYPE(DSmtpSpool,d_smtp_spool,G_TYPE_OBJECT)
+
+struct _DSmtpSpoolClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(smtp_spool_default);
+static DSmtpSpool* smtp_spool_default{nullptr};
+
+void d_smtp_spool_message_free(
+    DSmtpSpoolMessage* message)
+{
+    if(!message) return;
+    g_free(message->reverse_path);
+    g_clear_pointer(&message->recipients,g_ptr_array_unref);
+    g_clear_pointer(&message->blocks,g_ptr_array_unref);
+    g_free(message->body_digest);
+    g_clear_pointer(&message->body_blocks,g_ptr_array_unref);
+    g_clear_pointer(&message->body_spill,d_smtp_spool_spill_free);
+    g_free(message);
+}
+
+static void smtp_spool_set_errno_error(
+    GError** error,
+    gint saved_errno,
+    const gchar* operation,
+    const gchar* path)
+{
+    g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+        "%s %s: %s",operation,path,g_strerror(saved_errno));
+}
+
+/**
+ * @brief Get the body file name, the compressed and the plain bodies of
+ * the same digest are different files.
+ */
+static gchar* smtp_spool_body_name(
+    const DSmtpSpoolMessage* message)
+{
+    gboolean compressed = message->body_blocks || (message->body_spill && message->body_spill->compressed);
+    return g_strconcat(message->body_digest,compressed ? ".z" : "",NULL);
+}
+
+/**
+ * @brief Append the [begin,end) range of the message content.
+ */
+static void smtp_spool_append_range(
+    GString* record,
+    GPtrArray* blocks,
+    gsize begin,
+    gsize end)
+{
+    gsize offset{0};
+    for(guint index = 0; index < blocks->len && offset < end; index++) {
+        gsize size{0};
+        auto data = static_cast<const gchar*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(blocks,index)),&size));
+        gsize from = MAX(begin,offset);
+        gsize to = MIN(end,offset + size);
+        if(from < to) {
+            g_string_append_len(record,data + (from - offset),to - from);
+        }
+        offset += size;
+    }
+}
+
+/**
+ * @brief Build the journal record of the message.
+ * @details The record is the two lines of the record header followed by
+ * the exact envelope file content and the body if it isn't shared:
+ * @code
+ * ID <id>
+ * ENVELOPE <envelope file size> <1 if the body follows>
+ * MAIL FROM:<path>
+ * RCPT TO:<path>
+ * BODY <digest> <body size>
+ *
+ * <header><body>
+ * @endcode
+ * The compressed body is named by the ".z" suffix and the BODY line has
+ * the stored size followed by the compression and the plain body size:
+ * @code
+ * BODY <digest>.z <stored size> deflate <body size>
+ * @endcode
+ */
+static GBytes* smtp_spool_record_new(
+    const DSmtpSpoolMessage* message,
+    const gchar* id,
+    gboolean with_body)
+{
+    gsize body_size = message->size - message->header_size;
+    gboolean compressed = message->body_blocks || (message->body_spill && message->body_spill->compressed);
+    gsize stored_size = message->body_spill ? message->body_spill->size : body_size;
+    if(message->body_blocks) {
+        stored_size = 0;
+        for(guint index = 0; index < message->body_blocks->len; index++) {
+            stored_size += g_bytes_get_size(static_cast<GBytes*>(g_ptr_array_index(message->body_blocks,index)));
+        }
+    }
+    g_autoptr(GString) envelope = g_string_new(NULL);
+    g_string_append_printf(envelope,"MAIL FROM:<%s>\r\n",message->reverse_path);
+    for(guint index = 0; index < message->recipients->len; index++) {
+        g_string_append_printf(envelope,"RCPT TO:<%s>\r\n",
+            static_cast<const gchar*>(g_ptr_array_index(message->recipients,index)));
+    }
+    if(compressed) {
+        g_string_append_printf(envelope,"BODY %s.z %" G_GSIZE_FORMAT " deflate %" G_GSIZE_FORMAT "\r\n\r\n",
+            message->body_digest,stored_size,body_size);
+    } else {
+        g_string_append_printf(envelope,"BODY %s %" G_GSIZE_FORMAT "\r\n\r\n",
+            message->body_digest,body_size);
+    }
+
+    GString* record = g_string_sized_new(envelope->len + 128 + message->header_size +
+        (with_body ? stored_size : 0));
+    g_string_append_printf(record,"ID %s\r\nENVELOPE %" G_GSIZE_FORMAT " %d\r\n",
+        id,envelope->len + message->header_size,with_body ? 1 : 0);
+    g_string_append_len(record,envelope->str,envelope->len);
+    smtp_spool_append_range(record,message->blocks,0,message->header_size);
+    if(with_body && message->body_blocks) {
+        smtp_spool_append_range(record,message->body_blocks,0,stored_size);
+    } else if(with_body) {
+        smtp_spool_append_range(record,message->blocks,message->header_size,message->size);
+    }
+    gsize size = record->len;
+    return g_bytes_new_take(g_string_free(record,FALSE),size);
+}
+
+/**
+ * @brief Take the next CRLF terminated line of the record.
+ */
+static const gchar* smtp_spool_record_line(
+    const gchar* begin,
+    const gchar* end,
+    const gchar* prefix,
+    const gchar** value)
+{
+    auto line_end = static_cast<const gchar*>(g_strstr_len(begin,end - begin,"\r\n"));
+    gsize prefix_length = strlen(prefix);
+    if(!line_end || gsize(line_end - begin) < prefix_length || strncmp(begin,prefix,prefix_length) != 0) {
+        return nullptr;
+    }
+    *value = begin + prefix_length;
+    return line_end + 2;
+}
+
+/**
+ * @brief Write the data to the file by the temporary file rename.
+ */
+static gboolean smtp_spool_write_file(
+    const gchar* path,
+    const gchar* data,
+    gsize size,
+    GError** error)
+{
+    g_autoptr(GFile) file = g_file_new_for_path(path);
+    g_autoptr(GFileOutputStream) os = g_file_replace(file,NULL,FALSE,G_FILE_CREATE_PRIVATE,NULL,error);
+    if(!os) {
+        return FALSE;
+    }
+    if(!g_output_stream_write_all(G_OUTPUT_STREAM(os),data,size,NULL,NULL,error)) {
+        g_output_stream_close(G_OUTPUT_STREAM(os),NULL,NULL);
+        return FALSE;
+    }
+    return g_output_stream_close(G_OUTPUT_STREAM(os),NULL,error);
+}
+
+/**
+ * @brief Release the body reference of the applied or failed record.
+ * @details The body which isn't stored is forgotten, so the next record
+ * carries it again.
+ */
+static void smtp_spool_body_applied(
+    DSmtpSpool* spool,
+    const gchar* digest)
+{
+    g_autofree gchar* body_path = g_build_filename(spool->bodies_directory,digest,NULL);
+    g_mutex_lock(&spool->lock);
+    guint pending = GPOINTER_TO_UINT(g_hash_table_lookup(spool->bodies,digest));
+    if(pending > 1) {
+        g_hash_table_replace(spool->bodies,g_strdup(digest),GUINT_TO_POINTER(pending - 1));
+    } else if(g_file_test(body_path,G_FILE_TEST_EXISTS)) {
+        g_hash_table_replace(spool->bodies,g_strdup(digest),GUINT_TO_POINTER(0));
+    } else {
+        g_hash_table_remove(spool->bodies,digest);
+    }
+    g_mutex_unlock(&spool->lock);
+}
+
+/**
+ * @brief Add the message to the queue of every recipient domain.
+ */
+static void smtp_spool_enqueue(
+    DSmtpSpool* spool,
+    const gchar* id,
+    const gchar* envelope,
+    gsize envelope_size)
+{
+    const gchar* end = envelope + envelope_size;
+    g_autoptr(GPtrArray) domains = g_ptr_array_new_with_free_func(g_free);
+    for(const gchar* line = envelope; line < end; ) {
+        auto line_end = static_cast<const gchar*>(g_strstr_len(line,end - line,"\r\n"));
+        if(!line_end || line_end == line) break;
+        const gchar* path{nullptr};
+        if(smtp_spool_record_line(line,end,"RCPT TO:<",&path)) {
+            auto at = static_cast<const gchar*>(g_strrstr_len(path,line_end - path,"@"));
+            auto close = static_cast<const gchar*>(memchr(path,'>',line_end - path));
+            if(at && close && at < close) {
+                g_autofree gchar* domain = g_ascii_strdown(at + 1,close - at - 1);
+                if(!g_ptr_array_find_with_equal_func(domains,domain,g_str_equal,NULL)) {
+                    g_ptr_array_add(domains,g_steal_pointer(&domain));
+                }
+            }
+        }
+        line = line_end + 2;
+    }
+    for(guint position = 0; position < domains->len; position++) {
+        GError* error{NULL};
+        auto domain = static_cast<const gchar*>(g_ptr_array_index(domains,position));
+        // The replayed message may be queued by the previous run.
+        guint32 record = spool->replaying ?
+            d_smtp_queue_index_lookup_or_enqueue(spool->index,id,domain,&error) :
+            d_smtp_queue_index_enqueue(spool->index,id,domain,&error);
+        if(record == SMTP_QUEUE_INDEX_NONE) {
+            g_warning("spool message %s isn't queued: %d %s",id,error->code,error->message);
+            g_error_free(error);
+        }
+    }
+}
+
+/**
+ * @brief Create the message files.
+ */
+static gboolean smtp_spool_write_message(
+    DSmtpSpool* spool,
+    const gchar* id,
+    const gchar* digest,
+    const gchar* envelope,
+    gsize envelope_size,
+    const gchar* body,
+    gsize body_size,
+    gboolean with_body,
+    GError** error)
+{
+    g_autofree gchar* envelope_path = g_build_filename(spool->messages_directory,id,NULL);
+    g_autofree gchar* link_path = g_strconcat(envelope_path,".body",NULL);
+    g_autofree gchar* body_path = g_build_filename(spool->bodies_directory,digest,NULL);
+    // The link exists already if the record is replayed.
+    gboolean shared{TRUE};
+    if(link(body_path,link_path) != 0 && errno != EEXIST) {
+        if(!with_body) {
+            // The body must be applied by the earlier record.
+            smtp_spool_set_errno_error(error,errno,"link",body_path);
+            return FALSE;
+        }
+        shared = FALSE;
+        if(!smtp_spool_write_file(link_path,body,body_size,error)) {
+            return FALSE;
+        }
+        // The equal body may be linked meanwhile, then this copy just isn't shared.
+        if(link(link_path,body_path) != 0 && errno != EEXIST) {
+            g_warning("spool body %s isn't shared: %s",body_path,g_strerror(errno));
+        }
+    }
+    if(!smtp_spool_write_file(envelope_path,envelope,envelope_size,error)) {
+        return FALSE;
+    }
+    // The index to be rebuilt from the envelopes isn't opened by the replay.
+    if(spool->index) {
+        smtp_spool_enqueue(spool,id,envelope,envelope_size);
+    }
+
+    g_mutex_lock(&spool->lock);
+    spool->metrics.messages++;
+    spool->metrics.bytes_written += envelope_size;
+    if(shared) {
+        spool->metrics.bodies_shared++;
+        spool->metrics.bytes_shared += body_size;
+    } else {
+        spool->metrics.bodies_stored++;
+        spool->metrics.bytes_written += body_size;
+    }
+    g_mutex_unlock(&spool->lock);
+    return TRUE;
+}
+
+/**
+ * @brief Create the spool files of the journal record.
+ * @details The record is applied after it is durable in the journal, or
+ * again by the retry and the journal replay, so the existing files are
+ * accepted.
+ * @param [in] release Release the body reference taken by the store.
+ */
+static gboolean smtp_spool_apply_record(
+    DSmtpSpool* spool,
+    GBytes* record,
+    gboolean release,
+    GError** error)
+{
+    gsize size{0};
+    auto data = static_cast<const gchar*>(g_bytes_get_data(record,&size));
+    const gchar* end = data + size;
+    const gchar* id_value{nullptr};
+    const gchar* envelope_value{nullptr};
+    const gchar* envelope = smtp_spool_record_line(data,end,"ID ",&id_value);
+    envelope = envelope ? smtp_spool_record_line(envelope,end,"ENVELOPE ",&envelope_value) : nullptr;
+    gchar* tail{nullptr};
+    guint64 envelope_size = envelope ? g_ascii_strtoull(envelope_value,&tail,10) : 0;
+    if(!envelope || envelope_size > guint64(end - envelope)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"spool record is damaged");
+        return FALSE;
+    }
+    gboolean with_body = g_ascii_strtoull(tail,NULL,10) != 0;
+    g_autofree gchar* id = g_strndup(id_value,strcspn(id_value,"\r\n"));
+    // The digest is the BODY line of the envelope.
+    g_autofree gchar* digest{nullptr};
+    gsize body_size{0};
+    for(const gchar* line = envelope; line < envelope + envelope_size; ) {
+        const gchar* value{nullptr};
+        const gchar* next = smtp_spool_record_line(line,envelope + envelope_size,"BODY ",&value);
+        if(next) {
+            gsize digest_length = strcspn(value," \r\n");
+            digest = g_strndup(value,digest_length);
+            body_size = g_ascii_strtoull(value + digest_length,NULL,10);
+            break;
+        }
+        auto line_end = static_cast<const gchar*>(g_strstr_len(line,envelope + envelope_size - line,"\r\n"));
+        if(!line_end || line_end == line) break;
+        line = line_end + 2;
+    }
+    if(!digest) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"spool record %s has no body digest",id);
+        return FALSE;
+    }
+
+    const gchar* body = envelope + envelope_size;
+    gboolean applied{FALSE};
+    if(with_body && body_size != gsize(end - body)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"spool record %s body size mismatch",id);
+    } else {
+        applied = smtp_spool_write_message(spool,id,digest,envelope,envelope_size,
+            body,body_size,with_body,error);
+    }
+    // The body is linked or failed, it may be removed now.
+    if(release) {
+        smtp_spool_body_applied(spool,digest);
+    }
+    return applied;
+}
+
+/**
+ * @brief Apply the durable records, called by the journal thread.
+ */
+static void smtp_spool_journal_commit(
+    GPtrArray* records,
+    gpointer user_data)
+{
+    auto spool = D_SMTP_SPOOL(user_data);
+    for(guint index = 0; index < records->len; index++) {
+        auto record = static_cast<GBytes*>(g_ptr_array_index(records,index));
+        GError* error{NULL};
+        if(!smtp_spool_apply_record(spool,record,TRUE,&error)) {
+            // The record stays in the journal until the retry or the replay applies it.
+            g_critical("spool record apply failed: %d %s",error->code,error->message);
+            g_error_free(error);
+            g_ptr_array_add(spool->unapplied,g_bytes_ref(record));
+        }
+    }
+}
+
+/**
+ * @brief Apply again the failed records in order.
+ * @details The record without the body follows the failed one with it,
+ * so it is retried after it.
+ * @return TRUE if all records are applied.
+ */
+static gboolean smtp_spool_retry_records(
+    DSmtpSpool* spool)
+{
+    g_autoptr(GPtrArray) records = g_steal_pointer(&spool->unapplied);
+    spool->unapplied = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    for(guint index = 0; index < records->len; index++) {
+        auto record = static_cast<GBytes*>(g_ptr_array_index(records,index));
+        if(!smtp_spool_apply_record(spool,record,FALSE,NULL)) {
+            g_ptr_array_add(spool->unapplied,g_bytes_ref(record));
+        }
+    }
+    return spool->unapplied->len == 0;
+}
+
+/**
+ * @brief Make the spool files durable.
+ */
+static gboolean smtp_spool_sync(
+    DSmtpSpool* spool)
+{
+#ifdef __linux__
+    if(syncfs(spool->directory_fd) != 0) {
+        g_warning("spool %s sync failed: %s",spool->directory,g_strerror(errno));
+        return FALSE;
+    }
+#else
+    sync();
+#endif
+    return TRUE;
+}
+
+/**
+ * @brief Make the applied records durable before the journal truncate.
+ * @details The journal is the only copy of the records not applied, it
+ * isn't truncated until they are.
+ */
+static gboolean smtp_spool_journal_checkpoint(
+    gpointer user_data)
+{
+    auto spool = D_SMTP_SPOOL(user_data);
+    if(spool->unapplied->len && !smtp_spool_retry_records(spool)) {
+        g_warning("spool %s: %u journal records aren't applied, the journal is kept",
+            spool->directory,spool->unapplied->len);
+        return FALSE;
+    }
+    return smtp_spool_sync(spool);
+}
+
+static void smtp_spool_journal_replay(
+    GBytes* record,
+    gpointer user_data)
+{
+    auto spool = D_SMTP_SPOOL(user_data);
+    GError* error{NULL};
+    if(!smtp_spool_apply_record(spool,record,TRUE,&error)) {
+        g_critical("spool record replay failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        // The journal mapping is released after the replay.
+        gsize size{0};
+        gconstpointer data = g_bytes_get_data(record,&size);
+        g_ptr_array_add(spool->unapplied,g_bytes_new(data,size));
+    }
+}
+
+DSmtpSpoolSpill* d_smtp_spool_spill_new(
+    DSmtpSpool* spool,
+    gboolean compressed,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),NULL);
+    g_autofree gchar* path = g_build_filename(spool->spill_directory,"XXXXXX",NULL);
+    gint fd = g_mkstemp_full(path,O_RDWR | O_CLOEXEC,0600);
+    if(fd < 0) {
+        smtp_spool_set_errno_error(error,errno,"mkstemp",path);
+        return NULL;
+    }
+    auto spill = g_new0(DSmtpSpoolSpill,1);
+    spill->path = g_steal_pointer(&path);
+    spill->fd = fd;
+    spill->compressed = compressed;
+    return spill;
+}
+
+gboolean d_smtp_spool_spill_write(
+    DSmtpSpoolSpill* spill,
+    const gchar* data,
+    gsize size,
+    GError** error)
+{
+    while(size > 0) {
+        gssize written = write(spill->fd,data,size);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            smtp_spool_set_errno_error(error,errno,"write",spill->path);
+            return FALSE;
+        }
+        data += written;
+        size -= written;
+        spill->size += written;
+    }
+    return TRUE;
+}
+
+void d_smtp_spool_spill_free(
+    DSmtpSpoolSpill* spill)
+{
+    if(!spill) return;
+    close(spill->fd);
+    unlink(spill->path);
+    g_free(spill->path);
+    g_free(spill);
+}
+
+/**
+ * @brief Sync the directory entries.
+ */
+static gboolean smtp_spool_sync_directory(
+    const gchar* path,
+    GError** error)
+{
+    gint fd = open(path,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0 || fsync(fd) != 0) {
+        smtp_spool_set_errno_error(error,errno,"fsync",path);
+        if(fd >= 0) close(fd);
+        return FALSE;
+    }
+    close(fd);
+    return TRUE;
+}
+
+/**
+ * @brief Make the spilled body durable in the bodies directory, runs in
+ * the GIO thread pool.
+ * @details The equal body stored already is used as is.
+ */
+static void smtp_spool_spill_link_thread(
+    GTask* task,
+    gpointer source_object,
+    gpointer task_data,
+    GCancellable* cancellable)
+{
+    auto spool = D_SMTP_SPOOL(source_object);
+    auto message = static_cast<DSmtpSpoolMessage*>(task_data);
+    DSmtpSpoolSpill* spill = message->body_spill;
+    g_autofree gchar* body_name = smtp_spool_body_name(message);
+    g_autofree gchar* body_path = g_build_filename(spool->bodies_directory,body_name,NULL);
+    GError* error{NULL};
+    if(fsync(spill->fd) != 0) {
+        smtp_spool_set_errno_error(&error,errno,"fsync",spill->path);
+    } else if(link(spill->path,body_path) != 0 && errno != EEXIST) {
+        smtp_spool_set_errno_error(&error,errno,"link",body_path);
+    } else {
+        smtp_spool_sync_directory(spool->bodies_directory,&error);
+    }
+    if(error) {
+        g_task_return_error(task,error);
+        return;
+    }
+    g_task_return_boolean(task,TRUE);
+}
+
+/**
+ * @brief Append the record of the message with the spilled body.
+ */
+static void smtp_spool_spill_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto spool = D_SMTP_SPOOL(source_object);
+    g_autoptr(GTask) task = G_TASK(user_data);
+    auto message = static_cast<DSmtpSpoolMessage*>(g_task_get_task_data(G_TASK(res)));
+    GError* error{NULL};
+    if(!g_task_propagate_boolean(G_TASK(res),&error)) {
+        g_autofree gchar* body_name = smtp_spool_body_name(message);
+        smtp_spool_body_applied(spool,body_name);
+        g_task_return_error(task,error);
+        return;
+    }
+    // The body is in the bodies directory, the record goes without it.
+    auto id = static_cast<const gchar*>(g_task_get_task_data(task));
+    g_autoptr(GBytes) record = smtp_spool_record_new(message,id,FALSE);
+    d_smtp_journal_append(spool->journal,record,task);
+}
+
+void d_smtp_spool_store_async(
+    DSmtpSpool* spool,
+    DSmtpSpoolMessage* message,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_SMTP_SPOOL(spool));
+    gchar* id = g_strdup_printf("%" G_GINT64_MODIFIER "x-%x-%x",
+        g_get_real_time(),guint(getpid()),guint(g_atomic_int_add(&spool->sequence,1)));
+    g_autofree gchar* body_name = smtp_spool_body_name(message);
+    // The body known by the earlier record isn't written to the journal
+    // again, the pending count keeps it from removal until applied.
+    g_mutex_lock(&spool->lock);
+    gpointer pending{nullptr};
+    gboolean with_body = !g_hash_table_lookup_extended(spool->bodies,body_name,NULL,&pending);
+    g_hash_table_replace(spool->bodies,g_strdup(body_name),
+        GUINT_TO_POINTER(GPOINTER_TO_UINT(pending) + 1));
+    g_mutex_unlock(&spool->lock);
+
+    // The callback is invoked in the thread default context of the caller
+    // when the journal record is durable.
+    g_autoptr(GTask) task = g_task_new(spool,cancellable,callback,user_data);
+    g_task_set_task_data(task,id,g_free);
+    if(message->body_spill) {
+        // The fsync of the spilled body doesn't block the caller.
+        g_autoptr(GTask) link_task = g_task_new(spool,cancellable,
+            smtp_spool_spill_handle,g_steal_pointer(&task));
+        g_task_set_task_data(link_task,message,
+            reinterpret_cast<GDestroyNotify>(d_smtp_spool_message_free));
+        g_task_run_in_thread(link_task,smtp_spool_spill_link_thread);
+        return;
+    }
+    g_autoptr(GBytes) record = smtp_spool_record_new(message,id,with_body);
+    d_smtp_spool_message_free(message);
+    d_smtp_journal_append(spool->journal,record,task);
+}
+
+gchar* d_smtp_spool_store_finish(
+    DSmtpSpool* spool,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,spool),NULL);
+    if(!g_task_propagate_boolean(G_TASK(result),error)) {
+        return NULL;
+    }
+    return g_strdup(static_cast<const gchar*>(g_task_get_task_data(G_TASK(result))));
+}
+
+gchar* d_smtp_spool_dequeue(
+    DSmtpSpool* spool,
+    const gchar* destination)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),NULL);
+    return d_smtp_queue_index_dequeue(spool->index,destination);
+}
+
+guint d_smtp_spool_get_queued_count(
+    DSmtpSpool* spool)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),0);
+    return d_smtp_queue_index_get_count(spool->index,NULL);
+}
+
+gboolean d_smtp_spool_remove(
+    DSmtpSpool* spool,
+    const gchar* id,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),FALSE);
+    g_autofree gchar* envelope_path = g_build_filename(spool->messages_directory,id,NULL);
+    g_autofree gchar* link_path = g_strconcat(envelope_path,".body",NULL);
+    g_autofree gchar* envelope = NULL;
+    gsize envelope_size{0};
+    if(!g_file_get_contents(envelope_path,&envelope,&envelope_size,error)) {
+        return FALSE;
+    }
+    g_autofree gchar* digest = NULL;
+    for(const gchar* line = envelope; line && *line; ) {
+        const gchar* value{nullptr};
+        if(smtp_spool_record_line(line,envelope + envelope_size,"BODY ",&value)) {
+            digest = g_strndup(value,strcspn(value," \r\n"));
+            break;
+        }
+        auto next = strstr(line,"\r\n");
+        if(next == line) break;
+        line = next ? next + 2 : NULL;
+    }
+    if(unlink(envelope_path) != 0) {
+        smtp_spool_set_errno_error(error,errno,"unlink",envelope_path);
+        return FALSE;
+    }
+    unlink(link_path);
+    if(digest) {
+        // Only the bodies directory link is left and no record waits for
+        // the body. The store which links the body after the check keeps
+        // its own link.
+        g_autofree gchar* body_path = g_build_filename(spool->bodies_directory,digest,NULL);
+        struct stat body_stat;
+        g_mutex_lock(&spool->lock);
+        if(GPOINTER_TO_UINT(g_hash_table_lookup(spool->bodies,digest)) == 0 &&
+           stat(body_path,&body_stat) == 0 && body_stat.st_nlink == 1) {
+            unlink(body_path);
+            g_hash_table_remove(spool->bodies,digest);
+        }
+        g_mutex_unlock(&spool->lock);
+    }
+    return TRUE;
+}
+
+gboolean d_smtp_spool_save_dictionary(
+    DSmtpSpool* spool,
+    GBytes* dictionary,
+    guint32 id,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),FALSE);
+    g_autofree gchar* name = g_strdup_printf("%08x",id);
+    g_autofree gchar* path = g_build_filename(spool->dictionaries_directory,name,NULL);
+    if(g_file_test(path,G_FILE_TEST_EXISTS)) {
+        return TRUE;
+    }
+    gsize size{0};
+    auto data = static_cast<const gchar*>(g_bytes_get_data(dictionary,&size));
+    if(!smtp_spool_write_file(path,data,size,error)) {
+        return FALSE;
+    }
+    // The dictionary is durable before the first record using it.
+    if(!smtp_spool_sync(spool)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_FAILED,"spool dictionary %s sync failed",path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+GInputStream* d_smtp_spool_open_body(
+    DSmtpSpool* spool,
+    const gchar* id,
+    gboolean decompress,
+    gboolean* compressed,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_SPOOL(spool),NULL);
+    g_autofree gchar* envelope_path = g_build_filename(spool->messages_directory,id,NULL);
+    g_autofree gchar* link_path = g_strconcat(envelope_path,".body",NULL);
+    g_autofree gchar* envelope = NULL;
+    gsize envelope_size{0};
+    if(!g_file_get_contents(envelope_path,&envelope,&envelope_size,error)) {
+        return NULL;
+    }
+    // The compressed body has the compression after the stored size.
+    gboolean deflated{FALSE};
+    for(const gchar* line = envelope; line && *line; ) {
+        const gchar* value{nullptr};
+        if(smtp_spool_record_line(line,envelope + envelope_size,"BODY ",&value)) {
+            gsize length = strcspn(value,"\r\n");
+            g_autofree gchar* body_line = g_strndup(value,length);
+            g_auto(GStrv) fields = g_strsplit(body_line," ",0);
+            deflated = g_strv_length(fields) >= 3 && g_strcmp0(fields[2],"deflate") == 0;
+            break;
+        }
+        auto next = strstr(line,"\r\n");
+        if(next == line) break;
+        line = next ? next + 2 : NULL;
+    }
+    g_autoptr(GFile) file = g_file_new_for_path(link_path);
+    g_autoptr(GFileInputStream) stream = g_file_read(file,NULL,error);
+    if(!stream) {
+        return NULL;
+    }
+    *compressed = deflated && !decompress;
+    if(!deflated || !decompress) {
+        return G_INPUT_STREAM(g_steal_pointer(&stream));
+    }
+    g_autoptr(DSmtpInflater) inflater = d_smtp_inflater_new(spool->dictionaries_directory);
+    return g_converter_input_stream_new(G_INPUT_STREAM(stream),G_CONVERTER(inflater));
+}
+
+void d_smtp_spool_log_metrics(
+    DSmtpSpool* spool)
+{
+    g_return_if_fail(D_IS_SMTP_SPOOL(spool));
+    g_mutex_lock(&spool->lock);
+    DSmtpSpoolMetrics metrics = spool->metrics;
+    g_mutex_unlock(&spool->lock);
+    g_message("spool: %" G_GUINT64_FORMAT " messages, bodies stored %" G_GUINT64_FORMAT
+        " shared %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " bytes written, %" G_GUINT64_FORMAT " bytes shared",
+        metrics.messages,metrics.bodies_stored,metrics.bodies_shared,
+        metrics.bytes_written,metrics.bytes_shared);
+    g_message("spool: %u messages queued",d_smtp_queue_index_get_count(spool->index,NULL));
+    d_smtp_journal_log_metrics(spool->journal);
+}
+
+void d_smtp_spool_set_default(
+    DSmtpSpool* spool)
+{
+    G_LOCK(smtp_spool_default);
+    g_set_object(&smtp_spool_default,spool);
+    G_UNLOCK(smtp_spool_default);
+}
+
+DSmtpSpool* d_smtp_spool_get_default()
+{
+    G_LOCK(smtp_spool_default);
+    DSmtpSpool* spool = smtp_spool_default ? D_SMTP_SPOOL(g_object_ref(smtp_spool_default)) : NULL;
+    G_UNLOCK(smtp_spool_default);
+    return spool;
+}
+
+/**
+ * @brief Load the digests of the stored bodies.
+ */
+static gboolean smtp_spool_load_bodies(
+    DSmtpSpool* spool,
+    GError** error)
+{
+    g_autoptr(GDir) dir = g_dir_open(spool->bodies_directory,0,error);
+    if(!dir) {
+        return FALSE;
+    }
+    for(const gchar* name = g_dir_read_name(dir); name; name = g_dir_read_name(dir)) {
+        g_hash_table_replace(spool->bodies,g_strdup(name),GUINT_TO_POINTER(0));
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Remove the spill files of the messages not stored by the previous run.
+ */
+static void smtp_spool_remove_spills(
+    DSmtpSpool* spool)
+{
+    g_autoptr(GDir) dir = g_dir_open(spool->spill_directory,0,NULL);
+    if(!dir) {
+        return;
+    }
+    for(const gchar* name = g_dir_read_name(dir); name; name = g_dir_read_name(dir)) {
+        g_autofree gchar* path = g_build_filename(spool->spill_directory,name,NULL);
+        unlink(path);
+    }
+}
+
+/**
+ * @brief Queue the stored messages again by the spool directory walk.
+ */
+static void smtp_spool_rebuild_index(
+    DSmtpSpool* spool)
+{
+    GError* error{NULL};
+    g_autoptr(GDir) dir = g_dir_open(spool->messages_directory,0,&error);
+    if(!dir) {
+        g_warning("spool queue rebuild failed: %d %s",error->code,error->message);
+        g_error_free(error);
+        return;
+    }
+    gint64 start = g_get_monotonic_time();
+    d_smtp_queue_index_clear(spool->index);
+    // The identifier starts with the store time, the name order is the queue order.
+    g_autoptr(GPtrArray) ids = g_ptr_array_new_with_free_func(g_free);
+    for(const gchar* name = g_dir_read_name(dir); name; name = g_dir_read_name(dir)) {
+        if(name[0] != '.' && !g_str_has_suffix(name,".body")) {
+            g_ptr_array_add(ids,g_strdup(name));
+        }
+    }
+    g_ptr_array_sort(ids,[](gconstpointer a, gconstpointer b) {
+        return strcmp(*static_cast<const gchar* const*>(a),*static_cast<const gchar* const*>(b));
+    });
+    for(guint position = 0; position < ids->len; position++) {
+        auto id = static_cast<const gchar*>(g_ptr_array_index(ids,position));
+        g_autofree gchar* path = g_build_filename(spool->messages_directory,id,NULL);
+        g_autofree gchar* envelope = NULL;
+        gsize envelope_size{0};
+        if(g_file_get_contents(path,&envelope,&envelope_size,NULL)) {
+            smtp_spool_enqueue(spool,id,envelope,envelope_size);
+        }
+    }
+    g_message("spool %s: queue rebuilt from %u messages in %" G_GINT64_FORMAT " ms",
+        spool->directory,ids->len,(g_get_monotonic_time() - start) / 1000);
+}
+
+static void d_smtp_spool_init(DSmtpSpool* spool)
+{
+    spool->directory_fd = -1;
+    spool->bodies = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,NULL);
+    spool->unapplied = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    g_mutex_init(&spool->lock);
+}
+
+static void d_smtp_spool_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_SPOOL(object));
+    auto spool = D_SMTP_SPOOL(object);
+    // The journal thread commits the queued records before exit.
+    g_clear_object(&spool->journal);
+    g_clear_object(&spool->index);
+    if(spool->directory_fd >= 0) {
+        close(spool->directory_fd);
+    }
+    g_free(spool->directory);
+    g_free(spool->messages_directory);
+    g_free(spool->bodies_directory);
+    g_free(spool->dictionaries_directory);
+    g_free(spool->spill_directory);
+    g_hash_table_unref(spool->bodies);
+    g_ptr_array_unref(spool->unapplied);
+    g_mutex_clear(&spool->lock);
+    G_OBJECT_CLASS(d_smtp_spool_parent_class)->finalize(object);
+}
+
+static void d_smtp_spool_class_init(DSmtpSpoolClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_spool_finalize;
+}
+
+/**
+ * @brief Create new instance of spool.
+ */
+DSmtpSpool* d_smtp_spool_new(
+    const gchar* directory,
+    guint commit_window,
+    GError** error)
+{
+    g_autofree gchar* messages_directory = g_build_filename(directory,"messages",NULL);
+    g_autofree gchar* bodies_directory = g_build_filename(directory,"bodies",NULL);
+    g_autofree gchar* dictionaries_directory = g_build_filename(directory,"dictionaries",NULL);
+    g_autofree gchar* spill_directory = g_build_filename(directory,"spill",NULL);
+    const gchar* directories[] = {messages_directory,bodies_directory,dictionaries_directory,spill_directory};
+    for(const gchar* path : directories) {
+        if(g_mkdir_with_parents(path,0700) != 0) {
+            smtp_spool_set_errno_error(error,errno,"mkdir",path);
+            return NULL;
+        }
+    }
+
+    g_autoptr(DSmtpSpool) spool = reinterpret_cast<DSmtpSpool*>(
+        g_object_new(
+            D_TYPE_SMTP_SPOOL,
+            NULL));
+
+    spool->directory = g_strdup(directory);
+    spool->messages_directory = g_steal_pointer(&messages_directory);
+    spool->bodies_directory = g_steal_pointer(&bodies_directory);
+    spool->dictionaries_directory = g_steal_pointer(&dictionaries_directory);
+    spool->spill_directory = g_steal_pointer(&spill_directory);
+    spool->directory_fd = open(directory,O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(spool->directory_fd < 0) {
+        smtp_spool_set_errno_error(error,errno,"open",directory);
+        return NULL;
+    }
+    if(!smtp_spool_load_bodies(spool,error)) {
+        return NULL;
+    }
+    smtp_spool_remove_spills(spool);
+    gint64 start = g_get_monotonic_time();
+    g_autofree gchar* index_path = g_build_filename(directory,"queue.index",NULL);
+    g_autoptr(DSmtpQueueIndex) index = d_smtp_queue_index_new(index_path,SPOOL_QUEUE_MAX_DESTINATIONS,error);
+    if(!index) {
+        return NULL;
+    }
+    // The replayed messages are queued in place, only the index left by
+    // the crash is rebuilt by the spool directory walk.
+    gboolean rebuild = d_smtp_queue_index_needs_rebuild(index);
+    if(!rebuild) {
+        spool->index = D_SMTP_QUEUE_INDEX(g_object_ref(index));
+    }
+    // The records of the previous run may be not applied or not synced.
+    g_autofree gchar* journal_path = g_build_filename(directory,"journal",NULL);
+    spool->replaying = TRUE;
+    gsize journal_size{0};
+    gint replayed = d_smtp_journal_replay(journal_path,smtp_spool_journal_replay,spool,&journal_size,error);
+    spool->replaying = FALSE;
+    if(replayed < 0) {
+        return NULL;
+    }
+    if(replayed) {
+        g_message("spool %s: %d journal records replayed",directory,replayed);
+        if(!smtp_spool_sync(spool)) {
+            g_set_error(error,G_IO_ERROR,G_IO_ERROR_FAILED,"spool %s: replayed records sync failed",directory);
+            return NULL;
+        }
+        smtp_spool_load_bodies(spool,NULL);
+    }
+    if(rebuild) {
+        spool->index = g_steal_pointer(&index);
+        smtp_spool_rebuild_index(spool);
+    } else {
+        g_message("spool %s: %u messages queued, index loaded in %" G_GINT64_FORMAT " us",
+            directory,d_smtp_queue_index_get_count(spool->index,NULL),g_get_monotonic_time() - start);
+    }
+    // The records not applied by the replay stay in the journal.
+    if(spool->unapplied->len) {
+        g_warning("spool %s: %u replayed records aren't applied, the journal is kept",
+            directory,spool->unapplied->len);
+    }
+    spool->journal = d_smtp_journal_new(journal_path,spool->unapplied->len ? journal_size : 0,commit_window,
+        SPOOL_JOURNAL_MAX_BATCH,SPOOL_JOURNAL_CHECKPOINT_SIZE,error);
+    if(!spool->journal) {
+        return NULL;
+    }
+    d_smtp_journal_set_funcs(spool->journal,smtp_spool_journal_commit,
+        smtp_spool_journal_checkpoint,spool);
+
+    return g_steal_pointer(&spool);
+}
+
+}
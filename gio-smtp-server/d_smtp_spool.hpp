@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_SPOOL__HPP__
+#define __D__NEW__SMTP_SPOOL__HPP__
+/**
+ * @brief Content addressed message spool.
+ * @details Every message is split to the envelope file with the header
+ * and the body stored by the digest of its content:
+ * @code
+ * messages/<id>       envelope lines, empty line, message header
+ * messages/<id>.body  hard link of bodies/<digest>
+ * bodies/<digest>     the body, stored once for all equal bodies
+ * bodies/<digest>.z   the body compressed by the zlib format
+ * dictionaries/<id>   the preset dictionaries of the compressed bodies
+ * spill/<name>        the big body written while the message is received
+ * @endcode
+ * The envelope file appears last by rename, so the message exists only
+ * when it is complete. The hard links count is the number of envelopes
+ * referencing the body, the body of the duplicate message isn't written.
+ *
+ * The message is first appended to the write ahead journal, the records
+ * of the concurrent stores share one fsync. The spool files are created
+ * from the durable records and the journal is replayed on the spool open,
+ * so the stored message survives the crash before the spool files sync.
+ * The record failed to apply is retried by the checkpoint, the journal
+ * isn't truncated until it is applied.
+ *
+ * The big body is written to the spill file while it is received, the
+ * file is synced and linked to the bodies directory before the record
+ * without the body is appended, so the message isn't kept in the memory.
+ *
+ * The body compressed while the message data is received is stored in
+ * place of the plain one. The stream names its dictionary by the id, the
+ * dictionary file is kept for the bodies compressed by the earlier runs.
+ *
+ * The applied message is queued to every recipient domain in the memory
+ * mapped queue index, so the queue is loaded without the directory walk.
+ * The walk rebuilds the index only after the crash, the messages of the
+ * replayed journal records are queued in place unless already queued.
+ */
+
+#include <gio/gio.h>
+
+/**
+ * @brief The body written to the spool while it is received.
+ */
+typedef struct _DSmtpSpoolSpill DSmtpSpoolSpill;
+
+/**
+ * @brief The message passed to the spool.
+ */
+struct DSmtpSpoolMessage
+{
+    gchar* reverse_path;
+    /// @brief The forward paths, array of gchar*.
+    GPtrArray* recipients;
+    /// @brief The message content blocks in order, array of GBytes.
+    GPtrArray* blocks;
+    /// @brief The number of first content bytes which are the header.
+    gsize header_size;
+    /// @brief The content size without the dot stuffing and the end of data marker.
+    gsize size;
+    /// @brief The body digest in hex.
+    gchar* body_digest;
+    /// @brief The compressed body blocks, array of GBytes, or NULL if the
+    /// body is stored as is.
+    GPtrArray* body_blocks;
+    /// @brief The body written to the spill file or NULL, the blocks have
+    /// only the header then.
+    DSmtpSpoolSpill* body_spill;
+};
+
+extern "C" {
+#define D_TYPE_SMTP_SPOOL (d_smtp_spool_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpSpool,d_smtp_spool,D,SMTP_SPOOL,GObject)
+
+/**
+ * @brief Free the spool message.
+ */
+void d_smtp_spool_message_free(
+    DSmtpSpoolMessage* message);
+
+/**
+ * @brief Start the body spill file.
+ * @param [in] compressed The body is written as the zlib stream.
+ * @return The spill or NULL in case of failure.
+ */
+DSmtpSpoolSpill* d_smtp_spool_spill_new(
+    DSmtpSpool* spool,
+    gboolean compressed,
+    GError** error);
+
+/**
+ * @brief Append the body bytes to the spill file.
+ */
+gboolean d_smtp_spool_spill_write(
+    DSmtpSpoolSpill* spill,
+    const gchar* data,
+    gsize size,
+    GError** error);
+
+/**
+ * @brief Close and remove the spill file.
+ * @details The stored body stays by its link in the bodies directory.
+ */
+void d_smtp_spool_spill_free(
+    DSmtpSpoolSpill* spill);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(DSmtpSpoolSpill,d_smtp_spool_spill_free)
+
+/**
+ * @brief Store the message.
+ * @details The callback is invoked in the thread default main context
+ * of the caller when the message is durable in the journal.
+ * @param [in] message The message, spool takes the ownership.
+ */
+void d_smtp_spool_store_async(
+    DSmtpSpool* spool,
+    DSmtpSpoolMessage* message,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the message store.
+ * @return The message identifier or NULL in case of failure.
+ */
+gchar* d_smtp_spool_store_finish(
+    DSmtpSpool* spool,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Take the oldest queued message of the destination.
+ * @details The message stays in the spool until it is removed.
+ * @param [in] destination The recipient domain.
+ * @return The message identifier or NULL if nothing is queued.
+ */
+gchar* d_smtp_spool_dequeue(
+    DSmtpSpool* spool,
+    const gchar* destination);
+
+/**
+ * @brief Get the number of queued messages for all destinations.
+ */
+guint d_smtp_spool_get_queued_count(
+    DSmtpSpool* spool);
+
+/**
+ * @brief Remove the message, the body is removed with its last reference.
+ */
+gboolean d_smtp_spool_remove(
+    DSmtpSpool* spool,
+    const gchar* id,
+    GError** error);
+
+/**
+ * @brief Keep the dictionary of the compressed bodies.
+ * @details The dictionary is written and synced unless the spool has it
+ * already, so the durable records never reference the lost dictionary.
+ * @param [in] dictionary The dictionary content.
+ * @param [in] id The dictionary id, Adler-32 of the content.
+ */
+gboolean d_smtp_spool_save_dictionary(
+    DSmtpSpool* spool,
+    GBytes* dictionary,
+    guint32 id,
+    GError** error);
+
+/**
+ * @brief Open the message body for the delivery.
+ * @param [in] id The message identifier.
+ * @param [in] decompress Decompress the compressed body, otherwise the
+ * stored zlib stream is passed through.
+ * @param [out] compressed Whether the returned stream is compressed.
+ * @return The body stream or NULL in case of failure.
+ */
+GInputStream* d_smtp_spool_open_body(
+    DSmtpSpool* spool,
+    const gchar* id,
+    gboolean decompress,
+    gboolean* compressed,
+    GError** error);
+
+/**
+ * @brief Write the stored and shared bodies statistics to the log.
+ */
+void d_smtp_spool_log_metrics(
+    DSmtpSpool* spool);
+
+/**
+ * @brief Set the spool used by the connections.
+ * @param [in] spool The spool or NULL, the messages aren't stored.
+ */
+void d_smtp_spool_set_default(
+    DSmtpSpool* spool);
+
+/**
+ * @brief Get the spool used by the connections.
+ * @return The spool or NULL, caller owns the reference.
+ */
+DSmtpSpool* d_smtp_spool_get_default();
+
+/**
+ * @brief Create new instance of spool.
+ * @details The spool directories are created if not exist and the
+ * journal records of the previous run are applied.
+ * @param [in] directory The spool directory.
+ * @param [in] commit_window The microseconds the journal waits for more
+ * records before the fsync, 0 commits the records already queued.
+ * @return The spool or NULL in case of failure.
+ */
+DSmtpSpool* d_smtp_spool_new(
+    const gchar* directory,
+    guint commit_window,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_SPOOL__HPP__
@@ -14,134 +14,135 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 /**
- * @brief SMTP state little object for processing SMTP FSM.
+ * @brief SMTP FSM transition table.
  */
 
 #include "d_smtp_state.hpp"
+#include "d_smtp_probes.hpp"
 
-extern "C" {
-
-struct _DSmtpState
+/**
+ * @brief The next states of the one state for every event.
+ */
+struct DSmtpStateRow
 {
-    GObject parent;
     SMTP_STATE state;
+    SMTP_STATE next[NR_SMTP_EVENTS];
 };
-typedef _DSmtpState DSmtpState;
 
-G_DEFINE_TYPE(DSmtpState,d_smtp_state,G_TYPE_OBJECT)
-
-struct _DSmtpStateClass
+/**
+ * @brief Make the table row.
+ * @details The row must list the next state of every event in the
+ * SMTP_COMMAND then SMTP_EVENT order, the missing one fails the build.
+ */
+template<typename... States>
+static constexpr DSmtpStateRow smtp_state_row(SMTP_STATE state, States... next)
 {
-    GObjectClass parent_class;
-};
+    static_assert(sizeof...(States) == NR_SMTP_EVENTS,
+        "the state row must have the next state for every event");
+    return DSmtpStateRow{state,{next...}};
+}
 
+// The event isn't allowed in the state.
+static constexpr SMTP_STATE REJECT = SMTP_STATE_ERROR;
+
+static constexpr DSmtpStateRow smtp_state_table[] = {
+    //             state                          UNKNOWN HELO                      EHLO                      MAIL                           RCPT                           DATA                           QUIT                      STARTTLS                      RSET                           NOOP                           WRITE_COMPLETE                 DATA_END                    TLS_ESTABLISHED
+    smtp_state_row(SMTP_STATE_ERROR,              REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        REJECT,                        REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_GREETING_SENDING,   REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_GREETING_SENT,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_GREETING_SENT,      REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, REJECT,                        REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_GREETING_SENT,      SMTP_STATE_GREETING_SENT,      SMTP_STATE_GREETING_SENT,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_HELO_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_HELO_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_HELO_ACCEPTED,      REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, SMTP_STATE_MAIL_RECEIVED,      REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_HELO_ACCEPTED,      SMTP_STATE_HELO_ACCEPTED,      SMTP_STATE_HELO_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_EHLO_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_EHLO_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_EHLO_ACCEPTED,      REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, SMTP_STATE_MAIL_RECEIVED_EHLO, REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, SMTP_STATE_STARTTLS_RECEIVED, SMTP_STATE_EHLO_ACCEPTED,      SMTP_STATE_EHLO_ACCEPTED,      SMTP_STATE_EHLO_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_MAIL_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_MAIL_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_MAIL_ACCEPTED,      REJECT, REJECT,                   REJECT,                   REJECT,                        SMTP_STATE_RCPT_RECEIVED,      REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED,      SMTP_STATE_MAIL_ACCEPTED,      SMTP_STATE_MAIL_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RCPT_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_RCPT_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RCPT_ACCEPTED,      REJECT, REJECT,                   REJECT,                   REJECT,                        SMTP_STATE_RCPT_RECEIVED,      SMTP_STATE_DATA_RECEIVED,      SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED,      SMTP_STATE_RCPT_ACCEPTED,      SMTP_STATE_RCPT_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_DATA_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_DATA_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_DATA_ACCEPTED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        REJECT,                        SMTP_STATE_DATA_ENDED,      REJECT),
+    smtp_state_row(SMTP_STATE_DATA_ENDED,         REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, SMTP_STATE_MAIL_RECEIVED,      REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED,      SMTP_STATE_DATA_ENDED,         SMTP_STATE_DATA_ENDED,         REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_QUIT_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_CLOSE,              REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_CLOSE,              REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        REJECT,                        REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_STARTTLS_RECEIVED,  REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_TLS_HANDSHAKE,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_TLS_HANDSHAKE,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        REJECT,                        REJECT,                     SMTP_STATE_TLS_ESTABLISHED),
+    smtp_state_row(SMTP_STATE_TLS_ESTABLISHED,    REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, REJECT,                        REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_TLS_ESTABLISHED,    SMTP_STATE_TLS_ESTABLISHED,    SMTP_STATE_TLS_ESTABLISHED,    REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RSET_RECEIVED,      REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_HELO_ACCEPTED,      REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_MAIL_RECEIVED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_MAIL_ACCEPTED_EHLO, REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_MAIL_ACCEPTED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        SMTP_STATE_RCPT_RECEIVED_EHLO, REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED_EHLO, SMTP_STATE_MAIL_ACCEPTED_EHLO, SMTP_STATE_MAIL_ACCEPTED_EHLO, REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RCPT_RECEIVED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_RCPT_ACCEPTED_EHLO, REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RCPT_ACCEPTED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        SMTP_STATE_RCPT_RECEIVED_EHLO, SMTP_STATE_DATA_RECEIVED_EHLO, SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED_EHLO, SMTP_STATE_RCPT_ACCEPTED_EHLO, SMTP_STATE_RCPT_ACCEPTED_EHLO, REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_DATA_RECEIVED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_DATA_ACCEPTED_EHLO, REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_DATA_ACCEPTED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        REJECT,                        SMTP_STATE_DATA_ENDED_EHLO, REJECT),
+    smtp_state_row(SMTP_STATE_DATA_ENDED_EHLO,    REJECT, SMTP_STATE_HELO_RECEIVED, SMTP_STATE_EHLO_RECEIVED, SMTP_STATE_MAIL_RECEIVED_EHLO, REJECT,                        REJECT,                        SMTP_STATE_QUIT_RECEIVED, REJECT,                       SMTP_STATE_RSET_RECEIVED_EHLO, SMTP_STATE_DATA_ENDED_EHLO,    SMTP_STATE_DATA_ENDED_EHLO,    REJECT,                     REJECT),
+    smtp_state_row(SMTP_STATE_RSET_RECEIVED_EHLO, REJECT, REJECT,                   REJECT,                   REJECT,                        REJECT,                        REJECT,                        REJECT,                   REJECT,                       REJECT,                        REJECT,                        SMTP_STATE_EHLO_ACCEPTED,      REJECT,                     REJECT),
+};
 
 /**
- * @brief Get current state.
- * @return Return one of SMTP_STATE enumeration value.
+ * @brief Check the table has the row of every state in the enumeration order.
  */
-SMTP_STATE d_smtp_state_get_current_state(
-    DSmtpState* smtp_state)
+static constexpr bool smtp_state_table_is_complete()
 {
-    return smtp_state->state;
+    if(sizeof(smtp_state_table) / sizeof(smtp_state_table[0]) != NR_SMTP_STATES) {
+        return false;
+    }
+    for(int state = 0; state < NR_SMTP_STATES; state++) {
+        if(smtp_state_table[state].state != state) {
+            return false;
+        }
+        for(int event = 0; event < NR_SMTP_EVENTS; event++) {
+            if(smtp_state_table[state].next[event] >= NR_SMTP_STATES) {
+                return false;
+            }
+        }
+    }
+    return true;
 }
+static_assert(smtp_state_table_is_complete(),
+    "the transition table must have the row of every state in the SMTP_STATE order");
+
+extern "C" {
 
 static const gchar* smtp_state_to_text(SMTP_STATE state);
 
+SMTP_STATE d_smtp_state_get_current_state(
+    const DSmtpState* smtp_state)
+{
+    return smtp_state->state;
+}
+
 const gchar* d_smtp_state_get_current_state_text(
-    DSmtpState* smtp_state)
+    const DSmtpState* smtp_state)
 {
     return smtp_state_to_text(smtp_state->state);
 }
 
-/**
- * @brief Switch to the new state by the write bytes complete.
- * @return Function returns TRUE if state successfully changed.
- */
+gboolean d_smtp_state_next_by_event(
+    DSmtpState* smtp_state,
+    guint event)
+{
+    // The out of range event goes to the ERROR row by the index mask.
+    SMTP_STATE state = smtp_state->state;
+    guint valid = (event < NR_SMTP_EVENTS) & (guint(state) < NR_SMTP_STATES);
+    smtp_state->state = smtp_state_table[state * valid].next[event * valid];
+    D_SMTP_PROBE4(state,smtp_state,gint(state),gint(smtp_state->state),event);
+    if(G_UNLIKELY(smtp_state->state == SMTP_STATE_ERROR)) {
+        g_debug("smtp state: event %u isn't expected in state %s",event,smtp_state_to_text(state));
+        return FALSE;
+    }
+    return TRUE;
+}
+
 gboolean d_smtp_state_next_by_write_complete(
     DSmtpState* smtp_state)
 {
-    g_message("current state %s",smtp_state_to_text(smtp_state->state));
-    SMTP_STATE new_state = SMTP_STATE_ERROR;
-    switch(smtp_state->state) {
-    case SMTP_STATE_GREETING_SENDING:
-        new_state = SMTP_STATE_GREETING_SENT;
-        break;
-    case SMTP_STATE_HELO_RECEIVED:
-        new_state = SMTP_STATE_HELO_ACCEPTED;
-        break;
-    case SMTP_STATE_EHLO_RECEIVED:
-        new_state = SMTP_STATE_EHLO_ACCEPTED;
-        break;
-    case SMTP_STATE_MAIL_RECEIVED:
-        new_state = SMTP_STATE_MAIL_ACCEPTED;
-        break;
-    case SMTP_STATE_RCPT_RECEIVED:
-        new_state = SMTP_STATE_RCPT_ACCEPTED;
-        break;
-    case SMTP_STATE_DATA_RECEIVED:
-        new_state = SMTP_STATE_DATA_ACCEPTED;
-        break;
-    case SMTP_STATE_DATA_ENDED:
-        new_state = SMTP_STATE_DATA_ENDED;
-        break;
-    case SMTP_STATE_QUIT_RECEIVED:
-        new_state = SMTP_STATE_QUIT_ACCEPTED;
-        break;
-    case SMTP_STATE_QUIT_ACCEPTED:
-        new_state = SMTP_STATE_CLOSE;
-        break;
-    default:
-        g_warning("smtp state: unknown current state");
-    }
-    smtp_state->state = new_state;
-    g_message("new state by write complete: %s",smtp_state_to_text(smtp_state->state));
-    return smtp_state->state != SMTP_STATE_ERROR;
+    return d_smtp_state_next_by_event(smtp_state,SMTP_EVENT_WRITE_COMPLETE);
 }
-/**
- * @brief Switch to the new state by the command.
- * @return Function returns TRUE if state successfully changed.
- */
+
 gboolean d_smtp_state_next_state_by_command(
     DSmtpState* smtp_state,
     SMTP_COMMAND command)
 {
-    g_message("old state: %s",smtp_state_to_text(smtp_state->state));
-    SMTP_STATE new_state = SMTP_STATE_ERROR;
-    switch(smtp_state->state) {
-    case SMTP_STATE_GREETING_SENDING:
-    case SMTP_STATE_GREETING_SENT:
-        if(command == SMTP_COMMAND_HELO) new_state = SMTP_STATE_HELO_RECEIVED;
-        else if(command == SMTP_COMMAND_EHLO) new_state = SMTP_STATE_EHLO_RECEIVED;
-        break;
-    case SMTP_STATE_HELO_ACCEPTED:
-        if(command == SMTP_COMMAND_MAIL) new_state = SMTP_STATE_MAIL_RECEIVED;
-        else if(command == SMTP_COMMAND_QUIT) new_state = SMTP_STATE_QUIT_ACCEPTED;
-        break;
-    case SMTP_STATE_EHLO_RECEIVED:
-        if(command == SMTP_COMMAND_MAIL) new_state = SMTP_STATE_MAIL_RECEIVED;
-        else if(command == SMTP_COMMAND_QUIT) new_state = SMTP_STATE_QUIT_ACCEPTED;
-        break;
-    case SMTP_STATE_MAIL_ACCEPTED:
-        if(command == SMTP_COMMAND_RCPT) new_state = SMTP_STATE_RCPT_RECEIVED;
-        else if(command == SMTP_COMMAND_QUIT) new_state = SMTP_STATE_QUIT_ACCEPTED;
-        break;
-    case SMTP_STATE_RCPT_ACCEPTED:
-        if(command == SMTP_COMMAND_RCPT) new_state = SMTP_STATE_RCPT_RECEIVED;
-        else if(command == SMTP_COMMAND_QUIT) new_state = SMTP_STATE_QUIT_ACCEPTED;
-        else if(command == SMTP_COMMAND_DATA) new_state = SMTP_STATE_DATA_RECEIVED;
-        break;
-    case SMTP_STATE_DATA_ACCEPTED:
-        break;
-    case SMTP_STATE_DATA_ENDED:
-        if(command == SMTP_COMMAND_QUIT) new_state = SMTP_STATE_QUIT_ACCEPTED;
-        break;
-    default:
-        g_warning("smtp unknown state");
-    }
-    smtp_state->state = new_state;
-    g_message("new state by command: %s",smtp_state_to_text(smtp_state->state));
-    return smtp_state->state != SMTP_STATE_ERROR;
+    return d_smtp_state_next_by_event(smtp_state,command);
 }
 
 gboolean d_smtp_state_set_next_state(
@@ -152,6 +153,12 @@ gboolean d_smtp_state_set_next_state(
     return TRUE;
 }
 
+gboolean d_smtp_state_is_data_accepted(
+    SMTP_STATE state)
+{
+    return state == SMTP_STATE_DATA_ACCEPTED || state == SMTP_STATE_DATA_ACCEPTED_EHLO;
+}
+
 static const gchar* smtp_state_to_text(SMTP_STATE state)
 {
     switch(state) {
@@ -170,32 +177,21 @@ static const gchar* smtp_state_to_text(SMTP_STATE state)
     case SMTP_STATE_DATA_ACCEPTED: return "DATA_ACCEPTED";
     case SMTP_STATE_DATA_ENDED: return "DATA_ENDED";
     case SMTP_STATE_QUIT_RECEIVED: return "QUIT_RECEIVED";
-    case SMTP_STATE_QUIT_ACCEPTED: return "QUIT_ACCEPTED";
     case SMTP_STATE_CLOSE: return "CLOSE";
+    case SMTP_STATE_STARTTLS_RECEIVED: return "STARTTLS_RECEIVED";
+    case SMTP_STATE_TLS_HANDSHAKE: return "TLS_HANDSHAKE";
+    case SMTP_STATE_TLS_ESTABLISHED: return "TLS_ESTABLISHED";
+    case SMTP_STATE_RSET_RECEIVED: return "RSET_RECEIVED";
+    case SMTP_STATE_MAIL_RECEIVED_EHLO: return "MAIL_RECEIVED_EHLO";
+    case SMTP_STATE_MAIL_ACCEPTED_EHLO: return "MAIL_ACCEPTED_EHLO";
+    case SMTP_STATE_RCPT_RECEIVED_EHLO: return "RCPT_RECEIVED_EHLO";
+    case SMTP_STATE_RCPT_ACCEPTED_EHLO: return "RCPT_ACCEPTED_EHLO";
+    case SMTP_STATE_DATA_RECEIVED_EHLO: return "DATA_RECEIVED_EHLO";
+    case SMTP_STATE_DATA_ACCEPTED_EHLO: return "DATA_ACCEPTED_EHLO";
+    case SMTP_STATE_DATA_ENDED_EHLO: return "DATA_ENDED_EHLO";
+    case SMTP_STATE_RSET_RECEIVED_EHLO: return "RSET_RECEIVED_EHLO";
     default: return "UNKNOWN";
     }
 }
 
-static void d_smtp_state_init(DSmtpState* smtp_state)
-{
-    smtp_state->state = SMTP_STATE_ERROR;
-}
-
-static void d_smtp_state_class_init(DSmtpStateClass* klass)
-{
-}
-
-/**
- * @brief Create new instance of SMTP FSM.
- */
-DSmtpState* d_smtp_state_new()
-{
-    auto smtp_state = reinterpret_cast<DSmtpState*>(
-        g_object_new(
-            D_TYPE_SMTP_STATE,
-            NULL));
-
-    return smtp_state;
-}
-
 }
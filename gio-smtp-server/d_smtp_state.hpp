@@ -16,7 +16,11 @@
 #ifndef __D__NEW__SMTP_STATE__HPP__
 #define __D__NEW__SMTP_STATE__HPP__
 /**
- * @brief SMTP state little object for processing SMTP FSM.
+ * @brief SMTP FSM value.
+ * @details The state is the plain value embedded into the connection.
+ * Transitions are looked up in the constant [state][event] table, the
+ * table is checked at compile time to have the next state of every
+ * event in every state.
  */
 
 #include <gio/gio.h>
@@ -39,27 +43,76 @@ enum SMTP_STATE
     SMTP_STATE_DATA_ACCEPTED,
     SMTP_STATE_DATA_ENDED,
     SMTP_STATE_QUIT_RECEIVED,
-    SMTP_STATE_QUIT_ACCEPTED,
-    SMTP_STATE_CLOSE
+    SMTP_STATE_CLOSE,
+    /// @brief STARTTLS is accepted, the 220 response is sending.
+    SMTP_STATE_STARTTLS_RECEIVED,
+    /// @brief The TLS handshake is in progress.
+    SMTP_STATE_TLS_HANDSHAKE,
+    /// @brief The TLS is established, client must start over with EHLO.
+    SMTP_STATE_TLS_ESTABLISHED,
+    /// @brief RSET is accepted, the transaction is dropped, the session
+    /// returns to HELO_ACCEPTED.
+    SMTP_STATE_RSET_RECEIVED,
+    /// @brief The transaction states of the session greeted by EHLO, the
+    /// RSET returns to EHLO_ACCEPTED and STARTTLS is accepted again.
+    SMTP_STATE_MAIL_RECEIVED_EHLO,
+    SMTP_STATE_MAIL_ACCEPTED_EHLO,
+    SMTP_STATE_RCPT_RECEIVED_EHLO,
+    SMTP_STATE_RCPT_ACCEPTED_EHLO,
+    SMTP_STATE_DATA_RECEIVED_EHLO,
+    SMTP_STATE_DATA_ACCEPTED_EHLO,
+    SMTP_STATE_DATA_ENDED_EHLO,
+    SMTP_STATE_RSET_RECEIVED_EHLO,
+    NR_SMTP_STATES
 };
 
-extern "C" {
-#define D_TYPE_SMTP_STATE (d_smtp_state_get_type())
+/**
+ * @brief FSM events.
+ * @details The received command is the event with the SMTP_COMMAND value.
+ */
+enum SMTP_EVENT
+{
+    /// @brief The response write is completed.
+    SMTP_EVENT_WRITE_COMPLETE = NR_SMTP_COMMANDS,
+    /// @brief The end of message data marker is received.
+    SMTP_EVENT_DATA_END,
+    /// @brief The TLS handshake is completed.
+    SMTP_EVENT_TLS_ESTABLISHED,
+    NR_SMTP_EVENTS
+};
 
-G_DECLARE_FINAL_TYPE(DSmtpState,d_smtp_state,D,SMTP_STATE,GObject)
+/**
+ * @brief SMTP FSM, zero initialized value is in SMTP_STATE_ERROR.
+ */
+struct DSmtpState
+{
+    SMTP_STATE state;
+};
+
+extern "C" {
 
 /**
  * @brief Get current state.
  * @return Return one of SMTP_STATE enumeration value.
  */
 SMTP_STATE d_smtp_state_get_current_state(
-    DSmtpState* smtp_state);
+    const DSmtpState* smtp_state);
 
 /**
  * @brief @brief Get current state as text string.
  */
 const gchar* d_smtp_state_get_current_state_text(
-    DSmtpState* smtp_state);
+    const DSmtpState* smtp_state);
+
+/**
+ * @brief Switch to the new state by the event.
+ * @details The event not expected in the current state switches
+ * to SMTP_STATE_ERROR.
+ * @return Function returns TRUE if state successfully changed.
+ */
+gboolean d_smtp_state_next_by_event(
+    DSmtpState* smtp_state,
+    guint event);
 
 /**
  * @brief Switch to the new state by the write bytes complete.
@@ -77,7 +130,8 @@ gboolean d_smtp_state_next_state_by_command(
     SMTP_COMMAND command);
 
 /**
- * @brief Switch to the new state by the new state.
+ * @brief Set the state without the transition check.
+ * @details Used to start the session.
  * @return Function returns TRUE if state successfully changed.
  */
 gboolean d_smtp_state_set_next_state(
@@ -85,9 +139,11 @@ gboolean d_smtp_state_set_next_state(
     SMTP_STATE state);
 
 /**
- * @brief Create new instance of SMTP FSM.
+ * @brief Check the message data is being received in the state.
+ * @details The HELO and EHLO sessions have their own DATA_ACCEPTED states.
  */
-DSmtpState* d_smtp_state_new();
+gboolean d_smtp_state_is_data_accepted(
+    SMTP_STATE state);
 
 }
 
@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_tls.hpp"
+
+/// @brief TLS record type of the handshake messages.
+#define TLS_RECORD_HANDSHAKE 0x16
+/// @brief TLS handshake message type of ClientHello.
+#define TLS_HANDSHAKE_CLIENT_HELLO 0x01
+/// @brief RFC 5077 session ticket extension.
+#define TLS_EXTENSION_SESSION_TICKET 0x0023
+/// @brief RFC 8446 pre-shared key extension.
+#define TLS_EXTENSION_PRE_SHARED_KEY 0x0029
+/// @brief The deadline in seconds of the handshake offloaded to the thread.
+#define TLS_HANDSHAKE_DEADLINE 10
+
+extern "C" {
+
+struct _DSmtpTls
+{
+    GObject parent;
+
+    GTlsCertificate* certificate;
+};
+typedef _DSmtpTls DSmtpTls;
+
+G_DEFINE_TYPE(DSmtpTls,d_smtp_tls,G_TYPE_OBJECT)
+
+struct _DSmtpTlsClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The handshake metrics, updated from any thread under the lock.
+ */
+struct DSmtpTlsMetrics
+{
+    gint full;
+    /// @brief The handshakes of the client offering the session resumption.
+    gint resumption_offered;
+    gint failed;
+    gint64 full_time;
+    gint64 resumption_offered_time;
+};
+static DSmtpTlsMetrics smtp_tls_metrics;
+G_LOCK_DEFINE_STATIC(smtp_tls_metrics);
+
+/**
+ * @brief The deadline of the offloaded handshake.
+ */
+struct DSmtpTlsHandshake
+{
+    /// @brief Cancelled by the deadline or by the caller cancellable.
+    GCancellable* cancellable;
+    GCancellable* caller_cancellable;
+    gulong cancelled_id;
+    /// @brief The deadline timer in the main context of the caller.
+    GSource* timer;
+    gint expired;
+};
+
+/// @brief The handshake threads, created on the first offloaded handshake.
+static GThreadPool* smtp_tls_handshake_pool{nullptr};
+/// @brief The maximum number of handshake threads, 0 disables the offload.
+static gint smtp_tls_handshake_threads{2};
+G_LOCK_DEFINE_STATIC(smtp_tls_handshake_pool);
+
+DSmtpTls* d_smtp_tls_get_for_config(
+    DSmtpConfig* config,
+    GError** error)
+{
+    const gchar* certificate_file = d_smtp_config_get_tls_certificate(config);
+    if(!certificate_file || !*certificate_file) {
+        return NULL;
+    }
+    const gchar* key_file = d_smtp_config_get_tls_key(config);
+    if(!key_file || !*key_file) {
+        key_file = certificate_file;
+    }
+    // The context is kept with the configuration instance, so the
+    // reloaded configuration loads the certificate again.
+    G_LOCK_DEFINE_STATIC(smtp_tls_contexts);
+    static GQuark context_quark = g_quark_from_static_string("d-smtp-tls-context");
+    static GQuark error_quark = g_quark_from_static_string("d-smtp-tls-error");
+    G_LOCK(smtp_tls_contexts);
+    auto tls = D_SMTP_TLS(g_object_get_qdata(G_OBJECT(config),context_quark));
+    auto load_error = static_cast<GError*>(g_object_get_qdata(G_OBJECT(config),error_quark));
+    if(!tls && !load_error) {
+        auto certificate = g_tls_certificate_new_from_files(certificate_file,key_file,&load_error);
+        if(certificate) {
+            tls = D_SMTP_TLS(g_object_new(D_TYPE_SMTP_TLS,NULL));
+            tls->certificate = certificate;
+            g_object_set_qdata_full(G_OBJECT(config),context_quark,tls,g_object_unref);
+            g_message("TLS certificate loaded from %s",certificate_file);
+        } else {
+            g_object_set_qdata_full(G_OBJECT(config),error_quark,load_error,
+                reinterpret_cast<GDestroyNotify>(g_error_free));
+        }
+    }
+    if(tls) {
+        g_object_ref(tls);
+    } else if(error) {
+        *error = g_error_copy(load_error);
+    }
+    G_UNLOCK(smtp_tls_contexts);
+    return tls;
+}
+
+GIOStream* d_smtp_tls_server_connection_new(
+    DSmtpTls* tls,
+    GIOStream* base_stream,
+    GError** error)
+{
+    g_return_val_if_fail(D_IS_SMTP_TLS(tls),NULL);
+    auto tls_connection = g_tls_server_connection_new(base_stream,tls->certificate,error);
+    if(!tls_connection) {
+        return NULL;
+    }
+    g_object_set(tls_connection,"authentication-mode",G_TLS_AUTHENTICATION_NONE,NULL);
+    return tls_connection;
+}
+
+void d_smtp_tls_set_handshake_threads(
+    guint max_threads)
+{
+    G_LOCK(smtp_tls_handshake_pool);
+    g_atomic_int_set(&smtp_tls_handshake_threads,max_threads);
+    // The queued handshakes are still run when the offload is disabled.
+    if(smtp_tls_handshake_pool && max_threads > 0) {
+        g_thread_pool_set_max_threads(smtp_tls_handshake_pool,max_threads,NULL);
+    }
+    G_UNLOCK(smtp_tls_handshake_pool);
+}
+
+static void smtp_tls_handshake_free(
+    DSmtpTlsHandshake* handshake)
+{
+    g_source_destroy(handshake->timer);
+    g_source_unref(handshake->timer);
+    if(handshake->caller_cancellable) {
+        g_cancellable_disconnect(handshake->caller_cancellable,handshake->cancelled_id);
+        g_object_unref(handshake->caller_cancellable);
+    }
+    g_object_unref(handshake->cancellable);
+    g_free(handshake);
+}
+
+static void smtp_tls_handshake_cancelled(
+    GCancellable* cancellable,
+    gpointer user_data)
+{
+    g_cancellable_cancel(G_CANCELLABLE(user_data));
+}
+
+static gboolean smtp_tls_handshake_expired(
+    gpointer user_data)
+{
+    auto handshake = static_cast<DSmtpTlsHandshake*>(user_data);
+    g_atomic_int_set(&handshake->expired,TRUE);
+    g_cancellable_cancel(handshake->cancellable);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief Run the blocking handshake in the handshake thread.
+ * @details The task returns the result to the main context of the thread
+ * which started the handshake. The handshake waiting in the queue past
+ * its deadline fails at once.
+ */
+static void d_smtp_tls_handshake_thread(
+    gpointer data,
+    gpointer user_data)
+{
+    auto task = G_TASK(data);
+    auto tls_connection = G_TLS_CONNECTION(g_task_get_source_object(task));
+    auto handshake = static_cast<DSmtpTlsHandshake*>(g_task_get_task_data(task));
+    GError* error{NULL};
+    if(g_tls_connection_handshake(tls_connection,handshake->cancellable,&error)) {
+        g_task_return_boolean(task,TRUE);
+        g_object_unref(task);
+        return;
+    }
+    if(g_atomic_int_get(&handshake->expired) && g_error_matches(error,G_IO_ERROR,G_IO_ERROR_CANCELLED)) {
+        g_clear_error(&error);
+        g_set_error(&error,G_IO_ERROR,G_IO_ERROR_TIMED_OUT,"TLS handshake deadline expired");
+    }
+    g_task_return_error(task,error);
+    g_object_unref(task);
+}
+
+/**
+ * @brief Completion of the handshake run in the worker thread.
+ */
+static void d_smtp_tls_handshake_handle(
+    GObject *source_object,
+	GAsyncResult *res,
+	gpointer user_data)
+{
+    auto task = G_TASK(user_data);
+    GError* error{NULL};
+    if(g_tls_connection_handshake_finish(G_TLS_CONNECTION(source_object),res,&error)) {
+        g_task_return_boolean(task,TRUE);
+    } else {
+        g_task_return_error(task,error);
+    }
+    g_object_unref(task);
+}
+
+void d_smtp_tls_handshake_async(
+    GIOStream* tls_connection,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    auto task = g_task_new(tls_connection,cancellable,callback,user_data);
+    g_task_set_source_tag(task,reinterpret_cast<gpointer>(d_smtp_tls_handshake_async));
+    guint max_threads = g_atomic_int_get(&smtp_tls_handshake_threads);
+    if(max_threads == 0) {
+        g_tls_connection_handshake_async(G_TLS_CONNECTION(tls_connection),G_PRIORITY_DEFAULT,
+            cancellable,d_smtp_tls_handshake_handle,task);
+        return;
+    }
+    // The stalled client holds the handshake thread until the deadline,
+    // the read timeout of the session may be much longer.
+    auto handshake = g_new0(DSmtpTlsHandshake,1);
+    handshake->cancellable = g_cancellable_new();
+    if(cancellable) {
+        handshake->caller_cancellable = G_CANCELLABLE(g_object_ref(cancellable));
+        handshake->cancelled_id = g_cancellable_connect(cancellable,
+            G_CALLBACK(smtp_tls_handshake_cancelled),handshake->cancellable,NULL);
+    }
+    handshake->timer = g_timeout_source_new_seconds(TLS_HANDSHAKE_DEADLINE);
+    g_source_set_callback(handshake->timer,smtp_tls_handshake_expired,handshake,NULL);
+    g_source_attach(handshake->timer,g_main_context_get_thread_default());
+    g_task_set_task_data(task,handshake,reinterpret_cast<GDestroyNotify>(smtp_tls_handshake_free));
+    GError* error{NULL};
+    G_LOCK(smtp_tls_handshake_pool);
+    if(!smtp_tls_handshake_pool) {
+        smtp_tls_handshake_pool = g_thread_pool_new(d_smtp_tls_handshake_thread,NULL,
+            max_threads,FALSE,&error);
+    }
+    // The handshakes above the threads count wait in the pool queue.
+    if(smtp_tls_handshake_pool) {
+        g_thread_pool_push(smtp_tls_handshake_pool,task,&error);
+    }
+    G_UNLOCK(smtp_tls_handshake_pool);
+    if(error) {
+        g_task_return_error(task,error);
+        g_object_unref(task);
+    }
+}
+
+gboolean d_smtp_tls_handshake_finish(
+    GIOStream* tls_connection,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,tls_connection),FALSE);
+    return g_task_propagate_boolean(G_TASK(result),error);
+}
+
+/**
+ * @brief Read the big endian number from the ClientHello.
+ */
+static gboolean client_hello_read(
+    const guint8** p,
+    const guint8* end,
+    guint length,
+    guint* value)
+{
+    if(end - *p < length) {
+        return FALSE;
+    }
+    *value = 0;
+    for(guint index = 0; index < length; index++) {
+        *value = (*value << 8) | *(*p)++;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Skip the vector with length prefix of length bytes.
+ */
+static gboolean client_hello_skip(
+    const guint8** p,
+    const guint8* end,
+    guint length)
+{
+    guint count{0};
+    if(!client_hello_read(p,end,length,&count) || end - *p < count) {
+        return FALSE;
+    }
+    *p += count;
+    return TRUE;
+}
+
+gboolean d_smtp_tls_client_hello_offers_resumption(
+    const guint8* data,
+    gsize size)
+{
+    const guint8* p = data;
+    const guint8* end = data + size;
+    guint value{0};
+    // Record header: type, version and length.
+    if(!client_hello_read(&p,end,1,&value) || value != TLS_RECORD_HANDSHAKE) {
+        return FALSE;
+    }
+    if(!client_hello_read(&p,end,2,&value) || !client_hello_read(&p,end,2,&value)) {
+        return FALSE;
+    }
+    // The ClientHello is expected in the first record.
+    end = MIN(end,p + value);
+    // Handshake header: type and length.
+    if(!client_hello_read(&p,end,1,&value) || value != TLS_HANDSHAKE_CLIENT_HELLO) {
+        return FALSE;
+    }
+    if(!client_hello_read(&p,end,3,&value)) {
+        return FALSE;
+    }
+    // Legacy version and random.
+    if(end - p < 2 + 32) {
+        return FALSE;
+    }
+    p += 2 + 32;
+    // Session id, cipher suites and compression methods.
+    if(!client_hello_skip(&p,end,1) || !client_hello_skip(&p,end,2) || !client_hello_skip(&p,end,1)) {
+        return FALSE;
+    }
+    guint extensions_length{0};
+    if(!client_hello_read(&p,end,2,&extensions_length)) {
+        return FALSE;
+    }
+    end = MIN(end,p + extensions_length);
+    while(p < end) {
+        guint type{0};
+        guint length{0};
+        if(!client_hello_read(&p,end,2,&type) || !client_hello_read(&p,end,2,&length)) {
+            return FALSE;
+        }
+        if(type == TLS_EXTENSION_PRE_SHARED_KEY ||
+           (type == TLS_EXTENSION_SESSION_TICKET && length > 0)) {
+            return TRUE;
+        }
+        if(end - p < length) {
+            return FALSE;
+        }
+        p += length;
+    }
+    return FALSE;
+}
+
+void d_smtp_tls_handshake_completed(
+    gboolean resumption_offered,
+    gint64 duration,
+    gboolean success)
+{
+    G_LOCK(smtp_tls_metrics);
+    if(!success) {
+        smtp_tls_metrics.failed++;
+    } else if(resumption_offered) {
+        smtp_tls_metrics.resumption_offered++;
+        smtp_tls_metrics.resumption_offered_time += duration;
+    } else {
+        smtp_tls_metrics.full++;
+        smtp_tls_metrics.full_time += duration;
+    }
+    G_UNLOCK(smtp_tls_metrics);
+}
+
+void d_smtp_tls_log_metrics()
+{
+    G_LOCK(smtp_tls_metrics);
+    DSmtpTlsMetrics metrics = smtp_tls_metrics;
+    G_UNLOCK(smtp_tls_metrics);
+    g_message("TLS handshakes: full %d (mean %.1f us), resumption offered %d (mean %.1f us), failed %d",
+        metrics.full,metrics.full ? double(metrics.full_time) / metrics.full : 0.0,
+        metrics.resumption_offered,metrics.resumption_offered ?
+            double(metrics.resumption_offered_time) / metrics.resumption_offered : 0.0,
+        metrics.failed);
+}
+
+static void d_smtp_tls_init(DSmtpTls* tls)
+{
+}
+
+static void d_smtp_tls_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_TLS(object));
+    auto tls = D_SMTP_TLS(object);
+    g_clear_object(&tls->certificate);
+    G_OBJECT_CLASS(d_smtp_tls_parent_class)->finalize(object);
+}
+
+static void d_smtp_tls_class_init(DSmtpTlsClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_tls_finalize;
+}
+
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_TLS__HPP__
+#define __D__NEW__SMTP_TLS__HPP__
+/**
+ * @brief SMTP server TLS context object.
+ * @details Holds the server certificate shared by the connections of all
+ * workers and collects the handshake metrics.
+ *
+ * Session resumption is provided by the GIO TLS backend: the session
+ * cache and the session ticket key of the gnutls backend are process wide,
+ * so a ticket issued by one worker is accepted by every other worker, and
+ * the ticket encryption keys are rotated by gnutls.
+ *
+ * The blocking handshakes are run by the bounded pool of handshake
+ * threads, so a burst of the new TLS clients doesn't stall the workers
+ * serving the established sessions. The handshake result is returned
+ * to the main context of the worker which started the handshake. The
+ * offloaded handshake has its own short deadline, so the stalled clients
+ * hold the handshake threads for seconds, not for the read timeout.
+ *
+ * The handshake is counted as resumption offered when the ClientHello
+ * carries a session ticket or a pre-shared key. The GIO backend doesn't
+ * tell whether the server accepted it, so the handshake time is collected
+ * separately for the offered and the other handshakes: the offered mean
+ * close to the full one shows the tickets rejected after the key rotation
+ * or the restart.
+ */
+
+#include <gio/gio.h>
+#include "d_smtp_config.hpp"
+
+extern "C" {
+#define D_TYPE_SMTP_TLS (d_smtp_tls_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpTls,d_smtp_tls,D,SMTP_TLS,GObject)
+
+/**
+ * @brief Get the TLS context for the configuration.
+ * @details The certificate files are loaded once per configuration
+ * instance, all workers sharing the configuration get the same context.
+ * Function can be called from any thread.
+ * @param [in] config The server configuration.
+ * @param [out] error The location for error or NULL.
+ * @return The new reference to TLS context or NULL. The error isn't
+ * set if the TLS isn't configured.
+ */
+DSmtpTls* d_smtp_tls_get_for_config(
+    DSmtpConfig* config,
+    GError** error);
+
+/**
+ * @brief Create the server side TLS connection.
+ * @param [in] tls TLS context.
+ * @param [in] base_stream The plain connection stream.
+ * @param [out] error The location for error or NULL.
+ */
+GIOStream* d_smtp_tls_server_connection_new(
+    DSmtpTls* tls,
+    GIOStream* base_stream,
+    GError** error);
+
+/**
+ * @brief Set the maximum number of handshake threads.
+ * @details Function can be called from any thread.
+ * @param [in] max_threads The threads count, 0 - handshakes are run
+ * asynchronously in the calling thread.
+ */
+void d_smtp_tls_set_handshake_threads(
+    guint max_threads);
+
+/**
+ * @brief Start the server handshake in the handshake thread.
+ * @details The callback is called in the thread default main context
+ * of the caller.
+ * @param [in] tls_connection The connection created by d_smtp_tls_server_connection_new.
+ * @param [in] cancellable The cancellable object or NULL.
+ * @param [in] callback The completion callback.
+ * @param [in] user_data The callback user data.
+ */
+void d_smtp_tls_handshake_async(
+    GIOStream* tls_connection,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the handshake started by d_smtp_tls_handshake_async.
+ * @return Return TRUE if the handshake is completed successfully.
+ */
+gboolean d_smtp_tls_handshake_finish(
+    GIOStream* tls_connection,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Test if ClientHello offers the session resumption.
+ * @param [in] data The beginning of the client TLS stream.
+ * @param [in] size The number of bytes available.
+ * @return Return TRUE if the session ticket or pre-shared key is offered.
+ */
+gboolean d_smtp_tls_client_hello_offers_resumption(
+    const guint8* data,
+    gsize size);
+
+/**
+ * @brief Account the completed handshake.
+ * @param [in] resumption_offered The client offered the session resumption.
+ * @param [in] duration The handshake duration in microseconds.
+ * @param [in] success The handshake is completed successfully.
+ */
+void d_smtp_tls_handshake_completed(
+    gboolean resumption_offered,
+    gint64 duration,
+    gboolean success);
+
+/**
+ * @brief Write the handshake metrics to the log.
+ */
+void d_smtp_tls_log_metrics();
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_TLS__HPP__
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_trace.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// @brief The ring file magic "DSTR".
+#define TRACE_RING_MAGIC 0x52545344u
+#define TRACE_RING_VERSION 1u
+
+extern "C" {
+
+struct DSmtpTraceRingHeader
+{
+    guint32 magic;
+    guint32 version;
+    guint32 record_size;
+    /// @brief The number of records, the power of 2.
+    guint32 capacity;
+    /// @brief The number of records ever taken, accessed atomically.
+    gint head;
+    guint32 reserved[11];
+};
+
+G_STATIC_ASSERT(sizeof(DSmtpTraceRingHeader) == 64);
+
+struct _DSmtpTraceRing
+{
+    GObject parent;
+
+    gchar* path;
+    guint8* map;
+    gsize map_size;
+};
+typedef _DSmtpTraceRing DSmtpTraceRing;
+
+G_DEFINE_TYPE(DSmtpTraceRing,d_smtp_trace_ring,G_TYPE_OBJECT)
+
+struct _DSmtpTraceRingClass
+{
+    GObjectClass parent;
+};
+
+G_LOCK_DEFINE_STATIC(smtp_trace_ring_default);
+static DSmtpTraceRing* smtp_trace_ring_default{nullptr};
+
+/**
+ * @brief Add the time since the start to the phase total.
+ */
+static void trace_add(
+    guint32* total,
+    gint64 start,
+    gint64 now)
+{
+    gint64 sum = gint64(*total) + (now - start);
+    *total = guint32(CLAMP(sum,0,gint64(G_MAXUINT32)));
+}
+
+void d_smtp_trace_init(
+    DSmtpTrace* trace)
+{
+    memset(trace,0,sizeof(*trace));
+    trace->ring = d_smtp_trace_ring_get_default();
+    if(trace->ring) {
+        trace->created = g_get_monotonic_time();
+        trace->record.accept = trace->created;
+    }
+}
+
+void d_smtp_trace_clear(
+    DSmtpTrace* trace)
+{
+    if(trace->ring) {
+        d_smtp_trace_mark(trace,SMTP_TRACE_EVENT_CLOSE);
+    }
+}
+
+void d_smtp_trace_set_accept_time(
+    DSmtpTrace* trace,
+    gint64 accept_time)
+{
+    if(trace->ring) {
+        trace->record.accept = accept_time;
+    }
+}
+
+void d_smtp_trace_mark(
+    DSmtpTrace* trace,
+    SMTP_TRACE_EVENT event)
+{
+    if(!trace->ring) {
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    DSmtpTraceRecord* record = &trace->record;
+    switch(event) {
+    case SMTP_TRACE_EVENT_COMMAND_READ:
+        if(record->commands < G_MAXUINT16) record->commands++;
+        if(trace->response_written) {
+            trace_add(&record->command_wait,trace->response_written,now);
+            trace->response_written = 0;
+        }
+        trace->command_read = now;
+        break;
+    case SMTP_TRACE_EVENT_RESPONSE_WRITE:
+        if(trace->data_end) {
+            trace_add(&record->spool,trace->data_end,now);
+            trace->data_end = 0;
+        } else if(trace->command_read) {
+            trace_add(&record->command,trace->command_read,now);
+        }
+        trace->command_read = 0;
+        trace->response_write = now;
+        break;
+    case SMTP_TRACE_EVENT_RESPONSE_WRITTEN:
+        if(trace->response_write) {
+            trace_add(&record->write,trace->response_write,now);
+            trace->response_write = 0;
+        }
+        if(!trace->greeted) {
+            trace->greeted = TRUE;
+            trace_add(&record->greeting,trace->created,now);
+        }
+        trace->response_written = now;
+        break;
+    case SMTP_TRACE_EVENT_DATA_START:
+        // The wait after 354 is the message upload, not the command wait.
+        trace->response_written = 0;
+        trace->data_start = now;
+        break;
+    case SMTP_TRACE_EVENT_DATA_END:
+        if(trace->data_start) {
+            trace_add(&record->data,trace->data_start,now);
+            trace->data_start = 0;
+        }
+        if(record->messages < G_MAXUINT16) record->messages++;
+        trace->data_end = now;
+        break;
+    case SMTP_TRACE_EVENT_TLS_START:
+        // The ClientHello wait is the client and network time.
+        if(trace->response_written) {
+            trace_add(&record->command_wait,trace->response_written,now);
+            trace->response_written = 0;
+        }
+        trace->tls_start = now;
+        break;
+    case SMTP_TRACE_EVENT_TLS_END:
+        if(trace->tls_start) {
+            trace_add(&record->tls,trace->tls_start,now);
+            trace->tls_start = 0;
+        }
+        // The client sends EHLO again after the handshake.
+        trace->response_written = now;
+        break;
+    case SMTP_TRACE_EVENT_CLOSE:
+        trace_add(&record->dispatch,record->accept,trace->created);
+        trace_add(&record->session,record->accept,now);
+        d_smtp_trace_ring_append(trace->ring,record);
+        // The session is written once.
+        g_clear_object(&trace->ring);
+        break;
+    default:
+        break;
+    }
+}
+
+static DSmtpTraceRingHeader* trace_ring_header(DSmtpTraceRing* ring)
+{
+    return reinterpret_cast<DSmtpTraceRingHeader*>(ring->map);
+}
+
+void d_smtp_trace_ring_append(
+    DSmtpTraceRing* ring,
+    const DSmtpTraceRecord* record)
+{
+    g_return_if_fail(D_IS_SMTP_TRACE_RING(ring));
+    DSmtpTraceRingHeader* header = trace_ring_header(ring);
+    guint32 sequence = guint32(g_atomic_int_add(&header->head,1));
+    auto slot = reinterpret_cast<DSmtpTraceRecord*>(ring->map + sizeof(DSmtpTraceRingHeader)) +
+        (sequence & (header->capacity - 1));
+    // The reader skips the slot while the sequence doesn't match.
+    g_atomic_int_set(reinterpret_cast<gint*>(&slot->sequence),0);
+    DSmtpTraceRecord copy = *record;
+    copy.sequence = 0;
+    memcpy(slot,&copy,sizeof(copy));
+    g_atomic_int_set(reinterpret_cast<gint*>(&slot->sequence),gint(sequence + 1));
+}
+
+void d_smtp_trace_ring_set_default(
+    DSmtpTraceRing* ring)
+{
+    G_LOCK(smtp_trace_ring_default);
+    g_set_object(&smtp_trace_ring_default,ring);
+    G_UNLOCK(smtp_trace_ring_default);
+}
+
+DSmtpTraceRing* d_smtp_trace_ring_get_default()
+{
+    G_LOCK(smtp_trace_ring_default);
+    DSmtpTraceRing* ring = smtp_trace_ring_default ?
+        D_SMTP_TRACE_RING(g_object_ref(smtp_trace_ring_default)) : NULL;
+    G_UNLOCK(smtp_trace_ring_default);
+    return ring;
+}
+
+gint d_smtp_trace_ring_read(
+    const gchar* path,
+    DSmtpTraceReadFunc read_func,
+    gpointer user_data,
+    GError** error)
+{
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path,FALSE,error);
+    if(!file) {
+        return -1;
+    }
+    gsize size = g_mapped_file_get_length(file);
+    auto data = reinterpret_cast<const guint8*>(g_mapped_file_get_contents(file));
+    DSmtpTraceRingHeader header;
+    if(size < sizeof(header)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"%s isn't the trace ring",path);
+        return -1;
+    }
+    memcpy(&header,data,sizeof(header));
+    if(header.magic != TRACE_RING_MAGIC || header.version != TRACE_RING_VERSION ||
+       header.record_size != sizeof(DSmtpTraceRecord) || header.capacity == 0 ||
+       size < sizeof(header) + gsize(header.capacity) * sizeof(DSmtpTraceRecord)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_DATA,"%s isn't the trace ring",path);
+        return -1;
+    }
+    auto records = reinterpret_cast<const DSmtpTraceRecord*>(data + sizeof(header));
+    // The oldest record is overwritten first, start right after the head.
+    guint32 head = guint32(header.head);
+    guint32 first = head > header.capacity ? head - header.capacity : 0;
+    gint count{0};
+    for(guint32 sequence = first; sequence != head; sequence++) {
+        const DSmtpTraceRecord* record = &records[sequence & (header.capacity - 1)];
+        if(record->sequence == sequence + 1) {
+            read_func(record,user_data);
+            count++;
+        }
+    }
+    return count;
+}
+
+static void d_smtp_trace_ring_init(DSmtpTraceRing* ring)
+{
+}
+
+static void d_smtp_trace_ring_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_TRACE_RING(object));
+    auto ring = D_SMTP_TRACE_RING(object);
+    if(ring->map) {
+        munmap(ring->map,ring->map_size);
+    }
+    g_free(ring->path);
+    G_OBJECT_CLASS(d_smtp_trace_ring_parent_class)->finalize(object);
+}
+
+static void d_smtp_trace_ring_class_init(DSmtpTraceRingClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_trace_ring_finalize;
+}
+
+/**
+ * @brief Create new instance of trace ring.
+ */
+DSmtpTraceRing* d_smtp_trace_ring_new(
+    const gchar* path,
+    guint capacity,
+    GError** error)
+{
+    guint32 ring_capacity = 1;
+    while(ring_capacity < capacity && ring_capacity < (1u << 30)) {
+        ring_capacity <<= 1;
+    }
+    gsize size = sizeof(DSmtpTraceRingHeader) + gsize(ring_capacity) * sizeof(DSmtpTraceRecord);
+    gint fd = open(path,O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,0600);
+    if(fd < 0 || ftruncate(fd,size) != 0) {
+        gint saved_errno = errno;
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+            "trace ring %s: %s",path,g_strerror(saved_errno));
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    gint saved_errno = errno;
+    // The mapping keeps the file.
+    close(fd);
+    if(map == MAP_FAILED) {
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(saved_errno),
+            "trace ring %s mmap: %s",path,g_strerror(saved_errno));
+        return NULL;
+    }
+
+    auto ring = reinterpret_cast<DSmtpTraceRing*>(
+        g_object_new(
+            D_TYPE_SMTP_TRACE_RING,
+            NULL));
+
+    ring->path = g_strdup(path);
+    ring->map = static_cast<guint8*>(map);
+    ring->map_size = size;
+    DSmtpTraceRingHeader* header = trace_ring_header(ring);
+    header->magic = TRACE_RING_MAGIC;
+    header->version = TRACE_RING_VERSION;
+    header->record_size = sizeof(DSmtpTraceRecord);
+    header->capacity = ring_capacity;
+
+    return ring;
+}
+
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_TRACE__HPP__
+#define __D__NEW__SMTP_TRACE__HPP__
+/**
+ * @brief Per session latency trace.
+ * @details The trace is the plain value embedded into the connection. The
+ * connection marks the session events, the trace adds the time between
+ * them to the phase totals and writes the one fixed size record to the
+ * trace ring at the session close:
+ * @code
+ * dispatch      accept to the connection creation in the worker
+ * greeting      connection creation to the greeting write completion
+ * command_wait  response written to the next command read, client and network
+ * command       command read to the response write start, parsing
+ * write         response write start to the write completion
+ * data          354 written to the end of data, message upload
+ * spool         end of data to the response write start, message store
+ * tls           TLS handshake
+ * session       accept to the close
+ * @endcode
+ * The trace ring is the memory mapped file of records, the writers from
+ * all workers take the slots by the atomic counter. The trace is disabled
+ * and costs one test per event if the default ring isn't set.
+ */
+
+#include <gio/gio.h>
+
+enum SMTP_TRACE_EVENT
+{
+    SMTP_TRACE_EVENT_COMMAND_READ,
+    SMTP_TRACE_EVENT_RESPONSE_WRITE,
+    SMTP_TRACE_EVENT_RESPONSE_WRITTEN,
+    SMTP_TRACE_EVENT_DATA_START,
+    SMTP_TRACE_EVENT_DATA_END,
+    SMTP_TRACE_EVENT_TLS_START,
+    SMTP_TRACE_EVENT_TLS_END,
+    SMTP_TRACE_EVENT_CLOSE,
+    NR_SMTP_TRACE_EVENTS
+};
+
+/**
+ * @brief The session record of the trace ring.
+ * @details The phase times are microseconds summed over the session.
+ */
+struct DSmtpTraceRecord
+{
+    /// @brief The ring sequence plus one, written last, 0 while writing.
+    guint32 sequence;
+    guint16 commands;
+    guint16 messages;
+    /// @brief Monotonic time of the accept.
+    gint64 accept;
+    guint32 dispatch;
+    guint32 greeting;
+    guint32 command_wait;
+    guint32 command;
+    guint32 write;
+    guint32 data;
+    guint32 spool;
+    guint32 tls;
+    guint32 session;
+    guint32 reserved[3];
+};
+
+G_STATIC_ASSERT(sizeof(DSmtpTraceRecord) == 64);
+
+extern "C" {
+#define D_TYPE_SMTP_TRACE_RING (d_smtp_trace_ring_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpTraceRing,d_smtp_trace_ring,D,SMTP_TRACE_RING,GObject)
+}
+
+/**
+ * @brief The session trace, zero initialized value is disabled.
+ */
+struct DSmtpTrace
+{
+    DSmtpTraceRing* ring;
+    DSmtpTraceRecord record;
+    gint64 created;
+    /// @brief The start of the running phases, 0 if isn't running.
+    gint64 command_read;
+    gint64 response_write;
+    gint64 response_written;
+    gint64 data_start;
+    gint64 data_end;
+    gint64 tls_start;
+    gboolean greeted;
+};
+
+/**
+ * @brief Called for every record of the ring read.
+ */
+typedef void (*DSmtpTraceReadFunc)(
+    const DSmtpTraceRecord* record,
+    gpointer user_data);
+
+extern "C" {
+
+/**
+ * @brief Start the session trace if the default ring is set.
+ */
+void d_smtp_trace_init(
+    DSmtpTrace* trace);
+
+/**
+ * @brief Write the record if the session isn't closed and drop the ring.
+ */
+void d_smtp_trace_clear(
+    DSmtpTrace* trace);
+
+/**
+ * @brief Set the accept time, the connection creation time by default.
+ */
+void d_smtp_trace_set_accept_time(
+    DSmtpTrace* trace,
+    gint64 accept_time);
+
+/**
+ * @brief Mark the session event at the current monotonic time.
+ * @details The close event writes the record to the ring.
+ */
+void d_smtp_trace_mark(
+    DSmtpTrace* trace,
+    SMTP_TRACE_EVENT event);
+
+/**
+ * @brief Append the record to the ring, function can be called from any thread.
+ */
+void d_smtp_trace_ring_append(
+    DSmtpTraceRing* ring,
+    const DSmtpTraceRecord* record);
+
+/**
+ * @brief Set the ring used by the new connections.
+ * @param [in] ring The ring or NULL, the tracing is disabled.
+ */
+void d_smtp_trace_ring_set_default(
+    DSmtpTraceRing* ring);
+
+/**
+ * @brief Get the ring used by the new connections.
+ * @return The ring or NULL, caller owns the reference.
+ */
+DSmtpTraceRing* d_smtp_trace_ring_get_default();
+
+/**
+ * @brief Read the complete records of the ring file in the write order.
+ * @return The number of records or -1 in case of failure.
+ */
+gint d_smtp_trace_ring_read(
+    const gchar* path,
+    DSmtpTraceReadFunc read_func,
+    gpointer user_data,
+    GError** error);
+
+/**
+ * @brief Create new instance of trace ring.
+ * @details The ring file is created again, the old records are lost.
+ * @param [in] path The ring file path.
+ * @param [in] capacity The number of records, rounded up to the power of 2.
+ * @return The ring or NULL in case of failure.
+ */
+DSmtpTraceRing* d_smtp_trace_ring_new(
+    const gchar* path,
+    guint capacity,
+    GError** error);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_TRACE__HPP__
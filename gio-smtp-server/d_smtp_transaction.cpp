@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_transaction.hpp"
+
+extern "C" {
+
+void d_smtp_transaction_init(
+    DSmtpTransaction* transaction)
+{
+    transaction->reverse_path = g_string_new(NULL);
+    transaction->recipients = g_ptr_array_new_with_free_func(g_free);
+    transaction->blocks = g_ptr_array_new_with_free_func(reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    transaction->deflate = nullptr;
+    transaction->deflated = 0;
+    transaction->spill = nullptr;
+    transaction->prepended = 0;
+    transaction->max_header_size = G_MAXSIZE;
+    transaction->max_message_size = G_MAXSIZE;
+    transaction->too_large = FALSE;
+    transaction->failed = FALSE;
+    transaction->messages_count = 0;
+    d_smtp_message_parser_init(&transaction->message);
+}
+
+void d_smtp_transaction_clear(
+    DSmtpTransaction* transaction)
+{
+    if(transaction->reverse_path) {
+        g_string_free(transaction->reverse_path,TRUE);
+        transaction->reverse_path = nullptr;
+    }
+    g_clear_pointer(&transaction->recipients,g_ptr_array_unref);
+    g_clear_pointer(&transaction->blocks,g_ptr_array_unref);
+    g_clear_pointer(&transaction->deflate,d_smtp_deflate_free);
+    g_clear_pointer(&transaction->spill,d_smtp_spool_spill_free);
+    d_smtp_message_parser_clear(&transaction->message);
+}
+
+void d_smtp_transaction_reset(
+    DSmtpTransaction* transaction)
+{
+    // Truncate and set size keep the string and array buffers allocated.
+    g_string_truncate(transaction->reverse_path,0);
+    g_ptr_array_set_size(transaction->recipients,0);
+    g_ptr_array_set_size(transaction->blocks,0);
+    g_clear_pointer(&transaction->deflate,d_smtp_deflate_free);
+    transaction->deflated = 0;
+    g_clear_pointer(&transaction->spill,d_smtp_spool_spill_free);
+    transaction->prepended = 0;
+    transaction->too_large = FALSE;
+    transaction->failed = FALSE;
+    d_smtp_message_parser_reset(&transaction->message,transaction->max_header_size);
+}
+
+void d_smtp_transaction_begin(
+    DSmtpTransaction* transaction,
+    const gchar* reverse_path)
+{
+    d_smtp_transaction_reset(transaction);
+    g_string_assign(transaction->reverse_path,reverse_path ? reverse_path : "");
+}
+
+void d_smtp_transaction_add_recipient(
+    DSmtpTransaction* transaction,
+    const gchar* forward_path)
+{
+    g_ptr_array_add(transaction->recipients,g_strdup(forward_path ? forward_path : ""));
+}
+
+void d_smtp_transaction_set_max_header_size(
+    DSmtpTransaction* transaction,
+    gsize max_header_size)
+{
+    // The message in progress keeps its limit.
+    transaction->max_header_size = max_header_size;
+}
+
+void d_smtp_transaction_set_max_message_size(
+    DSmtpTransaction* transaction,
+    gsize max_message_size)
+{
+    transaction->max_message_size = max_message_size;
+}
+
+gboolean d_smtp_transaction_is_discarding(
+    const DSmtpTransaction* transaction)
+{
+    return transaction->message.header_too_large || transaction->too_large || transaction->failed;
+}
+
+/**
+ * @brief Drop the kept content of the rejected message.
+ */
+static void smtp_transaction_discard(
+    DSmtpTransaction* transaction)
+{
+    g_ptr_array_set_size(transaction->blocks,0);
+    g_clear_pointer(&transaction->deflate,d_smtp_deflate_free);
+    g_clear_pointer(&transaction->spill,d_smtp_spool_spill_free);
+}
+
+/**
+ * @brief Reject the message which body can't be kept.
+ */
+static void smtp_transaction_fail(
+    DSmtpTransaction* transaction,
+    GError* error)
+{
+    g_warning("message body isn't kept: %d %s",error->code,error->message);
+    g_error_free(error);
+    transaction->failed = TRUE;
+    smtp_transaction_discard(transaction);
+}
+
+/**
+ * @brief Write the [begin,end) range of the blocks to the spill file.
+ */
+static gboolean smtp_transaction_spill_range(
+    DSmtpSpoolSpill* spill,
+    GPtrArray* blocks,
+    gsize begin,
+    gsize end,
+    GError** error)
+{
+    gsize offset{0};
+    for(guint index = 0; index < blocks->len && offset < end; index++) {
+        gsize size{0};
+        auto data = static_cast<const gchar*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(blocks,index)),&size));
+        gsize from = MAX(begin,offset);
+        gsize to = MIN(end,offset + size);
+        if(from < to && !d_smtp_spool_spill_write(spill,data + (from - offset),to - from,error)) {
+            return FALSE;
+        }
+        offset += size;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Move the body from the memory to the spool spill file.
+ * @details The compressed body is spilled by its compressed blocks and
+ * stays compressed, the plain body blocks are dropped and only the header
+ * is kept. Without the spool the message isn't stored and the body stays
+ * in the memory up to the message size limit.
+ */
+static void smtp_transaction_spill(
+    DSmtpTransaction* transaction)
+{
+    g_autoptr(DSmtpSpool) spool = d_smtp_spool_get_default();
+    if(!spool) {
+        return;
+    }
+    DSmtpMessageParser* parser = &transaction->message;
+    GError* error{NULL};
+    transaction->spill = d_smtp_spool_spill_new(spool,transaction->deflate != nullptr,&error);
+    gboolean written = transaction->spill != nullptr;
+    if(written && transaction->deflate) {
+        g_autoptr(GPtrArray) blocks = d_smtp_deflate_take_blocks(transaction->deflate);
+        written = smtp_transaction_spill_range(transaction->spill,blocks,0,G_MAXSIZE,&error);
+    } else if(written) {
+        written = smtp_transaction_spill_range(transaction->spill,transaction->blocks,
+            parser->header_size,parser->size,&error);
+    }
+    if(!written) {
+        smtp_transaction_fail(transaction,error);
+        return;
+    }
+    // The block with the header end is cut by the header size.
+    GPtrArray* blocks = transaction->blocks;
+    guint count{0};
+    for(gsize offset = 0; count < blocks->len && offset < parser->header_size; count++) {
+        auto bytes = static_cast<GBytes*>(g_ptr_array_index(blocks,count));
+        gsize size = g_bytes_get_size(bytes);
+        if(offset + size > parser->header_size) {
+            g_ptr_array_index(blocks,count) = g_bytes_new_from_bytes(bytes,0,parser->header_size - offset);
+            g_bytes_unref(bytes);
+        }
+        offset += size;
+    }
+    g_ptr_array_set_size(blocks,count);
+}
+
+/**
+ * @brief Write the body bytes to the spill file.
+ */
+static void smtp_transaction_spill_write(
+    DSmtpTransaction* transaction,
+    const gchar* data,
+    gsize size)
+{
+    GError* error{NULL};
+    gboolean written{FALSE};
+    if(transaction->deflate) {
+        d_smtp_deflate_update(transaction->deflate,data,size);
+        g_autoptr(GPtrArray) blocks = d_smtp_deflate_take_blocks(transaction->deflate);
+        written = smtp_transaction_spill_range(transaction->spill,blocks,0,G_MAXSIZE,&error);
+    } else {
+        written = d_smtp_spool_spill_write(transaction->spill,data,size,&error);
+    }
+    if(!written) {
+        smtp_transaction_fail(transaction,error);
+    }
+}
+
+/**
+ * @brief Write the end of the compressed stream to the spill file.
+ */
+static void smtp_transaction_spill_finish(
+    DSmtpTransaction* transaction)
+{
+    if(!transaction->deflate) {
+        return;
+    }
+    GError* error{NULL};
+    g_autoptr(GPtrArray) blocks = d_smtp_deflate_finish(transaction->deflate);
+    if(!blocks) {
+        g_set_error(&error,G_IO_ERROR,G_IO_ERROR_FAILED,"body compression failed");
+        smtp_transaction_fail(transaction,error);
+        return;
+    }
+    if(!smtp_transaction_spill_range(transaction->spill,blocks,0,G_MAXSIZE,&error)) {
+        smtp_transaction_fail(transaction,error);
+        return;
+    }
+    g_clear_pointer(&transaction->deflate,d_smtp_deflate_free);
+}
+
+/**
+ * @brief Compress the body bytes received since the last call.
+ * @details The blocks are only the received content here, the fields
+ * are prepended after the end of data.
+ */
+static void smtp_transaction_deflate(
+    DSmtpTransaction* transaction)
+{
+    DSmtpMessageParser* parser = &transaction->message;
+    if(!d_smtp_message_parser_body_started(parser)) {
+        return;
+    }
+    gsize begin = MAX(transaction->deflated,parser->header_size);
+    gsize end = parser->size;
+    if(begin >= end) {
+        return;
+    }
+    // The new bytes are at the tail of the blocks.
+    guint index = transaction->blocks->len;
+    gsize offset = parser->size;
+    while(index > 0 && offset > begin) {
+        offset -= g_bytes_get_size(static_cast<GBytes*>(g_ptr_array_index(transaction->blocks,--index)));
+    }
+    for(; index < transaction->blocks->len && offset < end; index++) {
+        gsize size{0};
+        auto data = static_cast<const gchar*>(
+            g_bytes_get_data(static_cast<GBytes*>(g_ptr_array_index(transaction->blocks,index)),&size));
+        gsize from = MAX(begin,offset);
+        gsize to = MIN(end,offset + size);
+        if(from < to) {
+            d_smtp_deflate_update(transaction->deflate,data + (from - offset),to - from);
+        }
+        offset += size;
+    }
+    transaction->deflated = end;
+}
+
+gboolean d_smtp_transaction_add_data(
+    DSmtpTransaction* transaction,
+    GBytes* bytes,
+    gsize* consumed)
+{
+    DSmtpMessageParser* parser = &transaction->message;
+    if(parser->size == 0 && !transaction->deflate) {
+        g_autoptr(DSmtpCompressor) compressor = d_smtp_compressor_get_default();
+        if(compressor) {
+            transaction->deflate = d_smtp_deflate_new(compressor);
+        }
+    }
+    gsize size{0};
+    auto data = static_cast<const gchar*>(g_bytes_get_data(bytes,&size));
+    gboolean found = d_smtp_message_parser_feed(parser,data,size,consumed);
+    // The limits are checked as the data streams in, the rest of the
+    // rejected message is only searched for the end of data.
+    if(d_smtp_transaction_is_discarding(transaction)) {
+        return found;
+    }
+    if(parser->header_too_large || parser->size > transaction->max_message_size) {
+        transaction->too_large = !parser->header_too_large;
+        smtp_transaction_discard(transaction);
+        return found;
+    }
+    GArray* spans = parser->spans;
+    if(transaction->spill) {
+        for(guint index = 0; index < spans->len && transaction->spill; index++) {
+            const DSmtpMessageSpan& span = g_array_index(spans,DSmtpMessageSpan,index);
+            smtp_transaction_spill_write(transaction,data + span.offset,span.length);
+        }
+    } else {
+        // The content spans share the received block, the data isn't copied.
+        for(guint index = 0; index < spans->len; index++) {
+            const DSmtpMessageSpan& span = g_array_index(spans,DSmtpMessageSpan,index);
+            if(span.length == size) {
+                g_ptr_array_add(transaction->blocks,g_bytes_ref(bytes));
+            } else {
+                g_ptr_array_add(transaction->blocks,g_bytes_new_from_bytes(bytes,span.offset,span.length));
+            }
+        }
+        if(transaction->deflate) {
+            smtp_transaction_deflate(transaction);
+        }
+        if(d_smtp_message_parser_body_started(parser) &&
+           parser->size > parser->header_size + SMTP_TRANSACTION_MAX_MEMORY) {
+            smtp_transaction_spill(transaction);
+        }
+    }
+    if(found && transaction->spill) {
+        smtp_transaction_spill_finish(transaction);
+    }
+    return found;
+}
+
+void d_smtp_transaction_prepend(
+    DSmtpTransaction* transaction,
+    GBytes* bytes)
+{
+    transaction->prepended += g_bytes_get_size(bytes);
+    g_ptr_array_insert(transaction->blocks,0,bytes);
+}
+
+DSmtpSpoolMessage* d_smtp_transaction_complete(
+    DSmtpTransaction* transaction)
+{
+    DSmtpMessageParser* parser = &transaction->message;
+    transaction->messages_count++;
+    g_debug("message %u <%s> from <%s> to %u recipients, %" G_GSIZE_FORMAT " bytes in %u blocks",
+        transaction->messages_count,parser->message_id->str,transaction->reverse_path->str,
+        transaction->recipients->len,parser->size,transaction->blocks->len);
+
+    auto message = g_new0(DSmtpSpoolMessage,1);
+    message->reverse_path = g_strdup(transaction->reverse_path->str);
+    message->recipients = g_ptr_array_new_full(transaction->recipients->len,g_free);
+    for(guint index = 0; index < transaction->recipients->len; index++) {
+        g_ptr_array_add(message->recipients,
+            g_strdup(static_cast<const gchar*>(g_ptr_array_index(transaction->recipients,index))));
+    }
+    // The blocks are passed by reference, the received data isn't copied.
+    message->blocks = g_ptr_array_new_full(transaction->blocks->len,
+        reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    for(guint index = 0; index < transaction->blocks->len; index++) {
+        auto bytes = static_cast<GBytes*>(g_ptr_array_index(transaction->blocks,index));
+        g_ptr_array_add(message->blocks,g_bytes_ref(bytes));
+    }
+    // The prepended fields are in the blocks, but not counted by the parser.
+    message->size = transaction->prepended + parser->size;
+    message->header_size = transaction->prepended + MIN(parser->header_size,parser->size);
+    message->body_digest = g_strdup(g_checksum_get_string(parser->body_checksum));
+    // The whole body is compressed by the last data block.
+    if(transaction->spill) {
+        message->body_spill = g_steal_pointer(&transaction->spill);
+    } else if(transaction->deflate) {
+        message->body_blocks = d_smtp_deflate_finish(transaction->deflate);
+    }
+
+    d_smtp_transaction_reset(transaction);
+    return message;
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_TRANSACTION__HPP__
+#define __D__NEW__SMTP_TRANSACTION__HPP__
+/**
+ * @brief SMTP mail transaction.
+ * @details The transaction is the plain value embedded into the connection.
+ * It lives for the whole session and is reset between the messages, the
+ * reset keeps the allocated storage so the next MAIL doesn't allocate again.
+ * The body bigger than SMTP_TRANSACTION_MAX_MEMORY is written to the spool
+ * spill file as it arrives, only the header stays in the memory.
+ */
+
+#include <gio/gio.h>
+#include "d_smtp_compress.hpp"
+#include "d_smtp_message.hpp"
+#include "d_smtp_spool.hpp"
+
+/// @brief The body size kept in the memory until the spill to the spool.
+#define SMTP_TRANSACTION_MAX_MEMORY (1024 * 1024)
+
+struct DSmtpTransaction
+{
+    /// @brief The MAIL FROM path.
+    GString* reverse_path;
+    /// @brief The RCPT TO paths, array of gchar*.
+    GPtrArray* recipients;
+    /// @brief The scanner of the message data.
+    DSmtpMessageParser message;
+    /// @brief The message blocks in order, array of GBytes.
+    /// @details Blocks reference the received buffers, the data isn't copied.
+    GPtrArray* blocks;
+    /// @brief The body compression or NULL if the spool compression is disabled.
+    DSmtpDeflate* deflate;
+    /// @brief The message data offset the body is compressed up to.
+    gsize deflated;
+    /// @brief The spilled body or NULL if the body is in the blocks.
+    DSmtpSpoolSpill* spill;
+    /// @brief The size of the prepended header fields.
+    gsize prepended;
+    gsize max_header_size;
+    gsize max_message_size;
+    /// @brief The message is bigger than max_message_size, the data is discarded.
+    gboolean too_large;
+    /// @brief The spill write failed, the data is discarded.
+    gboolean failed;
+    /// @brief The number of messages completed in the session.
+    guint messages_count;
+};
+
+extern "C" {
+
+/**
+ * @brief Allocate the transaction storage.
+ */
+void d_smtp_transaction_init(
+    DSmtpTransaction* transaction);
+
+/**
+ * @brief Free the transaction storage.
+ */
+void d_smtp_transaction_clear(
+    DSmtpTransaction* transaction);
+
+/**
+ * @brief Drop the current transaction, the storage is kept for reuse.
+ * @details Used by RSET, new MAIL and HELO/EHLO.
+ */
+void d_smtp_transaction_reset(
+    DSmtpTransaction* transaction);
+
+/**
+ * @brief Start the new transaction with the reverse path.
+ */
+void d_smtp_transaction_begin(
+    DSmtpTransaction* transaction,
+    const gchar* reverse_path);
+
+/**
+ * @brief Add the recipient to the transaction.
+ */
+void d_smtp_transaction_add_recipient(
+    DSmtpTransaction* transaction,
+    const gchar* forward_path);
+
+/**
+ * @brief Set the header size limit of the next messages.
+ */
+void d_smtp_transaction_set_max_header_size(
+    DSmtpTransaction* transaction,
+    gsize max_header_size);
+
+/**
+ * @brief Set the size limit of the message content.
+ */
+void d_smtp_transaction_set_max_message_size(
+    DSmtpTransaction* transaction,
+    gsize max_message_size);
+
+/**
+ * @brief Scan and keep the received block of the message data.
+ * @details Only the message content of the block is kept, without the
+ * dot stuffing and the end of data marker. The bytes after the marker
+ * are left to the caller. The body is compressed
+ * as it arrives if the default compressor is set. The content of the
+ * message with too large header or size isn't kept, only the end of
+ * data is searched.
+ * @param [in] bytes The received block.
+ * @param [out] consumed The number of block bytes taken by the message.
+ * @return Function returns TRUE if the end of data marker is found.
+ */
+gboolean d_smtp_transaction_add_data(
+    DSmtpTransaction* transaction,
+    GBytes* bytes,
+    gsize* consumed);
+
+/**
+ * @brief Put the header field in front of the message.
+ * @details Used at spool time for our Received field.
+ * @param [in] bytes The header field, transaction takes the ownership.
+ */
+void d_smtp_transaction_prepend(
+    DSmtpTransaction* transaction,
+    GBytes* bytes);
+
+/**
+ * @brief Check the received data is dropped.
+ * @details The message is rejected by the end of data then.
+ */
+gboolean d_smtp_transaction_is_discarding(
+    const DSmtpTransaction* transaction);
+
+/**
+ * @brief Complete the message and reset the transaction.
+ * @return The message for the spool, caller owns the message.
+ */
+DSmtpSpoolMessage* d_smtp_transaction_complete(
+    DSmtpTransaction* transaction);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_TRANSACTION__HPP__
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_smtp_worker.hpp"
+#include "d_smtp_connection.hpp"
+#include "d_loop_watchdog.hpp"
+
+extern "C" {
+
+/**
+ * @brief The connection on the way to other worker.
+ */
+struct DSmtpWorkerMigration
+{
+    DSmtpWorkerMigration* next;
+    DSmtpConnection* connection;
+};
+
+struct DSmtpWorkerSource
+{
+    GSource source;
+    DSmtpWorker* worker;
+};
+
+struct _DSmtpWorker
+{
+    GObject parent;
+
+    guint index;
+    GMainContext* context;
+    GMainLoop* loop;
+    GThread* thread;
+    /// @brief Main loop watchdog, stopped when the worker stops.
+    DLoopWatchdog* watchdog;
+    /// @brief The worker loop runs, accessed atomically from any thread.
+    gint running;
+    /// @brief All workers of the server including this one, NULL if
+    /// the sessions aren't rebalanced. Accessed only from the worker context.
+    GPtrArray* peers;
+    /// @brief The time of the last session pushed to other worker.
+    gint64 last_migration;
+    /// @brief Lock free stack of the incoming sessions, pushed from any thread.
+    DSmtpWorkerMigration* inbox;
+    /// @brief The source which adopts the incoming sessions.
+    GSource* inbox_source;
+    /// @brief Connections list, accessed only from the worker context.
+    GList* connections;
+    /// @brief Connections count, accessed atomically from any thread.
+    gint connections_count;
+    /// @brief Current configuration, accessed only from the worker context.
+    DSmtpConfig* config;
+};
+typedef _DSmtpWorker DSmtpWorker;
+
+G_DEFINE_TYPE(DSmtpWorker,d_smtp_worker,G_TYPE_OBJECT)
+
+struct _DSmtpWorkerClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The data passed to the worker context.
+ */
+struct DSmtpWorkerInvoke
+{
+    DSmtpWorker* worker;
+    GSocket* socket;
+    DSmtpConfig* config;
+    /// @brief Monotonic time of the socket accept.
+    gint64 accept_time;
+};
+
+static void d_smtp_worker_invoke_free(gpointer user_data)
+{
+    auto invoke = static_cast<DSmtpWorkerInvoke*>(user_data);
+    g_object_unref(invoke->worker);
+    g_clear_object(&invoke->socket);
+    g_clear_object(&invoke->config);
+    g_free(invoke);
+}
+
+static void d_smtp_worker_connection_disconnected(
+    GObject* source,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(source));
+    g_return_if_fail(D_IS_SMTP_WORKER(user_data));
+    auto connection = D_SMTP_CONNECTION(source);
+    auto worker = D_SMTP_WORKER(user_data);
+    g_message("SMTP worker %u connection disconnect",worker->index);
+    auto list = g_list_find(worker->connections,connection);
+    if(list) {
+        worker->connections = g_list_delete_link(worker->connections,list);
+        g_atomic_int_add(&worker->connections_count,-1);
+    } else {
+        g_critical("SMTP worker disconnected connection isn't in list");
+    }
+    g_object_unref(connection);
+}
+
+/**
+ * @brief Find the worker to take a session from this worker.
+ * @details The session is pushed away if the worker loop is busy over the
+ * rebalance threshold and other worker is at most half as busy. One session
+ * is moved per watchdog tick, so the peers loads are updated in between.
+ */
+static DSmtpWorker* d_smtp_worker_find_peer(DSmtpWorker* worker)
+{
+    if(!worker->peers || !worker->watchdog) {
+        return NULL;
+    }
+    guint threshold = d_smtp_config_get_rebalance_threshold(worker->config);
+    guint load = d_loop_watchdog_get_load(worker->watchdog);
+    if(!threshold || load < threshold) {
+        return NULL;
+    }
+    gint64 now = g_get_monotonic_time();
+    gint64 period = gint64(d_smtp_config_get_watchdog_interval(worker->config)) * G_TIME_SPAN_MILLISECOND;
+    if(now - worker->last_migration < period) {
+        return NULL;
+    }
+    DSmtpWorker* peer{nullptr};
+    guint peer_load = load / 2;
+    for(guint index = 0; index < worker->peers->len; index++) {
+        auto candidate = D_SMTP_WORKER(g_ptr_array_index(worker->peers,index));
+        if(candidate == worker || !g_atomic_int_get(&candidate->running)) {
+            continue;
+        }
+        guint candidate_load = d_loop_watchdog_get_load(candidate->watchdog);
+        if(candidate_load < peer_load || (!peer && candidate_load == peer_load)) {
+            peer = candidate;
+            peer_load = candidate_load;
+        }
+    }
+    return peer;
+}
+
+/**
+ * @brief Push the session to the worker inbox.
+ * @details Function can be called from any thread.
+ * @param [in] connection The detached connection, worker takes the ownership.
+ */
+static void d_smtp_worker_push(
+    DSmtpWorker* worker,
+    DSmtpConnection* connection)
+{
+    g_atomic_int_inc(&worker->connections_count);
+    auto migration = g_new(DSmtpWorkerMigration,1);
+    migration->connection = connection;
+    migration->next = __atomic_load_n(&worker->inbox,__ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&worker->inbox,&migration->next,migration,
+        TRUE,__ATOMIC_RELEASE,__ATOMIC_RELAXED)) {
+    }
+    // The inbox source is checked on every loop iteration.
+    g_main_context_wakeup(worker->context);
+}
+
+static void d_smtp_worker_connection_safe_point(
+    GObject* source,
+    gpointer user_data);
+
+static void d_smtp_worker_connect(
+    DSmtpWorker* worker,
+    DSmtpConnection* connection)
+{
+    g_signal_connect(connection,"disconnected",G_CALLBACK(d_smtp_worker_connection_disconnected),worker);
+    g_signal_connect(connection,"safe-point",G_CALLBACK(d_smtp_worker_connection_safe_point),worker);
+    worker->connections = g_list_prepend(worker->connections,connection);
+}
+
+/**
+ * @brief Move the session waiting for the next command to the less busy worker.
+ */
+static void d_smtp_worker_connection_safe_point(
+    GObject* source,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_SMTP_CONNECTION(source));
+    g_return_if_fail(D_IS_SMTP_WORKER(user_data));
+    auto connection = D_SMTP_CONNECTION(source);
+    auto worker = D_SMTP_WORKER(user_data);
+    DSmtpWorker* peer = d_smtp_worker_find_peer(worker);
+    if(!peer || !d_smtp_connection_detach(connection)) {
+        return;
+    }
+    g_message("SMTP worker %u connection moved to worker %u, load %u/%u",
+        worker->index,peer->index,d_loop_watchdog_get_load(worker->watchdog),
+        d_loop_watchdog_get_load(peer->watchdog));
+    worker->last_migration = g_get_monotonic_time();
+    g_signal_handlers_disconnect_by_data(connection,worker);
+    // The list reference goes to the peer with the connection.
+    worker->connections = g_list_remove(worker->connections,connection);
+    g_atomic_int_add(&worker->connections_count,-1);
+    d_smtp_worker_push(peer,connection);
+}
+
+static gboolean d_smtp_worker_source_pending(
+    GSource* source)
+{
+    auto worker = reinterpret_cast<DSmtpWorkerSource*>(source)->worker;
+    return __atomic_load_n(&worker->inbox,__ATOMIC_RELAXED) != NULL;
+}
+
+static gboolean d_smtp_worker_source_prepare(
+    GSource* source,
+    gint* timeout)
+{
+    *timeout = -1;
+    return d_smtp_worker_source_pending(source);
+}
+
+/**
+ * @brief Adopt the sessions pushed by other workers.
+ */
+static gboolean d_smtp_worker_source_dispatch(
+    GSource* source,
+    GSourceFunc callback,
+    gpointer user_data)
+{
+    auto worker = reinterpret_cast<DSmtpWorkerSource*>(source)->worker;
+    auto migration = __atomic_exchange_n(&worker->inbox,NULL,__ATOMIC_ACQUIRE);
+    // The stack is in the reverse order of pushes.
+    DSmtpWorkerMigration* list{nullptr};
+    while(migration) {
+        auto next = migration->next;
+        migration->next = list;
+        list = migration;
+        migration = next;
+    }
+    while(list) {
+        migration = list;
+        list = list->next;
+        auto connection = migration->connection;
+        g_free(migration);
+        d_smtp_worker_connect(worker,connection);
+        // The peer might not have applied the last configuration yet.
+        d_smtp_connection_apply_config(connection,worker->config);
+        d_smtp_connection_attach(connection);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs d_smtp_worker_source_funcs =
+{
+    d_smtp_worker_source_prepare,
+    d_smtp_worker_source_pending,
+    d_smtp_worker_source_dispatch,
+    NULL
+};
+
+static gboolean d_smtp_worker_add_socket_handle(gpointer user_data)
+{
+    auto invoke = static_cast<DSmtpWorkerInvoke*>(user_data);
+    auto worker = invoke->worker;
+    auto connection = d_smtp_connection_new_with_config(invoke->socket,worker->config);
+    d_smtp_connection_set_accept_time(connection,invoke->accept_time);
+    d_smtp_worker_connect(worker,connection);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean d_smtp_worker_set_config_handle(gpointer user_data)
+{
+    auto invoke = static_cast<DSmtpWorkerInvoke*>(user_data);
+    auto worker = invoke->worker;
+    g_set_object(&worker->config,invoke->config);
+    if(worker->watchdog) {
+        d_loop_watchdog_set_threshold(worker->watchdog,
+            d_smtp_config_get_watchdog_stall_threshold(worker->config));
+    }
+    for(GList* item = worker->connections; item; item = item->next) {
+        d_smtp_connection_apply_config(D_SMTP_CONNECTION(item->data),worker->config);
+    }
+    g_message("SMTP worker %u configuration applied to %u connections",
+        worker->index,g_list_length(worker->connections));
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer d_smtp_worker_thread(gpointer user_data)
+{
+    auto worker = D_SMTP_WORKER(user_data);
+    // All async operations started from this thread use the worker context.
+    g_main_context_push_thread_default(worker->context);
+    g_main_loop_run(worker->loop);
+    g_main_context_pop_thread_default(worker->context);
+    return NULL;
+}
+
+void d_smtp_worker_start(DSmtpWorker* worker)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(worker));
+    if(!worker->loop || worker->thread) {
+        return;
+    }
+    g_autofree gchar* name = g_strdup_printf("smtp-worker-%u",worker->index);
+    g_atomic_int_set(&worker->running,TRUE);
+    worker->thread = g_thread_new(name,d_smtp_worker_thread,worker);
+}
+
+void d_smtp_worker_stop(DSmtpWorker* worker)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(worker));
+    g_atomic_int_set(&worker->running,FALSE);
+    if(worker->thread) {
+        g_main_loop_quit(worker->loop);
+        g_thread_join(worker->thread);
+        worker->thread = nullptr;
+    }
+    // The watchdog source can't be removed while the loop runs in other
+    // thread, the worker without thread is stopped from the loop thread.
+    // Other workers may still read the watchdog load, so it is kept.
+    if(worker->watchdog) {
+        d_loop_watchdog_stop(worker->watchdog);
+    }
+    // Peers hold each other, the references are dropped here.
+    g_clear_pointer(&worker->peers,g_ptr_array_unref);
+}
+
+GMainContext* d_smtp_worker_get_context(DSmtpWorker* worker)
+{
+    g_return_val_if_fail(D_IS_SMTP_WORKER(worker),NULL);
+    return worker->context;
+}
+
+guint d_smtp_worker_get_connections_count(DSmtpWorker* worker)
+{
+    g_return_val_if_fail(D_IS_SMTP_WORKER(worker),0);
+    return g_atomic_int_get(&worker->connections_count);
+}
+
+void d_smtp_worker_add_socket(
+    DSmtpWorker* worker,
+    GSocket* socket)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(worker));
+    // Count connection immediately so the server limit is checked against
+    // the sockets which are still on the way to the worker context.
+    g_atomic_int_inc(&worker->connections_count);
+    auto invoke = g_new0(DSmtpWorkerInvoke,1);
+    invoke->worker = D_SMTP_WORKER(g_object_ref(worker));
+    invoke->socket = socket;
+    invoke->accept_time = g_get_monotonic_time();
+    g_main_context_invoke_full(worker->context,G_PRIORITY_DEFAULT,
+        d_smtp_worker_add_socket_handle,invoke,d_smtp_worker_invoke_free);
+}
+
+void d_smtp_worker_set_peers(
+    DSmtpWorker* worker,
+    GPtrArray* workers)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(worker));
+    g_return_if_fail(!worker->thread);
+    g_clear_pointer(&worker->peers,g_ptr_array_unref);
+    if(workers && workers->len > 1) {
+        worker->peers = g_ptr_array_ref(workers);
+    }
+}
+
+void d_smtp_worker_set_config(
+    DSmtpWorker* worker,
+    DSmtpConfig* config)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(worker));
+    g_return_if_fail(D_IS_SMTP_CONFIG(config));
+    auto invoke = g_new0(DSmtpWorkerInvoke,1);
+    invoke->worker = D_SMTP_WORKER(g_object_ref(worker));
+    invoke->config = D_SMTP_CONFIG(g_object_ref(config));
+    g_main_context_invoke_full(worker->context,G_PRIORITY_DEFAULT,
+        d_smtp_worker_set_config_handle,invoke,d_smtp_worker_invoke_free);
+}
+
+static void d_smtp_worker_init(DSmtpWorker* worker)
+{
+}
+
+static void d_smtp_worker_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SMTP_WORKER(object));
+    auto worker = D_SMTP_WORKER(object);
+    d_smtp_worker_stop(worker);
+    // The sessions pushed after the stop are dropped.
+    auto migration = __atomic_exchange_n(&worker->inbox,NULL,__ATOMIC_ACQUIRE);
+    while(migration) {
+        auto next = migration->next;
+        g_object_unref(migration->connection);
+        g_free(migration);
+        migration = next;
+    }
+    if(worker->inbox_source) {
+        g_source_destroy(worker->inbox_source);
+        g_clear_pointer(&worker->inbox_source,g_source_unref);
+    }
+    g_clear_object(&worker->watchdog);
+    g_list_free_full(worker->connections,g_object_unref);
+    g_clear_object(&worker->config);
+    g_clear_pointer(&worker->loop,g_main_loop_unref);
+    g_clear_pointer(&worker->context,g_main_context_unref);
+    G_OBJECT_CLASS(d_smtp_worker_parent_class)->finalize(object);
+}
+
+static void d_smtp_worker_class_init(DSmtpWorkerClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_smtp_worker_finalize;
+}
+
+/**
+ * @brief Create new instance of SMTP worker.
+ */
+DSmtpWorker* d_smtp_worker_new(
+    guint index,
+    gboolean threaded,
+    DSmtpConfig* config)
+{
+    auto worker = reinterpret_cast<DSmtpWorker*>(
+        g_object_new(
+            D_TYPE_SMTP_WORKER,
+            NULL));
+
+    worker->index = index;
+    worker->config = D_SMTP_CONFIG(g_object_ref(config));
+    if(threaded) {
+        worker->context = g_main_context_new();
+        worker->loop = g_main_loop_new(worker->context,FALSE);
+    } else {
+        worker->context = g_main_context_ref(g_main_context_default());
+        worker->running = TRUE;
+    }
+    worker->inbox_source = g_source_new(&d_smtp_worker_source_funcs,sizeof(DSmtpWorkerSource));
+    reinterpret_cast<DSmtpWorkerSource*>(worker->inbox_source)->worker = worker;
+    g_source_set_name(worker->inbox_source,"smtp worker inbox");
+    g_source_attach(worker->inbox_source,worker->context);
+    g_autofree gchar* name = threaded ?
+        g_strdup_printf("smtp-worker-%u",index) : g_strdup("main");
+    worker->watchdog = d_loop_watchdog_new(worker->context,name,
+        d_smtp_config_get_watchdog_interval(config),
+        d_smtp_config_get_watchdog_stall_threshold(config));
+
+    return worker;
+}
+
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SMTP_WORKER__HPP__
+#define __D__NEW__SMTP_WORKER__HPP__
+/**
+ * @brief SMTP worker object owns the set of connections.
+ * @details Every worker runs its own main context. All operations of the
+ * connections owned by the worker are executed in the worker context.
+ * The worker without thread uses the global default main context.
+ * The worker context is watched by the loop lag watchdog, the busy
+ * worker moves sessions to the idle ones between the commands.
+ */
+
+#include <gio/gio.h>
+#include "d_smtp_config.hpp"
+
+extern "C" {
+#define D_TYPE_SMTP_WORKER (d_smtp_worker_get_type())
+
+G_DECLARE_FINAL_TYPE(DSmtpWorker,d_smtp_worker,D,SMTP_WORKER,GObject)
+
+/**
+ * @brief Start the worker thread.
+ * @details Function does nothing for the worker without thread.
+ */
+void d_smtp_worker_start(DSmtpWorker* worker);
+
+/**
+ * @brief Stop the worker main loop and wait the worker thread exit.
+ * @details The main loop watchdog is destroyed. The worker without thread
+ * must be stopped from the main context thread.
+ */
+void d_smtp_worker_stop(DSmtpWorker* worker);
+
+/**
+ * @brief Get the main context used by the worker connections.
+ */
+GMainContext* d_smtp_worker_get_context(DSmtpWorker* worker);
+
+/**
+ * @brief Get the number of connections owned by the worker.
+ * @details Function can be called from any thread. The connections
+ * are counted from the d_smtp_worker_add_socket call.
+ */
+guint d_smtp_worker_get_connections_count(DSmtpWorker* worker);
+
+/**
+ * @brief Pass accepted socket to the worker.
+ * @details The SMTP connection is created in the worker context.
+ * Function can be called from any thread.
+ * @param [in] worker Worker object instance.
+ * @param [in] socket The accepted socket, worker takes the ownership.
+ */
+void d_smtp_worker_add_socket(
+    DSmtpWorker* worker,
+    GSocket* socket);
+
+/**
+ * @brief Set the workers the sessions can be moved to.
+ * @details The busy worker moves the session waiting for the next command
+ * to the least busy of the workers, see [server] rebalance-threshold. The
+ * peers are released when the worker stops. Function must be called
+ * before the worker is started.
+ * @param [in] workers All workers of the server, NULL disables the rebalancing.
+ */
+void d_smtp_worker_set_peers(
+    DSmtpWorker* worker,
+    GPtrArray* workers);
+
+/**
+ * @brief Set the new configuration for the worker.
+ * @details The configuration is applied in the worker context to the
+ * already established connections and used for the new ones.
+ * Function can be called from any thread.
+ */
+void d_smtp_worker_set_config(
+    DSmtpWorker* worker,
+    DSmtpConfig* config);
+
+/**
+ * @brief Create new instance of SMTP worker.
+ * @param [in] index The worker index, used for the thread name.
+ * @param [in] threaded Create the worker with own thread and main context.
+ * @param [in] config The configuration for the new connections.
+ */
+DSmtpWorker* d_smtp_worker_new(
+    guint index,
+    gboolean threaded,
+    DSmtpConfig* config);
+
+}
+
+#endif //#ifndef __D__NEW__SMTP_WORKER__HPP__
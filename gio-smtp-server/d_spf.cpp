@@ -0,0 +1,1350 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_spf.hpp"
+#include <string.h>
+#include <arpa/inet.h>
+
+/// @brief RFC 7208 4.6.4 limit of the DNS querying terms.
+#define SPF_MAX_LOOKUPS 10
+/// @brief RFC 7208 4.6.4 limit of the lookups without answer.
+#define SPF_MAX_VOID_LOOKUPS 2
+/// @brief RFC 7208 4.6.4 limit of the MX hosts of the mx mechanism.
+#define SPF_MAX_MX_HOSTS 10
+/// @brief The maximum length of the expanded domain name.
+#define SPF_MAX_DOMAIN_LENGTH 253
+
+extern "C" {
+
+enum SPF_TERM
+{
+    SPF_TERM_ALL,
+    /// @brief The run of ip4 and ip6 mechanisms merged into the prefix table.
+    SPF_TERM_IP,
+    SPF_TERM_A,
+    SPF_TERM_MX,
+    SPF_TERM_PTR,
+    SPF_TERM_EXISTS,
+    SPF_TERM_INCLUDE
+};
+
+enum SPF_RECORD_STATUS
+{
+    SPF_RECORD_VALID,
+    /// @brief The domain has no SPF record.
+    SPF_RECORD_ABSENT,
+    /// @brief The domain has more than one record or the record is malformed.
+    SPF_RECORD_INVALID
+};
+
+/**
+ * @brief The networks of the one prefix length.
+ */
+struct DSpfPrefixSet
+{
+    guint8 size;
+    guint8 length;
+    /// @brief The masked network padded to 16 bytes to the term order + 1.
+    GHashTable* networks;
+};
+
+/**
+ * @brief The ip4 and ip6 mechanisms of the run.
+ * @details The address matches the network of the lowest order, so the
+ * run keeps the meaning of the mechanisms sequence.
+ */
+struct DSpfPrefixTable
+{
+    /// @brief Array of DSpfPrefixSet*.
+    GPtrArray* sets;
+    /// @brief The qualifier of every mechanism by the order.
+    GArray* qualifiers;
+};
+
+struct DSpfTerm
+{
+    SPF_TERM kind;
+    SPF_RESULT qualifier;
+    /// @brief The domain spec, may have macros. NULL for the current domain.
+    gchar* domain_spec;
+    guint8 cidr4;
+    guint8 cidr6;
+    DSpfPrefixTable* table;
+};
+
+/**
+ * @brief The compiled SPF record, immutable and shared by evaluations.
+ */
+struct DSpfRecord
+{
+    gint ref_count;
+    SPF_RECORD_STATUS status;
+    /// @brief Array of DSpfTerm.
+    GArray* terms;
+    gchar* redirect;
+};
+
+struct DSpfRecordEntry
+{
+    /// @brief The TXT answer the record is compiled from.
+    DDnsAnswer* answer;
+    DSpfRecord* record;
+};
+
+struct DSpfMetrics
+{
+    guint64 evaluations;
+    guint64 results[NR_SPF_RESULTS];
+    guint64 record_hits;
+    guint64 record_compiles;
+};
+
+struct _DSpf
+{
+    GObject parent;
+
+    DDnsCache* cache;
+    guint max_records;
+
+    GMutex lock;
+    /// @brief The compiled records by the domain.
+    GHashTable* records;
+    DSpfMetrics metrics;
+};
+typedef _DSpf DSpf;
+
+G_DEFINE_TYPE(DSpf,d_spf,G_TYPE_OBJECT)
+
+struct _DSpfClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The state of the term lookups.
+ * @details The redirect has the slot after the last term.
+ */
+struct DSpfSlot
+{
+    gboolean started;
+    gboolean done;
+    /// @brief The term is counted against the lookups limit.
+    gboolean counted;
+    gboolean void_counted;
+    /// @brief The number of lookups in flight.
+    guint pending;
+    /// @brief SPF_RESULT_TEMPERROR or SPF_RESULT_PERMERROR if the term failed.
+    SPF_RESULT error;
+    gboolean matched;
+    gboolean void_lookup;
+    /// @brief The expanded target domain.
+    gchar* target;
+    /// @brief The record of include and redirect.
+    DSpfRecord* record;
+    gboolean child_done;
+    SPF_RESULT child_result;
+};
+
+struct DSpfEval;
+
+/**
+ * @brief The evaluation of the one record.
+ */
+struct DSpfFrame
+{
+    DSpfEval* eval;
+    /// @brief The frame of the include or redirect term, NULL for the top one.
+    DSpfFrame* parent;
+    guint parent_slot;
+    gchar* domain;
+    DSpfRecord* record;
+    DSpfSlot* slots;
+    /// @brief The term being matched.
+    guint index;
+    gboolean finished;
+};
+
+/**
+ * @brief The check_host() evaluation.
+ * @details Every lookup in flight holds the reference, the lookups
+ * prefetched for the terms never reached complete after the result.
+ */
+struct DSpfEval
+{
+    gint ref_count;
+    DSpf* spf;
+    /// @brief The task, NULL once the result is returned.
+    GTask* task;
+    GInetAddress* address;
+    guint8 bytes[16];
+    gsize size;
+    gchar* sender;
+    gchar* local_part;
+    gchar* sender_domain;
+    gchar* helo;
+    guint lookups;
+    guint void_lookups;
+    /// @brief Array of DSpfFrame*, all frames of the evaluation.
+    GPtrArray* frames;
+};
+
+/**
+ * @brief The reference of the lookup to its slot.
+ */
+struct DSpfSlotRef
+{
+    DSpfEval* eval;
+    DSpfFrame* frame;
+    guint index;
+};
+
+typedef void (*DSpfRecordFunc)(DSpfRecord* record, gpointer user_data);
+
+struct DSpfFetch
+{
+    DSpf* spf;
+    gchar* domain;
+    DSpfRecordFunc func;
+    gpointer user_data;
+};
+
+G_LOCK_DEFINE_STATIC(spf_default);
+static DSpf* spf_default{nullptr};
+
+static const gchar* spf_result_names[NR_SPF_RESULTS] = {
+    "none",
+    "neutral",
+    "pass",
+    "fail",
+    "softfail",
+    "temperror",
+    "permerror"
+};
+
+static void d_spf_frame_step(DSpfFrame* frame);
+
+const gchar* d_spf_result_to_string(
+    SPF_RESULT result)
+{
+    g_return_val_if_fail(result < NR_SPF_RESULTS,NULL);
+    return spf_result_names[result];
+}
+
+/**
+ * @brief Keep the first length bits of the address, the rest is zeroed.
+ */
+static void d_spf_mask(
+    const guint8* bytes,
+    gsize size,
+    guint length,
+    guint8* network)
+{
+    memset(network,0,16);
+    guint full = MIN(length / 8,size);
+    memcpy(network,bytes,full);
+    if(full < size && length % 8) {
+        network[full] = bytes[full] & guint8(0xff << (8 - length % 8));
+    }
+}
+
+static gboolean d_spf_prefix_equal(
+    const guint8* a,
+    const guint8* b,
+    gsize size,
+    guint length)
+{
+    guint8 network_a[16];
+    guint8 network_b[16];
+    d_spf_mask(a,size,length,network_a);
+    d_spf_mask(b,size,length,network_b);
+    return memcmp(network_a,network_b,size) == 0;
+}
+
+static guint d_spf_network_hash(gconstpointer key)
+{
+    auto bytes = reinterpret_cast<const guint8*>(key);
+    guint hash = 5381;
+    for(guint i = 0; i < 16; i++) {
+        hash = hash * 33 + bytes[i];
+    }
+    return hash;
+}
+
+static gboolean d_spf_network_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a,b,16) == 0;
+}
+
+static void d_spf_prefix_set_free(gpointer data)
+{
+    auto set = reinterpret_cast<DSpfPrefixSet*>(data);
+    g_hash_table_unref(set->networks);
+    g_free(set);
+}
+
+static DSpfPrefixTable* d_spf_prefix_table_new()
+{
+    auto table = g_new0(DSpfPrefixTable,1);
+    table->sets = g_ptr_array_new_with_free_func(d_spf_prefix_set_free);
+    table->qualifiers = g_array_new(FALSE,FALSE,sizeof(SPF_RESULT));
+    return table;
+}
+
+static void d_spf_prefix_table_free(DSpfPrefixTable* table)
+{
+    g_ptr_array_unref(table->sets);
+    g_array_unref(table->qualifiers);
+    g_free(table);
+}
+
+static void d_spf_prefix_table_add(
+    DSpfPrefixTable* table,
+    const guint8* bytes,
+    gsize size,
+    guint length,
+    SPF_RESULT qualifier)
+{
+    g_array_append_val(table->qualifiers,qualifier);
+    DSpfPrefixSet* set{nullptr};
+    for(guint i = 0; i < table->sets->len && !set; i++) {
+        auto candidate = reinterpret_cast<DSpfPrefixSet*>(table->sets->pdata[i]);
+        if(candidate->size == size && candidate->length == length) {
+            set = candidate;
+        }
+    }
+    if(!set) {
+        set = g_new0(DSpfPrefixSet,1);
+        set->size = size;
+        set->length = length;
+        set->networks = g_hash_table_new_full(d_spf_network_hash,d_spf_network_equal,g_free,NULL);
+        g_ptr_array_add(table->sets,set);
+    }
+    auto network = static_cast<guint8*>(g_malloc(16));
+    d_spf_mask(bytes,size,length,network);
+    // The earlier mechanism of the same network wins.
+    if(g_hash_table_contains(set->networks,network)) {
+        g_free(network);
+        return;
+    }
+    g_hash_table_insert(set->networks,network,GUINT_TO_POINTER(table->qualifiers->len));
+}
+
+/**
+ * @brief Match the address against the table.
+ * @return The qualifier of the first matching mechanism or SPF_RESULT_NONE.
+ */
+static SPF_RESULT d_spf_prefix_table_match(
+    DSpfPrefixTable* table,
+    const guint8* bytes,
+    gsize size)
+{
+    guint best = 0;
+    guint8 network[16];
+    for(guint i = 0; i < table->sets->len; i++) {
+        auto set = reinterpret_cast<DSpfPrefixSet*>(table->sets->pdata[i]);
+        if(set->size != size) {
+            continue;
+        }
+        d_spf_mask(bytes,size,set->length,network);
+        guint order = GPOINTER_TO_UINT(g_hash_table_lookup(set->networks,network));
+        if(order && (!best || order < best)) {
+            best = order;
+        }
+    }
+    return best ? g_array_index(table->qualifiers,SPF_RESULT,best - 1) : SPF_RESULT_NONE;
+}
+
+static void d_spf_term_clear(gpointer data)
+{
+    auto term = reinterpret_cast<DSpfTerm*>(data);
+    g_free(term->domain_spec);
+    if(term->table) {
+        d_spf_prefix_table_free(term->table);
+    }
+}
+
+static DSpfRecord* d_spf_record_ref(
+    DSpfRecord* record)
+{
+    g_atomic_int_inc(&record->ref_count);
+    return record;
+}
+
+static void d_spf_record_unref(
+    DSpfRecord* record)
+{
+    if(!record) return;
+    if(g_atomic_int_dec_and_test(&record->ref_count)) {
+        g_array_unref(record->terms);
+        g_free(record->redirect);
+        g_free(record);
+    }
+}
+
+static void d_spf_record_entry_free(gpointer data)
+{
+    auto entry = reinterpret_cast<DSpfRecordEntry*>(data);
+    d_dns_answer_unref(entry->answer);
+    d_spf_record_unref(entry->record);
+    g_free(entry);
+}
+
+/**
+ * @brief Parse the optional domain spec and the dual CIDR length of a and mx.
+ */
+static gboolean d_spf_parse_domain_cidr(
+    const gchar* args,
+    DSpfTerm* term)
+{
+    const gchar* p = args;
+    if(*p == ':') {
+        p++;
+        gsize length = strcspn(p,"/");
+        if(length == 0) {
+            return FALSE;
+        }
+        term->domain_spec = g_strndup(p,length);
+        p += length;
+    }
+    gchar* end;
+    if(p[0] == '/' && p[1] != '/') {
+        guint64 cidr = g_ascii_strtoull(p + 1,&end,10);
+        if(end == p + 1 || cidr > 32) {
+            return FALSE;
+        }
+        term->cidr4 = cidr;
+        p = end;
+    }
+    if(p[0] == '/' && p[1] == '/') {
+        guint64 cidr = g_ascii_strtoull(p + 2,&end,10);
+        if(end == p + 2 || cidr > 128) {
+            return FALSE;
+        }
+        term->cidr6 = cidr;
+        p = end;
+    }
+    return *p == 0;
+}
+
+/**
+ * @brief Parse the ip4 or ip6 mechanism into the prefix table.
+ */
+static gboolean d_spf_parse_network(
+    const gchar* args,
+    gboolean ip6,
+    SPF_RESULT qualifier,
+    DSpfPrefixTable* table)
+{
+    if(*args != ':') {
+        return FALSE;
+    }
+    const gchar* slash = strchr(args + 1,'/');
+    g_autofree gchar* text = slash ? g_strndup(args + 1,slash - args - 1) : g_strdup(args + 1);
+    gsize size = ip6 ? 16 : 4;
+    guint length = size * 8;
+    if(slash) {
+        gchar* end;
+        guint64 cidr = g_ascii_strtoull(slash + 1,&end,10);
+        if(end == slash + 1 || *end || cidr > length) {
+            return FALSE;
+        }
+        length = cidr;
+    }
+    guint8 bytes[16];
+    if(inet_pton(ip6 ? AF_INET6 : AF_INET,text,bytes) != 1) {
+        return FALSE;
+    }
+    d_spf_prefix_table_add(table,bytes,size,length,qualifier);
+    return TRUE;
+}
+
+/**
+ * @brief Parse the one term of the record.
+ * @param [in,out] ip_run The index of the open prefix table term or G_MAXUINT.
+ */
+static gboolean d_spf_parse_term(
+    DSpfRecord* record,
+    const gchar* token,
+    guint* ip_run)
+{
+    const gchar* p = token;
+    SPF_RESULT qualifier = SPF_RESULT_PASS;
+    gboolean has_qualifier = TRUE;
+    switch(*p) {
+    case '+': qualifier = SPF_RESULT_PASS; break;
+    case '-': qualifier = SPF_RESULT_FAIL; break;
+    case '~': qualifier = SPF_RESULT_SOFTFAIL; break;
+    case '?': qualifier = SPF_RESULT_NEUTRAL; break;
+    default: has_qualifier = FALSE; break;
+    }
+    if(has_qualifier) {
+        p++;
+    }
+    gsize name_length = strcspn(p,":/=");
+    if(name_length == 0 || !g_ascii_isalpha(*p)) {
+        return FALSE;
+    }
+    g_autofree gchar* name = g_ascii_strdown(p,name_length);
+    const gchar* args = p + name_length;
+    if(*args == '=') {
+        if(has_qualifier) {
+            return FALSE;
+        }
+        // The unknown modifiers are ignored, exp isn't used by the server.
+        if(g_str_equal(name,"redirect")) {
+            if(record->redirect || !args[1]) {
+                return FALSE;
+            }
+            record->redirect = g_strdup(args + 1);
+        }
+        return TRUE;
+    }
+    if(g_str_equal(name,"ip4") || g_str_equal(name,"ip6")) {
+        if(*ip_run == G_MAXUINT) {
+            DSpfTerm term{};
+            term.kind = SPF_TERM_IP;
+            term.table = d_spf_prefix_table_new();
+            g_array_append_val(record->terms,term);
+            *ip_run = record->terms->len - 1;
+        }
+        return d_spf_parse_network(args,name[2] == '6',qualifier,
+            g_array_index(record->terms,DSpfTerm,*ip_run).table);
+    }
+    DSpfTerm term{};
+    term.qualifier = qualifier;
+    term.cidr4 = 32;
+    term.cidr6 = 128;
+    gboolean valid = TRUE;
+    if(g_str_equal(name,"all")) {
+        term.kind = SPF_TERM_ALL;
+        valid = *args == 0;
+    } else if(g_str_equal(name,"include") || g_str_equal(name,"exists")) {
+        term.kind = name[0] == 'i' ? SPF_TERM_INCLUDE : SPF_TERM_EXISTS;
+        valid = *args == ':' && args[1];
+        if(valid) {
+            term.domain_spec = g_strdup(args + 1);
+        }
+    } else if(g_str_equal(name,"a") || g_str_equal(name,"mx")) {
+        term.kind = name[0] == 'a' ? SPF_TERM_A : SPF_TERM_MX;
+        valid = d_spf_parse_domain_cidr(args,&term);
+    } else if(g_str_equal(name,"ptr")) {
+        term.kind = SPF_TERM_PTR;
+        if(*args == ':' && args[1]) {
+            term.domain_spec = g_strdup(args + 1);
+        } else {
+            valid = *args == 0;
+        }
+    } else {
+        valid = FALSE;
+    }
+    if(!valid) {
+        d_spf_term_clear(&term);
+        return FALSE;
+    }
+    *ip_run = G_MAXUINT;
+    g_array_append_val(record->terms,term);
+    return TRUE;
+}
+
+/**
+ * @brief Select the SPF record of the TXT answer and compile it.
+ */
+static DSpfRecord* d_spf_record_compile(
+    DDnsAnswer* answer)
+{
+    auto record = g_new0(DSpfRecord,1);
+    record->ref_count = 1;
+    record->status = SPF_RECORD_ABSENT;
+    record->terms = g_array_new(FALSE,TRUE,sizeof(DSpfTerm));
+    g_array_set_clear_func(record->terms,d_spf_term_clear);
+    if(answer->status != DNS_ANSWER_OK) {
+        return record;
+    }
+    const gchar* text{nullptr};
+    for(guint i = 0; i < answer->records->len; i++) {
+        const gchar* data = g_array_index(answer->records,DDnsRecord,i).data;
+        if(g_ascii_strncasecmp(data,"v=spf1",6) != 0 || (data[6] != 0 && data[6] != ' ')) {
+            continue;
+        }
+        if(text) {
+            record->status = SPF_RECORD_INVALID;
+            return record;
+        }
+        text = data;
+    }
+    if(!text) {
+        return record;
+    }
+    record->status = SPF_RECORD_VALID;
+    g_auto(GStrv) tokens = g_strsplit(text + 6," ",-1);
+    guint ip_run = G_MAXUINT;
+    for(gchar** token = tokens; *token; token++) {
+        if(**token && !d_spf_parse_term(record,*token,&ip_run)) {
+            record->status = SPF_RECORD_INVALID;
+            break;
+        }
+    }
+    return record;
+}
+
+/**
+ * @brief Get the compiled record of the answer.
+ * @details The record compiled from the same answer instance is reused,
+ * so the record expires with the TXT answer in the DNS cache.
+ */
+static DSpfRecord* d_spf_record_for_answer(
+    DSpf* spf,
+    const gchar* domain,
+    DDnsAnswer* answer)
+{
+    g_autofree gchar* key = g_ascii_strdown(domain,-1);
+    g_mutex_lock(&spf->lock);
+    auto entry = reinterpret_cast<DSpfRecordEntry*>(g_hash_table_lookup(spf->records,key));
+    if(entry && entry->answer == answer) {
+        spf->metrics.record_hits++;
+        DSpfRecord* record = d_spf_record_ref(entry->record);
+        g_mutex_unlock(&spf->lock);
+        return record;
+    }
+    g_mutex_unlock(&spf->lock);
+
+    DSpfRecord* record = d_spf_record_compile(answer);
+
+    g_mutex_lock(&spf->lock);
+    spf->metrics.record_compiles++;
+    if(!entry && g_hash_table_size(spf->records) >= spf->max_records) {
+        // Drop the arbitrary eighth of the records, the hot ones come back.
+        guint evict = MAX(spf->max_records / 8,1);
+        GHashTableIter iter;
+        g_hash_table_iter_init(&iter,spf->records);
+        while(evict-- > 0 && g_hash_table_iter_next(&iter,NULL,NULL)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    entry = g_new0(DSpfRecordEntry,1);
+    entry->answer = d_dns_answer_ref(answer);
+    entry->record = d_spf_record_ref(record);
+    g_hash_table_replace(spf->records,g_steal_pointer(&key),entry);
+    g_mutex_unlock(&spf->lock);
+    return record;
+}
+
+static void d_spf_record_fetch_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto fetch = reinterpret_cast<DSpfFetch*>(user_data);
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    DSpfRecord* record{nullptr};
+    if(answer) {
+        record = d_spf_record_for_answer(fetch->spf,fetch->domain,answer);
+    } else if(g_error_matches(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_NOT_FOUND)) {
+        // The malformed domain name has no record.
+        record = g_new0(DSpfRecord,1);
+        record->ref_count = 1;
+        record->status = SPF_RECORD_ABSENT;
+        record->terms = g_array_new(FALSE,TRUE,sizeof(DSpfTerm));
+    }
+    g_clear_error(&error);
+    fetch->func(record,fetch->user_data);
+    d_spf_record_unref(record);
+    g_free(fetch->domain);
+    g_free(fetch);
+}
+
+/**
+ * @brief Get the compiled record of the domain.
+ * @details The function gets NULL if the TXT lookup failed.
+ */
+static void d_spf_record_fetch(
+    DSpf* spf,
+    const gchar* domain,
+    DSpfRecordFunc func,
+    gpointer user_data)
+{
+    auto fetch = g_new0(DSpfFetch,1);
+    fetch->spf = spf;
+    fetch->domain = g_strdup(domain);
+    fetch->func = func;
+    fetch->user_data = user_data;
+    d_dns_cache_lookup_async(spf->cache,DNS_RECORD_TXT,domain,NULL,d_spf_record_fetch_handle,fetch);
+}
+
+/**
+ * @brief Get the macro letter value.
+ * @return The value or NULL for the letter not allowed in the domain spec.
+ */
+static gchar* d_spf_macro_value(
+    DSpfEval* eval,
+    gchar letter,
+    const gchar* domain)
+{
+    switch(letter) {
+    case 's': return g_strdup(eval->sender);
+    case 'l': return g_strdup(eval->local_part);
+    case 'o': return g_strdup(eval->sender_domain);
+    case 'd': return g_strdup(domain);
+    case 'h': return g_strdup(eval->helo ? eval->helo : "unknown");
+    case 'p': return g_strdup("unknown");
+    case 'v': return g_strdup(eval->size == 4 ? "in-addr" : "ip6");
+    case 'i':
+        if(eval->size == 4) {
+            return g_strdup_printf("%u.%u.%u.%u",eval->bytes[0],eval->bytes[1],eval->bytes[2],eval->bytes[3]);
+        } else {
+            static const gchar hex[] = "0123456789abcdef";
+            GString* value = g_string_sized_new(64);
+            for(guint i = 0; i < 16; i++) {
+                g_string_append_printf(value,"%s%c.%c",i ? "." : "",
+                    hex[eval->bytes[i] >> 4],hex[eval->bytes[i] & 0x0f]);
+            }
+            return g_string_free(value,FALSE);
+        }
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Expand the macros of the domain spec, RFC 7208 7.
+ * @return The domain or NULL if the spec is malformed.
+ */
+static gchar* d_spf_expand(
+    DSpfEval* eval,
+    const gchar* spec,
+    const gchar* domain)
+{
+    if(!strchr(spec,'%')) {
+        return g_strdup(spec);
+    }
+    GString* result = g_string_sized_new(64);
+    for(const gchar* p = spec; *p; p++) {
+        if(*p != '%') {
+            g_string_append_c(result,*p);
+            continue;
+        }
+        p++;
+        if(*p == '%') {
+            g_string_append_c(result,'%');
+        } else if(*p == '_') {
+            g_string_append_c(result,' ');
+        } else if(*p == '-') {
+            g_string_append(result,"%20");
+        } else if(*p == '{' && p[1]) {
+            gchar letter = p[1];
+            g_autofree gchar* value = d_spf_macro_value(eval,g_ascii_tolower(letter),domain);
+            p += 2;
+            guint keep = 0;
+            while(g_ascii_isdigit(*p)) {
+                keep = MIN(keep * 10 + (*p++ - '0'),128);
+            }
+            gboolean reverse = FALSE;
+            if(*p == 'r' || *p == 'R') {
+                reverse = TRUE;
+                p++;
+            }
+            GString* delimiters = g_string_new(NULL);
+            while(*p && strchr(".-+,/_=",*p)) {
+                g_string_append_c(delimiters,*p++);
+            }
+            if(*p != '}' || !value) {
+                g_string_free(delimiters,TRUE);
+                g_string_free(result,TRUE);
+                return NULL;
+            }
+            gchar** parts = g_strsplit_set(value,delimiters->len ? delimiters->str : ".",-1);
+            g_string_free(delimiters,TRUE);
+            guint count = g_strv_length(parts);
+            if(reverse) {
+                for(guint i = 0; i < count / 2; i++) {
+                    gchar* part = parts[i];
+                    parts[i] = parts[count - 1 - i];
+                    parts[count - 1 - i] = part;
+                }
+            }
+            guint first = keep && keep < count ? count - keep : 0;
+            g_autofree gchar* joined = g_strjoinv(".",parts + first);
+            g_strfreev(parts);
+            if(g_ascii_isupper(letter)) {
+                g_autofree gchar* escaped = g_uri_escape_string(joined,NULL,FALSE);
+                g_string_append(result,escaped);
+            } else {
+                g_string_append(result,joined);
+            }
+        } else {
+            g_string_free(result,TRUE);
+            return NULL;
+        }
+    }
+    // The long name loses its leftmost labels.
+    const gchar* name = result->str;
+    while(strlen(name) > SPF_MAX_DOMAIN_LENGTH && strchr(name,'.')) {
+        name = strchr(name,'.') + 1;
+    }
+    gchar* expanded = g_strdup(name);
+    g_string_free(result,TRUE);
+    return expanded;
+}
+
+static void d_spf_eval_unref(
+    DSpfEval* eval)
+{
+    if(--eval->ref_count > 0) {
+        return;
+    }
+    g_ptr_array_unref(eval->frames);
+    g_object_unref(eval->address);
+    g_free(eval->sender);
+    g_free(eval->local_part);
+    g_free(eval->sender_domain);
+    g_free(eval->helo);
+    g_object_unref(eval->spf);
+    g_free(eval);
+}
+
+static void d_spf_eval_complete(
+    DSpfEval* eval,
+    SPF_RESULT result)
+{
+    if(!eval->task) {
+        return;
+    }
+    g_mutex_lock(&eval->spf->lock);
+    eval->spf->metrics.results[result]++;
+    g_mutex_unlock(&eval->spf->lock);
+    g_task_return_int(eval->task,result);
+    g_clear_object(&eval->task);
+}
+
+static void d_spf_frame_free(gpointer data)
+{
+    auto frame = reinterpret_cast<DSpfFrame*>(data);
+    for(guint i = 0; i <= frame->record->terms->len; i++) {
+        g_free(frame->slots[i].target);
+        d_spf_record_unref(frame->slots[i].record);
+    }
+    g_free(frame->slots);
+    d_spf_record_unref(frame->record);
+    g_free(frame->domain);
+    g_free(frame);
+}
+
+static void d_spf_frame_finish(
+    DSpfFrame* frame,
+    SPF_RESULT result)
+{
+    frame->finished = TRUE;
+    if(!frame->parent) {
+        d_spf_eval_complete(frame->eval,result);
+        return;
+    }
+    DSpfSlot* slot = &frame->parent->slots[frame->parent_slot];
+    slot->child_done = TRUE;
+    slot->child_result = result;
+    d_spf_frame_step(frame->parent);
+}
+
+static DSpfSlotRef* d_spf_slot_ref_new(
+    DSpfFrame* frame,
+    guint index)
+{
+    auto ref = g_new0(DSpfSlotRef,1);
+    ref->eval = frame->eval;
+    ref->eval->ref_count++;
+    ref->frame = frame;
+    ref->index = index;
+    frame->slots[index].pending++;
+    return ref;
+}
+
+/**
+ * @brief Complete the one lookup of the slot.
+ * @details The frame continues if it waits for the slot.
+ */
+static void d_spf_slot_ref_complete(
+    DSpfSlotRef* ref)
+{
+    DSpfFrame* frame = ref->frame;
+    DSpfSlot* slot = &frame->slots[ref->index];
+    if(--slot->pending == 0) {
+        slot->done = TRUE;
+        if(frame->index == ref->index && !frame->finished) {
+            d_spf_frame_step(frame);
+        }
+    }
+    d_spf_eval_unref(ref->eval);
+    g_free(ref);
+}
+
+static DSpfTerm* d_spf_slot_term(
+    DSpfSlotRef* ref)
+{
+    return &g_array_index(ref->frame->record->terms,DSpfTerm,ref->index);
+}
+
+/**
+ * @brief Match the client address against the answer addresses.
+ */
+static void d_spf_slot_address_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto ref = reinterpret_cast<DSpfSlotRef*>(user_data);
+    DSpfSlot* slot = &ref->frame->slots[ref->index];
+    DSpfTerm* term = d_spf_slot_term(ref);
+    DSpfEval* eval = ref->eval;
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!answer) {
+        g_error_free(error);
+        slot->error = SPF_RESULT_TEMPERROR;
+    } else if(answer->status != DNS_ANSWER_OK) {
+        // The MX host without address isn't the void lookup.
+        slot->void_lookup = slot->void_lookup || term->kind == SPF_TERM_A;
+    } else {
+        guint length = eval->size == 4 ? term->cidr4 : term->cidr6;
+        for(guint i = 0; i < answer->records->len && !slot->matched; i++) {
+            guint8 bytes[16];
+            if(inet_pton(eval->size == 4 ? AF_INET : AF_INET6,
+                g_array_index(answer->records,DDnsRecord,i).data,bytes) == 1) {
+                slot->matched = d_spf_prefix_equal(bytes,eval->bytes,eval->size,length);
+            }
+        }
+    }
+    d_spf_slot_ref_complete(ref);
+}
+
+/**
+ * @brief Look up the addresses of all MX hosts at once.
+ */
+static void d_spf_slot_mx_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto ref = reinterpret_cast<DSpfSlotRef*>(user_data);
+    DSpfSlot* slot = &ref->frame->slots[ref->index];
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!answer) {
+        g_error_free(error);
+        slot->error = SPF_RESULT_TEMPERROR;
+    } else if(answer->status != DNS_ANSWER_OK) {
+        slot->void_lookup = TRUE;
+    } else if(answer->records->len > SPF_MAX_MX_HOSTS) {
+        slot->error = SPF_RESULT_PERMERROR;
+    } else {
+        DNS_RECORD_TYPE type = ref->eval->size == 4 ? DNS_RECORD_A : DNS_RECORD_AAAA;
+        for(guint i = 0; i < answer->records->len; i++) {
+            d_dns_cache_lookup_async(D_DNS_CACHE(source_object),type,
+                g_array_index(answer->records,DDnsRecord,i).data,NULL,
+                d_spf_slot_address_handle,d_spf_slot_ref_new(ref->frame,ref->index));
+        }
+    }
+    d_spf_slot_ref_complete(ref);
+}
+
+static void d_spf_slot_exists_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto ref = reinterpret_cast<DSpfSlotRef*>(user_data);
+    DSpfSlot* slot = &ref->frame->slots[ref->index];
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(D_DNS_CACHE(source_object),res,&error);
+    if(!answer) {
+        g_error_free(error);
+        slot->error = SPF_RESULT_TEMPERROR;
+    } else if(answer->status != DNS_ANSWER_OK) {
+        slot->void_lookup = TRUE;
+    } else {
+        slot->matched = TRUE;
+    }
+    d_spf_slot_ref_complete(ref);
+}
+
+/**
+ * @brief Match the validated host name against the target domain.
+ * @details The lookup errors are no match, RFC 7208 5.5.
+ */
+static void d_spf_slot_ptr_handle(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    auto ref = reinterpret_cast<DSpfSlotRef*>(user_data);
+    DSpfSlot* slot = &ref->frame->slots[ref->index];
+    g_autofree gchar* host = d_dns_cache_verify_address_finish(D_DNS_CACHE(source_object),res,NULL);
+    if(host) {
+        gsize host_length = strlen(host);
+        gsize target_length = strlen(slot->target);
+        slot->matched = host_length >= target_length &&
+            g_ascii_strcasecmp(host + host_length - target_length,slot->target) == 0 &&
+            (host_length == target_length || host[host_length - target_length - 1] == '.');
+    }
+    d_spf_slot_ref_complete(ref);
+}
+
+static void d_spf_slot_record_handle(
+    DSpfRecord* record,
+    gpointer user_data)
+{
+    auto ref = reinterpret_cast<DSpfSlotRef*>(user_data);
+    DSpfSlot* slot = &ref->frame->slots[ref->index];
+    if(record) {
+        slot->record = d_spf_record_ref(record);
+    } else {
+        slot->error = SPF_RESULT_TEMPERROR;
+    }
+    d_spf_slot_ref_complete(ref);
+}
+
+/**
+ * @brief Issue the lookups of the term.
+ */
+static void d_spf_slot_start(
+    DSpfFrame* frame,
+    guint index)
+{
+    DSpfEval* eval = frame->eval;
+    DSpfSlot* slot = &frame->slots[index];
+    GArray* terms = frame->record->terms;
+    DSpfTerm* term = index < terms->len ? &g_array_index(terms,DSpfTerm,index) : NULL;
+    const gchar* spec = term ? term->domain_spec : frame->record->redirect;
+    slot->started = TRUE;
+    slot->target = spec ? d_spf_expand(eval,spec,frame->domain) : g_strdup(frame->domain);
+    if(!slot->target) {
+        slot->error = SPF_RESULT_PERMERROR;
+        slot->done = TRUE;
+        return;
+    }
+    DDnsCache* cache = eval->spf->cache;
+    SPF_TERM kind = term ? term->kind : SPF_TERM_INCLUDE;
+    DSpfSlotRef* ref = d_spf_slot_ref_new(frame,index);
+    switch(kind) {
+    case SPF_TERM_A:
+        d_dns_cache_lookup_async(cache,eval->size == 4 ? DNS_RECORD_A : DNS_RECORD_AAAA,
+            slot->target,NULL,d_spf_slot_address_handle,ref);
+        break;
+    case SPF_TERM_MX:
+        d_dns_cache_lookup_async(cache,DNS_RECORD_MX,slot->target,NULL,d_spf_slot_mx_handle,ref);
+        break;
+    case SPF_TERM_EXISTS:
+        d_dns_cache_lookup_async(cache,DNS_RECORD_A,slot->target,NULL,d_spf_slot_exists_handle,ref);
+        break;
+    case SPF_TERM_PTR:
+        d_dns_cache_verify_address_async(cache,eval->address,NULL,d_spf_slot_ptr_handle,ref);
+        break;
+    default:
+        d_spf_record_fetch(eval->spf,slot->target,d_spf_slot_record_handle,ref);
+        break;
+    }
+}
+
+static gboolean d_spf_slot_is_lookup(
+    DSpfFrame* frame,
+    guint index)
+{
+    GArray* terms = frame->record->terms;
+    if(index == terms->len) {
+        return frame->record->redirect != NULL;
+    }
+    SPF_TERM kind = g_array_index(terms,DSpfTerm,index).kind;
+    return kind != SPF_TERM_ALL && kind != SPF_TERM_IP;
+}
+
+/**
+ * @brief Issue the lookups of the record terms at once.
+ * @details Only as many terms as the lookups limit leaves are prefetched,
+ * the rest are started when the walk reaches them.
+ */
+static void d_spf_frame_prefetch(
+    DSpfFrame* frame)
+{
+    DSpfEval* eval = frame->eval;
+    guint budget = eval->lookups < SPF_MAX_LOOKUPS ? SPF_MAX_LOOKUPS - eval->lookups : 0;
+    for(guint i = frame->index; i <= frame->record->terms->len && budget > 0; i++) {
+        if(d_spf_slot_is_lookup(frame,i) && !frame->slots[i].started) {
+            d_spf_slot_start(frame,i);
+            budget--;
+        }
+    }
+}
+
+/**
+ * @brief Match the terms in order, RFC 7208 4.6.
+ * @details The frame stops at the term waiting for its lookups, the
+ * lookup completion continues it.
+ */
+static void d_spf_frame_step(
+    DSpfFrame* frame)
+{
+    DSpfEval* eval = frame->eval;
+    if(!eval->task || frame->finished) {
+        return;
+    }
+    GArray* terms = frame->record->terms;
+    for(; frame->index < terms->len || (frame->index == terms->len && frame->record->redirect); frame->index++) {
+        guint index = frame->index;
+        DSpfTerm* term = index < terms->len ? &g_array_index(terms,DSpfTerm,index) : NULL;
+        if(term && term->kind == SPF_TERM_ALL) {
+            d_spf_frame_finish(frame,term->qualifier);
+            return;
+        }
+        if(term && term->kind == SPF_TERM_IP) {
+            SPF_RESULT qualifier = d_spf_prefix_table_match(term->table,eval->bytes,eval->size);
+            if(qualifier != SPF_RESULT_NONE) {
+                d_spf_frame_finish(frame,qualifier);
+                return;
+            }
+            continue;
+        }
+        DSpfSlot* slot = &frame->slots[index];
+        if(!slot->counted) {
+            slot->counted = TRUE;
+            if(++eval->lookups > SPF_MAX_LOOKUPS) {
+                d_spf_frame_finish(frame,SPF_RESULT_PERMERROR);
+                return;
+            }
+        }
+        if(!slot->started) {
+            d_spf_slot_start(frame,index);
+        }
+        if(!slot->done) {
+            return;
+        }
+        if(slot->error != SPF_RESULT_NONE) {
+            d_spf_frame_finish(frame,slot->error);
+            return;
+        }
+        if(slot->void_lookup && !slot->void_counted) {
+            slot->void_counted = TRUE;
+            if(++eval->void_lookups > SPF_MAX_VOID_LOOKUPS) {
+                d_spf_frame_finish(frame,SPF_RESULT_PERMERROR);
+                return;
+            }
+        }
+        if(!term || term->kind == SPF_TERM_INCLUDE) {
+            if(!slot->child_done) {
+                if(slot->record->status != SPF_RECORD_VALID) {
+                    d_spf_frame_finish(frame,SPF_RESULT_PERMERROR);
+                    return;
+                }
+                // The nested record result continues this frame.
+                auto child = g_new0(DSpfFrame,1);
+                child->eval = eval;
+                child->parent = frame;
+                child->parent_slot = index;
+                child->domain = g_strdup(slot->target);
+                child->record = d_spf_record_ref(slot->record);
+                child->slots = g_new0(DSpfSlot,child->record->terms->len + 1);
+                g_ptr_array_add(eval->frames,child);
+                d_spf_frame_prefetch(child);
+                d_spf_frame_step(child);
+                return;
+            }
+            if(!term) {
+                // The redirect result is the result of the record.
+                d_spf_frame_finish(frame,slot->child_result);
+                return;
+            }
+            if(slot->child_result == SPF_RESULT_TEMPERROR || slot->child_result == SPF_RESULT_PERMERROR) {
+                d_spf_frame_finish(frame,slot->child_result);
+                return;
+            }
+            slot->matched = slot->child_result == SPF_RESULT_PASS;
+        }
+        if(slot->matched) {
+            d_spf_frame_finish(frame,term->qualifier);
+            return;
+        }
+    }
+    d_spf_frame_finish(frame,SPF_RESULT_NEUTRAL);
+}
+
+static void d_spf_eval_root_handle(
+    DSpfRecord* record,
+    gpointer user_data)
+{
+    auto eval = reinterpret_cast<DSpfEval*>(user_data);
+    if(!record) {
+        d_spf_eval_complete(eval,SPF_RESULT_TEMPERROR);
+    } else if(record->status == SPF_RECORD_ABSENT) {
+        d_spf_eval_complete(eval,SPF_RESULT_NONE);
+    } else if(record->status == SPF_RECORD_INVALID) {
+        d_spf_eval_complete(eval,SPF_RESULT_PERMERROR);
+    } else {
+        auto frame = g_new0(DSpfFrame,1);
+        frame->eval = eval;
+        frame->domain = g_strdup(eval->sender_domain);
+        frame->record = d_spf_record_ref(record);
+        frame->slots = g_new0(DSpfSlot,record->terms->len + 1);
+        g_ptr_array_add(eval->frames,frame);
+        d_spf_frame_prefetch(frame);
+        d_spf_frame_step(frame);
+    }
+    d_spf_eval_unref(eval);
+}
+
+void d_spf_check_host_async(
+    DSpf* spf,
+    GInetAddress* address,
+    const gchar* sender,
+    const gchar* helo,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data)
+{
+    g_return_if_fail(D_IS_SPF(spf));
+    g_return_if_fail(G_IS_INET_ADDRESS(address));
+    GTask* task = g_task_new(spf,cancellable,callback,user_data);
+    g_task_set_source_tag(task,(gpointer)d_spf_check_host_async);
+
+    auto eval = g_new0(DSpfEval,1);
+    eval->ref_count = 1;
+    eval->spf = D_SPF(g_object_ref(spf));
+    eval->task = task;
+    eval->address = G_INET_ADDRESS(g_object_ref(address));
+    eval->frames = g_ptr_array_new_with_free_func(d_spf_frame_free);
+    const guint8* bytes = g_inet_address_to_bytes(address);
+    eval->size = g_inet_address_get_native_size(address);
+    static const guint8 mapped_prefix[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+    if(eval->size == 16 && memcmp(bytes,mapped_prefix,sizeof(mapped_prefix)) == 0) {
+        bytes += sizeof(mapped_prefix);
+        eval->size = 4;
+    }
+    memcpy(eval->bytes,bytes,eval->size);
+    eval->helo = helo && *helo ? g_strdup(helo) : NULL;
+    // The null reverse path is checked as postmaster of the HELO domain.
+    eval->sender = sender && *sender ? g_strdup(sender) : g_strdup_printf("postmaster@%s",helo ? helo : "");
+    const gchar* at = strrchr(eval->sender,'@');
+    eval->local_part = at && at != eval->sender ? g_strndup(eval->sender,at - eval->sender) : g_strdup("postmaster");
+    eval->sender_domain = g_strdup(at ? at + 1 : eval->sender);
+
+    g_mutex_lock(&spf->lock);
+    spf->metrics.evaluations++;
+    g_mutex_unlock(&spf->lock);
+    if(!*eval->sender_domain) {
+        d_spf_eval_complete(eval,SPF_RESULT_NONE);
+        d_spf_eval_unref(eval);
+        return;
+    }
+    d_spf_record_fetch(spf,eval->sender_domain,d_spf_eval_root_handle,eval);
+}
+
+SPF_RESULT d_spf_check_host_finish(
+    DSpf* spf,
+    GAsyncResult* result,
+    GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result,spf),SPF_RESULT_TEMPERROR);
+    GError* task_error{NULL};
+    gssize value = g_task_propagate_int(G_TASK(result),&task_error);
+    if(task_error) {
+        g_propagate_error(error,task_error);
+        return SPF_RESULT_TEMPERROR;
+    }
+    return SPF_RESULT(value);
+}
+
+GBytes* d_spf_received_new(
+    SPF_RESULT result,
+    const gchar* address,
+    const gchar* sender,
+    const gchar* helo)
+{
+    gchar* field = g_strdup_printf("Received-SPF: %s client-ip=%s; envelope-from=\"%s\"; helo=%s;\r\n",
+        d_spf_result_to_string(result),address,sender ? sender : "",helo && *helo ? helo : "unknown");
+    return g_bytes_new_take(field,strlen(field));
+}
+
+void d_spf_log_metrics(
+    DSpf* spf)
+{
+    g_return_if_fail(D_IS_SPF(spf));
+    g_mutex_lock(&spf->lock);
+    DSpfMetrics metrics = spf->metrics;
+    guint records = g_hash_table_size(spf->records);
+    g_mutex_unlock(&spf->lock);
+    GString* results = g_string_new(NULL);
+    for(guint i = 0; i < NR_SPF_RESULTS; i++) {
+        g_string_append_printf(results,"%s%s %" G_GUINT64_FORMAT,i ? ", " : "",spf_result_names[i],metrics.results[i]);
+    }
+    g_message("SPF: %u cached records, evaluations %" G_GUINT64_FORMAT ", record hits %" G_GUINT64_FORMAT
+        ", record compiles %" G_GUINT64_FORMAT ", results %s",
+        records,metrics.evaluations,metrics.record_hits,metrics.record_compiles,results->str);
+    g_string_free(results,TRUE);
+}
+
+void d_spf_set_default(
+    DSpf* spf)
+{
+    G_LOCK(spf_default);
+    g_set_object(&spf_default,spf);
+    G_UNLOCK(spf_default);
+}
+
+DSpf* d_spf_get_default()
+{
+    G_LOCK(spf_default);
+    DSpf* spf = spf_default ? D_SPF(g_object_ref(spf_default)) : NULL;
+    G_UNLOCK(spf_default);
+    return spf;
+}
+
+static void d_spf_init(DSpf* spf)
+{
+    g_mutex_init(&spf->lock);
+    spf->records = g_hash_table_new_full(g_str_hash,g_str_equal,g_free,d_spf_record_entry_free);
+}
+
+static void d_spf_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_SPF(object));
+    auto spf = D_SPF(object);
+    g_hash_table_unref(spf->records);
+    g_clear_object(&spf->cache);
+    g_mutex_clear(&spf->lock);
+    G_OBJECT_CLASS(d_spf_parent_class)->finalize(object);
+}
+
+static void d_spf_class_init(DSpfClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_spf_finalize;
+}
+
+/**
+ * @brief Create new instance of the SPF evaluator.
+ */
+DSpf* d_spf_new(
+    DDnsCache* cache,
+    guint max_records)
+{
+    auto spf = reinterpret_cast<DSpf*>(
+        g_object_new(
+            D_TYPE_SPF,
+            NULL));
+
+    spf->cache = D_DNS_CACHE(g_object_ref(cache));
+    spf->max_records = MAX(max_records,1);
+
+    return spf;
+}
+
+}
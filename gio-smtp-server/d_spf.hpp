@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__SPF__HPP__
+#define __D__NEW__SPF__HPP__
+/**
+ * @brief RFC 7208 SPF evaluation.
+ * @details The SPF records are compiled into the term lists once and
+ * kept by domain for as long as the DNS cache keeps the TXT answer they
+ * were compiled from. The runs of the ip4 and ip6 mechanisms are merged
+ * into the prefix tables, the address is matched by one hash lookup per
+ * distinct prefix length. When the record evaluation starts, the DNS
+ * lookups of all its include, a, mx, ptr, exists and redirect terms are
+ * issued at once within the 10 lookups limit, the terms are then matched
+ * in order as their answers arrive.
+ */
+
+#include "d_dns_cache.hpp"
+
+extern "C" {
+#define D_TYPE_SPF (d_spf_get_type())
+
+G_DECLARE_FINAL_TYPE(DSpf,d_spf,D,SPF,GObject)
+
+/**
+ * @brief The check_host() result.
+ */
+enum SPF_RESULT
+{
+    SPF_RESULT_NONE,
+    SPF_RESULT_NEUTRAL,
+    SPF_RESULT_PASS,
+    SPF_RESULT_FAIL,
+    SPF_RESULT_SOFTFAIL,
+    SPF_RESULT_TEMPERROR,
+    SPF_RESULT_PERMERROR,
+    NR_SPF_RESULTS
+};
+
+/**
+ * @brief Get the result name used in the Received-SPF field.
+ */
+const gchar* d_spf_result_to_string(
+    SPF_RESULT result);
+
+/**
+ * @brief Evaluate the SPF policy of the sender domain for the client.
+ * @param [in] address The client address.
+ * @param [in] sender The MAIL FROM path, empty for the null reverse path.
+ * @param [in] helo The HELO/EHLO domain, used if the path is empty.
+ */
+void d_spf_check_host_async(
+    DSpf* spf,
+    GInetAddress* address,
+    const gchar* sender,
+    const gchar* helo,
+    GCancellable* cancellable,
+    GAsyncReadyCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Finish the evaluation.
+ * @return The SPF result, the DNS failures are SPF_RESULT_TEMPERROR.
+ */
+SPF_RESULT d_spf_check_host_finish(
+    DSpf* spf,
+    GAsyncResult* result,
+    GError** error);
+
+/**
+ * @brief Build the Received-SPF header field.
+ * @return The header field bytes, caller owns the reference.
+ */
+GBytes* d_spf_received_new(
+    SPF_RESULT result,
+    const gchar* address,
+    const gchar* sender,
+    const gchar* helo);
+
+/**
+ * @brief Write the evaluation and the record cache counters to the log.
+ */
+void d_spf_log_metrics(
+    DSpf* spf);
+
+/**
+ * @brief Set the process wide SPF evaluator used by the connections.
+ * @param [in] spf The evaluator or NULL to disable the checks.
+ */
+void d_spf_set_default(
+    DSpf* spf);
+
+/**
+ * @brief Get the process wide SPF evaluator.
+ * @return The new reference or NULL if the checks are disabled.
+ */
+DSpf* d_spf_get_default();
+
+/**
+ * @brief Create new instance of the SPF evaluator.
+ * @param [in] cache The DNS cache used for the lookups.
+ * @param [in] max_records The maximum number of the compiled records kept.
+ */
+DSpf* d_spf_new(
+    DDnsCache* cache,
+    guint max_records);
+
+}
+
+#endif //#ifndef __D__NEW__SPF__HPP__
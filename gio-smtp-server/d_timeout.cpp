@@ -14,13 +14,16 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include "d_timeout.hpp"
+#include "d_smtp_probes.hpp"
 
 /**
  * @brief Common object for processing cancleable timeouts.
  * @details Object dedicated for processing timeouts for GIO
  * asyncrhonous operations. The asynchrounous operations
  * will canceled by timeout expire event.
- * Currently object deal with three timeout values: read, write and close.
+ * Currently object deal with four timeout values: read, data, write and close.
+ * The timer source is attached to the thread default main context of the
+ * caller, so object can be used from any worker thread.
  */
 
 extern "C" {
@@ -35,10 +38,11 @@ struct _DTimeout
     TIMEOUT_OPERATION current_timeout_operation;
 
     gint read_timout_value;
+    gint data_timout_value;
     gint write_timout_value;
     gint close_timout_value;
 
-    guint current_timeout_source_id;
+    GSource* current_timeout_source;
 };
 typedef _DTimeout DTimeout;
 
@@ -72,6 +76,7 @@ guint d_timeout_get_value(
 {
     switch(timeout_type) {
     case TIMEOUT_OPERATION_READ: return timeout->read_timout_value;
+    case TIMEOUT_OPERATION_DATA: return timeout->data_timout_value;
     case TIMEOUT_OPERATION_WRITE: return timeout->write_timout_value;
     case TIMEOUT_OPERATION_CLOSE: return timeout->close_timout_value;
     default: g_warning("unknown timeout operation type");
@@ -94,6 +99,9 @@ void d_timeout_set_value(
     case TIMEOUT_OPERATION_READ: 
         timeout->read_timout_value = timeout_value;
         break;
+    case TIMEOUT_OPERATION_DATA:
+        timeout->data_timout_value = timeout_value;
+        break;
     case TIMEOUT_OPERATION_WRITE:
         timeout->write_timout_value = timeout_value;
         break;
@@ -134,10 +142,13 @@ static gboolean internal_timeout_function(gpointer user_data)
     // We are called because specific amount of time expired.
     g_return_val_if_fail(D_IS_TIMEOUT(user_data),G_SOURCE_REMOVE);
     auto timeout = D_TIMEOUT(user_data);
+    // Reset current source for timeout before the cancel handlers are called,
+    // the source itself is destroyed by the main loop on return.
+    g_source_unref(timeout->current_timeout_source);
+    timeout->current_timeout_source = nullptr;
+    D_SMTP_PROBE2(timeout_fire,timeout,gint(timeout->current_timeout_operation));
     // Cancel the cancelable object.
     g_cancellable_cancel(timeout->cancelable);
-    // Reset current source id for timeout.
-    timeout->current_timeout_source_id = 0;
     // Request to remove this source from futher execution.
     return G_SOURCE_REMOVE;
 }
@@ -156,13 +167,19 @@ void d_timeout_start(
     // Get the specific timeout value.
     guint timeout_value = d_timeout_get_value(timeout,timeout_type);
     g_message("start timeout type:%d value:%d",timeout_type,timeout_value);
+    D_SMTP_PROBE3(timeout_start,timeout,gint(timeout_type),timeout_value);
     // Reset cancelable object.
     if(g_cancellable_is_cancelled(timeout->cancelable)) {
         g_warning("timeout: cancelable object already was canceled, reset it");
         g_cancellable_reset(timeout->cancelable);
     }
-    timeout->current_timeout_source_id = g_timeout_add_seconds(
-        timeout_value, internal_timeout_function, timeout);
+    // Attach to the context of the caller thread instead of the global default.
+    timeout->current_timeout_source = g_timeout_source_new_seconds(timeout_value);
+    g_source_set_callback(timeout->current_timeout_source,
+        internal_timeout_function, timeout, NULL);
+    g_source_set_name(timeout->current_timeout_source,"smtp timeout");
+    g_source_attach(timeout->current_timeout_source,
+        g_main_context_get_thread_default());
 }
 
 /**
@@ -172,9 +189,11 @@ void d_timeout_stop(
     DTimeout* timeout,
     TIMEOUT_OPERATION timeout_type)
 {
-    if(timeout->current_timeout_source_id) {
-        g_source_remove(timeout->current_timeout_source_id);
-        timeout->current_timeout_source_id = 0;
+    if(timeout->current_timeout_source) {
+        D_SMTP_PROBE2(timeout_stop,timeout,gint(timeout_type));
+        g_source_destroy(timeout->current_timeout_source);
+        g_source_unref(timeout->current_timeout_source);
+        timeout->current_timeout_source = nullptr;
     }
 }
 
@@ -184,6 +203,7 @@ static void d_timeout_init(DTimeout* timeout)
     timeout->cancelable = g_cancellable_new();
     // Setup default value for timeouts.
     timeout->read_timout_value = 10;
+    timeout->data_timout_value = 10;
     timeout->write_timout_value = 10;
     timeout->close_timout_value = 10;
 }
@@ -192,9 +212,10 @@ static void d_timeout_finalize(GObject* object)
 {
     g_return_if_fail(D_IS_TIMEOUT(object));
     auto timeout = D_TIMEOUT(object);
-    if(timeout->current_timeout_source_id) {
-        g_source_remove(timeout->current_timeout_source_id);
-        timeout->current_timeout_source_id = 0;
+    if(timeout->current_timeout_source) {
+        g_source_destroy(timeout->current_timeout_source);
+        g_source_unref(timeout->current_timeout_source);
+        timeout->current_timeout_source = nullptr;
     }
     g_cancellable_disconnect(timeout->cancelable, timeout->cancelable_id);
     g_object_unref(timeout->cancelable);
@@ -20,13 +20,16 @@
  * @details Object dedicated for processing timeouts for GIO
  * asyncrhonous operations. The asynchrounous operations
  * will canceled by timeout expire event.
- * Currently object deal with three timeout values: read, write and close.
+ * Currently object deal with four timeout values: read, data, write and close.
+ * The timer source is attached to the thread default main context of the
+ * caller, so object can be used from any worker thread.
  */
 
 #include <gio/gio.h>
 
 enum TIMEOUT_OPERATION {
     TIMEOUT_OPERATION_READ,
+    TIMEOUT_OPERATION_DATA,
     TIMEOUT_OPERATION_WRITE,
     TIMEOUT_OPERATION_CLOSE,
 };
@@ -0,0 +1,711 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include "d_uring.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define D_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+
+/// @brief The number of submission queue entries.
+#define URING_ENTRIES 1024
+/// @brief The group id of receive provided buffers.
+#define URING_BUFFER_GROUP 1
+/// @brief The number of buffers provided at ring creation.
+#define URING_BUFFERS_BATCH 64
+/// @brief The buffer id is 16 bits value.
+#define URING_MAX_BUFFERS 32768
+
+extern "C" {
+
+struct _DUringOperation
+{
+    DUringCallback callback;
+    gpointer user_data;
+    /// @brief The receive is submitted again if provided buffers are exhausted.
+    gint recv_fd;
+};
+
+/**
+ * @brief The ring completions event source.
+ */
+struct DUringSource
+{
+    GSource source;
+    DUring* uring;
+    gpointer event_tag;
+};
+
+struct _DUring
+{
+    GObject parent;
+
+    gint ring_fd;
+    gint event_fd;
+    gsize buffer_size;
+    /// @brief The provided buffers, buffer id is the index.
+    GPtrArray* buffers;
+    /// @brief The memory blocks holding buffers.
+    GPtrArray* chunks;
+    GSource* source;
+#ifdef D_HAVE_IO_URING
+    guint sq_entries;
+    gpointer sq_ring;
+    gsize sq_ring_size;
+    gpointer cq_ring;
+    gsize cq_ring_size;
+    struct io_uring_sqe* sqes;
+    gsize sqes_size;
+    guint* sq_head;
+    guint* sq_tail;
+    guint* sq_mask;
+    guint* sq_array;
+    guint* cq_head;
+    guint* cq_tail;
+    guint* cq_mask;
+    struct io_uring_cqe* cqes;
+#endif
+    /// @brief The tail of queued submissions.
+    guint sqe_tail;
+    /// @brief The number of queued but not submitted entries.
+    guint to_submit;
+};
+typedef _DUring DUring;
+
+G_DEFINE_TYPE(DUring,d_uring,G_TYPE_OBJECT)
+
+struct _DUringClass
+{
+    GObjectClass parent;
+};
+
+/**
+ * @brief The provided buffer wrapped into GBytes.
+ */
+struct DUringBuffer
+{
+    DUring* uring;
+    guint buffer_id;
+};
+
+#ifdef D_HAVE_IO_URING
+
+static gint uring_setup(guint entries, struct io_uring_params* params)
+{
+    return gint(syscall(__NR_io_uring_setup,entries,params));
+}
+
+static gint uring_enter(gint fd, guint to_submit)
+{
+    return gint(syscall(__NR_io_uring_enter,fd,to_submit,0,0,NULL,0));
+}
+
+static gint uring_register(gint fd, guint opcode, gpointer arg, guint nr_args)
+{
+    return gint(syscall(__NR_io_uring_register,fd,opcode,arg,nr_args));
+}
+
+/**
+ * @brief Pass queued submissions to the kernel.
+ */
+static void d_uring_flush(DUring* uring)
+{
+    while(uring->to_submit) {
+        gint submitted = uring_enter(uring->ring_fd,uring->to_submit);
+        if(submitted < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            // EAGAIN and EBUSY are resolved after completions are processed.
+            if(errno != EAGAIN && errno != EBUSY) {
+                g_warning("io_uring enter failed: %d %s",errno,g_strerror(errno));
+            }
+            return;
+        }
+        if(submitted == 0) {
+            return;
+        }
+        uring->to_submit -= submitted;
+    }
+}
+
+/**
+ * @brief Get the next free submission queue entry.
+ * @return The zeroed entry or NULL if the queue is full.
+ */
+static struct io_uring_sqe* d_uring_get_sqe(DUring* uring)
+{
+    guint head = __atomic_load_n(uring->sq_head,__ATOMIC_ACQUIRE);
+    if(uring->sqe_tail - head >= uring->sq_entries) {
+        d_uring_flush(uring);
+        head = __atomic_load_n(uring->sq_head,__ATOMIC_ACQUIRE);
+        if(uring->sqe_tail - head >= uring->sq_entries) {
+            g_warning("io_uring submission queue is full");
+            return NULL;
+        }
+    }
+    guint index = uring->sqe_tail & *uring->sq_mask;
+    struct io_uring_sqe* sqe = &uring->sqes[index];
+    memset(sqe,0,sizeof(*sqe));
+    uring->sq_array[index] = index;
+    uring->sqe_tail++;
+    __atomic_store_n(uring->sq_tail,uring->sqe_tail,__ATOMIC_RELEASE);
+    uring->to_submit++;
+    return sqe;
+}
+
+/**
+ * @brief Queue the buffers to the receive buffer group.
+ */
+static gboolean d_uring_provide_buffers(
+    DUring* uring,
+    guint buffer_id,
+    guint count)
+{
+    auto sqe = d_uring_get_sqe(uring);
+    if(!sqe) {
+        return FALSE;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = guint64(g_ptr_array_index(uring->buffers,buffer_id));
+    sqe->len = uring->buffer_size;
+    sqe->off = buffer_id;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    return TRUE;
+}
+
+/**
+ * @brief Allocate the new buffers and provide them to the ring.
+ * @details Every call doubles the number of buffers.
+ */
+static gboolean d_uring_add_buffers(DUring* uring)
+{
+    guint first = uring->buffers->len;
+    guint count = MIN(MAX(first,URING_BUFFERS_BATCH),URING_MAX_BUFFERS - first);
+    if(!count) {
+        g_warning("io_uring provided buffers limit has reached");
+        return FALSE;
+    }
+    auto chunk = static_cast<gchar*>(g_malloc(gsize(count) * uring->buffer_size));
+    g_ptr_array_add(uring->chunks,chunk);
+    for(guint index = 0; index < count; index++) {
+        g_ptr_array_add(uring->buffers,chunk + gsize(index) * uring->buffer_size);
+    }
+    g_message("io_uring provided buffers count: %u",uring->buffers->len);
+    return d_uring_provide_buffers(uring,first,count);
+}
+
+static void d_uring_prep_recv(
+    DUring* uring,
+    struct io_uring_sqe* sqe,
+    DUringOperation* operation)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = operation->recv_fd;
+    // One byte is reserved for the terminating zero.
+    sqe->len = uring->buffer_size - 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = guint64(operation);
+}
+
+/**
+ * @brief Call the operation callback for the completion.
+ */
+static void d_uring_complete(
+    DUring* uring,
+    DUringOperation* operation,
+    gint result,
+    guint flags)
+{
+    if(result == -ENOBUFS && operation->recv_fd >= 0 && d_uring_add_buffers(uring)) {
+        // Submission is in order, so buffers are provided before the receive.
+        auto sqe = d_uring_get_sqe(uring);
+        if(sqe) {
+            d_uring_prep_recv(uring,sqe,operation);
+            return;
+        }
+    }
+    gboolean more = (flags & IORING_CQE_F_MORE) != 0;
+    guint buffer_id = (flags & IORING_CQE_F_BUFFER) ? flags >> IORING_CQE_BUFFER_SHIFT : G_MAXUINT;
+    operation->callback(operation,result,buffer_id,more,operation->user_data);
+    if(!more) {
+        g_free(operation);
+    }
+}
+
+/**
+ * @brief Process all available completions.
+ */
+static void d_uring_process_completions(DUring* uring)
+{
+    guint head = *uring->cq_head;
+    for(;;) {
+        guint tail = __atomic_load_n(uring->cq_tail,__ATOMIC_ACQUIRE);
+        if(head == tail) {
+            break;
+        }
+        struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+        auto operation = reinterpret_cast<DUringOperation*>(cqe->user_data);
+        gint result = cqe->res;
+        guint flags = cqe->flags;
+        // Release the entry before the callback, it may submit the new operations.
+        head++;
+        __atomic_store_n(uring->cq_head,head,__ATOMIC_RELEASE);
+        if(!operation) {
+            // Buffers and cancel requests have no operation.
+            if(result < 0 && result != -ENOENT && result != -EALREADY) {
+                g_warning("io_uring internal operation failed: %d %s",-result,g_strerror(-result));
+            }
+            continue;
+        }
+        d_uring_complete(uring,operation,result,flags);
+    }
+}
+
+static gboolean d_uring_completions_pending(DUring* uring)
+{
+    return *uring->cq_head != __atomic_load_n(uring->cq_tail,__ATOMIC_ACQUIRE);
+}
+
+static gboolean d_uring_source_prepare(
+    GSource* source,
+    gint* timeout)
+{
+    auto uring = reinterpret_cast<DUringSource*>(source)->uring;
+    // Operations queued during the main loop iteration go to the kernel at once.
+    d_uring_flush(uring);
+    *timeout = -1;
+    return d_uring_completions_pending(uring);
+}
+
+static gboolean d_uring_source_check(
+    GSource* source)
+{
+    auto uring_source = reinterpret_cast<DUringSource*>(source);
+    return (g_source_query_unix_fd(source,uring_source->event_tag) & G_IO_IN) ||
+        d_uring_completions_pending(uring_source->uring);
+}
+
+static gboolean d_uring_source_dispatch(
+    GSource* source,
+    GSourceFunc callback,
+    gpointer user_data)
+{
+    auto uring = reinterpret_cast<DUringSource*>(source)->uring;
+    guint64 value{0};
+    if(read(uring->event_fd,&value,sizeof(value)) < 0 && errno != EAGAIN) {
+        g_warning("io_uring eventfd read failed: %d %s",errno,g_strerror(errno));
+    }
+    d_uring_process_completions(uring);
+    return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs d_uring_source_funcs =
+{
+    d_uring_source_prepare,
+    d_uring_source_check,
+    d_uring_source_dispatch,
+    NULL
+};
+
+/**
+ * @brief Map the ring queues.
+ */
+static gboolean d_uring_map(
+    DUring* uring,
+    struct io_uring_params* params,
+    GError** error)
+{
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(guint);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if(params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_ring_size = uring->cq_ring_size = MAX(uring->sq_ring_size,uring->cq_ring_size);
+    }
+    uring->sq_ring = mmap(NULL,uring->sq_ring_size,PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,uring->ring_fd,IORING_OFF_SQ_RING);
+    if(uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        goto failed;
+    }
+    if(params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL,uring->cq_ring_size,PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,uring->ring_fd,IORING_OFF_CQ_RING);
+        if(uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            goto failed;
+        }
+    }
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = static_cast<struct io_uring_sqe*>(mmap(NULL,uring->sqes_size,
+        PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,uring->ring_fd,IORING_OFF_SQES));
+    if(uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        goto failed;
+    }
+    {
+        auto sq = static_cast<gchar*>(uring->sq_ring);
+        auto cq = static_cast<gchar*>(uring->cq_ring);
+        uring->sq_entries = params->sq_entries;
+        uring->sq_head = reinterpret_cast<guint*>(sq + params->sq_off.head);
+        uring->sq_tail = reinterpret_cast<guint*>(sq + params->sq_off.tail);
+        uring->sq_mask = reinterpret_cast<guint*>(sq + params->sq_off.ring_mask);
+        uring->sq_array = reinterpret_cast<guint*>(sq + params->sq_off.array);
+        uring->cq_head = reinterpret_cast<guint*>(cq + params->cq_off.head);
+        uring->cq_tail = reinterpret_cast<guint*>(cq + params->cq_off.tail);
+        uring->cq_mask = reinterpret_cast<guint*>(cq + params->cq_off.ring_mask);
+        uring->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params->cq_off.cqes);
+        uring->sqe_tail = *uring->sq_tail;
+    }
+    return TRUE;
+failed:
+    g_set_error(error,G_IO_ERROR,g_io_error_from_errno(errno),
+        "io_uring mmap failed: %s",g_strerror(errno));
+    return FALSE;
+}
+
+/**
+ * @brief Create the ring attached to the thread default main context.
+ */
+static DUring* d_uring_new(
+    gsize buffer_size,
+    GError** error)
+{
+    auto uring = reinterpret_cast<DUring*>(
+        g_object_new(
+            D_TYPE_URING,
+            NULL));
+    uring->buffer_size = buffer_size;
+
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    uring->ring_fd = uring_setup(URING_ENTRIES,&params);
+    if(uring->ring_fd < 0) {
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(errno),
+            "io_uring setup failed: %s",g_strerror(errno));
+        g_object_unref(uring);
+        return NULL;
+    }
+    if(!d_uring_map(uring,&params,error)) {
+        g_object_unref(uring);
+        return NULL;
+    }
+    uring->event_fd = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK);
+    if(uring->event_fd < 0 ||
+       uring_register(uring->ring_fd,IORING_REGISTER_EVENTFD,&uring->event_fd,1) < 0) {
+        g_set_error(error,G_IO_ERROR,g_io_error_from_errno(errno),
+            "io_uring eventfd register failed: %s",g_strerror(errno));
+        g_object_unref(uring);
+        return NULL;
+    }
+    uring->source = g_source_new(&d_uring_source_funcs,sizeof(DUringSource));
+    auto uring_source = reinterpret_cast<DUringSource*>(uring->source);
+    uring_source->uring = uring;
+    uring_source->event_tag = g_source_add_unix_fd(uring->source,uring->event_fd,G_IO_IN);
+    g_source_set_name(uring->source,"io_uring");
+    g_source_attach(uring->source,g_main_context_get_thread_default());
+    if(!d_uring_add_buffers(uring)) {
+        g_set_error(error,G_IO_ERROR,G_IO_ERROR_FAILED,"io_uring provide buffers failed");
+        g_object_unref(uring);
+        return NULL;
+    }
+    return uring;
+}
+
+gboolean d_uring_is_supported()
+{
+    static gsize supported{0};
+    if(g_once_init_enter(&supported)) {
+        struct io_uring_params params;
+        memset(&params,0,sizeof(params));
+        gint fd = uring_setup(4,&params);
+        gsize result = 1;
+        if(fd < 0) {
+            g_message("io_uring isn't available: %s",g_strerror(errno));
+        } else {
+            // Fast poll came together with the buffer select receive.
+            if(params.features & IORING_FEAT_FAST_POLL) {
+                result = 2;
+            } else {
+                g_message("io_uring kernel support is too old");
+            }
+            close(fd);
+        }
+        g_once_init_leave(&supported,result);
+    }
+    return supported == 2;
+}
+
+DUringOperation* d_uring_recv(
+    DUring* uring,
+    gint fd,
+    DUringCallback callback,
+    gpointer user_data)
+{
+    g_return_val_if_fail(D_IS_URING(uring),NULL);
+    auto sqe = d_uring_get_sqe(uring);
+    if(!sqe) {
+        return NULL;
+    }
+    auto operation = g_new0(DUringOperation,1);
+    operation->callback = callback;
+    operation->user_data = user_data;
+    operation->recv_fd = fd;
+    d_uring_prep_recv(uring,sqe,operation);
+    return operation;
+}
+
+DUringOperation* d_uring_send(
+    DUring* uring,
+    gint fd,
+    gconstpointer buffer,
+    gsize count,
+    DUringCallback callback,
+    gpointer user_data,
+    gboolean link_recv,
+    DUringOperation** recv_operation)
+{
+    g_return_val_if_fail(D_IS_URING(uring),NULL);
+    // Both entries of the link must be queued together.
+    guint head = __atomic_load_n(uring->sq_head,__ATOMIC_ACQUIRE);
+    if(link_recv && uring->sqe_tail - head + 2 > uring->sq_entries) {
+        d_uring_flush(uring);
+    }
+    auto sqe = d_uring_get_sqe(uring);
+    if(!sqe) {
+        return NULL;
+    }
+    auto operation = g_new0(DUringOperation,1);
+    operation->callback = callback;
+    operation->user_data = user_data;
+    operation->recv_fd = -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = guint64(buffer);
+    sqe->len = count;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = guint64(operation);
+    if(link_recv) {
+        auto recv_sqe = d_uring_get_sqe(uring);
+        if(recv_sqe) {
+            sqe->flags |= IOSQE_IO_LINK;
+            auto recv = g_new0(DUringOperation,1);
+            recv->callback = callback;
+            recv->user_data = user_data;
+            recv->recv_fd = fd;
+            d_uring_prep_recv(uring,recv_sqe,recv);
+            *recv_operation = recv;
+        } else {
+            *recv_operation = NULL;
+        }
+    }
+    return operation;
+}
+
+DUringOperation* d_uring_accept(
+    DUring* uring,
+    gint fd,
+    gboolean multishot,
+    DUringCallback callback,
+    gpointer user_data)
+{
+    g_return_val_if_fail(D_IS_URING(uring),NULL);
+    auto sqe = d_uring_get_sqe(uring);
+    if(!sqe) {
+        return NULL;
+    }
+    auto operation = g_new0(DUringOperation,1);
+    operation->callback = callback;
+    operation->user_data = user_data;
+    operation->recv_fd = -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if(multishot) {
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = guint64(operation);
+    return operation;
+}
+
+void d_uring_cancel(
+    DUring* uring,
+    DUringOperation* operation)
+{
+    g_return_if_fail(D_IS_URING(uring));
+    auto sqe = d_uring_get_sqe(uring);
+    if(!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = guint64(operation);
+}
+
+void d_uring_buffer_return(
+    DUring* uring,
+    guint buffer_id)
+{
+    g_return_if_fail(D_IS_URING(uring));
+    g_return_if_fail(buffer_id < uring->buffers->len);
+    d_uring_provide_buffers(uring,buffer_id,1);
+}
+
+#else // D_HAVE_IO_URING
+
+static DUring* d_uring_new(
+    gsize buffer_size,
+    GError** error)
+{
+    g_set_error(error,G_IO_ERROR,G_IO_ERROR_NOT_SUPPORTED,"io_uring isn't supported");
+    return NULL;
+}
+
+gboolean d_uring_is_supported()
+{
+    return FALSE;
+}
+
+DUringOperation* d_uring_recv(DUring* uring, gint fd,
+    DUringCallback callback, gpointer user_data)
+{
+    return NULL;
+}
+
+DUringOperation* d_uring_send(DUring* uring, gint fd, gconstpointer buffer, gsize count,
+    DUringCallback callback, gpointer user_data, gboolean link_recv,
+    DUringOperation** recv_operation)
+{
+    return NULL;
+}
+
+DUringOperation* d_uring_accept(DUring* uring, gint fd, gboolean multishot,
+    DUringCallback callback, gpointer user_data)
+{
+    return NULL;
+}
+
+void d_uring_cancel(DUring* uring, DUringOperation* operation)
+{
+}
+
+void d_uring_buffer_return(DUring* uring, guint buffer_id)
+{
+}
+
+#endif // D_HAVE_IO_URING
+
+DUring* d_uring_get_thread_default(
+    gsize buffer_size,
+    GError** error)
+{
+    static GPrivate uring_private = G_PRIVATE_INIT(g_object_unref);
+    auto uring = static_cast<DUring*>(g_private_get(&uring_private));
+    if(!uring) {
+        uring = d_uring_new(buffer_size,error);
+        if(!uring) {
+            return NULL;
+        }
+        g_private_set(&uring_private,uring);
+    }
+    return uring;
+}
+
+gsize d_uring_get_buffer_size(
+    DUring* uring)
+{
+    g_return_val_if_fail(D_IS_URING(uring),0);
+    return uring->buffer_size;
+}
+
+static void d_uring_buffer_release(gpointer user_data)
+{
+    auto buffer = static_cast<DUringBuffer*>(user_data);
+    d_uring_buffer_return(buffer->uring,buffer->buffer_id);
+    g_object_unref(buffer->uring);
+    g_free(buffer);
+}
+
+GBytes* d_uring_buffer_bytes_new(
+    DUring* uring,
+    guint buffer_id,
+    gsize size)
+{
+    g_return_val_if_fail(D_IS_URING(uring),NULL);
+    g_return_val_if_fail(buffer_id < uring->buffers->len,NULL);
+    auto data = static_cast<gchar*>(g_ptr_array_index(uring->buffers,buffer_id));
+    data[size] = 0;
+    auto buffer = g_new0(DUringBuffer,1);
+    buffer->uring = D_URING(g_object_ref(uring));
+    buffer->buffer_id = buffer_id;
+    return g_bytes_new_with_free_func(data,size,d_uring_buffer_release,buffer);
+}
+
+static void d_uring_init(DUring* uring)
+{
+    uring->ring_fd = -1;
+    uring->event_fd = -1;
+    uring->buffers = g_ptr_array_new();
+    uring->chunks = g_ptr_array_new_with_free_func(g_free);
+}
+
+static void d_uring_finalize(GObject* object)
+{
+    g_return_if_fail(D_IS_URING(object));
+    auto uring = D_URING(object);
+    if(uring->source) {
+        g_source_destroy(uring->source);
+        g_source_unref(uring->source);
+    }
+#ifdef D_HAVE_IO_URING
+    if(uring->sqes) {
+        munmap(uring->sqes,uring->sqes_size);
+    }
+    if(uring->cq_ring && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring,uring->cq_ring_size);
+    }
+    if(uring->sq_ring) {
+        munmap(uring->sq_ring,uring->sq_ring_size);
+    }
+    if(uring->event_fd >= 0) {
+        close(uring->event_fd);
+    }
+    // Closing the ring cancels the operations in flight.
+    if(uring->ring_fd >= 0) {
+        close(uring->ring_fd);
+    }
+#endif
+    g_ptr_array_unref(uring->buffers);
+    g_ptr_array_unref(uring->chunks);
+    G_OBJECT_CLASS(d_uring_parent_class)->finalize(object);
+}
+
+static void d_uring_class_init(DUringClass* klass)
+{
+    auto object_class = G_OBJECT_CLASS(klass);
+    object_class->finalize = d_uring_finalize;
+}
+
+}
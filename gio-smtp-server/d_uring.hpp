@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef __D__NEW__URING__HPP__
+#define __D__NEW__URING__HPP__
+/**
+ * @brief Linux io_uring submission and completion ring.
+ * @details Every thread running a main context has its own ring. The ring
+ * completions are signalled through the eventfd watched by the GSource
+ * attached to the thread default main context, so completion callbacks
+ * are called from the same main loop as the rest of GObject code.
+ * The queued submissions are flushed once per main loop iteration.
+ *
+ * Received data is placed to the ring provided buffers, the buffer is
+ * taken by the kernel only when the data has arrived. The buffers are
+ * returned to the ring when the bytes created by d_uring_buffer_bytes_new
+ * are released.
+ *
+ * The ring isn't thread safe, all functions must be called from the
+ * thread which created the ring.
+ */
+
+#include <gio/gio.h>
+
+extern "C" {
+#define D_TYPE_URING (d_uring_get_type())
+
+G_DECLARE_FINAL_TYPE(DUring,d_uring,D,URING,GObject)
+
+/**
+ * @brief The submitted ring operation.
+ */
+typedef struct _DUringOperation DUringOperation;
+
+/**
+ * @brief The operation completion callback.
+ * @param [in] operation The completed operation, the pointer is valid
+ * only during the call unless the completion has the more flag.
+ * @param [in] result The operation result, negative errno in case of failure.
+ * @param [in] buffer_id The provided buffer holding the received data
+ * or G_MAXUINT if no buffer is used.
+ * @param [in] more The multishot operation remains active.
+ * @param [in] user_data The data passed at the operation submission.
+ */
+typedef void (*DUringCallback)(
+    DUringOperation* operation,
+    gint result,
+    guint buffer_id,
+    gboolean more,
+    gpointer user_data);
+
+/**
+ * @brief Test if the kernel supports io_uring.
+ * @details The check is performed once per process.
+ */
+gboolean d_uring_is_supported();
+
+/**
+ * @brief Get the ring of the calling thread.
+ * @details The ring is created on the first call and attached to the
+ * thread default main context.
+ * @param [in] buffer_size The size of provided receive buffers, used
+ * only when the ring is created.
+ * @param [out] error The location for error or NULL.
+ * @return The ring, caller doesn't own the reference, or NULL in case
+ * of failure.
+ */
+DUring* d_uring_get_thread_default(
+    gsize buffer_size,
+    GError** error);
+
+/**
+ * @brief Get the size of provided receive buffers.
+ */
+gsize d_uring_get_buffer_size(
+    DUring* uring);
+
+/**
+ * @brief Submit the receive to the provided buffer.
+ * @return The operation or NULL if the submission queue is full.
+ * @details The buffer id is passed to the callback, the buffer keeps
+ * owned by the caller until it is passed to d_uring_buffer_bytes_new
+ * or d_uring_buffer_return.
+ */
+DUringOperation* d_uring_recv(
+    DUring* uring,
+    gint fd,
+    DUringCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Submit the send.
+ * @param [in] link_recv Link the receive to the send. The receive starts
+ * only when whole buffer is sent, otherwise it is completed with -ECANCELED.
+ * @param [out] recv_operation The linked receive operation.
+ */
+DUringOperation* d_uring_send(
+    DUring* uring,
+    gint fd,
+    gconstpointer buffer,
+    gsize count,
+    DUringCallback callback,
+    gpointer user_data,
+    gboolean link_recv,
+    DUringOperation** recv_operation);
+
+/**
+ * @brief Submit the accept.
+ * @param [in] multishot Keep the accept active for the next connections.
+ */
+DUringOperation* d_uring_accept(
+    DUring* uring,
+    gint fd,
+    gboolean multishot,
+    DUringCallback callback,
+    gpointer user_data);
+
+/**
+ * @brief Request the operation cancellation.
+ * @details The operation callback is called with -ECANCELED result
+ * unless the operation is already completed.
+ */
+void d_uring_cancel(
+    DUring* uring,
+    DUringOperation* operation);
+
+/**
+ * @brief Wrap the received provided buffer into GBytes.
+ * @details The data is terminated by zero. The buffer is returned to the
+ * ring when the last reference to the bytes is dropped.
+ */
+GBytes* d_uring_buffer_bytes_new(
+    DUring* uring,
+    guint buffer_id,
+    gsize size);
+
+/**
+ * @brief Return the unused provided buffer to the ring.
+ */
+void d_uring_buffer_return(
+    DUring* uring,
+    guint buffer_id);
+
+}
+
+#endif //#ifndef __D__NEW__URING__HPP__
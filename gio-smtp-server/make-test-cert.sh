@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Create the self-signed certificate for the local STARTTLS testing.
+#
+#   ./make-test-cert.sh [DIR]
+#
+# Add to the configuration file:
+#
+#   [tls]
+#   certificate=DIR/smtp-test.crt
+#   key=DIR/smtp-test.key
+#
+# Full handshake, the session is saved for the next run:
+#
+#   openssl s_client -connect localhost:8425 -starttls smtp -sess_out /tmp/smtp.sess
+#
+# Resumed handshake:
+#
+#   openssl s_client -connect localhost:8425 -starttls smtp -sess_in /tmp/smtp.sess
+#
+# The handshake metrics are written to the log by: kill -USR1 <server pid>
+#
+set -e
+
+DIR=${1:-.}
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 \
+    -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+    -keyout "$DIR/smtp-test.key" \
+    -out "$DIR/smtp-test.crt"
+
+echo "certificate: $DIR/smtp-test.crt"
+echo "key:         $DIR/smtp-test.key"
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief SMTP command parser tests.
+ */
+#include "d_smtp_command.hpp"
+#include <string.h>
+
+/**
+ * @brief Process the one command line.
+ * @return The command or NULL if the line is rejected.
+ */
+static DSmtpCommand* command_test_process(
+    const gchar* line,
+    gsize size)
+{
+    g_autoptr(DSmtpCommand) command = d_smtp_command_new();
+    g_autoptr(GBytes) bytes = g_bytes_new(line,size);
+    d_smtp_command_set_bytes(command,bytes);
+    if(!d_smtp_command_process(command)) {
+        return NULL;
+    }
+    return D_SMTP_COMMAND(g_steal_pointer(&command));
+}
+
+static void command_test_reject(
+    const gchar* line,
+    gsize size)
+{
+    g_autoptr(DSmtpCommand) command = command_test_process(line,size);
+    g_assert_null(command);
+}
+
+static void command_test_helo()
+{
+    const gchar line[] = "HELO client.example.com\r\n";
+    g_autoptr(DSmtpCommand) command = command_test_process(line,strlen(line));
+    g_assert_nonnull(command);
+    g_assert_cmpint(d_smtp_command_get_smtp_command(command),==,SMTP_COMMAND_HELO);
+    g_assert_cmpint(d_smtp_command_get_response_code(command),==,250);
+    g_assert_cmpstr(d_smtp_command_get_domain(command),==,"client.example.com");
+}
+
+static void command_test_ehlo()
+{
+    const gchar line[] = "EHLO  client.example.com\r\n";
+    g_autoptr(DSmtpCommand) command = command_test_process(line,strlen(line));
+    g_assert_nonnull(command);
+    g_assert_cmpint(d_smtp_command_get_smtp_command(command),==,SMTP_COMMAND_EHLO);
+    g_assert_cmpstr(d_smtp_command_get_domain(command),==,"client.example.com");
+
+    const gchar empty[] = "EHLO \r\n";
+    g_autoptr(DSmtpCommand) rejected = command_test_process(empty,strlen(empty));
+    g_assert_null(rejected);
+}
+
+static void command_test_mail()
+{
+    const gchar line[] = "MAIL FROM:<sender@example.com>\r\n";
+    g_autoptr(DSmtpCommand) command = command_test_process(line,strlen(line));
+    g_assert_nonnull(command);
+    g_assert_cmpint(d_smtp_command_get_smtp_command(command),==,SMTP_COMMAND_MAIL);
+    g_assert_cmpstr(d_smtp_command_get_path(command),==,"sender@example.com");
+
+    const gchar null_path[] = "MAIL FROM:<>\r\n";
+    g_autoptr(DSmtpCommand) bounce = command_test_process(null_path,strlen(null_path));
+    g_assert_nonnull(bounce);
+    g_assert_cmpstr(d_smtp_command_get_path(bounce),==,"");
+
+    const gchar unclosed[] = "MAIL FROM:<sender@example.com\r\n";
+    g_autoptr(DSmtpCommand) rejected = command_test_process(unclosed,strlen(unclosed));
+    g_assert_null(rejected);
+}
+
+static void command_test_rcpt()
+{
+    const gchar line[] = "RCPT TO:<rcpt@example.org>\r\n";
+    g_autoptr(DSmtpCommand) command = command_test_process(line,strlen(line));
+    g_assert_nonnull(command);
+    g_assert_cmpint(d_smtp_command_get_smtp_command(command),==,SMTP_COMMAND_RCPT);
+    g_assert_cmpstr(d_smtp_command_get_path(command),==,"rcpt@example.org");
+}
+
+static void command_test_no_parameters()
+{
+    static const struct {
+        const gchar* line;
+        SMTP_COMMAND command;
+        gint response_code;
+    } commands[] = {
+        {"DATA\r\n",SMTP_COMMAND_DATA,354},
+        {"QUIT\r\n",SMTP_COMMAND_QUIT,221},
+        {"RSET\r\n",SMTP_COMMAND_RSET,250},
+        {"NOOP\r\n",SMTP_COMMAND_NOOP,250},
+        {"NOOP ignored\r\n",SMTP_COMMAND_NOOP,250},
+        {"STARTTLS\r\n",SMTP_COMMAND_STARTTLS,220},
+    };
+    for(guint i = 0; i < G_N_ELEMENTS(commands); i++) {
+        g_autoptr(DSmtpCommand) command = command_test_process(commands[i].line,strlen(commands[i].line));
+        g_assert_nonnull(command);
+        g_assert_cmpint(d_smtp_command_get_smtp_command(command),==,commands[i].command);
+        g_assert_cmpint(d_smtp_command_get_response_code(command),==,commands[i].response_code);
+    }
+
+    const gchar rset[] = "RSET now\r\n";
+    g_autoptr(DSmtpCommand) rejected = command_test_process(rset,strlen(rset));
+    g_assert_null(rejected);
+}
+
+static void command_test_unknown()
+{
+    const gchar line[] = "VRFY postmaster\r\n";
+    command_test_reject(line,strlen(line));
+}
+
+static void command_test_bare_lf()
+{
+    const gchar line[] = "HELO client.example.com\n";
+    command_test_reject(line,strlen(line));
+
+    const gchar bare_cr[] = "HELO client.example.com\r";
+    command_test_reject(bare_cr,strlen(bare_cr));
+
+    const gchar no_end[] = "QUIT";
+    command_test_reject(no_end,strlen(no_end));
+}
+
+static void command_test_pipelined()
+{
+    // The connection passes one line at a time, the next command isn't part of it.
+    const gchar line[] = "RSET\r\nQUIT\r\n";
+    command_test_reject(line,strlen(line));
+}
+
+static void command_test_nul()
+{
+    const gchar line[] = "QUIT\0\r\n";
+    command_test_reject(line,sizeof(line) - 1);
+}
+
+static void command_test_length()
+{
+    const gchar short_line[] = "QU\r\n";
+    command_test_reject(short_line,strlen(short_line));
+
+    g_autoptr(GString) line = g_string_new("MAIL FROM:<");
+    while(line->len < SMTP_COMMAND_MAX_LENGTH - strlen(">\r\n")) {
+        g_string_append_c(line,'a');
+    }
+    g_string_append(line,">\r\n");
+    g_assert_cmpuint(line->len,==,SMTP_COMMAND_MAX_LENGTH);
+    g_autoptr(DSmtpCommand) longest = command_test_process(line->str,line->len);
+    g_assert_nonnull(longest);
+
+    g_string_insert_c(line,strlen("MAIL FROM:<"),'a');
+    command_test_reject(line->str,line->len);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    // The parser logs the rejected lines as warnings.
+    g_log_set_always_fatal(GLogLevelFlags(G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL));
+    g_test_add_func("/command/helo",command_test_helo);
+    g_test_add_func("/command/ehlo",command_test_ehlo);
+    g_test_add_func("/command/mail",command_test_mail);
+    g_test_add_func("/command/rcpt",command_test_rcpt);
+    g_test_add_func("/command/no-parameters",command_test_no_parameters);
+    g_test_add_func("/command/unknown",command_test_unknown);
+    g_test_add_func("/command/bare-lf",command_test_bare_lf);
+    g_test_add_func("/command/pipelined",command_test_pipelined);
+    g_test_add_func("/command/nul",command_test_nul);
+    g_test_add_func("/command/length",command_test_length);
+    return g_test_run();
+}
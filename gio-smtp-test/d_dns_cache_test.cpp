@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief DNS cache tests.
+ * @details The lookups are answered by the static answers, the tests
+ * don't need the DNS server.
+ */
+#include "d_dns_cache.hpp"
+
+/**
+ * @brief Wait for the async result in the default main context.
+ */
+static void dns_test_ready(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    *reinterpret_cast<GAsyncResult**>(user_data) = G_ASYNC_RESULT(g_object_ref(res));
+}
+
+static GAsyncResult* dns_test_wait(
+    GAsyncResult** result)
+{
+    while(!*result) {
+        g_main_context_iteration(NULL,TRUE);
+    }
+    return *result;
+}
+
+static DDnsCache* dns_test_cache()
+{
+    GError* error{NULL};
+    DDnsCache* cache = d_dns_cache_new(NULL,64,60,3600,1,&error);
+    g_assert_no_error(error);
+    static const gchar* const example_a[] = {"192.0.2.10","192.0.2.11",NULL};
+    static const gchar* const example_mx[] = {"20 mail-b.example.com","10 mail-a.example.com",NULL};
+    static const gchar* const example_txt[] = {"v=spf1 mx -all",NULL};
+    static const gchar* const empty[] = {NULL};
+    static const gchar* const ptr_65[] = {"amy.example.com",NULL};
+    static const gchar* const amy_a[] = {"192.0.2.65",NULL};
+    static const gchar* const ptr_66[] = {"bob.example.com",NULL};
+    static const gchar* const bob_a[] = {"192.0.2.99",NULL};
+    d_dns_cache_add_static(cache,DNS_RECORD_A,"example.com",example_a);
+    d_dns_cache_add_static(cache,DNS_RECORD_MX,"example.com.",example_mx);
+    d_dns_cache_add_static(cache,DNS_RECORD_TXT,"Example.COM",example_txt);
+    d_dns_cache_add_static(cache,DNS_RECORD_AAAA,"example.com",empty);
+    d_dns_cache_add_static(cache,DNS_RECORD_A,"missing.example.com",NULL);
+    d_dns_cache_add_static(cache,DNS_RECORD_PTR,"65.2.0.192.in-addr.arpa",ptr_65);
+    d_dns_cache_add_static(cache,DNS_RECORD_A,"amy.example.com",amy_a);
+    d_dns_cache_add_static(cache,DNS_RECORD_PTR,"66.2.0.192.in-addr.arpa",ptr_66);
+    d_dns_cache_add_static(cache,DNS_RECORD_A,"bob.example.com",bob_a);
+    return cache;
+}
+
+static DDnsAnswer* dns_test_lookup(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name)
+{
+    GAsyncResult* result{NULL};
+    d_dns_cache_lookup_async(cache,type,name,NULL,dns_test_ready,&result);
+    GError* error{NULL};
+    DDnsAnswer* answer = d_dns_cache_lookup_finish(cache,dns_test_wait(&result),&error);
+    g_assert_no_error(error);
+    g_assert_nonnull(answer);
+    g_object_unref(result);
+    return answer;
+}
+
+static const gchar* dns_test_record(
+    DDnsAnswer* answer,
+    guint index)
+{
+    return g_array_index(answer->records,DDnsRecord,index).data;
+}
+
+static void dns_test_static()
+{
+    g_autoptr(DDnsCache) cache = dns_test_cache();
+    g_autoptr(DDnsAnswer) a = dns_test_lookup(cache,DNS_RECORD_A,"EXAMPLE.com.");
+    g_assert_cmpint(a->status,==,DNS_ANSWER_OK);
+    g_assert_cmpuint(a->records->len,==,2);
+    g_assert_cmpstr(dns_test_record(a,0),==,"192.0.2.10");
+    g_assert_cmpstr(dns_test_record(a,1),==,"192.0.2.11");
+
+    // The MX records are sorted by preference.
+    g_autoptr(DDnsAnswer) mx = dns_test_lookup(cache,DNS_RECORD_MX,"example.com");
+    g_assert_cmpuint(mx->records->len,==,2);
+    g_assert_cmpuint(g_array_index(mx->records,DDnsRecord,0).preference,==,10);
+    g_assert_cmpstr(dns_test_record(mx,0),==,"mail-a.example.com");
+    g_assert_cmpstr(dns_test_record(mx,1),==,"mail-b.example.com");
+
+    g_autoptr(DDnsAnswer) txt = dns_test_lookup(cache,DNS_RECORD_TXT,"example.com");
+    g_assert_cmpstr(dns_test_record(txt,0),==,"v=spf1 mx -all");
+
+    g_autoptr(DDnsAnswer) nodata = dns_test_lookup(cache,DNS_RECORD_AAAA,"example.com");
+    g_assert_cmpint(nodata->status,==,DNS_ANSWER_NODATA);
+    g_assert_cmpuint(nodata->records->len,==,0);
+
+    g_autoptr(DDnsAnswer) nxdomain = dns_test_lookup(cache,DNS_RECORD_A,"missing.example.com");
+    g_assert_cmpint(nxdomain->status,==,DNS_ANSWER_NXDOMAIN);
+
+    // The static answer is shared, not queried again.
+    g_autoptr(DDnsAnswer) again = dns_test_lookup(cache,DNS_RECORD_A,"example.com");
+    g_assert_true(again == a);
+}
+
+static void dns_test_invalid_name()
+{
+    g_autoptr(DDnsCache) cache = dns_test_cache();
+    GAsyncResult* result{NULL};
+    d_dns_cache_lookup_async(cache,DNS_RECORD_A,".",NULL,dns_test_ready,&result);
+    GError* error{NULL};
+    g_autoptr(DDnsAnswer) answer = d_dns_cache_lookup_finish(cache,dns_test_wait(&result),&error);
+    g_assert_null(answer);
+    g_assert_error(error,G_RESOLVER_ERROR,G_RESOLVER_ERROR_NOT_FOUND);
+    g_error_free(error);
+    g_object_unref(result);
+}
+
+static void dns_test_reverse_name()
+{
+    g_autoptr(GInetAddress) ip4 = g_inet_address_new_from_string("192.0.2.65");
+    g_autofree gchar* name4 = d_dns_cache_reverse_name(ip4,NULL);
+    g_assert_cmpstr(name4,==,"65.2.0.192.in-addr.arpa");
+    g_autofree gchar* zone = d_dns_cache_reverse_name(ip4,"zen.example.org");
+    g_assert_cmpstr(zone,==,"65.2.0.192.zen.example.org");
+
+    g_autoptr(GInetAddress) ip6 = g_inet_address_new_from_string("2001:db8::567:89ab");
+    g_autofree gchar* name6 = d_dns_cache_reverse_name(ip6,NULL);
+    g_assert_cmpstr(name6,==,"b.a.9.8.7.6.5.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa");
+}
+
+static gchar* dns_test_verify(
+    DDnsCache* cache,
+    const gchar* text)
+{
+    g_autoptr(GInetAddress) address = g_inet_address_new_from_string(text);
+    GAsyncResult* result{NULL};
+    d_dns_cache_verify_address_async(cache,address,NULL,dns_test_ready,&result);
+    GError* error{NULL};
+    gchar* host = d_dns_cache_verify_address_finish(cache,dns_test_wait(&result),&error);
+    g_assert_no_error(error);
+    g_object_unref(result);
+    return host;
+}
+
+static void dns_test_verify_address()
+{
+    g_autoptr(DDnsCache) cache = dns_test_cache();
+    g_autofree gchar* amy = dns_test_verify(cache,"192.0.2.65");
+    g_assert_cmpstr(amy,==,"amy.example.com");
+    // The name doesn't point back to the address.
+    g_autofree gchar* bob = dns_test_verify(cache,"192.0.2.66");
+    g_assert_null(bob);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    g_test_add_func("/dns-cache/static",dns_test_static);
+    g_test_add_func("/dns-cache/invalid-name",dns_test_invalid_name);
+    g_test_add_func("/dns-cache/reverse-name",dns_test_reverse_name);
+    g_test_add_func("/dns-cache/verify-address",dns_test_verify_address);
+    return g_test_run();
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Spool journal tests.
+ */
+#include "d_smtp_journal.hpp"
+#include <glib/gstdio.h>
+#include <string.h>
+
+/**
+ * @brief The journal file in the temporary directory of the test.
+ */
+struct JournalTest
+{
+    gchar* dir;
+    gchar* path;
+    /// @brief The records applied by the commit function.
+    gint committed;
+    gint checkpoints;
+    /// @brief The checkpoint function result.
+    gboolean applied;
+    gint pending;
+};
+
+static void journal_test_setup(
+    JournalTest* test)
+{
+    memset(test,0,sizeof(*test));
+    GError* error{NULL};
+    test->dir = g_dir_make_tmp("gio-smtp-journal-XXXXXX",&error);
+    g_assert_no_error(error);
+    test->path = g_build_filename(test->dir,"journal",NULL);
+}
+
+static void journal_test_teardown(
+    JournalTest* test)
+{
+    g_unlink(test->path);
+    g_rmdir(test->dir);
+    g_free(test->path);
+    g_free(test->dir);
+}
+
+static void journal_test_commit(
+    GPtrArray* records,
+    gpointer user_data)
+{
+    g_atomic_int_add(&reinterpret_cast<JournalTest*>(user_data)->committed,gint(records->len));
+}
+
+static gboolean journal_test_checkpoint(
+    gpointer user_data)
+{
+    auto test = reinterpret_cast<JournalTest*>(user_data);
+    g_atomic_int_inc(&test->checkpoints);
+    return test->applied;
+}
+
+static void journal_test_appended(
+    GObject* source_object,
+    GAsyncResult* result,
+    gpointer user_data)
+{
+    GError* error{NULL};
+    g_assert_true(g_task_propagate_boolean(G_TASK(result),&error));
+    g_assert_no_error(error);
+    reinterpret_cast<JournalTest*>(user_data)->pending--;
+}
+
+static GBytes* journal_test_record(
+    guint index)
+{
+    gchar* text = g_strdup_printf("record %u",index);
+    return g_bytes_new_take(text,strlen(text));
+}
+
+static DSmtpJournal* journal_test_open(
+    JournalTest* test,
+    gsize keep_size,
+    gsize checkpoint_size)
+{
+    GError* error{NULL};
+    DSmtpJournal* journal = d_smtp_journal_new(test->path,keep_size,0,8,checkpoint_size,&error);
+    g_assert_no_error(error);
+    d_smtp_journal_set_funcs(journal,journal_test_commit,journal_test_checkpoint,test);
+    return journal;
+}
+
+/**
+ * @brief Append the records and wait until they are durable.
+ */
+static void journal_test_append(
+    JournalTest* test,
+    DSmtpJournal* journal,
+    guint first,
+    guint count)
+{
+    for(guint index = first; index < first + count; index++) {
+        g_autoptr(GBytes) record = journal_test_record(index);
+        g_autoptr(GTask) task = g_task_new(NULL,NULL,journal_test_appended,test);
+        test->pending++;
+        d_smtp_journal_append(journal,record,task);
+    }
+    while(test->pending) {
+        g_main_context_iteration(NULL,TRUE);
+    }
+}
+
+static void journal_test_replayed(
+    GBytes* record,
+    gpointer user_data)
+{
+    g_ptr_array_add(reinterpret_cast<GPtrArray*>(user_data),g_bytes_ref(record));
+}
+
+/**
+ * @brief Replay the journal and check the records are the appended ones.
+ */
+static gsize journal_test_replay(
+    JournalTest* test,
+    guint count)
+{
+    g_autoptr(GPtrArray) records = g_ptr_array_new_with_free_func(
+        reinterpret_cast<GDestroyNotify>(g_bytes_unref));
+    gsize valid_size{0};
+    GError* error{NULL};
+    g_assert_cmpint(d_smtp_journal_replay(test->path,journal_test_replayed,records,&valid_size,&error),==,gint(count));
+    g_assert_no_error(error);
+    g_assert_cmpuint(records->len,==,count);
+    for(guint index = 0; index < count; index++) {
+        g_autoptr(GBytes) expected = journal_test_record(index);
+        g_assert_true(g_bytes_equal(static_cast<GBytes*>(records->pdata[index]),expected));
+    }
+    return valid_size;
+}
+
+static gsize journal_test_file_size(
+    JournalTest* test)
+{
+    GStatBuf buf;
+    g_assert_cmpint(g_stat(test->path,&buf),==,0);
+    return gsize(buf.st_size);
+}
+
+static void journal_test_replay_records()
+{
+    JournalTest test;
+    journal_test_setup(&test);
+    g_assert_cmpuint(journal_test_replay(&test,0),==,0);
+
+    DSmtpJournal* journal = journal_test_open(&test,0,G_MAXSIZE);
+    journal_test_append(&test,journal,0,20);
+    // The records aren't applied, the stop keeps the journal.
+    g_object_unref(journal);
+    g_assert_cmpint(test.committed,==,20);
+    g_assert_cmpint(test.checkpoints,==,1);
+    g_assert_cmpuint(journal_test_replay(&test,20),==,journal_test_file_size(&test));
+    journal_test_teardown(&test);
+}
+
+static void journal_test_torn_tail()
+{
+    JournalTest test;
+    journal_test_setup(&test);
+    DSmtpJournal* journal = journal_test_open(&test,0,G_MAXSIZE);
+    journal_test_append(&test,journal,0,3);
+    g_object_unref(journal);
+    gsize valid_size = journal_test_file_size(&test);
+
+    // The crash in the middle of the write leaves the partial frame.
+    FILE* file = g_fopen(test.path,"ab");
+    g_assert_nonnull(file);
+    const gchar torn[] = "DSJR\x40\0\0\0partial record";
+    g_assert_cmpuint(fwrite(torn,1,sizeof(torn) - 1,file),==,sizeof(torn) - 1);
+    fclose(file);
+    g_assert_cmpuint(journal_test_replay(&test,3),==,valid_size);
+
+    // The reopened journal drops the torn tail, the new records follow the valid ones.
+    journal = journal_test_open(&test,valid_size,G_MAXSIZE);
+    g_assert_cmpuint(journal_test_file_size(&test),==,valid_size);
+    journal_test_append(&test,journal,3,2);
+    g_object_unref(journal);
+    g_assert_cmpuint(journal_test_replay(&test,5),==,journal_test_file_size(&test));
+
+    // The journal opened without the kept records is emptied.
+    journal = journal_test_open(&test,0,G_MAXSIZE);
+    g_object_unref(journal);
+    g_assert_cmpuint(journal_test_file_size(&test),==,0);
+    journal_test_teardown(&test);
+}
+
+static void journal_test_checkpoint_applied()
+{
+    JournalTest test;
+    journal_test_setup(&test);
+    test.applied = TRUE;
+    // Every commit is over the checkpoint size.
+    DSmtpJournal* journal = journal_test_open(&test,0,1);
+    journal_test_append(&test,journal,0,4);
+    g_object_unref(journal);
+    g_assert_cmpint(test.committed,==,4);
+    g_assert_cmpint(test.checkpoints,>=,1);
+    g_assert_cmpuint(journal_test_file_size(&test),==,0);
+    g_assert_cmpuint(journal_test_replay(&test,0),==,0);
+    journal_test_teardown(&test);
+}
+
+static void journal_test_checkpoint_refused()
+{
+    JournalTest test;
+    journal_test_setup(&test);
+    DSmtpJournal* journal = journal_test_open(&test,0,1);
+    journal_test_append(&test,journal,0,4);
+    journal_test_append(&test,journal,4,4);
+    g_object_unref(journal);
+    // The journal is the only copy of the records not applied.
+    g_assert_cmpint(test.checkpoints,>=,2);
+    g_assert_cmpuint(journal_test_replay(&test,8),==,journal_test_file_size(&test));
+    journal_test_teardown(&test);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    // The refused checkpoint and the torn record are logged as warnings.
+    g_log_set_always_fatal(GLogLevelFlags(G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL));
+    g_test_add_func("/journal/replay",journal_test_replay_records);
+    g_test_add_func("/journal/torn-tail",journal_test_torn_tail);
+    g_test_add_func("/journal/checkpoint-applied",journal_test_checkpoint_applied);
+    g_test_add_func("/journal/checkpoint-refused",journal_test_checkpoint_refused);
+    return g_test_run();
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Message data scanner tests.
+ */
+#include "d_smtp_message.hpp"
+#include <string.h>
+
+static const gchar message_test_data[] =
+    "Received: from a.example\r\n"
+    "Received: from b.example\r\n"
+    "Message-ID: <1@a.example>\r\n"
+    "From: Joe\r\n"
+    " <joe@a.example>\r\n"
+    "From: Other <other@a.example>\r\n"
+    "Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+    "\r\n"
+    "body\r\n"
+    ".\r\n"
+    "QUIT\r\n";
+
+/**
+ * @brief Feed the data in the blocks of the size until the end of data.
+ * @return The number of the message bytes fed including the marker.
+ */
+static gsize message_test_feed(
+    DSmtpMessageParser* parser,
+    const gchar* data,
+    gsize size,
+    gsize block_size,
+    gboolean* found)
+{
+    gsize offset{0};
+    *found = FALSE;
+    while(offset < size && !*found) {
+        gsize consumed{0};
+        gsize length = MIN(block_size,size - offset);
+        *found = d_smtp_message_parser_feed(parser,data + offset,length,&consumed);
+        g_assert_cmpuint(consumed,<=,length);
+        if(!*found) {
+            g_assert_cmpuint(consumed,==,length);
+        }
+        offset += consumed;
+    }
+    return offset;
+}
+
+static void message_test_end_of_data()
+{
+    gsize size = strlen(message_test_data);
+    gsize message_size = strstr(message_test_data,"\r\n.\r\n") - message_test_data + strlen("\r\n.\r\n");
+    gsize header_size = strstr(message_test_data,"\r\n\r\n") - message_test_data + strlen("\r\n\r\n");
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    // The marker is split at every position by some block size.
+    for(gsize block_size = 1; block_size <= size; block_size++) {
+        d_smtp_message_parser_reset(&parser,G_MAXSIZE);
+        gboolean found;
+        g_assert_cmpuint(message_test_feed(&parser,message_test_data,size,block_size,&found),==,message_size);
+        g_assert_true(found);
+        g_assert_cmpuint(parser.header_size,==,header_size);
+        g_assert_false(parser.header_too_large);
+    }
+    d_smtp_message_parser_clear(&parser);
+}
+
+static void message_test_empty()
+{
+    const gchar data[] = ".\r\n";
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    gsize consumed{0};
+    g_assert_true(d_smtp_message_parser_feed(&parser,data,strlen(data),&consumed));
+    g_assert_cmpuint(consumed,==,strlen(data));
+    d_smtp_message_parser_clear(&parser);
+}
+
+static void message_test_not_marker()
+{
+    // The dot line needs CRLF on both sides, the marker split by CR isn't one.
+    const gchar data[] =
+        "Subject: x\r\n"
+        "\r\n"
+        "x.\r\n"
+        ".x\r\n"
+        " .\r\n"
+        ".\r\r\n"
+        "..\r\n";
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    for(gsize block_size = 1; block_size <= strlen(data); block_size++) {
+        d_smtp_message_parser_reset(&parser,G_MAXSIZE);
+        gboolean found;
+        g_assert_cmpuint(message_test_feed(&parser,data,strlen(data),block_size,&found),==,strlen(data));
+        g_assert_false(found);
+    }
+    d_smtp_message_parser_clear(&parser);
+}
+
+static void message_test_header_fields()
+{
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    gboolean found;
+    message_test_feed(&parser,message_test_data,strlen(message_test_data),7,&found);
+    g_assert_true(found);
+    g_assert_cmpuint(parser.received_count,==,2);
+    g_assert_cmpstr(parser.message_id->str,==,"<1@a.example>");
+    // The folded value is unfolded, only the first field of the name is taken.
+    g_assert_cmpstr(parser.from->str,==,"Joe <joe@a.example>");
+    g_assert_cmpstr(parser.date->str,==,"Mon, 1 Jan 2024 00:00:00 +0000");
+
+    d_smtp_message_parser_reset(&parser,G_MAXSIZE);
+    g_assert_cmpuint(parser.received_count,==,0);
+    g_assert_cmpstr(parser.from->str,==,"");
+    d_smtp_message_parser_clear(&parser);
+}
+
+/**
+ * @brief Feed the data in the blocks of the size and collect the content spans.
+ */
+static GString* message_test_content(
+    DSmtpMessageParser* parser,
+    const gchar* data,
+    gsize size,
+    gsize block_size)
+{
+    GString* content = g_string_new(NULL);
+    gsize offset{0};
+    gboolean found{FALSE};
+    while(offset < size && !found) {
+        gsize consumed{0};
+        found = d_smtp_message_parser_feed(parser,data + offset,MIN(block_size,size - offset),&consumed);
+        for(guint i = 0; i < parser->spans->len; i++) {
+            auto span = &g_array_index(parser->spans,DSmtpMessageSpan,i);
+            g_assert_cmpuint(span->offset + span->length,<=,consumed);
+            g_string_append_len(content,data + offset + span->offset,span->length);
+        }
+        offset += consumed;
+    }
+    g_assert_true(found);
+    return content;
+}
+
+static void message_test_dot_unstuffing()
+{
+    const gchar data[] =
+        "Subject: dots\r\n"
+        "\r\n"
+        "..\r\n"
+        "...leading\r\n"
+        "trailing.\r\n"
+        "\r\n"
+        ".\r\n";
+    const gchar content[] =
+        "Subject: dots\r\n"
+        "\r\n"
+        ".\r\n"
+        "..leading\r\n"
+        "trailing.\r\n"
+        "\r\n";
+    const gchar* body = content + strlen("Subject: dots\r\n\r\n");
+    g_autofree gchar* body_digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256,body,-1);
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    for(gsize block_size = 1; block_size <= strlen(data); block_size++) {
+        d_smtp_message_parser_reset(&parser,G_MAXSIZE);
+        g_autoptr(GString) received = message_test_content(&parser,data,strlen(data),block_size);
+        // The stuffing dots and the end of data marker aren't the content.
+        g_assert_cmpstr(received->str,==,content);
+        g_assert_cmpuint(parser.size,==,strlen(content));
+        g_assert_cmpuint(parser.header_size,==,gsize(body - content));
+        g_assert_cmpstr(g_checksum_get_string(parser.body_checksum),==,body_digest);
+    }
+    d_smtp_message_parser_clear(&parser);
+}
+
+static void message_test_header_too_large()
+{
+    DSmtpMessageParser parser;
+    d_smtp_message_parser_init(&parser);
+    d_smtp_message_parser_reset(&parser,32);
+    gboolean found;
+    gsize size = message_test_feed(&parser,message_test_data,strlen(message_test_data),5,&found);
+    // The end of data is still found, the rest of the header isn't parsed.
+    g_assert_true(found);
+    g_assert_cmpuint(size,==,gsize(strstr(message_test_data,"QUIT") - message_test_data));
+    g_assert_true(parser.header_too_large);
+    g_assert_cmpuint(parser.received_count,==,1);
+    g_assert_cmpstr(parser.message_id->str,==,"");
+    d_smtp_message_parser_clear(&parser);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    g_test_add_func("/message/end-of-data",message_test_end_of_data);
+    g_test_add_func("/message/empty",message_test_empty);
+    g_test_add_func("/message/not-marker",message_test_not_marker);
+    g_test_add_func("/message/header-fields",message_test_header_fields);
+    g_test_add_func("/message/dot-unstuffing",message_test_dot_unstuffing);
+    g_test_add_func("/message/header-too-large",message_test_header_too_large);
+    return g_test_run();
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief Queue index tests.
+ */
+#include "d_smtp_queue_index.hpp"
+#include <glib/gstdio.h>
+#include <string.h>
+
+/**
+ * @brief The index files in the temporary directory of the test.
+ */
+struct QueueIndexTest
+{
+    gchar* dir;
+    gchar* path;
+    /// @brief The copy of the index taken while it's open, as left by the crash.
+    gchar* crash_path;
+};
+
+static void queue_index_test_setup(
+    QueueIndexTest* test)
+{
+    GError* error{NULL};
+    test->dir = g_dir_make_tmp("gio-smtp-queue-XXXXXX",&error);
+    g_assert_no_error(error);
+    test->path = g_build_filename(test->dir,"queue.index",NULL);
+    test->crash_path = g_build_filename(test->dir,"crash.index",NULL);
+}
+
+static void queue_index_test_teardown(
+    QueueIndexTest* test)
+{
+    g_unlink(test->path);
+    g_unlink(test->crash_path);
+    g_rmdir(test->dir);
+    g_free(test->path);
+    g_free(test->crash_path);
+    g_free(test->dir);
+}
+
+static DSmtpQueueIndex* queue_index_test_open(
+    const gchar* path,
+    guint max_destinations)
+{
+    GError* error{NULL};
+    DSmtpQueueIndex* index = d_smtp_queue_index_new(path,max_destinations,&error);
+    g_assert_no_error(error);
+    g_assert_nonnull(index);
+    return index;
+}
+
+static void queue_index_test_enqueue(
+    DSmtpQueueIndex* index,
+    const gchar* id,
+    const gchar* destination)
+{
+    GError* error{NULL};
+    g_assert_cmpuint(d_smtp_queue_index_enqueue(index,id,destination,&error),!=,SMTP_QUEUE_INDEX_NONE);
+    g_assert_no_error(error);
+}
+
+static void queue_index_test_dequeue(
+    DSmtpQueueIndex* index,
+    const gchar* destination,
+    const gchar* expected)
+{
+    g_autofree gchar* id = d_smtp_queue_index_dequeue(index,destination);
+    g_assert_cmpstr(id,==,expected);
+}
+
+static void queue_index_test_queue()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    g_autoptr(DSmtpQueueIndex) index = queue_index_test_open(test.path,16);
+    // The new index has nothing to keep, the owner fills it.
+    g_assert_true(d_smtp_queue_index_needs_rebuild(index));
+    d_smtp_queue_index_clear(index);
+    g_assert_false(d_smtp_queue_index_needs_rebuild(index));
+
+    queue_index_test_enqueue(index,"a","example.com");
+    queue_index_test_enqueue(index,"b","Example.Org");
+    queue_index_test_enqueue(index,"c","EXAMPLE.COM");
+    GError* error{NULL};
+    guint32 record = d_smtp_queue_index_enqueue(index,"d","example.com",&error);
+    g_assert_no_error(error);
+    queue_index_test_enqueue(index,"e","example.com");
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,5);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.com"),==,4);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.org"),==,1);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.net"),==,0);
+
+    g_auto(GStrv) destinations = d_smtp_queue_index_get_destinations(index);
+    g_assert_cmpuint(g_strv_length(destinations),==,2);
+    g_assert_true(g_strv_contains(destinations,"example.com"));
+    g_assert_true(g_strv_contains(destinations,"example.org"));
+
+    // The record is removed from the middle of the queue, twice is no-op.
+    d_smtp_queue_index_remove(index,record);
+    d_smtp_queue_index_remove(index,record);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.com"),==,3);
+    queue_index_test_dequeue(index,"example.com","a");
+    queue_index_test_dequeue(index,"example.com","c");
+    queue_index_test_dequeue(index,"example.com","e");
+    queue_index_test_dequeue(index,"example.com",NULL);
+    queue_index_test_dequeue(index,"example.net",NULL);
+    queue_index_test_dequeue(index,"example.org","b");
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,0);
+
+    // The released records are reused.
+    queue_index_test_enqueue(index,"f","example.org");
+    queue_index_test_dequeue(index,"example.org","f");
+
+    g_clear_object(&index);
+    queue_index_test_teardown(&test);
+}
+
+static void queue_index_test_limits()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    g_autoptr(DSmtpQueueIndex) index = queue_index_test_open(test.path,2);
+    d_smtp_queue_index_clear(index);
+    GError* error{NULL};
+    gchar id[SMTP_QUEUE_INDEX_MAX_ID + 2];
+    memset(id,'i',sizeof(id) - 1);
+    id[sizeof(id) - 1] = '\0';
+    g_assert_cmpuint(d_smtp_queue_index_enqueue(index,id,"example.com",&error),==,SMTP_QUEUE_INDEX_NONE);
+    g_assert_error(error,G_IO_ERROR,G_IO_ERROR_INVALID_ARGUMENT);
+    g_clear_error(&error);
+
+    queue_index_test_enqueue(index,"a","example.com");
+    queue_index_test_enqueue(index,"b","example.org");
+    g_assert_cmpuint(d_smtp_queue_index_enqueue(index,"c","example.net",&error),==,SMTP_QUEUE_INDEX_NONE);
+    g_assert_error(error,G_IO_ERROR,G_IO_ERROR_NO_SPACE);
+    g_clear_error(&error);
+
+    g_clear_object(&index);
+    queue_index_test_teardown(&test);
+}
+
+static void queue_index_test_reopen()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    DSmtpQueueIndex* index = queue_index_test_open(test.path,16);
+    d_smtp_queue_index_clear(index);
+    // More records than the new file has, the index grows.
+    const guint count = 3000;
+    for(guint number = 0; number < count; number++) {
+        g_autofree gchar* id = g_strdup_printf("%08u",number);
+        queue_index_test_enqueue(index,id,number % 2 ? "example.com" : "example.org");
+    }
+    g_object_unref(index);
+
+    // The cleanly closed index is used as is.
+    index = queue_index_test_open(test.path,16);
+    g_assert_false(d_smtp_queue_index_needs_rebuild(index));
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,count);
+    for(guint number = 0; number < count; number++) {
+        g_autofree gchar* id = g_strdup_printf("%08u",number);
+        queue_index_test_dequeue(index,number % 2 ? "example.com" : "example.org",id);
+        // The dequeued records are taken by the other destination queues.
+        if(number % 2) {
+            queue_index_test_enqueue(index,id,"example.net");
+        }
+    }
+    g_object_unref(index);
+
+    index = queue_index_test_open(test.path,16);
+    g_assert_false(d_smtp_queue_index_needs_rebuild(index));
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,count / 2);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.net"),==,count / 2);
+    queue_index_test_dequeue(index,"example.net","00000001");
+    g_object_unref(index);
+    queue_index_test_teardown(&test);
+}
+
+static void queue_index_test_rebuild()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    g_autoptr(DSmtpQueueIndex) index = queue_index_test_open(test.path,16);
+    d_smtp_queue_index_clear(index);
+    queue_index_test_enqueue(index,"a","example.com");
+    queue_index_test_enqueue(index,"b","example.com");
+    GError* error{NULL};
+    g_assert_true(d_smtp_queue_index_sync(index,&error));
+    g_assert_no_error(error);
+
+    // The file of the open index is what the crash leaves.
+    gchar* contents;
+    gsize length;
+    g_assert_true(g_file_get_contents(test.path,&contents,&length,&error));
+    g_assert_no_error(error);
+    g_assert_true(g_file_set_contents(test.crash_path,contents,length,&error));
+    g_assert_no_error(error);
+    g_free(contents);
+    g_clear_object(&index);
+
+    index = queue_index_test_open(test.crash_path,16);
+    g_assert_true(d_smtp_queue_index_needs_rebuild(index));
+    // The owner rebuilds the index from the spool.
+    d_smtp_queue_index_clear(index);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,0);
+    queue_index_test_enqueue(index,"a","example.com");
+    g_assert_false(d_smtp_queue_index_needs_rebuild(index));
+    g_clear_object(&index);
+
+    index = queue_index_test_open(test.crash_path,16);
+    g_assert_false(d_smtp_queue_index_needs_rebuild(index));
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,1);
+    g_clear_object(&index);
+    queue_index_test_teardown(&test);
+}
+
+static void queue_index_test_damaged()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    GError* error{NULL};
+    g_assert_true(g_file_set_contents(test.path,"not an index",-1,&error));
+    g_assert_no_error(error);
+    g_autoptr(DSmtpQueueIndex) index = queue_index_test_open(test.path,16);
+    g_assert_true(d_smtp_queue_index_needs_rebuild(index));
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,0);
+    queue_index_test_enqueue(index,"a","example.com");
+    g_clear_object(&index);
+    queue_index_test_teardown(&test);
+}
+
+static void queue_index_test_replay()
+{
+    QueueIndexTest test;
+    queue_index_test_setup(&test);
+    g_autoptr(DSmtpQueueIndex) index = queue_index_test_open(test.path,16);
+    d_smtp_queue_index_clear(index);
+    GError* error{NULL};
+    guint32 record = d_smtp_queue_index_enqueue(index,"a","example.com",&error);
+    queue_index_test_enqueue(index,"b","example.com");
+    // The replayed record of the queued message keeps its place.
+    g_assert_cmpuint(d_smtp_queue_index_lookup_or_enqueue(index,"a","example.com",&error),==,record);
+    g_assert_no_error(error);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,"example.com"),==,2);
+    // The message of the other destination is queued there.
+    g_assert_cmpuint(d_smtp_queue_index_lookup_or_enqueue(index,"a","example.org",&error),!=,SMTP_QUEUE_INDEX_NONE);
+    g_assert_no_error(error);
+    g_assert_cmpuint(d_smtp_queue_index_get_count(index,NULL),==,3);
+
+    queue_index_test_dequeue(index,"example.com","a");
+    // The delivered message is queued again by the next replay.
+    g_assert_cmpuint(d_smtp_queue_index_lookup_or_enqueue(index,"a","example.com",&error),!=,SMTP_QUEUE_INDEX_NONE);
+    g_assert_no_error(error);
+    queue_index_test_dequeue(index,"example.com","b");
+    queue_index_test_dequeue(index,"example.com","a");
+    g_clear_object(&index);
+    queue_index_test_teardown(&test);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    // The damaged index is logged as warning.
+    g_log_set_always_fatal(GLogLevelFlags(G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL));
+    g_test_add_func("/queue-index/queue",queue_index_test_queue);
+    g_test_add_func("/queue-index/limits",queue_index_test_limits);
+    g_test_add_func("/queue-index/reopen",queue_index_test_reopen);
+    g_test_add_func("/queue-index/rebuild",queue_index_test_rebuild);
+    g_test_add_func("/queue-index/damaged",queue_index_test_damaged);
+    g_test_add_func("/queue-index/replay",queue_index_test_replay);
+    return g_test_run();
+}
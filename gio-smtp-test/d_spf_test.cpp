@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2022 Daniyar Tleulin <daniyar.tleulin@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+/**
+ * @brief SPF evaluation tests.
+ * @details The zone and the simple policies follow the examples of RFC 7208
+ * Appendix A, the macros are the examples of RFC 7208 7.4. The DNS cache
+ * answers from the static records.
+ */
+#include "d_spf.hpp"
+#include <string.h>
+
+struct SpfTest
+{
+    DDnsCache* cache;
+    DSpf* spf;
+};
+
+static void spf_test_add(
+    DDnsCache* cache,
+    DNS_RECORD_TYPE type,
+    const gchar* name,
+    const gchar* data)
+{
+    const gchar* records[] = {data,NULL};
+    d_dns_cache_add_static(cache,type,name,data ? records : NULL);
+}
+
+static void spf_test_setup(
+    SpfTest* test)
+{
+    GError* error{NULL};
+    test->cache = d_dns_cache_new(NULL,256,60,3600,1,&error);
+    g_assert_no_error(error);
+    test->spf = d_spf_new(test->cache,64);
+
+    static const gchar* const example_com_a[] = {"192.0.2.10","192.0.2.11",NULL};
+    static const gchar* const example_com_mx[] = {"10 mail-a.example.com","20 mail-b.example.com",NULL};
+    d_dns_cache_add_static(test->cache,DNS_RECORD_A,"example.com",example_com_a);
+    d_dns_cache_add_static(test->cache,DNS_RECORD_MX,"example.com",example_com_mx);
+    spf_test_add(test->cache,DNS_RECORD_A,"amy.example.com","192.0.2.65");
+    spf_test_add(test->cache,DNS_RECORD_A,"bob.example.com","192.0.2.66");
+    spf_test_add(test->cache,DNS_RECORD_A,"mail-a.example.com","192.0.2.129");
+    spf_test_add(test->cache,DNS_RECORD_A,"mail-b.example.com","192.0.2.130");
+    static const gchar* const empty[] = {NULL};
+    d_dns_cache_add_static(test->cache,DNS_RECORD_A,"example.org",empty);
+    spf_test_add(test->cache,DNS_RECORD_MX,"example.org","10 mail-c.example.org");
+    spf_test_add(test->cache,DNS_RECORD_A,"mail-c.example.org","192.0.2.140");
+
+    spf_test_add(test->cache,DNS_RECORD_PTR,"10.2.0.192.in-addr.arpa","example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"11.2.0.192.in-addr.arpa","example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"65.2.0.192.in-addr.arpa","amy.example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"66.2.0.192.in-addr.arpa","bob.example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"129.2.0.192.in-addr.arpa","mail-a.example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"130.2.0.192.in-addr.arpa","mail-b.example.com");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"140.2.0.192.in-addr.arpa","mail-c.example.org");
+    spf_test_add(test->cache,DNS_RECORD_PTR,"4.0.0.10.in-addr.arpa","bob.example.com");
+}
+
+static void spf_test_teardown(
+    SpfTest* test)
+{
+    g_object_unref(test->spf);
+    g_object_unref(test->cache);
+}
+
+static void spf_test_ready(
+    GObject* source_object,
+    GAsyncResult* res,
+    gpointer user_data)
+{
+    *reinterpret_cast<GAsyncResult**>(user_data) = G_ASYNC_RESULT(g_object_ref(res));
+}
+
+static SPF_RESULT spf_test_check(
+    SpfTest* test,
+    const gchar* address,
+    const gchar* sender,
+    const gchar* helo)
+{
+    g_autoptr(GInetAddress) client = g_inet_address_new_from_string(address);
+    g_assert_nonnull(client);
+    GAsyncResult* result{NULL};
+    d_spf_check_host_async(test->spf,client,sender,helo,NULL,spf_test_ready,&result);
+    while(!result) {
+        g_main_context_iteration(NULL,TRUE);
+    }
+    GError* error{NULL};
+    SPF_RESULT spf_result = d_spf_check_host_finish(test->spf,result,&error);
+    g_assert_no_error(error);
+    g_object_unref(result);
+    return spf_result;
+}
+
+/**
+ * @brief Set the policy of example.com and check the client addresses.
+ */
+static void spf_test_policy(
+    SpfTest* test,
+    const gchar* policy,
+    const gchar* const* passed,
+    const gchar* const* failed)
+{
+    spf_test_add(test->cache,DNS_RECORD_TXT,"example.com",policy);
+    for(guint i = 0; passed[i]; i++) {
+        g_assert_cmpstr(d_spf_result_to_string(spf_test_check(test,passed[i],"joe@example.com","mx.example.net")),==,
+            d_spf_result_to_string(SPF_RESULT_PASS));
+    }
+    for(guint i = 0; failed[i]; i++) {
+        g_assert_cmpstr(d_spf_result_to_string(spf_test_check(test,failed[i],"joe@example.com","mx.example.net")),==,
+            d_spf_result_to_string(SPF_RESULT_FAIL));
+    }
+}
+
+static void spf_test_examples()
+{
+    SpfTest test;
+    spf_test_setup(&test);
+    const gchar* none[] = {NULL};
+    {
+        const gchar* passed[] = {"192.0.2.65","10.0.0.4",NULL};
+        spf_test_policy(&test,"v=spf1 +all",passed,none);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.10","192.0.2.11",NULL};
+        const gchar* failed[] = {"192.0.2.65","192.0.2.129",NULL};
+        spf_test_policy(&test,"v=spf1 a -all",passed,failed);
+    }
+    {
+        const gchar* failed[] = {"192.0.2.10","192.0.2.140",NULL};
+        spf_test_policy(&test,"v=spf1 a:example.org -all",none,failed);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.129","192.0.2.130",NULL};
+        const gchar* failed[] = {"192.0.2.10","192.0.2.140",NULL};
+        spf_test_policy(&test,"v=spf1 mx -all",passed,failed);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.140",NULL};
+        const gchar* failed[] = {"192.0.2.129",NULL};
+        spf_test_policy(&test,"v=spf1 mx:example.org -all",passed,failed);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.129","192.0.2.130","192.0.2.140",NULL};
+        const gchar* failed[] = {"192.0.2.10","192.0.2.65",NULL};
+        spf_test_policy(&test,"v=spf1 mx mx:example.org -all",passed,failed);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.128","192.0.2.131","192.0.2.141","192.0.2.143",NULL};
+        const gchar* failed[] = {"192.0.2.132","192.0.2.139",NULL};
+        spf_test_policy(&test,"v=spf1 mx/30 mx:example.org/30 -all",passed,failed);
+    }
+    {
+        // The reverse name of 10.0.0.4 isn't confirmed by its address.
+        const gchar* passed[] = {"192.0.2.65",NULL};
+        const gchar* failed[] = {"192.0.2.140","10.0.0.4",NULL};
+        spf_test_policy(&test,"v=spf1 ptr -all",passed,failed);
+    }
+    {
+        const gchar* passed[] = {"192.0.2.129",NULL};
+        const gchar* failed[] = {"192.0.2.65",NULL};
+        spf_test_policy(&test,"v=spf1 ip4:192.0.2.128/28 -all",passed,failed);
+    }
+    {
+        // The ip4 and ip6 run is matched in the order of the mechanisms.
+        const gchar* passed[] = {"2001:db8::1","192.0.2.1",NULL};
+        const gchar* failed[] = {"2001:db8:1::1","192.0.2.2","::ffff:192.0.2.2",NULL};
+        spf_test_policy(&test,"v=spf1 -ip6:2001:db8:1::/48 ip6:2001:db8::/32 ip4:192.0.2.1 -all",passed,failed);
+    }
+    spf_test_teardown(&test);
+}
+
+static void spf_test_results()
+{
+    SpfTest test;
+    spf_test_setup(&test);
+    static const struct {
+        const gchar* policy;
+        SPF_RESULT result;
+    } policies[] = {
+        {"v=spf1 ~all",SPF_RESULT_SOFTFAIL},
+        {"v=spf1 ?all",SPF_RESULT_NEUTRAL},
+        {"v=spf1 a",SPF_RESULT_NEUTRAL},
+        {"v=spf1 a unknown-modifier=x -all",SPF_RESULT_FAIL},
+        {"v=spf1 bogus:example.com -all",SPF_RESULT_PERMERROR},
+        {"v=spf1 ip4:192.0.2.300 -all",SPF_RESULT_PERMERROR},
+        {"v=spf10 +all",SPF_RESULT_NONE},
+        {"not spf",SPF_RESULT_NONE},
+    };
+    for(guint i = 0; i < G_N_ELEMENTS(policies); i++) {
+        spf_test_add(test.cache,DNS_RECORD_TXT,"example.com",policies[i].policy);
+        g_assert_cmpstr(d_spf_result_to_string(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net")),==,
+            d_spf_result_to_string(policies[i].result));
+    }
+
+    // The domain may publish only one SPF record.
+    static const gchar* const records[] = {"v=spf1 +all","v=spf1 -all",NULL};
+    d_dns_cache_add_static(test.cache,DNS_RECORD_TXT,"example.com",records);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net"),==,SPF_RESULT_PERMERROR);
+
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.org",NULL);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.org","mx.example.net"),==,SPF_RESULT_NONE);
+    spf_test_teardown(&test);
+}
+
+static void spf_test_include()
+{
+    SpfTest test;
+    spf_test_setup(&test);
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com","v=spf1 a -all");
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.net","v=spf1 include:example.com ~all");
+    // The include matches only if the included record passes.
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.10","joe@example.net","mx.example.net"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.net","mx.example.net"),==,SPF_RESULT_SOFTFAIL);
+
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.net","v=spf1 redirect=example.com");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.11","joe@example.net","mx.example.net"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.net","mx.example.net"),==,SPF_RESULT_FAIL);
+
+    // The included domain without record is the permanent error.
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.org",NULL);
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.net","v=spf1 include:example.org ~all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.10","joe@example.net","mx.example.net"),==,SPF_RESULT_PERMERROR);
+    spf_test_teardown(&test);
+}
+
+static void spf_test_macros()
+{
+    SpfTest test;
+    spf_test_setup(&test);
+    spf_test_add(test.cache,DNS_RECORD_TXT,"email.example.com",
+        "v=spf1 exists:%{ir}.%{v}._spf.%{d2} exists:%{l1r-}.lp._spf.%{d2} -all");
+    spf_test_add(test.cache,DNS_RECORD_A,"3.2.0.192.in-addr._spf.example.com","127.0.0.2");
+    spf_test_add(test.cache,DNS_RECORD_A,"4.2.0.192.in-addr._spf.example.com",NULL);
+    spf_test_add(test.cache,DNS_RECORD_A,"5.2.0.192.in-addr._spf.example.com",NULL);
+    spf_test_add(test.cache,DNS_RECORD_A,"strong.lp._spf.example.com","127.0.0.2");
+    spf_test_add(test.cache,DNS_RECORD_A,"weak.lp._spf.example.com",NULL);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.3","strong-bad@email.example.com","mx.example.net"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.4","strong-bad@email.example.com","mx.example.net"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.5","weak-bad@email.example.com","mx.example.net"),==,SPF_RESULT_FAIL);
+
+    // The null reverse path is checked as postmaster of the HELO domain.
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com","v=spf1 a -all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.10","","example.com"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","","example.com"),==,SPF_RESULT_FAIL);
+    spf_test_teardown(&test);
+}
+
+static void spf_test_limits()
+{
+    SpfTest test;
+    spf_test_setup(&test);
+    // The 11th DNS querying term is over the limit, the match before it isn't.
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com","v=spf1 a a a a a a a a a a a -all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.10","joe@example.com","mx.example.net"),==,SPF_RESULT_PASS);
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net"),==,SPF_RESULT_PERMERROR);
+
+    // The third lookup without answer is over the void lookups limit.
+    spf_test_add(test.cache,DNS_RECORD_A,"n1.example.net",NULL);
+    spf_test_add(test.cache,DNS_RECORD_A,"n2.example.net",NULL);
+    spf_test_add(test.cache,DNS_RECORD_A,"n3.example.net",NULL);
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com","v=spf1 a:n1.example.net a:n2.example.net -all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net"),==,SPF_RESULT_FAIL);
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com",
+        "v=spf1 a:n1.example.net a:n2.example.net a:n3.example.net -all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net"),==,SPF_RESULT_PERMERROR);
+
+    // The include loop ends by the lookups limit.
+    spf_test_add(test.cache,DNS_RECORD_TXT,"example.com","v=spf1 include:example.com -all");
+    g_assert_cmpint(spf_test_check(&test,"192.0.2.65","joe@example.com","mx.example.net"),==,SPF_RESULT_PERMERROR);
+    spf_test_teardown(&test);
+}
+
+static void spf_test_received()
+{
+    g_autoptr(GBytes) field = d_spf_received_new(SPF_RESULT_SOFTFAIL,"192.0.2.65","joe@example.com",NULL);
+    gsize size;
+    auto data = static_cast<const gchar*>(g_bytes_get_data(field,&size));
+    const gchar expected[] =
+        "Received-SPF: softfail client-ip=192.0.2.65; envelope-from=\"joe@example.com\"; helo=unknown;\r\n";
+    g_assert_cmpmem(data,size,expected,strlen(expected));
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc,&argv,NULL);
+    g_test_add_func("/spf/examples",spf_test_examples);
+    g_test_add_func("/spf/results",spf_test_results);
+    g_test_add_func("/spf/include",spf_test_include);
+    g_test_add_func("/spf/macros",spf_test_macros);
+    g_test_add_func("/spf/limits",spf_test_limits);
+    g_test_add_func("/spf/received",spf_test_received);
+    return g_test_run();
+}